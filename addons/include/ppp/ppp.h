@@ -322,6 +322,11 @@ int ppp_lcp_send_proto_reject(uint16_t proto, const uint8_t *pkt, size_t len);
 
     This list defines the flags we can negotiate during link establishment.
 
+    PPP_FLAG_VJ_COMP (Van Jacobson TCP/IP header compression, negotiated in
+    IPCP) is on by default. PPP_FLAG_PRED1 (Predictor type 1 compression of
+    all IP traffic, negotiated in CCP) is off by default, as it needs 64KiB of
+    memory for each direction it is used in.
+
     @{
 */
 #define PPP_FLAG_AUTH_PAP       0x00000001  /**< \brief PAP authentication */
@@ -331,6 +336,8 @@ int ppp_lcp_send_proto_reject(uint16_t proto, const uint8_t *pkt, size_t len);
 #define PPP_FLAG_MAGIC_NUMBER   0x00000010  /**< \brief Use magic numbers */
 #define PPP_FLAG_WANT_MRU       0x00000020  /**< \brief Specify MRU */
 #define PPP_FLAG_NO_ACCM        0x00000040  /**< \brief No ctl character map */
+#define PPP_FLAG_VJ_COMP        0x00000080  /**< \brief TCP/IP header comp */
+#define PPP_FLAG_PRED1          0x00000100  /**< \brief Predictor-1 comp */
 /** @} */
 
 /** \brief   Get the flags set for our side of the link.
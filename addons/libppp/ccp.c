@@ -0,0 +1,776 @@
+/* KallistiOS ##version##
+
+   libppp/ccp.c
+   Copyright (C) 2026 The KallistiOS Team
+
+*/
+
+/* This file implements the PPP Compression Control Protocol (RFC 1962), with
+   the Predictor type 1 compressor (RFC 1978). Predictor guesses each byte from
+   a hash of the bytes before it, so it needs no more than a table lookup per
+   byte in either direction, which is about all we can afford to spend on a
+   modem link. The price is a 64KiB table for each direction that's in use. */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ppp/ppp.h>
+
+#include <kos/net.h>
+
+#include <arch/timer.h>
+
+#include "ppp_internal.h"
+#include "fcs.h"
+
+/* CCP adds two codes on top of the LCP ones. */
+#define CCP_RESET_REQUEST       14
+#define CCP_RESET_ACK           15
+
+/* CCP configuration options. */
+#define CCP_CONFIGURE_PREDICTOR1    1
+
+/* Predictor adds a two byte length before and a two byte CRC after the
+   data. */
+#define PRED1_OVERHEAD          4
+#define PRED1_TABLE_SIZE        65536
+#define PRED1_COMPRESSED        0x8000
+
+/* How long to wait for a Reset-Ack before asking again. */
+#define CCP_RESET_TIMEOUT       1000
+
+typedef struct pred1_state {
+    uint8_t *table;
+    uint16_t hash;
+} pred1_state_t;
+
+static struct ccp_state_s {
+    int state;
+    uint8_t last_conf;
+    uint8_t last_term;
+    uint8_t last_coderej;
+    uint8_t last_reset;
+
+    ppp_state_t *ppp_state;
+
+    uint64_t next_resend;
+    uint16_t resend_cnt;
+    int (*resend_pkt)(ppp_protocol_t *, int);
+    void (*resend_timeout)(ppp_protocol_t *);
+
+    /* When we last asked the peer to reset its compressor, or 0 if we're not
+       waiting on that. */
+    uint64_t reset_sent;
+
+    /* Which directions are being compressed right now. */
+    int tx_active;
+    int rx_active;
+
+    pred1_state_t tx;
+    pred1_state_t rx;
+} ccp_state;
+
+/* Predictor output can be slightly larger than the input, so leave room for
+   an extra flag byte for each 8 bytes. */
+static uint8_t ccp_txbuf[PRED1_OVERHEAD + (PPP_MRU + 2) * 9 / 8 + 1];
+static uint8_t ccp_txtmp[PPP_MRU + 2];
+static uint8_t ccp_rxbuf[PPP_MRU + 2];
+
+#define PRED1_HASH(h, x)        (h) = (uint16_t)(((h) << 4) ^ (x))
+
+static int pred1_alloc(pred1_state_t *st) {
+    if(!st->table && !(st->table = (uint8_t *)malloc(PRED1_TABLE_SIZE)))
+        return -1;
+
+    memset(st->table, 0, PRED1_TABLE_SIZE);
+    st->hash = 0;
+    return 0;
+}
+
+static void pred1_free(pred1_state_t *st) {
+    free(st->table);
+    st->table = NULL;
+}
+
+static void pred1_reset(pred1_state_t *st) {
+    if(st->table)
+        memset(st->table, 0, PRED1_TABLE_SIZE);
+
+    st->hash = 0;
+}
+
+/* The compressor and decompressor below are straight out of RFC 1978. Each
+   flag byte covers the next 8 bytes of input, with a bit set for each byte
+   that was guessed correctly. Bytes that weren't guessed follow the flag
+   byte. */
+static size_t pred1_compress(pred1_state_t *st, const uint8_t *src, size_t len,
+                             uint8_t *dst) {
+    uint8_t *tbl = st->table, *start = dst, *flagp;
+    uint16_t hash = st->hash;
+    uint8_t flags;
+    int bit;
+
+    while(len) {
+        flagp = dst++;
+        flags = 0;
+
+        for(bit = 1; bit < 256 && len; bit <<= 1, --len) {
+            if(tbl[hash] == *src) {
+                flags |= (uint8_t)bit;
+            }
+            else {
+                tbl[hash] = *src;
+                *dst++ = *src;
+            }
+
+            PRED1_HASH(hash, *src++);
+        }
+
+        *flagp = flags;
+    }
+
+    st->hash = hash;
+    return (size_t)(dst - start);
+}
+
+static int pred1_decompress(pred1_state_t *st, const uint8_t *src, size_t len,
+                            uint8_t *dst, size_t max) {
+    uint8_t *tbl = st->table, *start = dst, *end = dst + max;
+    uint16_t hash = st->hash;
+    uint8_t flags;
+    int bit;
+
+    while(len) {
+        flags = *src++;
+        --len;
+
+        for(bit = 1; bit < 256; bit <<= 1) {
+            if(flags & bit) {
+                if(dst == end)
+                    return -1;
+
+                *dst = tbl[hash];
+            }
+            else {
+                if(!len)
+                    break;
+
+                if(dst == end)
+                    return -1;
+
+                tbl[hash] = *dst = *src++;
+                --len;
+            }
+
+            PRED1_HASH(hash, *dst++);
+        }
+    }
+
+    st->hash = hash;
+    return (int)(dst - start);
+}
+
+/* When the peer sends a packet uncompressed, we still have to run it through
+   the table to stay in step with the peer's compressor. */
+static void pred1_sync(pred1_state_t *st, const uint8_t *src, size_t len) {
+    uint8_t *tbl = st->table;
+    uint16_t hash = st->hash;
+
+    while(len--) {
+        tbl[hash] = *src;
+        PRED1_HASH(hash, *src++);
+    }
+
+    st->hash = hash;
+}
+
+static void ccp_down(void) {
+    ccp_state.tx_active = 0;
+    ccp_state.rx_active = 0;
+    ccp_state.reset_sent = 0;
+
+    pred1_free(&ccp_state.tx);
+    pred1_free(&ccp_state.rx);
+}
+
+static void ccp_cfg_timeout(ppp_protocol_t *self) {
+    (void)self;
+
+    /* The peer doesn't want to talk about compression, which is fine. Just go
+       on without it. */
+    DBG("ccp: no response from peer, giving up\n");
+
+    ccp_state.resend_pkt = NULL;
+    ccp_state.resend_timeout = NULL;
+    ccp_state.state = PPP_STATE_STOPPED;
+}
+
+static int ccp_send_client_cfg(ppp_protocol_t *self, int resend) {
+    uint8_t rawpkt[16];
+    lcp_pkt_t *pkt = (lcp_pkt_t *)rawpkt;
+    int len = 0;
+
+    (void)self;
+
+    pkt->code = LCP_CONFIGURE_REQUEST;
+
+    if(resend)
+        pkt->id = ccp_state.last_conf;
+    else
+        pkt->id = ++ccp_state.last_conf;
+
+    /* Only ask for Predictor if we can get the memory for it. */
+    if(ccp_state.ppp_state->our_flags & PPP_FLAG_PRED1) {
+        if(pred1_alloc(&ccp_state.rx)) {
+            DBG("ccp: out of memory, not asking for predictor\n");
+            ccp_state.ppp_state->our_flags &= ~PPP_FLAG_PRED1;
+        }
+        else {
+            pkt->data[len++] = CCP_CONFIGURE_PREDICTOR1;
+            pkt->data[len++] = 2;
+        }
+    }
+
+    len += 4;
+    pkt->len = htons(len);
+
+    /* Set the resend timer for 3 seconds. */
+    ccp_state.next_resend = timer_ms_gettime64() + 3000;
+    ccp_state.resend_pkt = &ccp_send_client_cfg;
+    ccp_state.resend_timeout = &ccp_cfg_timeout;
+
+    if(!resend)
+        ccp_state.resend_cnt = 10;
+
+    return ppp_send(rawpkt, len, PPP_PROTOCOL_CCP);
+}
+
+static int ccp_send_simple(uint8_t code, uint8_t id) {
+    uint8_t buf[4];
+    lcp_pkt_t *pkt = (lcp_pkt_t *)buf;
+
+    pkt->code = code;
+    pkt->id = id;
+    pkt->len = htons(4);
+
+    return ppp_send(buf, 4, PPP_PROTOCOL_CCP);
+}
+
+static int ccp_send_code_reject(ppp_protocol_t *self, const uint8_t *pkt,
+                                size_t len) {
+    uint8_t buf[len + 4];
+    lcp_pkt_t *out = (lcp_pkt_t *)buf;
+    uint16_t out_len = len + 4;
+
+    (void)self;
+
+    /* See if we need to truncate whatever is in the packet... */
+    if(out_len > ccp_state.ppp_state->peer_mru)
+        out_len = ccp_state.ppp_state->peer_mru;
+
+    out->code = LCP_CODE_REJECT;
+    out->id = ++ccp_state.last_coderej;
+    out->len = htons(out_len);
+    memcpy(buf + 4, pkt, out_len - 4);
+
+    return ppp_send(buf, out_len, PPP_PROTOCOL_CCP);
+}
+
+static void ccp_up(void) {
+    ppp_state_t *st = ccp_state.ppp_state;
+
+    ccp_state.state = PPP_STATE_OPENED;
+    ccp_state.resend_pkt = NULL;
+    ccp_state.resend_timeout = NULL;
+    ccp_state.reset_sent = 0;
+
+    /* Start both directions from a clean slate. */
+    if(st->our_flags & PPP_FLAG_PRED1) {
+        pred1_reset(&ccp_state.rx);
+        ccp_state.rx_active = 1;
+    }
+
+    if(st->peer_flags & PPP_FLAG_PRED1) {
+        pred1_reset(&ccp_state.tx);
+        ccp_state.tx_active = 1;
+    }
+
+    DBG("ccp: compression up (rx: %s, tx: %s)\n",
+        (st->our_flags & PPP_FLAG_PRED1) ? "predictor" : "none",
+        (st->peer_flags & PPP_FLAG_PRED1) ? "predictor" : "none");
+}
+
+static int ccp_handle_configure_req(ppp_protocol_t *self,
+                                    const lcp_pkt_t *pkt, size_t len) {
+    size_t ptr = 0;
+    uint8_t opt_len;
+    uint8_t response[PPP_MRU];
+    uint8_t response_code = LCP_CONFIGURE_ACK;
+    uint16_t response_len = 4;
+    int pred1 = 0;
+
+    switch(ccp_state.state) {
+        case PPP_STATE_CLOSING:
+        case PPP_STATE_STOPPING:
+            /* Silently discard and don't move states. */
+            return 0;
+
+        case PPP_STATE_CLOSED:
+            return ccp_send_simple(LCP_TERMINATE_ACK, pkt->id);
+
+        case PPP_STATE_OPENED:
+            ccp_down();
+            __fallthrough;
+
+        case PPP_STATE_STOPPED:
+            ccp_send_client_cfg(self, 0);
+            ccp_state.state = PPP_STATE_REQUEST_SENT;
+            break;
+    }
+
+    DBG("ccp: peer configure request received with opts:\n");
+
+    len -= 4;
+
+    while(ptr < len) {
+        if(len - ptr < 2) {
+            DBG("ccp: bad configure length, ignoring.\n");
+            return -1;
+        }
+
+        opt_len = pkt->data[ptr + 1];
+
+        if(opt_len < 2 || ptr + opt_len > len) {
+            DBG("ccp: bad option length, ignoring packet\n");
+            return -1;
+        }
+
+        switch(pkt->data[ptr]) {
+            case CCP_CONFIGURE_PREDICTOR1:
+                if(opt_len == 2 && pred1_alloc(&ccp_state.tx) == 0) {
+                    DBG("    predictor type 1\n");
+                    pred1 = 1;
+                    break;
+                }
+
+                DBG("    predictor type 1 (rejected)\n");
+                goto reject_opt;
+
+            default:
+                DBG("    unknown option: %d (len %d)\n", pkt->data[ptr],
+                    opt_len);
+reject_opt:
+                if(response_len + opt_len < PPP_MRU) {
+                    response_code = LCP_CONFIGURE_REJECT;
+                    memcpy(response + response_len, &pkt->data[ptr], opt_len);
+                    response_len += opt_len;
+                }
+        }
+
+        ptr += opt_len;
+    }
+
+    if(response_code == LCP_CONFIGURE_ACK) {
+        int rv;
+        ppp_state_t *st = ccp_state.ppp_state;
+
+        memcpy(response, pkt, len + 4);
+        response[0] = LCP_CONFIGURE_ACK;
+        rv = ppp_send(response, len + 4, PPP_PROTOCOL_CCP);
+
+        if(pred1)
+            st->peer_flags |= PPP_FLAG_PRED1;
+        else
+            st->peer_flags &= ~PPP_FLAG_PRED1;
+
+        if(ccp_state.state == PPP_STATE_ACK_RECEIVED)
+            ccp_up();
+        else
+            ccp_state.state = PPP_STATE_ACK_SENT;
+
+        return rv;
+    }
+    else {
+        lcp_pkt_t *out = (lcp_pkt_t *)response;
+
+        out->code = LCP_CONFIGURE_REJECT;
+        out->id = pkt->id;
+        out->len = htons(response_len);
+
+        if(ccp_state.state != PPP_STATE_ACK_RECEIVED)
+            ccp_state.state = PPP_STATE_REQUEST_SENT;
+
+        return ppp_send(response, response_len, PPP_PROTOCOL_CCP);
+    }
+}
+
+static int ccp_handle_configure_ack(ppp_protocol_t *self,
+                                    const lcp_pkt_t *pkt, size_t len) {
+    (void)len;
+
+    if(pkt->id != ccp_state.last_conf) {
+        DBG("ccp: received configure ack with an invalid identifier\n");
+        return -1;
+    }
+
+    switch(ccp_state.state) {
+        case PPP_STATE_CLOSING:
+        case PPP_STATE_STOPPING:
+            return 0;
+
+        case PPP_STATE_CLOSED:
+        case PPP_STATE_STOPPED:
+            return ccp_send_simple(LCP_TERMINATE_ACK, pkt->id);
+
+        case PPP_STATE_REQUEST_SENT:
+            ccp_state.resend_cnt = 10;
+            ccp_state.state = PPP_STATE_ACK_RECEIVED;
+            return 0;
+
+        case PPP_STATE_OPENED:
+            ccp_down();
+            __fallthrough;
+
+        case PPP_STATE_ACK_RECEIVED:
+            ccp_state.state = PPP_STATE_REQUEST_SENT;
+            return ccp_send_client_cfg(self, 0);
+
+        case PPP_STATE_ACK_SENT:
+            ccp_up();
+            return 0;
+    }
+
+    return 0;
+}
+
+static int ccp_handle_configure_nak(ppp_protocol_t *self,
+                                    const lcp_pkt_t *pkt, size_t len) {
+    (void)len;
+
+    if(pkt->id != ccp_state.last_conf) {
+        DBG("ccp: received configure nak/reject with an invalid identifier\n");
+        return -1;
+    }
+
+    switch(ccp_state.state) {
+        case PPP_STATE_CLOSING:
+        case PPP_STATE_STOPPING:
+            return 0;
+
+        case PPP_STATE_CLOSED:
+        case PPP_STATE_STOPPED:
+            return ccp_send_simple(LCP_TERMINATE_ACK, pkt->id);
+
+        case PPP_STATE_OPENED:
+            ccp_down();
+            __fallthrough;
+
+        case PPP_STATE_REQUEST_SENT:
+        case PPP_STATE_ACK_RECEIVED:
+            ccp_state.state = PPP_STATE_REQUEST_SENT;
+            break;
+    }
+
+    /* Predictor is the only thing we know how to do, so if the peer wants
+       something else (or nothing at all), ask for no compression instead. This
+       is used for both naks and rejects. */
+    DBG("ccp: peer doesn't want predictor, going without\n");
+    ccp_state.ppp_state->our_flags &= ~PPP_FLAG_PRED1;
+    pred1_free(&ccp_state.rx);
+
+    return ccp_send_client_cfg(self, 0);
+}
+
+static int ccp_handle_terminate_req(ppp_protocol_t *self,
+                                    const lcp_pkt_t *pkt, size_t len) {
+    (void)self;
+    (void)len;
+
+    switch(ccp_state.state) {
+        case PPP_STATE_ACK_RECEIVED:
+        case PPP_STATE_ACK_SENT:
+            ccp_state.state = PPP_STATE_REQUEST_SENT;
+            break;
+
+        case PPP_STATE_OPENED:
+            ccp_down();
+            ccp_state.resend_pkt = NULL;
+            ccp_state.resend_timeout = NULL;
+            ccp_state.state = PPP_STATE_STOPPED;
+            break;
+    }
+
+    return ccp_send_simple(LCP_TERMINATE_ACK, pkt->id);
+}
+
+static int ccp_handle_terminate_ack(ppp_protocol_t *self,
+                                    const lcp_pkt_t *pkt, size_t len) {
+    (void)len;
+
+    if(pkt->id != ccp_state.last_term) {
+        DBG("ccp: received terminate ack with an invalid identifier\n");
+        return -1;
+    }
+
+    switch(ccp_state.state) {
+        case PPP_STATE_CLOSING:
+            ccp_state.resend_pkt = NULL;
+            ccp_state.resend_timeout = NULL;
+            ccp_state.state = PPP_STATE_CLOSED;
+            break;
+
+        case PPP_STATE_STOPPING:
+            ccp_state.resend_pkt = NULL;
+            ccp_state.resend_timeout = NULL;
+            ccp_state.state = PPP_STATE_STOPPED;
+            break;
+
+        case PPP_STATE_ACK_RECEIVED:
+            ccp_state.state = PPP_STATE_REQUEST_SENT;
+            break;
+
+        case PPP_STATE_OPENED:
+            /* Something has gone wrong... Attempt to reconfigure. */
+            ccp_down();
+            ccp_state.state = PPP_STATE_REQUEST_SENT;
+            return ccp_send_client_cfg(self, 0);
+    }
+
+    return 0;
+}
+
+static int ccp_shutdown(ppp_protocol_t *self) {
+    return ppp_del_protocol(self);
+}
+
+static int ccp_input(ppp_protocol_t *self, const uint8_t *buf, size_t len) {
+    const lcp_pkt_t *pkt = (const lcp_pkt_t *)buf;
+
+    if(len < sizeof(lcp_pkt_t) || len != ntohs(pkt->len))
+        return -1;
+
+    /* If we don't want compression, let the peer know that we don't speak
+       CCP at all. */
+    if(ccp_state.state == PPP_STATE_INITIAL)
+        return ppp_lcp_send_proto_reject(PPP_PROTOCOL_CCP, buf, len);
+
+    switch(pkt->code) {
+        case LCP_CONFIGURE_REQUEST:
+            return ccp_handle_configure_req(self, pkt, len);
+
+        case LCP_CONFIGURE_ACK:
+            return ccp_handle_configure_ack(self, pkt, len);
+
+        case LCP_CONFIGURE_NAK:
+        case LCP_CONFIGURE_REJECT:
+            return ccp_handle_configure_nak(self, pkt, len);
+
+        case LCP_TERMINATE_REQUEST:
+            return ccp_handle_terminate_req(self, pkt, len);
+
+        case LCP_TERMINATE_ACK:
+            return ccp_handle_terminate_ack(self, pkt, len);
+
+        case LCP_CODE_REJECT:
+            if(ccp_state.state == PPP_STATE_ACK_RECEIVED)
+                ccp_state.state = PPP_STATE_REQUEST_SENT;
+            break;
+
+        case CCP_RESET_REQUEST:
+            /* The peer lost track of our compressor. Start it over. */
+            if(ccp_state.state == PPP_STATE_OPENED) {
+                DBG("ccp: peer asked for a reset\n");
+                pred1_reset(&ccp_state.tx);
+                return ccp_send_simple(CCP_RESET_ACK, pkt->id);
+            }
+            break;
+
+        case CCP_RESET_ACK:
+            if(ccp_state.reset_sent && pkt->id == ccp_state.last_reset) {
+                pred1_reset(&ccp_state.rx);
+                ccp_state.reset_sent = 0;
+            }
+            break;
+
+        default:
+            return ccp_send_code_reject(self, buf, len);
+    }
+
+    return 0;
+}
+
+static void ccp_enter_phase(ppp_protocol_t *self, int oldp, int newp) {
+    (void)oldp;
+
+    if(newp == PPP_PHASE_NETWORK) {
+        ccp_state.ppp_state->peer_flags &= ~PPP_FLAG_PRED1;
+
+        /* Only bring up CCP if we've been asked to compress. */
+        if(ccp_state.ppp_state->our_flags & PPP_FLAG_PRED1) {
+            ccp_send_client_cfg(self, 0);
+            ccp_state.state = PPP_STATE_REQUEST_SENT;
+        }
+    }
+    else if(oldp == PPP_PHASE_NETWORK) {
+        ccp_down();
+        ccp_state.resend_pkt = NULL;
+        ccp_state.resend_timeout = NULL;
+        ccp_state.state = PPP_STATE_INITIAL;
+    }
+}
+
+static void ccp_check_timeouts(ppp_protocol_t *self, uint64_t tm) {
+    if(ccp_state.resend_pkt && tm >= ccp_state.next_resend) {
+        if(!ccp_state.resend_cnt) {
+            ccp_state.resend_timeout(self);
+        }
+        else {
+            ccp_state.resend_pkt(self, 1);
+            --ccp_state.resend_cnt;
+        }
+    }
+}
+
+static void ccp_request_reset(void) {
+    uint64_t now = timer_ms_gettime64();
+
+    /* Don't flood the peer if a run of packets comes in bad before it gets the
+       first request. */
+    if(ccp_state.reset_sent && now - ccp_state.reset_sent < CCP_RESET_TIMEOUT)
+        return;
+
+    ccp_state.reset_sent = now;
+    ccp_send_simple(CCP_RESET_REQUEST, ++ccp_state.last_reset);
+}
+
+static int comp_input(ppp_protocol_t *self, const uint8_t *buf, size_t len) {
+    uint16_t orglen, fcs;
+    uint8_t hdr[2];
+    int rv;
+
+    (void)self;
+
+    if(!ccp_state.rx_active)
+        return 0;
+
+    if(len < PRED1_OVERHEAD + 2)
+        goto bad;
+
+    orglen = (uint16_t)(((buf[0] << 8) | buf[1]) & ~PRED1_COMPRESSED);
+
+    if(orglen < 2 || orglen > sizeof(ccp_rxbuf))
+        goto bad;
+
+    if(buf[0] & (PRED1_COMPRESSED >> 8)) {
+        rv = pred1_decompress(&ccp_state.rx, buf + 2, len - PRED1_OVERHEAD,
+                              ccp_rxbuf, orglen);
+
+        if(rv != orglen)
+            goto bad;
+    }
+    else {
+        if(len - PRED1_OVERHEAD != orglen)
+            goto bad;
+
+        memcpy(ccp_rxbuf, buf + 2, orglen);
+        pred1_sync(&ccp_state.rx, ccp_rxbuf, orglen);
+    }
+
+    /* The CRC covers the length (without the compressed bit) and the original
+       data, and is followed by the FCS bytes themselves. */
+    hdr[0] = (uint8_t)(orglen >> 8);
+    hdr[1] = (uint8_t)orglen;
+    fcs = _ppp_fcs16(INITIAL_FCS, hdr, 2);
+    fcs = _ppp_fcs16(fcs, ccp_rxbuf, orglen);
+    fcs = _ppp_fcs16(fcs, buf + len - 2, 2);
+
+    if(fcs != FINAL_FCS)
+        goto bad;
+
+    return _ppp_input_proto((ccp_rxbuf[0] << 8) | ccp_rxbuf[1], ccp_rxbuf + 2,
+                            orglen - 2);
+
+bad:
+    DBG("ccp: dropping bad compressed packet\n");
+    _ppp_vj_input_error();
+    ccp_request_reset();
+    return -1;
+}
+
+int _ppp_ccp_send(const uint8_t *data, size_t len, uint16_t proto) {
+    uint16_t fcs, orglen = (uint16_t)(len + 2);
+    size_t clen;
+
+    if(!ccp_state.tx_active || len > PPP_MRU)
+        return ppp_send(data, len, proto);
+
+    /* The protocol field gets compressed along with the data. */
+    ccp_txtmp[0] = (uint8_t)(proto >> 8);
+    ccp_txtmp[1] = (uint8_t)proto;
+    memcpy(ccp_txtmp + 2, data, len);
+
+    ccp_txbuf[0] = (uint8_t)(orglen >> 8);
+    ccp_txbuf[1] = (uint8_t)orglen;
+
+    fcs = _ppp_fcs16(INITIAL_FCS, ccp_txbuf, 2);
+    fcs = _ppp_fcs16(fcs, ccp_txtmp, orglen) ^ 0xFFFF;
+
+    /* If it didn't get any smaller, send it as-is. The table has been updated
+       either way, and the peer will do the same on its end. */
+    clen = pred1_compress(&ccp_state.tx, ccp_txtmp, orglen, ccp_txbuf + 2);
+
+    if(clen < orglen) {
+        ccp_txbuf[0] |= PRED1_COMPRESSED >> 8;
+    }
+    else {
+        memcpy(ccp_txbuf + 2, ccp_txtmp, orglen);
+        clen = orglen;
+    }
+
+    ccp_txbuf[clen + 2] = (uint8_t)fcs;
+    ccp_txbuf[clen + 3] = (uint8_t)(fcs >> 8);
+
+    return ppp_send(ccp_txbuf, clen + PRED1_OVERHEAD, PPP_PROTOCOL_COMP);
+}
+
+void _ppp_ccp_rejected(void) {
+    DBG("ccp: peer rejected ccp, going without compression\n");
+
+    ccp_down();
+    ccp_state.resend_pkt = NULL;
+    ccp_state.resend_timeout = NULL;
+    ccp_state.state = PPP_STATE_STOPPED;
+}
+
+static ppp_protocol_t ccp_proto = {
+    PPP_PROTO_ENTRY_INIT,
+    "ccp",
+    PPP_PROTOCOL_CCP,
+    NULL,                   /* privdata */
+    NULL,                   /* init */
+    &ccp_shutdown,
+    &ccp_input,
+    &ccp_enter_phase,
+    &ccp_check_timeouts
+};
+
+static ppp_protocol_t comp_proto = {
+    PPP_PROTO_ENTRY_INIT,
+    "comp",
+    PPP_PROTOCOL_COMP,
+    NULL,                   /* privdata */
+    NULL,                   /* init */
+    &ccp_shutdown,
+    &comp_input,
+    NULL,                   /* enter_phase */
+    NULL                    /* check_timeouts */
+};
+
+int _ppp_ccp_init(ppp_state_t *st) {
+    ccp_state.ppp_state = st;
+    ccp_state.state = PPP_STATE_INITIAL;
+
+    return ppp_add_protocol(&comp_proto) | ppp_add_protocol(&ccp_proto);
+}
@@ -30,6 +30,10 @@ struct ipcp_state_s {
     uint16_t resend_cnt;
     int (*resend_pkt)(ppp_protocol_t *, int);
     void (*resend_timeout)(ppp_protocol_t *);
+
+    /* VJ compression parameters we ask the peer to use. */
+    uint8_t vj_max_slot;
+    uint8_t vj_cid_comp;
 } ipcp_state;
 
 /* IPCP configuration options. */
@@ -94,6 +98,15 @@ static int ipcp_send_client_cfg(ppp_protocol_t *self, int resend) {
     pkt->data[len++] = dns[2];
     pkt->data[len++] = dns[3];
 
+    if(ipcp_state.ppp_state->our_flags & PPP_FLAG_VJ_COMP) {
+        pkt->data[len++] = IPCP_CONFIGURE_IP_COMPRESSION;
+        pkt->data[len++] = 6;
+        pkt->data[len++] = (uint8_t)(PPP_PROTOCOL_VJ_COMP >> 8);
+        pkt->data[len++] = (uint8_t)PPP_PROTOCOL_VJ_COMP;
+        pkt->data[len++] = ipcp_state.vj_max_slot;
+        pkt->data[len++] = ipcp_state.vj_cid_comp;
+    }
+
     len += 4;
     pkt->len = htons(len);
 
@@ -162,6 +175,7 @@ static int ipcp_handle_configure_req(ppp_protocol_t *self,
 
     /* Parameters and their default values. */
     uint32_t addr = 0;
+    int vj = 0, vj_max_slot = 0, vj_cid_comp = 0;
 
     (void)pkt;
 
@@ -227,6 +241,25 @@ static int ipcp_handle_configure_req(ppp_protocol_t *self,
                 }
                 break;
 
+            case IPCP_CONFIGURE_IP_COMPRESSION:
+                /* We only do Van Jacobson compression, and only if we've been
+                   asked to. */
+                if(opt_len >= 6 &&
+                   pkt->data[ptr + 2] == (uint8_t)(PPP_PROTOCOL_VJ_COMP >> 8) &&
+                   pkt->data[ptr + 3] == (uint8_t)PPP_PROTOCOL_VJ_COMP &&
+                   (ipcp_state.ppp_state->our_flags & PPP_FLAG_VJ_COMP)) {
+                    vj = 1;
+                    vj_max_slot = pkt->data[ptr + 4];
+                    vj_cid_comp = pkt->data[ptr + 5];
+                    DBG("    VJ compression: %d slots%s\n", vj_max_slot + 1,
+                        vj_cid_comp ? ", compressed slot ids" : "");
+                }
+                else {
+                    DBG("    IP compression (rejected)\n");
+                    goto reject_opt;
+                }
+                break;
+
             case IPCP_CONFIGURE_PRIMARY_DNS:
                 if(opt_len == 6) {
                     DBG("    primary DNS: %d.%d.%d.%d\n",
@@ -309,6 +342,14 @@ reject_opt:
             nif->gateway[3] = (uint8_t)addr;
         }
 
+        if(vj) {
+            _ppp_vj_init_tx(vj_max_slot, vj_cid_comp);
+            st->peer_flags |= PPP_FLAG_VJ_COMP;
+        }
+        else {
+            st->peer_flags &= ~PPP_FLAG_VJ_COMP;
+        }
+
         if(ipcp_state.state == PPP_STATE_ACK_RECEIVED) {
             ipcp_state.state = PPP_STATE_OPENED;
 
@@ -385,6 +426,11 @@ static int ipcp_handle_configure_ack(ppp_protocol_t *self,
                spec is probably right? */
             ipcp_state.resend_cnt = 10;
             ipcp_state.state = PPP_STATE_ACK_RECEIVED;
+
+            /* The peer may start sending compressed headers any time now. */
+            if(ipcp_state.ppp_state->our_flags & PPP_FLAG_VJ_COMP)
+                _ppp_vj_init_rx(ipcp_state.vj_max_slot);
+
             return 0;
 
         case PPP_STATE_OPENED:
@@ -399,6 +445,9 @@ static int ipcp_handle_configure_ack(ppp_protocol_t *self,
             return ipcp_send_client_cfg(self, 0);
 
         case PPP_STATE_ACK_SENT:
+            if(ipcp_state.ppp_state->our_flags & PPP_FLAG_VJ_COMP)
+                _ppp_vj_init_rx(ipcp_state.vj_max_slot);
+
             ipcp_state.resend_pkt = NULL;
             ipcp_state.resend_timeout = NULL;
             ipcp_state.state = PPP_STATE_OPENED;
@@ -490,6 +539,25 @@ static int ipcp_handle_configure_nak(ppp_protocol_t *self,
                 }
                 break;
 
+            case IPCP_CONFIGURE_IP_COMPRESSION:
+                /* Take whatever slot parameters the peer wants, as long as we
+                   can handle them. Anything other than VJ, we can't do. */
+                if(opt_len >= 6 &&
+                   pkt->data[ptr + 2] == (uint8_t)(PPP_PROTOCOL_VJ_COMP >> 8) &&
+                   pkt->data[ptr + 3] == (uint8_t)PPP_PROTOCOL_VJ_COMP) {
+                    if(pkt->data[ptr + 4] < ipcp_state.vj_max_slot)
+                        ipcp_state.vj_max_slot = pkt->data[ptr + 4];
+
+                    ipcp_state.vj_cid_comp = pkt->data[ptr + 5] ? 1 : 0;
+                    DBG("    VJ compression: %d slots\n",
+                        ipcp_state.vj_max_slot + 1);
+                }
+                else {
+                    ipcp_state.ppp_state->our_flags &= ~PPP_FLAG_VJ_COMP;
+                    DBG("    IP compression (not VJ, disabling)\n");
+                }
+                break;
+
             case IPCP_CONFIGURE_PRIMARY_DNS:
                 if(opt_len == 6) {
                     dns = (pkt->data[ptr + 2] << 24) |
@@ -532,6 +600,79 @@ static int ipcp_handle_configure_nak(ppp_protocol_t *self,
     return ipcp_send_client_cfg(self, 0);
 }
 
+static int ipcp_handle_configure_rej(ppp_protocol_t *self,
+                                     const ipcp_pkt_t *pkt, size_t len) {
+    size_t ptr = 0;
+    uint8_t opt_len;
+    int changed = 0;
+
+    if(pkt->id != ipcp_state.last_conf) {
+        DBG("ipcp: received configure reject with an invalid identifier\n");
+        return -1;
+    }
+
+    switch(ipcp_state.state) {
+        case PPP_STATE_CLOSING:
+        case PPP_STATE_STOPPING:
+            /* Silently discard and don't move states. */
+            return 0;
+
+        case PPP_STATE_CLOSED:
+        case PPP_STATE_STOPPED:
+            /* Send a terminate ack and discard the request. */
+            return ipcp_send_terminate_ack(self, pkt->id, NULL, 0);
+
+        case PPP_STATE_OPENED:
+            /* XXXX: This layer down. */
+            __fallthrough;
+
+        case PPP_STATE_REQUEST_SENT:
+        case PPP_STATE_ACK_RECEIVED:
+            ipcp_state.state = PPP_STATE_REQUEST_SENT;
+            break;
+    }
+
+    DBG("ipcp: peer sent configure reject with opts:\n");
+
+    len -= 4;
+
+    while(ptr < len) {
+        if(len - ptr < 2) {
+            DBG("ipcp: bad configure length, ignoring.\n");
+            return -1;
+        }
+
+        opt_len = pkt->data[ptr + 1];
+
+        if(opt_len < 2 || ptr + opt_len > len) {
+            DBG("ipcp: bad option length, ignoring packet\n");
+            return -1;
+        }
+
+        switch(pkt->data[ptr]) {
+            case IPCP_CONFIGURE_IP_COMPRESSION:
+                /* Header compression is optional, so just go without. */
+                ipcp_state.ppp_state->our_flags &= ~PPP_FLAG_VJ_COMP;
+                changed = 1;
+                DBG("    IP compression\n");
+                break;
+
+            /* We can't do without anything else we ask for. Leave it to the
+               resend timer, like we always have. */
+            default:
+                DBG("    unknown option: %d (len %d)\n", pkt->data[ptr],
+                    opt_len);
+        }
+
+        ptr += opt_len;
+    }
+
+    if(!changed)
+        return 0;
+
+    return ipcp_send_client_cfg(self, 0);
+}
+
 static int ipcp_handle_terminate_req(ppp_protocol_t *self,
                                      const ipcp_pkt_t *pkt, size_t len) {
     (void)len;
@@ -641,8 +782,7 @@ static int ipcp_input(ppp_protocol_t *self, const uint8_t *buf, size_t len) {
             return ipcp_handle_configure_nak(self, pkt, len);
 
         case LCP_CONFIGURE_REJECT:
-            //return ipcp_handle_configure_rej(self, pkt, len);
-            return 0;
+            return ipcp_handle_configure_rej(self, pkt, len);
 
         case LCP_TERMINATE_REQUEST:
             return ipcp_handle_terminate_req(self, pkt, len);
@@ -671,6 +811,10 @@ static void ipcp_enter_phase(ppp_protocol_t *self, int oldp, int newp) {
 
     /* We only care about when we're entering the network phase. */
     if(newp == PPP_PHASE_NETWORK) {
+        ipcp_state.ppp_state->peer_flags &= ~PPP_FLAG_VJ_COMP;
+        ipcp_state.vj_max_slot = VJ_MAX_SLOTS - 1;
+        ipcp_state.vj_cid_comp = 1;
+
         ipcp_send_client_cfg(self, 0);
         ipcp_state.state = PPP_STATE_REQUEST_SENT;
     }
@@ -701,6 +845,20 @@ static int ip_input(ppp_protocol_t *self, const uint8_t *buf, size_t len) {
     return 0;
 }
 
+static int vj_input(ppp_protocol_t *self, const uint8_t *buf, size_t len) {
+    const uint8_t *pkt;
+    size_t pkt_len;
+
+    if(ipcp_state.state != PPP_STATE_OPENED ||
+       !(ipcp_state.ppp_state->our_flags & PPP_FLAG_VJ_COMP))
+        return 0;
+
+    if(!(pkt = _ppp_vj_uncompress(self->code, buf, len, &pkt_len)))
+        return -1;
+
+    return net_ipv4_input(ipcp_state.ppp_state->netif, pkt, pkt_len, NULL);
+}
+
 static ppp_protocol_t ipcp_proto = {
     PPP_PROTO_ENTRY_INIT,
     "ipcp",
@@ -725,10 +883,37 @@ static ppp_protocol_t ip_proto = {
     NULL                    /* check_timeouts */
 };
 
+static ppp_protocol_t vj_comp_proto = {
+    PPP_PROTO_ENTRY_INIT,
+    "vj-comp",
+    PPP_PROTOCOL_VJ_COMP,
+    NULL,                   /* privdata */
+    NULL,                   /* init */
+    &ipcp_shutdown,
+    &vj_input,
+    NULL,                   /* enter_phase */
+    NULL                    /* check_timeouts */
+};
+
+static ppp_protocol_t vj_uncomp_proto = {
+    PPP_PROTO_ENTRY_INIT,
+    "vj-uncomp",
+    PPP_PROTOCOL_VJ_UNCOMP,
+    NULL,                   /* privdata */
+    NULL,                   /* init */
+    &ipcp_shutdown,
+    &vj_input,
+    NULL,                   /* enter_phase */
+    NULL                    /* check_timeouts */
+};
+
 int _ppp_ipcp_init(ppp_state_t *st) {
     (void)st;
 
     ipcp_state.ppp_state = st;
+    ipcp_state.vj_max_slot = VJ_MAX_SLOTS - 1;
+    ipcp_state.vj_cid_comp = 1;
 
-    return ppp_add_protocol(&ip_proto) | ppp_add_protocol(&ipcp_proto);
+    return ppp_add_protocol(&ip_proto) | ppp_add_protocol(&vj_comp_proto) |
+        ppp_add_protocol(&vj_uncomp_proto) | ppp_add_protocol(&ipcp_proto);
 }
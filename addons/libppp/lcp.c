@@ -948,7 +948,12 @@ static int lcp_input(ppp_protocol_t *self, const uint8_t *buf, size_t len) {
             break;
 
         case LCP_PROTOCOL_REJECT:
-            /* XXXX: Need to inform the protocol that got rejected. */
+            /* XXXX: Need to inform the protocol that got rejected. CCP is the
+               only one that can carry on without the peer, so it's the only
+               one we tell for now. */
+            if(len >= 6 && ((pkt->data[0] << 8) | pkt->data[1]) ==
+               PPP_PROTOCOL_CCP)
+                _ppp_ccp_rejected();
             break;
 
         case LCP_ECHO_REQUEST:
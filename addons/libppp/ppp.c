@@ -39,11 +39,32 @@ static kthread_t *waiting_thd = NULL;
 static int conn_rv = 0;
 
 /* Receive buffer. This should never be touched by anything but the PPP thread.
-   1504 bytes = 1500 byte MRU + 2 bytes for protocol + 2 bytes for FCS. */
-#define PPP_MRU 1500
-static uint8_t ppp_recvbuf[PPP_MRU + 4];
+   1508 bytes = 1500 byte MRU + 2 bytes for protocol + 2 bytes for FCS + 4 bytes
+   for compression framing (if CCP is in use). */
+static uint8_t ppp_recvbuf[PPP_MRU + 8];
 static size_t ppp_recvbuf_len;
 
+/* Transmit buffer for header compression. Only used with the mutex held. */
+static uint8_t ppp_txbuf[PPP_MRU];
+
+/* Outgoing frames are escaped into here before being handed to the device. Big
+   enough for a full sized packet with every byte escaped. Only used with the
+   mutex held. */
+static uint8_t ppp_txframe[2 * (PPP_MRU + 8) + 2];
+
+/* Whether each byte needs escaping on the way out, built from out_accm. */
+static uint8_t tx_escape[256];
+static uint32_t tx_escape_accm[8];
+
+/* What each byte means on the way in, built from in_accm. */
+#define RX_NORMAL      0
+#define RX_FLAG        1
+#define RX_ESCAPE      2
+#define RX_DROP        3
+
+static uint8_t rx_class[256];
+static uint32_t rx_class_accm[8];
+
 TAILQ_HEAD(ppp_proto_list, ppp_proto);
 static struct ppp_proto_list protocols = TAILQ_HEAD_INITIALIZER(protocols);
 
@@ -60,22 +81,17 @@ static inline void set_accm_bit(uint32_t *accm, uint8_t bit) {
     int pos1 = bit >> 5;
     int pos2 = bit & 0x1F;
 
-    accm[pos1] |= (1 << pos2);
+    accm[pos1] |= (1U << pos2);
 }
 
 static inline int check_accm_bit(uint32_t *accm, uint8_t bit) {
     int pos1 = bit >> 5;
     int pos2 = bit & 0x1F;
 
-    return accm[pos1] & (1 << pos2);
+    return !!(accm[pos1] & (1U << pos2));
 }
 
-int ppp_send(const uint8_t *data, size_t len, uint16_t proto) {
-    uint8_t tmp[5];
-    uint16_t fcs = INITIAL_FCS;
-    size_t i, j, run_len = 0;
-    const uint8_t *run_start = data;
-
+static int ppp_lock(void) {
     /* We can't use mutex_lock() inside an IRQ, so we have this song and dance
        with mutex_trylock() instead in that case. */
     if(irq_inside_int()) {
@@ -88,6 +104,51 @@ int ppp_send(const uint8_t *data, size_t len, uint16_t proto) {
         mutex_lock(&mutex);
     }
 
+    return 0;
+}
+
+/* Rebuild the escape table if the peer's ACCM has changed since we last
+   looked. */
+static void update_tx_escape(void) {
+    int i;
+
+    if(!memcmp(tx_escape_accm, ppp_state.out_accm, sizeof(tx_escape_accm)))
+        return;
+
+    memcpy(tx_escape_accm, ppp_state.out_accm, sizeof(tx_escape_accm));
+
+    for(i = 0; i < 256; ++i)
+        tx_escape[i] = check_accm_bit(ppp_state.out_accm, (uint8_t)i) ? 1 : 0;
+}
+
+static inline uint8_t *escape_data(uint8_t *out, const uint8_t *in,
+                                   size_t len) {
+    uint8_t ch;
+
+    while(len--) {
+        ch = *in++;
+
+        if(tx_escape[ch]) {
+            *out++ = ESCAPE_CHAR;
+            *out++ = ch ^ 0x20;
+        }
+        else {
+            *out++ = ch;
+        }
+    }
+
+    return out;
+}
+
+int ppp_send(const uint8_t *data, size_t len, uint16_t proto) {
+    uint8_t hdr[4], trailer[2];
+    uint8_t *out = ppp_txframe;
+    uint16_t fcs;
+    size_t n;
+
+    if(ppp_lock())
+        return -1;
+
     if(!ppp_state.device) {
         mutex_unlock(&mutex);
         errno = ENETDOWN;
@@ -100,149 +161,135 @@ int ppp_send(const uint8_t *data, size_t len, uint16_t proto) {
         return -1;
     }
 
-    /* Send the start of the framing out first. */
-    i = 0;
-    tmp[i++] = FLAG_SEQUENCE;
+    update_tx_escape();
 
-    if(check_accm_bit(ppp_state.out_accm, ADDRESS_FIELD)) {
-        tmp[i++] = ESCAPE_CHAR;
-        tmp[i++] = ADDRESS_FIELD ^ 0x20;
-    }
-    else {
-        tmp[i++] = ADDRESS_FIELD;
-    }
+    hdr[0] = ADDRESS_FIELD;
+    hdr[1] = CONTROL_FIELD;
+    hdr[2] = (uint8_t)(proto >> 8);
+    hdr[3] = (uint8_t)proto;
 
-    if(check_accm_bit(ppp_state.out_accm, CONTROL_FIELD)) {
-        tmp[i++] = ESCAPE_CHAR;
-        tmp[i++] = CONTROL_FIELD ^ 0x20;
-    }
-    else {
-        tmp[i++] = CONTROL_FIELD;
-    }
+    fcs = _ppp_fcs16(INITIAL_FCS, hdr, 4);
+    fcs = _ppp_fcs16(fcs, data, len) ^ 0xFFFF;
+    trailer[0] = (uint8_t)fcs;
+    trailer[1] = (uint8_t)(fcs >> 8);
 
-    fcs = (fcs >> 8) ^ fcstab[(fcs ^ ADDRESS_FIELD) & 0xFF];
-    fcs = (fcs >> 8) ^ fcstab[(fcs ^ CONTROL_FIELD) & 0xFF];
+    /* Build the whole frame in the transmit buffer, so that the device gets it
+       all at once. Only frames bigger than the MRU (which can happen with
+       compression) need more than one write. Each byte can take up to two
+       when escaped, and we need to leave room for the FCS and the final flag
+       sequence at the end. */
+    *out++ = FLAG_SEQUENCE;
+    out = escape_data(out, hdr, 4);
 
-    ppp_state.device->tx(ppp_state.device, tmp, i, 0);
+    while(len) {
+        n = (size_t)(ppp_txframe + sizeof(ppp_txframe) - out) / 2 - 3;
 
-    /* Next deal with the PPP protocol field. */
-    i = 0;
+        if(n > len)
+            n = len;
 
-    if(check_accm_bit(ppp_state.out_accm, (uint8_t)(proto >> 8))) {
-        tmp[i++] = ESCAPE_CHAR;
-        tmp[i++] = ((uint8_t)(proto >> 8)) ^ 0x20;
-    }
-    else {
-        tmp[i++] = (uint8_t)(proto >> 8);
-    }
+        out = escape_data(out, data, n);
+        data += n;
+        len -= n;
 
-    if(check_accm_bit(ppp_state.out_accm, (uint8_t)proto)) {
-        tmp[i++] = ESCAPE_CHAR;
-        tmp[i++] = ((uint8_t)proto) ^ 0x20;
-    }
-    else {
-        tmp[i++] = (uint8_t)proto;
+        if(len) {
+            ppp_state.device->tx(ppp_state.device, ppp_txframe,
+                                 out - ppp_txframe, 0);
+            out = ppp_txframe;
+        }
     }
 
-    fcs = (fcs >> 8) ^ fcstab[(fcs ^ ((uint8_t)(proto >> 8))) & 0xFF];
-    fcs = (fcs >> 8) ^ fcstab[(fcs ^ ((uint8_t)proto)) & 0xFF];
+    out = escape_data(out, trailer, 2);
+    *out++ = FLAG_SEQUENCE;
 
-    ppp_state.device->tx(ppp_state.device, tmp, i, 0);
+    ppp_state.device->tx(ppp_state.device, ppp_txframe, out - ppp_txframe,
+                         PPP_TX_END_OF_PKT);
 
-    /* Deal with the data now. */
-    for(j = 0; j < len; ++j) {
-        if(check_accm_bit(ppp_state.out_accm, data[j])) {
-            /* Send everything up to this point. */
-            if(run_len)
-                ppp_state.device->tx(ppp_state.device, run_start, run_len, 0);
+    /* Clean up, we're done. */
+    mutex_unlock(&mutex);
 
-            /* Escape the current byte and send it. */
-            tmp[0] = ESCAPE_CHAR;
-            tmp[1] = data[j] ^ 0x20;
-            ppp_state.device->tx(ppp_state.device, tmp, 2, 0);
+    return 0;
+}
 
-            /* Restart the run counter. */
-            run_start = data + j + 1;
-            run_len = 0;
-        }
-        else {
-            ++run_len;
-        }
+int _ppp_input_proto(uint16_t proto, const uint8_t *buf, size_t len) {
+    ppp_protocol_t *i;
 
-        fcs = (fcs >> 8) ^ fcstab[(fcs ^ data[j]) & 0xFF];
+    /* Look for the specified protocol in the list of registered protocols. */
+    TAILQ_FOREACH(i, &protocols, entry) {
+        if(i->code == proto)
+            return i->input(i, buf, len);
     }
 
-    /* Send anything left over. */
-    if(run_len)
-        ppp_state.device->tx(ppp_state.device, run_start, run_len, 0);
+    /* We didn't find it in the protocols list, so send a protocol reject. */
+    return ppp_lcp_send_proto_reject(proto, buf, len);
+}
 
-    /* Finish up with the FCS and tack it onto the end along with an extra flag
-       sequence to mark the end of the packet. */
-    fcs = fcs ^ 0xFFFF;
-    i = 0;
+static int ppp_input(void) {
+    /* Do we have a compressed protocol value? */
+    if(ppp_recvbuf[0] & 0x01) {
+        if(ppp_recvbuf_len < 3)
+            return -1;
 
-    if(check_accm_bit(ppp_state.out_accm, (uint8_t)(fcs & 0xFF))) {
-        tmp[i++] = ESCAPE_CHAR;
-        tmp[i++] = ((uint8_t)(fcs & 0xFF)) ^ 0x20;
+        return _ppp_input_proto(ppp_recvbuf[0], ppp_recvbuf + 1,
+                                ppp_recvbuf_len - 3);
     }
     else {
-        tmp[i++] = (uint8_t)(fcs & 0xFF);
-    }
+        if(ppp_recvbuf_len < 4)
+            return -1;
 
-    if(check_accm_bit(ppp_state.out_accm, (uint8_t)((fcs >> 8) & 0xFF))) {
-        tmp[i++] = ESCAPE_CHAR;
-        tmp[i++] = ((uint8_t)((fcs >> 8) & 0xFF)) ^ 0x20;
-    }
-    else {
-        tmp[i++] = (uint8_t)((fcs >> 8) & 0xFF);
+        return _ppp_input_proto((ppp_recvbuf[0] << 8) | ppp_recvbuf[1],
+                                ppp_recvbuf + 2, ppp_recvbuf_len - 4);
     }
+}
 
-    tmp[i++] = FLAG_SEQUENCE;
+/* Rebuild the receive byte classes if our ACCM has changed since we last
+   looked. */
+static void update_rx_class(void) {
+    int i;
 
-    ppp_state.device->tx(ppp_state.device, tmp, i, PPP_TX_END_OF_PKT);
+    if(!memcmp(rx_class_accm, ppp_state.in_accm, sizeof(rx_class_accm)))
+        return;
 
-    /* Clean up, we're done. */
-    mutex_unlock(&mutex);
+    memcpy(rx_class_accm, ppp_state.in_accm, sizeof(rx_class_accm));
 
-    return 0;
+    for(i = 0; i < 256; ++i) {
+        if(i == FLAG_SEQUENCE)
+            rx_class[i] = RX_FLAG;
+        else if(i == ESCAPE_CHAR)
+            rx_class[i] = RX_ESCAPE;
+        else if(check_accm_bit(ppp_state.in_accm, (uint8_t)i))
+            rx_class[i] = RX_DROP;
+        else
+            rx_class[i] = RX_NORMAL;
+    }
 }
 
-static int ppp_input(void) {
-    uint16_t proto;
-    uint8_t *ptr;
-    size_t len;
-    ppp_protocol_t *i;
+/* Check the FCS on a complete frame in the receive buffer. */
+static int check_fcs(int have_ac) {
+    static const uint8_t ac[2] = { ADDRESS_FIELD, CONTROL_FIELD };
+    uint16_t fcs = INITIAL_FCS;
 
-    /* Do we have a compressed protocol value? */
-    if(ppp_recvbuf[0] & 0x01) {
-        proto = ppp_recvbuf[0];
-        ptr = ppp_recvbuf + 1;
-        len = ppp_recvbuf_len - 3;
-    }
-    else {
-        proto = (ppp_recvbuf[0] << 8) | ppp_recvbuf[1];
-        ptr = ppp_recvbuf + 2;
-        len = ppp_recvbuf_len - 4;
-    }
+    if(have_ac)
+        fcs = _ppp_fcs16(fcs, ac, 2);
 
-    /* Look for the specified protocol in the list of registered protocols. */
-    TAILQ_FOREACH(i, &protocols, entry) {
-        if(i->code == proto)
-            return i->input(i, ptr, len);
+    fcs = _ppp_fcs16(fcs, ppp_recvbuf, ppp_recvbuf_len);
+
+    if(fcs != FINAL_FCS) {
+        DBG("ppp: dropping packet with bad final fcs, got: %04x\n", fcs);
+        DBG("ppp: was for proto %02x%02x\n", ppp_recvbuf[0], ppp_recvbuf[1]);
+        DBG("ppp: was %d bytes long\n", (int)ppp_recvbuf_len);
+        return 0;
     }
 
-    /* We didn't find it in the protocols list, so send a protocol reject. */
-    return ppp_lcp_send_proto_reject(proto, ppp_recvbuf + 2,
-                                     ppp_recvbuf_len - 4);
+    return 1;
 }
 
 /* PPP thread function. */
 void *ppp_main(void *arg) {
-    const uint8_t *data, *cur;
+    const uint8_t *data, *cur, *run;
     uint8_t ch;
     ssize_t data_len;
-    int esc = 0, expect = EXPECT_FLAGSEQ;
-    uint16_t fcs = INITIAL_FCS;
+    size_t n;
+    int esc = 0, expect = EXPECT_FLAGSEQ, have_ac = 0;
     ppp_protocol_t *i;
     uint64_t now;
 
@@ -260,126 +307,161 @@ void *ppp_main(void *arg) {
             goto check_timeouts;
         }
 
-        while(data_len--) {
-            ch = *cur++;
+        update_rx_class();
 
-            /* Go through some special edge cases... */
-            if(ch == FLAG_SEQUENCE) {
-                /* A flag sequence marks the beginning of a packet. Check what
-                   we should do with whatever we have already. */
-                switch(expect) {
-                    case EXPECT_FLAGSEQ:
-                        expect = EXPECT_ADDRESS;
-                        break;
+        while(data_len > 0) {
+            /* Most of the bytes in a packet need no special handling at all,
+               so copy runs of them into the receive buffer in one go. The FCS
+               is checked over the whole packet once the closing flag shows
+               up. */
+            if(expect == EXPECT_DATA && !esc) {
+                run = cur;
 
-                    case EXPECT_ADDRESS:
-                        /* Empty packet (or time fill). No matter, just continue
-                           expecting the all points address next. */
-                        break;
+                while(data_len > 0 && rx_class[*cur] == RX_NORMAL) {
+                    ++cur;
+                    --data_len;
+                }
 
-                    case EXPECT_CONTROL:
-                        DBG("ppp: aborting packet, unexpected flag sequence\n");
+                n = (size_t)(cur - run);
 
-                        expect = EXPECT_ADDRESS;
-                        ppp_recvbuf_len = 0;
-                        fcs = INITIAL_FCS;
-                        break;
-
-                    case EXPECT_DATA:
-                        /* Check the FCS so far, and see if the packet is valid.
-                           If it is, then pass the packet along to the proper
-                           protocol handler. */
-                        if(fcs == FINAL_FCS) {
-                            /* This is a good packet, pass it along. */
-                            ppp_input();
-                        }
-                        else    {
-                            DBG("ppp: dropping packet with bad final fcs, got: "
-                                "%04x\n", fcs);
-                            DBG("ppp: was for proto %02x%02x\n", ppp_recvbuf[0],
-                                ppp_recvbuf[1]);
-                            DBG("ppp: was %d bytes long\n",
-                                (int)ppp_recvbuf_len);
-                        }
-
-                        expect = EXPECT_ADDRESS;
-                        fcs = INITIAL_FCS;
+                if(n) {
+                    if(ppp_recvbuf_len + n <= sizeof(ppp_recvbuf)) {
+                        memcpy(ppp_recvbuf + ppp_recvbuf_len, run, n);
+                        ppp_recvbuf_len += n;
+                    }
+                    else {
+                        /* We've gone beyond the MRU, so bail. */
+                        expect = EXPECT_FLAGSEQ;
                         ppp_recvbuf_len = 0;
-                        break;
+
+                        DBG("ppp: Dropping packet with length greater than "
+                            "the configured MRU\n");
+                    }
                 }
+
+                if(data_len <= 0)
+                    break;
             }
-            else if(ch == ESCAPE_CHAR) {
-                esc = 1;
-            }
-            else if(check_accm_bit(ppp_state.in_accm, ch)) {
-                DBG("ppp: dropping character that should be escaped: %02x\n",
-                    ch);
-            }
-            else {
-                if(esc) {
-                    ch ^= 0x20;
+
+            ch = *cur++;
+            --data_len;
+
+            switch(rx_class[ch]) {
+                case RX_FLAG:
+                    /* A flag sequence marks the beginning of a packet. Check
+                       what we should do with whatever we have already. */
                     esc = 0;
-                }
 
-                /* Update our FCS */
-                fcs = (fcs >> 8) ^ fcstab[(fcs ^ ch) & 0xFF];
-
-                switch(expect) {
-                    case EXPECT_FLAGSEQ:
-                        DBG("ppp: Got data byte while expecting flag sequence, "
-                            "dropping %02x\n", ch);
-
-                        fcs = INITIAL_FCS;
-                        break;
-
-                    case EXPECT_CONTROL:
-                        if(ch == CONTROL_FIELD) {
-                            /* We got the correct control field, move onto
-                               data. */
-                            expect = EXPECT_DATA;
-                        }
-                        else {
-                            /* Something is probably wrong, so go ahead and drop
-                               the packet now. */
-                            expect = EXPECT_FLAGSEQ;
+                    switch(expect) {
+                        case EXPECT_FLAGSEQ:
+                            expect = EXPECT_ADDRESS;
+                            break;
+
+                        case EXPECT_ADDRESS:
+                            /* Empty packet (or time fill). No matter, just
+                               continue expecting the all points address
+                               next. */
+                            break;
+
+                        case EXPECT_CONTROL:
+                            DBG("ppp: aborting packet, unexpected flag "
+                                "sequence\n");
+
+                            expect = EXPECT_ADDRESS;
                             ppp_recvbuf_len = 0;
-                            fcs = INITIAL_FCS;
-
-                            DBG("ppp: Dropping packet with unexpected control "
-                                "field: %02x\n", ch);
-                        }
-                        break;
-
-                    case EXPECT_ADDRESS:
-                        if(ch == ADDRESS_FIELD) {
-                            /* We got the address byte, next we should get the
-                               control byte. */
-                            expect = EXPECT_CONTROL;
                             break;
-                        }
-                        else {
-                            /* Otherwise, the address/control fields were
-                               hopefully compressed. Check the flags set by LCP
-                               to make sure. */
-                            expect = EXPECT_DATA;
-                            __fallthrough;
-                        }
-
-                    case EXPECT_DATA:
-                        if(ppp_recvbuf_len < PPP_MRU + 4) {
-                            ppp_recvbuf[ppp_recvbuf_len++] = ch;
-                        }
-                        else {
-                            /* We've gone beyond the MRU, so bail. */
-                            expect = EXPECT_FLAGSEQ;
+
+                        case EXPECT_DATA:
+                            /* Check the FCS, and see if the packet is valid.
+                               If it is, then pass the packet along to the
+                               proper protocol handler. */
+                            if(check_fcs(have_ac)) {
+                                /* This is a good packet, pass it along. */
+                                ppp_input();
+                            }
+                            else {
+                                /* Let header compression know it missed
+                                   one. */
+                                _ppp_vj_input_error();
+                            }
+
+                            expect = EXPECT_ADDRESS;
                             ppp_recvbuf_len = 0;
-                            fcs = INITIAL_FCS;
+                            break;
+                    }
+
+                    have_ac = 0;
+                    break;
+
+                case RX_ESCAPE:
+                    esc = 1;
+                    break;
+
+                case RX_DROP:
+                    DBG("ppp: dropping character that should be escaped: "
+                        "%02x\n", ch);
+                    break;
+
+                default:
+                    if(esc) {
+                        ch ^= 0x20;
+                        esc = 0;
+                    }
+
+                    switch(expect) {
+                        case EXPECT_FLAGSEQ:
+                            DBG("ppp: Got data byte while expecting flag "
+                                "sequence, dropping %02x\n", ch);
+                            break;
 
-                            DBG("ppp: Dropping packet with length greater than "
-                                "the configured MRU\n");
-                        }
-                        break;
-                }
+                        case EXPECT_CONTROL:
+                            if(ch == CONTROL_FIELD) {
+                                /* We got the correct control field, move onto
+                                   data. */
+                                expect = EXPECT_DATA;
+                                have_ac = 1;
+                            }
+                            else {
+                                /* Something is probably wrong, so go ahead and
+                                   drop the packet now. */
+                                expect = EXPECT_FLAGSEQ;
+                                ppp_recvbuf_len = 0;
+
+                                DBG("ppp: Dropping packet with unexpected "
+                                    "control field: %02x\n", ch);
+                            }
+                            break;
+
+                        case EXPECT_ADDRESS:
+                            if(ch == ADDRESS_FIELD) {
+                                /* We got the address byte, next we should get
+                                   the control byte. */
+                                expect = EXPECT_CONTROL;
+                                break;
+                            }
+                            else {
+                                /* Otherwise, the address/control fields were
+                                   hopefully compressed. Check the flags set by
+                                   LCP to make sure. */
+                                expect = EXPECT_DATA;
+                                __fallthrough;
+                            }
+
+                        case EXPECT_DATA:
+                            if(ppp_recvbuf_len < sizeof(ppp_recvbuf)) {
+                                ppp_recvbuf[ppp_recvbuf_len++] = ch;
+                            }
+                            else {
+                                /* We've gone beyond the MRU, so bail. */
+                                expect = EXPECT_FLAGSEQ;
+                                ppp_recvbuf_len = 0;
+
+                                DBG("ppp: Dropping packet with length greater "
+                                    "than the configured MRU\n");
+                            }
+                            break;
+                    }
+                    break;
             }
         }
 
@@ -588,11 +670,29 @@ static int ppp_if_shutdown(netif_t *self) {
 }
 
 static int ppp_if_tx(netif_t *self, const uint8_t *data, int len, int blocking) {
+    uint16_t proto = PPP_PROTOCOL_IPv4;
+    size_t out_len = (size_t)len;
+    int rv;
+
     (void)self;
     (void)blocking;
 
+    if(ppp_lock())
+        return -1;
+
+    /* Compress the TCP/IP headers if the peer asked for it. */
+    if((ppp_state.peer_flags & PPP_FLAG_VJ_COMP) && out_len <= PPP_MRU) {
+        out_len = _ppp_vj_compress(data, out_len, ppp_txbuf, &proto);
+
+        if(proto != PPP_PROTOCOL_IPv4)
+            data = ppp_txbuf;
+    }
+
     /* XXXX: Support protocols other than IPv4 here... */
-    return ppp_send(data, len, PPP_PROTOCOL_IPv4);
+    rv = _ppp_ccp_send(data, out_len, proto);
+    mutex_unlock(&mutex);
+
+    return rv;
 }
 
 static int ppp_if_set_flags(netif_t *self, uint32_t flags_and, uint32_t flags_or) {
@@ -640,7 +740,9 @@ static netif_t ppp_if = {
     &ppp_if_dummy,              /* tx_commit */
     &ppp_if_dummy,              /* rx_poll */
     &ppp_if_set_flags,          /* set_flags */
-    &ppp_if_set_mc              /* set_mc */
+    &ppp_if_set_mc,             /* set_mc */
+    NULL,                       /* tx_pbuf */
+    { 0 }                       /* stats */
 };
 
 int ppp_init(void) {
@@ -669,12 +771,15 @@ int ppp_init(void) {
     /* Initialize a few sane defaults for the LCP configuration. */
     ppp_state.our_magic = time(NULL);
     ppp_state.our_flags = PPP_FLAG_ACCOMP |
-        PPP_FLAG_MAGIC_NUMBER;
+        PPP_FLAG_MAGIC_NUMBER | PPP_FLAG_VJ_COMP;
+
+    _ppp_fcs_init();
 
     /* Initialize all the protocols that are included in the library. */
     _ppp_lcp_init(&ppp_state);
     _ppp_pap_init(&ppp_state);
     _ppp_ipcp_init(&ppp_state);
+    _ppp_ccp_init(&ppp_state);
 
     /* Add us to netcore. */
     net_reg_device(&ppp_if);
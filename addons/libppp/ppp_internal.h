@@ -61,9 +61,13 @@ typedef struct ppp_state {
 /* PPP Protocols we might care about. */
 #define PPP_PROTOCOL_IPv4       0x0021
 #define PPP_PROTOCOL_IPv6       0x0057
+#define PPP_PROTOCOL_VJ_COMP    0x002d    /* RFC 1144 */
+#define PPP_PROTOCOL_VJ_UNCOMP  0x002f    /* RFC 1144 */
+#define PPP_PROTOCOL_COMP       0x00fd    /* RFC 1962 */
 
 #define PPP_PROTOCOL_IPCP       0x8021    /* RFC 1332 */
 #define PPP_PROTOCOL_IPV6CP     0x8057    /* RFC 2472 */
+#define PPP_PROTOCOL_CCP        0x80fd    /* RFC 1962 */
 
 #define PPP_PROTOCOL_LCP        0xc021
 #define PPP_PROTOCOL_PAP        0xc023    /* RFC 1334 */
@@ -93,8 +97,16 @@ typedef struct lcp_packet ipcp_pkt_t;
 #define LCP_ECHO_REPLY          10
 #define LCP_DISCARD_REQUEST     11
 
+/* Largest PPP packet we'll receive, not counting the protocol and FCS. */
+#define PPP_MRU                 1500
+
+/* Number of TCP connections we keep compressed headers for in each direction
+   with Van Jacobson compression. */
+#define VJ_MAX_SLOTS            16
+
 /* From ppp.c */
 int _ppp_enter_phase(int phase);
+int _ppp_input_proto(uint16_t proto, const uint8_t *buf, size_t len);
 
 /* From lcp.c */
 int _ppp_lcp_init(ppp_state_t *state);
@@ -105,4 +117,18 @@ int _ppp_pap_init(ppp_state_t *state);
 /* From ipcp.c */
 int _ppp_ipcp_init(ppp_state_t *state);
 
+/* From ccp.c */
+int _ppp_ccp_init(ppp_state_t *state);
+int _ppp_ccp_send(const uint8_t *data, size_t len, uint16_t proto);
+void _ppp_ccp_rejected(void);
+
+/* From vjcomp.c */
+void _ppp_vj_init_tx(int max_slot, int cid_comp);
+void _ppp_vj_init_rx(int max_slot);
+size_t _ppp_vj_compress(const uint8_t *pkt, size_t len, uint8_t *out,
+                        uint16_t *proto);
+const uint8_t *_ppp_vj_uncompress(uint16_t proto, const uint8_t *buf,
+                                  size_t len, size_t *out_len);
+void _ppp_vj_input_error(void);
+
 #endif /* !__LOCAL_PPP_PPP_INTERNAL_H */
@@ -0,0 +1,552 @@
+/* KallistiOS ##version##
+
+   libppp/vjcomp.c
+   Copyright (C) 2026 The KallistiOS Team
+
+*/
+
+/* This file implements Van Jacobson TCP/IP header compression, as described in
+   RFC 1144. The compressor keeps a copy of the last header sent on each of a
+   small number of TCP connections and only sends the fields that changed, as
+   deltas. On an interactive connection this takes the 40 byte IP+TCP header
+   down to 3-5 bytes per segment.
+
+   Everything in here works on byte arrays rather than the header structures,
+   as the received packets can be at any alignment within the PPP receive
+   buffer. */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <kos/net.h>
+
+#include "ppp_internal.h"
+#include "net_ipv4.h"
+
+/* Largest IP+TCP header we can deal with (60 bytes of each). */
+#define VJ_MAX_HDR      128
+
+/* Bits in the change mask of a compressed packet. */
+#define NEW_C           0x40
+#define NEW_I           0x20
+#define NEW_S           0x08
+#define NEW_A           0x04
+#define NEW_W           0x02
+#define NEW_U           0x01
+#define TCP_PUSH_BIT    0x10
+
+/* Combinations that would never show up normally, so they're used to encode
+   the two most common cases (echoed interactive data and unidirectional
+   data). */
+#define SPECIAL_I       (NEW_S | NEW_W | NEW_U)
+#define SPECIAL_D       (NEW_S | NEW_A | NEW_W | NEW_U)
+#define SPECIALS_MASK   (NEW_S | NEW_A | NEW_W | NEW_U)
+
+/* TCP flags we care about. */
+#define TH_FIN          0x01
+#define TH_SYN          0x02
+#define TH_RST          0x04
+#define TH_PUSH         0x08
+#define TH_ACK          0x10
+#define TH_URG          0x20
+
+/* Byte offsets of the fields we look at. TCP offsets are relative to the
+   start of the TCP header. */
+#define IP_LEN_OFF      2
+#define IP_ID_OFF       4
+#define IP_FRAG_OFF     6
+#define IP_PROTO_OFF    9
+#define IP_CSUM_OFF     10
+#define IP_ADDR_OFF     12
+
+#define TCP_SEQ_OFF     4
+#define TCP_ACK_OFF     8
+#define TCP_HLEN_OFF    12
+#define TCP_FLAGS_OFF   13
+#define TCP_WIN_OFF     14
+#define TCP_CSUM_OFF    16
+#define TCP_URP_OFF     18
+
+#define IP_HLEN(p)      (((p)[0] & 0x0f) << 2)
+#define TCP_HLEN(p)     (((p)[TCP_HLEN_OFF] >> 4) << 2)
+
+struct vj_slot {
+    struct vj_slot *next;
+    uint16_t hlen;
+    uint8_t id;
+    uint8_t hdr[VJ_MAX_HDR] __attribute__((aligned(4)));
+};
+
+static struct {
+    struct vj_slot *last;               /* Least recently used (list is
+                                           circular, so last->next is the
+                                           most recently used). */
+    uint8_t last_xmit;
+    int slots;
+    int cid_comp;
+    struct vj_slot slot[VJ_MAX_SLOTS];
+} vj_tx;
+
+static struct {
+    uint8_t last_recv;
+    int slots;
+    int toss;
+    struct vj_slot slot[VJ_MAX_SLOTS];
+
+    /* Decompressed packets get rebuilt in here. */
+    uint8_t buf[VJ_MAX_HDR + PPP_MRU] __attribute__((aligned(4)));
+} vj_rx;
+
+static inline uint16_t get16(const uint8_t *p) {
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static inline uint32_t get32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+        ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline void put16(uint8_t *p, uint16_t v) {
+    p[0] = (uint8_t)(v >> 8);
+    p[1] = (uint8_t)v;
+}
+
+static inline void put32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+/* Deltas are sent as one byte if they fit in 1-255, and as a zero byte
+   followed by the 16-bit value otherwise. */
+static inline uint8_t *encode(uint8_t *cp, uint16_t n) {
+    if(n >= 256 || n == 0) {
+        *cp++ = 0;
+        *cp++ = (uint8_t)(n >> 8);
+    }
+
+    *cp++ = (uint8_t)n;
+    return cp;
+}
+
+static inline const uint8_t *decode(const uint8_t *cp, const uint8_t *end,
+                                    uint16_t *n) {
+    if(cp >= end)
+        return NULL;
+
+    if(*cp) {
+        *n = *cp;
+        return cp + 1;
+    }
+
+    if(end - cp < 3)
+        return NULL;
+
+    *n = get16(cp + 1);
+    return cp + 3;
+}
+
+void _ppp_vj_init_tx(int max_slot, int cid_comp) {
+    int i;
+
+    if(max_slot >= VJ_MAX_SLOTS)
+        max_slot = VJ_MAX_SLOTS - 1;
+
+    memset(&vj_tx, 0, sizeof(vj_tx));
+    vj_tx.slots = max_slot + 1;
+    vj_tx.cid_comp = cid_comp;
+    vj_tx.last_xmit = 0xff;
+
+    /* Link all the slots together in a circle. */
+    for(i = 0; i < vj_tx.slots; ++i) {
+        vj_tx.slot[i].id = (uint8_t)i;
+        vj_tx.slot[i].next = &vj_tx.slot[(i + 1) % vj_tx.slots];
+    }
+
+    vj_tx.last = &vj_tx.slot[vj_tx.slots - 1];
+}
+
+void _ppp_vj_init_rx(int max_slot) {
+    int i;
+
+    if(max_slot >= VJ_MAX_SLOTS)
+        max_slot = VJ_MAX_SLOTS - 1;
+
+    memset(vj_rx.slot, 0, sizeof(vj_rx.slot));
+    vj_rx.slots = max_slot + 1;
+    vj_rx.last_recv = 0xff;
+
+    /* Nothing can be decompressed until the peer tells us about a connection
+       in an uncompressed packet. */
+    vj_rx.toss = 1;
+
+    for(i = 0; i < VJ_MAX_SLOTS; ++i)
+        vj_rx.slot[i].id = (uint8_t)i;
+}
+
+/* Compress an outgoing IPv4 packet. The PPP protocol to send it with is put in
+   proto. If that comes back as plain IPv4, the packet didn't need changing and
+   nothing was written to out, so the original should be sent. */
+size_t _ppp_vj_compress(const uint8_t *pkt, size_t len, uint8_t *out,
+                        uint16_t *proto) {
+    struct vj_slot *cs, *lcs;
+    const uint8_t *th, *oth;
+    uint8_t *old, *cp;
+    uint8_t changes = 0, buf[16];
+    size_t hlen, ihl, dlen;
+    uint16_t delta_s, delta_w, iplen;
+    uint32_t delta_a, delta_seq;
+
+    *proto = PPP_PROTOCOL_IPv4;
+
+    /* Only unfragmented TCP packets that are plain ACKs (with or without data)
+       can be compressed. Anything else goes as-is. */
+    if(!vj_tx.slots || len < 40 || pkt[IP_PROTO_OFF] != IPPROTO_TCP ||
+       (get16(pkt + IP_FRAG_OFF) & 0x3fff))
+        goto send_ip;
+
+    ihl = IP_HLEN(pkt);
+    th = pkt + ihl;
+
+    if(ihl < 20 || ihl + 20 > len)
+        goto send_ip;
+
+    if((th[TCP_FLAGS_OFF] & (TH_SYN | TH_FIN | TH_RST | TH_ACK)) != TH_ACK)
+        goto send_ip;
+
+    hlen = ihl + TCP_HLEN(th);
+
+    if(TCP_HLEN(th) < 20 || hlen > len)
+        goto send_ip;
+
+    /* Look for the connection in our slots, starting with the most recently
+       used one (the slots are in a circle, with vj_tx.last being the least
+       recently used). The addresses and ports are together in both headers. */
+    cs = vj_tx.last->next;
+
+    if(!cs->hlen || memcmp(pkt + IP_ADDR_OFF, cs->hdr + IP_ADDR_OFF, 8) ||
+       memcmp(th, cs->hdr + IP_HLEN(cs->hdr), 4)) {
+        do {
+            lcs = cs;
+            cs = cs->next;
+
+            if(cs->hlen && !memcmp(pkt + IP_ADDR_OFF, cs->hdr + IP_ADDR_OFF, 8)
+               && !memcmp(th, cs->hdr + IP_HLEN(cs->hdr), 4))
+                goto found;
+        } while(cs != vj_tx.last);
+
+        /* Not found, so reuse the least recently used slot. Moving the end of
+           the circle back by one makes it the most recently used. */
+        vj_tx.last = lcs;
+        goto send_uncompressed;
+
+found:
+        /* Move it to the front of the list. */
+        if(cs == vj_tx.last) {
+            vj_tx.last = lcs;
+        }
+        else {
+            lcs->next = cs->next;
+            cs->next = vj_tx.last->next;
+            vj_tx.last->next = cs;
+        }
+    }
+
+    /* Make sure nothing changed that we can't represent: the version, header
+       lengths and TOS, the fragment field, the TTL and protocol, and any
+       options. */
+    old = cs->hdr;
+    oth = old + IP_HLEN(old);
+
+    if(hlen != cs->hlen || pkt[0] != old[0] || pkt[1] != old[1] ||
+       memcmp(pkt + IP_FRAG_OFF, old + IP_FRAG_OFF, 4) ||
+       th[TCP_HLEN_OFF] != oth[TCP_HLEN_OFF] ||
+       (ihl > 20 && memcmp(pkt + 20, old + 20, ihl - 20)) ||
+       (TCP_HLEN(th) > 20 && memcmp(th + 20, oth + 20, TCP_HLEN(th) - 20)))
+        goto send_uncompressed;
+
+    /* Figure out what changed, encoding the deltas as we go. */
+    cp = buf;
+
+    if(th[TCP_FLAGS_OFF] & TH_URG) {
+        cp = encode(cp, get16(th + TCP_URP_OFF));
+        changes |= NEW_U;
+    }
+    else if(get16(th + TCP_URP_OFF) != get16(oth + TCP_URP_OFF)) {
+        goto send_uncompressed;
+    }
+
+    if((delta_w = get16(th + TCP_WIN_OFF) - get16(oth + TCP_WIN_OFF))) {
+        cp = encode(cp, delta_w);
+        changes |= NEW_W;
+    }
+
+    if((delta_a = get32(th + TCP_ACK_OFF) - get32(oth + TCP_ACK_OFF))) {
+        if(delta_a > 0xffff)
+            goto send_uncompressed;
+
+        cp = encode(cp, (uint16_t)delta_a);
+        changes |= NEW_A;
+    }
+
+    if((delta_seq = get32(th + TCP_SEQ_OFF) - get32(oth + TCP_SEQ_OFF))) {
+        if(delta_seq > 0xffff)
+            goto send_uncompressed;
+
+        cp = encode(cp, (uint16_t)delta_seq);
+        changes |= NEW_S;
+    }
+
+    iplen = get16(old + IP_LEN_OFF);
+
+    switch(changes) {
+        case 0:
+            /* Nothing changed. If this one has data and the last one didn't,
+               it's probably data following an ACK on an interactive connection,
+               so compress it. Otherwise, it's probably a retransmit or a window
+               probe, so send it uncompressed in case the other side missed the
+               compressed version. */
+            if(get16(pkt + IP_LEN_OFF) != iplen && iplen == hlen)
+                break;
+
+            goto send_uncompressed;
+
+        case SPECIAL_I:
+        case SPECIAL_D:
+            /* The actual changes match one of the special encodings, so we
+               can't use them. */
+            goto send_uncompressed;
+
+        case NEW_S | NEW_A:
+            if(delta_seq == delta_a && delta_seq == (uint32_t)(iplen - hlen)) {
+                /* Echoed interactive traffic. */
+                changes = SPECIAL_I;
+                cp = buf;
+            }
+            break;
+
+        case NEW_S:
+            if(delta_seq == (uint32_t)(iplen - hlen)) {
+                /* Data going in one direction. */
+                changes = SPECIAL_D;
+                cp = buf;
+            }
+            break;
+    }
+
+    if((delta_s = get16(pkt + IP_ID_OFF) - get16(old + IP_ID_OFF)) != 1) {
+        cp = encode(cp, delta_s);
+        changes |= NEW_I;
+    }
+
+    if(th[TCP_FLAGS_OFF] & TH_PUSH)
+        changes |= TCP_PUSH_BIT;
+
+    /* Save the header for next time. */
+    memcpy(cs->hdr, pkt, hlen);
+
+    /* Write out the compressed header and then the data. */
+    len -= hlen;
+    pkt += hlen;
+    dlen = (size_t)(cp - buf);
+    cp = out;
+
+    if(!vj_tx.cid_comp || vj_tx.last_xmit != cs->id) {
+        vj_tx.last_xmit = cs->id;
+        *cp++ = changes | NEW_C;
+        *cp++ = cs->id;
+    }
+    else {
+        *cp++ = changes;
+    }
+
+    *cp++ = th[TCP_CSUM_OFF];
+    *cp++ = th[TCP_CSUM_OFF + 1];
+    memcpy(cp, buf, dlen);
+    cp += dlen;
+    memcpy(cp, pkt, len);
+
+    *proto = PPP_PROTOCOL_VJ_COMP;
+    return (size_t)(cp - out) + len;
+
+send_uncompressed:
+    /* Send the whole thing, but with the slot id in place of the protocol so
+       that the peer knows where to save the header. */
+    memcpy(cs->hdr, pkt, hlen);
+    cs->hlen = (uint16_t)hlen;
+    vj_tx.last_xmit = cs->id;
+
+    memcpy(out, pkt, len);
+    out[IP_PROTO_OFF] = cs->id;
+
+    *proto = PPP_PROTOCOL_VJ_UNCOMP;
+    return len;
+
+send_ip:
+    return len;
+}
+
+void _ppp_vj_input_error(void) {
+    /* We've lost a packet, so the deltas can't be trusted until the peer sends
+       an explicit connection id again. */
+    vj_rx.toss = 1;
+}
+
+static const uint8_t *vj_rebuild(struct vj_slot *cs, const uint8_t *data,
+                                 size_t len, size_t *out_len) {
+    uint16_t csum;
+
+    if(cs->hlen + len > sizeof(vj_rx.buf))
+        return NULL;
+
+    /* Fill in the length and checksum of the IP header and put the packet
+       back together. */
+    put16(cs->hdr + IP_LEN_OFF, (uint16_t)(cs->hlen + len));
+    cs->hdr[IP_CSUM_OFF] = cs->hdr[IP_CSUM_OFF + 1] = 0;
+    memcpy(vj_rx.buf, cs->hdr, cs->hlen);
+    csum = net_ipv4_checksum(vj_rx.buf, IP_HLEN(cs->hdr), 0);
+    memcpy(vj_rx.buf + IP_CSUM_OFF, &csum, 2);
+    memcpy(cs->hdr + IP_CSUM_OFF, &csum, 2);
+    memcpy(vj_rx.buf + cs->hlen, data, len);
+
+    *out_len = cs->hlen + len;
+    return vj_rx.buf;
+}
+
+/* Rebuild a received VJ packet (of either type). Returns the full IPv4 packet,
+   or NULL if it has to be dropped. */
+const uint8_t *_ppp_vj_uncompress(uint16_t proto, const uint8_t *buf,
+                                  size_t len, size_t *out_len) {
+    const uint8_t *cp = buf, *end = buf + len;
+    struct vj_slot *cs;
+    uint8_t *th, changes;
+    size_t hlen;
+    uint16_t n;
+
+    if(!vj_rx.slots)
+        return NULL;
+
+    if(proto == PPP_PROTOCOL_VJ_UNCOMP) {
+        /* A full header, with the slot id where the protocol belongs. */
+        if(len < 40 || buf[IP_PROTO_OFF] >= vj_rx.slots)
+            goto bad;
+
+        hlen = IP_HLEN(buf);
+
+        if(hlen < 20 || hlen + 20 > len)
+            goto bad;
+
+        hlen += TCP_HLEN(buf + hlen);
+
+        if(hlen > len || hlen > VJ_MAX_HDR)
+            goto bad;
+
+        cs = &vj_rx.slot[buf[IP_PROTO_OFF]];
+        vj_rx.last_recv = cs->id;
+        vj_rx.toss = 0;
+
+        memcpy(cs->hdr, buf, hlen);
+        cs->hdr[IP_PROTO_OFF] = IPPROTO_TCP;
+        cs->hlen = (uint16_t)hlen;
+
+        return vj_rebuild(cs, buf + hlen, len - hlen, out_len);
+    }
+
+    if(len < 3)
+        goto bad;
+
+    changes = *cp++;
+
+    if(changes & NEW_C) {
+        if(*cp >= vj_rx.slots)
+            goto bad;
+
+        vj_rx.toss = 0;
+        vj_rx.last_recv = *cp++;
+    }
+    else if(vj_rx.toss) {
+        return NULL;
+    }
+
+    cs = &vj_rx.slot[vj_rx.last_recv];
+
+    if(!cs->hlen || end - cp < 2)
+        goto bad;
+
+    hlen = cs->hlen;
+    th = cs->hdr + IP_HLEN(cs->hdr);
+    th[TCP_CSUM_OFF] = *cp++;
+    th[TCP_CSUM_OFF + 1] = *cp++;
+
+    if(changes & TCP_PUSH_BIT)
+        th[TCP_FLAGS_OFF] |= TH_PUSH;
+    else
+        th[TCP_FLAGS_OFF] &= ~TH_PUSH;
+
+    switch(changes & SPECIALS_MASK) {
+        case SPECIAL_I:
+            n = get16(cs->hdr + IP_LEN_OFF) - hlen;
+            put32(th + TCP_ACK_OFF, get32(th + TCP_ACK_OFF) + n);
+            put32(th + TCP_SEQ_OFF, get32(th + TCP_SEQ_OFF) + n);
+            break;
+
+        case SPECIAL_D:
+            n = get16(cs->hdr + IP_LEN_OFF) - hlen;
+            put32(th + TCP_SEQ_OFF, get32(th + TCP_SEQ_OFF) + n);
+            break;
+
+        default:
+            if(changes & NEW_U) {
+                if(!(cp = decode(cp, end, &n)))
+                    goto bad;
+
+                th[TCP_FLAGS_OFF] |= TH_URG;
+                put16(th + TCP_URP_OFF, n);
+            }
+            else {
+                th[TCP_FLAGS_OFF] &= ~TH_URG;
+            }
+
+            if(changes & NEW_W) {
+                if(!(cp = decode(cp, end, &n)))
+                    goto bad;
+
+                put16(th + TCP_WIN_OFF, get16(th + TCP_WIN_OFF) + n);
+            }
+
+            if(changes & NEW_A) {
+                if(!(cp = decode(cp, end, &n)))
+                    goto bad;
+
+                put32(th + TCP_ACK_OFF, get32(th + TCP_ACK_OFF) + n);
+            }
+
+            if(changes & NEW_S) {
+                if(!(cp = decode(cp, end, &n)))
+                    goto bad;
+
+                put32(th + TCP_SEQ_OFF, get32(th + TCP_SEQ_OFF) + n);
+            }
+            break;
+    }
+
+    if(changes & NEW_I) {
+        if(!(cp = decode(cp, end, &n)))
+            goto bad;
+    }
+    else {
+        n = 1;
+    }
+
+    put16(cs->hdr + IP_ID_OFF, get16(cs->hdr + IP_ID_OFF) + n);
+
+    if((cp = vj_rebuild(cs, cp, (size_t)(end - cp), out_len)))
+        return cp;
+
+bad:
+    DBG("vj: dropping bad %s packet\n",
+        proto == PPP_PROTOCOL_VJ_COMP ? "compressed" : "uncompressed");
+    vj_rx.toss = 1;
+    return NULL;
+}
@@ -0,0 +1,283 @@
+/* KallistiOS ##version##
+
+   dns-cache.c
+   Copyright (C) 2026 The KallistiOS Team
+
+   This example shows what getaddrinfo() does with the answers it gets from a
+   DNS server: it remembers them for as long as the server says it may (even
+   when the answer is that a name doesn't exist), it asks for IPv4 and IPv6
+   addresses at the same time, and if several threads look up the same name at
+   once, only one query goes out for all of them.
+
+   It doesn't need a network (or a DNS server) to do so. The stack is brought
+   up on the software loopback device, and a tiny stand-in DNS server runs in a
+   thread of its own, counting how many queries actually make it to it.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <arch/timer.h>
+#include <kos/init.h>
+#include <kos/net.h>
+#include <kos/thread.h>
+
+KOS_INIT_FLAGS(INIT_DEFAULT);
+
+/* How long (in seconds) the stand-in server says its answers are good for. */
+#define ANSWER_TTL      2
+
+/* How long the server sits on queries for "slow.test", in ms. */
+#define SLOW_DELAY      200
+
+#define LOOKUP_THREADS  4
+
+static volatile int server_done;
+static volatile int queries;
+
+/*****************************************************************************/
+/* The stand-in server. It knows about "dreamcast.test" and "slow.test", each
+   with one IPv4 and one IPv6 address, and says that nothing else exists. */
+
+static void put16(uint8_t *p, uint16_t v) {
+    p[0] = (uint8_t)(v >> 8);
+    p[1] = (uint8_t)v;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+    put16(p, (uint16_t)(v >> 16));
+    put16(p + 2, (uint16_t)v);
+}
+
+/* Add a record named by a pointer back to the question, returning the size. */
+static int put_rr(uint8_t *p, uint16_t type, uint32_t ttl, const void *data,
+                  uint16_t len) {
+    put16(p, 0xc00c);
+    put16(p + 2, type);
+    put16(p + 4, 1);
+    put32(p + 6, ttl);
+    put16(p + 10, len);
+    memcpy(p + 12, data, len);
+
+    return 12 + len;
+}
+
+static int answer(uint8_t *msg, int len) {
+    static const uint8_t addr4[4] = { 10, 0, 0, 1 };
+    static const uint8_t addr6[16] = { 0xfd, 0, 0, 0, 0, 0, 0, 0,
+                                       0, 0, 0, 0, 0, 0, 0, 1 };
+    uint8_t soa[22] = { 0 };
+    char name[256] = "";
+    int o = 12, slow;
+    uint16_t qtype;
+
+    /* Pull the name and type out of the question. */
+    while(o < len && msg[o]) {
+        if(name[0])
+            strcat(name, ".");
+
+        strncat(name, (const char *)msg + o + 1, msg[o]);
+        o += msg[o] + 1;
+    }
+
+    if(o + 5 > len)
+        return -1;
+
+    qtype = (msg[o + 1] << 8) | msg[o + 2];
+    o += 5;
+    slow = !strcmp(name, "slow.test");
+
+    if(slow)
+        thd_sleep(SLOW_DELAY);
+
+    /* Turn the query into a response. */
+    msg[2] = 0x81;
+    msg[3] = 0x80;
+    put16(msg + 6, 0);
+    put16(msg + 8, 0);
+    put16(msg + 10, 0);
+
+    if(slow || !strcmp(name, "dreamcast.test")) {
+        if(qtype == 1)
+            o += put_rr(msg + o, 1, ANSWER_TTL, addr4, 4);
+        else if(qtype == 28)
+            o += put_rr(msg + o, 28, ANSWER_TTL, addr6, 16);
+
+        put16(msg + 6, 1);
+    }
+    else {
+        /* Name error, with the SOA record that says how long to remember it:
+           both names are the root, and the last field is the minimum TTL. */
+        msg[3] |= 3;
+        put32(soa + 18, ANSWER_TTL);
+        o += put_rr(msg + o, 6, ANSWER_TTL, soa, sizeof(soa));
+        put16(msg + 8, 1);
+    }
+
+    return o;
+}
+
+static void *dns_server(void *param) {
+    uint8_t buf[512];
+    struct sockaddr_in addr;
+    socklen_t alen;
+    ssize_t rv;
+    int sock = (int)(intptr_t)param;
+
+    while(!server_done) {
+        alen = sizeof(addr);
+
+        if((rv = recvfrom(sock, buf, sizeof(buf), 0, (struct sockaddr *)&addr,
+                          &alen)) < 12) {
+            if(rv < 0 && errno != EAGAIN)
+                break;
+
+            thd_pass();
+            continue;
+        }
+
+        ++queries;
+
+        if((rv = answer(buf, rv)) > 0)
+            sendto(sock, buf, rv, 0, (struct sockaddr *)&addr, alen);
+    }
+
+    return NULL;
+}
+
+/*****************************************************************************/
+
+/* Look a name up, and print what came back, how long it took and how many
+   queries the server saw for it. */
+static void lookup(const char *name, int family) {
+    struct addrinfo hints, *ai, *p;
+    char str[INET6_ADDRSTRLEN];
+    void *addr;
+    uint64_t start;
+    int err, before = queries;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = family;
+
+    start = timer_us_gettime64();
+    err = getaddrinfo(name, NULL, &hints, &ai);
+
+    printf("  %-16s %6.2f ms, %d %s: ", name,
+           (timer_us_gettime64() - start) / 1000.0, queries - before,
+           queries - before == 1 ? "query" : "queries");
+
+    if(err) {
+        printf("%s\n", err == EAI_NONAME ? "no such name" : "error");
+        return;
+    }
+
+    for(p = ai; p; p = p->ai_next) {
+        if(p->ai_family == AF_INET)
+            addr = &((struct sockaddr_in *)p->ai_addr)->sin_addr;
+        else
+            addr = &((struct sockaddr_in6 *)p->ai_addr)->sin6_addr;
+
+        inet_ntop(p->ai_family, addr, str, sizeof(str));
+        printf("%s%s", str, p->ai_next ? ", " : "\n");
+    }
+
+    freeaddrinfo(ai);
+}
+
+static void *lookup_thd(void *param) {
+    struct addrinfo *ai;
+
+    (void)param;
+
+    if(!getaddrinfo("slow.test", NULL, NULL, &ai))
+        freeaddrinfo(ai);
+
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    struct sockaddr_in addr;
+    kthread_t *server, *thds[LOOKUP_THREADS];
+    netif_t *lo;
+    uint64_t start;
+    int sock, i, before;
+
+    (void)argc;
+    (void)argv;
+
+    if(!(lo = net_loop_init())) {
+        printf("Couldn't bring up the network\n");
+        return EXIT_FAILURE;
+    }
+
+    /* The DNS server lives at the device's own address. */
+    memcpy(lo->dns, lo->ip_addr, sizeof(lo->dns));
+
+    if(net_init(0) < 0) {
+        printf("Couldn't bring up the network\n");
+        return EXIT_FAILURE;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(53);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    if((sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0 ||
+       bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+       fcntl(sock, F_SETFL, O_NONBLOCK) < 0) {
+        perror("dns server");
+        return EXIT_FAILURE;
+    }
+
+    server = thd_create(false, dns_server, (void *)(intptr_t)sock);
+
+    printf("First lookups go to the server (both types at once):\n");
+    lookup("dreamcast.test", AF_UNSPEC);
+    lookup("nowhere.test", AF_UNSPEC);
+
+    printf("Asking again comes straight from the cache:\n");
+    lookup("dreamcast.test", AF_UNSPEC);
+    lookup("dreamcast.test", AF_INET6);
+    lookup("nowhere.test", AF_UNSPEC);
+
+    printf("Once the %d second TTL is up, they're asked for again:\n",
+           ANSWER_TTL);
+    thd_sleep(ANSWER_TTL * 1000 + 500);
+    lookup("dreamcast.test", AF_UNSPEC);
+    lookup("nowhere.test", AF_INET);
+
+    printf("%d threads looking up the same slow name at once:\n",
+           LOOKUP_THREADS);
+    before = queries;
+    start = timer_ms_gettime64();
+
+    for(i = 0; i < LOOKUP_THREADS; ++i)
+        thds[i] = thd_create(false, lookup_thd, NULL);
+
+    for(i = 0; i < LOOKUP_THREADS; ++i)
+        thd_join(thds[i], NULL);
+
+    printf("  %d queries in %lu ms\n", queries - before,
+           (unsigned long)(timer_ms_gettime64() - start));
+
+    server_done = 1;
+    thd_join(server, NULL);
+    close(sock);
+
+    net_shutdown();
+    net_loop_shutdown();
+
+    return 0;
+}
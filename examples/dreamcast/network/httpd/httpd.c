@@ -14,6 +14,7 @@
 
 #include <sys/socket.h>
 #include <sys/select.h>
+#include <sys/sendfile.h>
 #include <netinet/in.h>
 
 #include <kos/fs.h>
@@ -176,7 +177,9 @@ int send_ok(http_state_t * hs, const char * ct) {
     char buffer[512];
 
     sprintf(buffer, "HTTP/1.0 200 OK\r\nContent-type: %s\r\nConnection: close\r\n\r\n", ct);
-    write(hs->socket, buffer, strlen(buffer));
+
+    /* The body is right behind this, so let it share a packet. */
+    send(hs->socket, buffer, strlen(buffer), MSG_MORE);
 
     return 0;
 }
@@ -245,7 +248,6 @@ void *client_thread(void *p) {
     char * buf, * ext;
     const char * ct;
     file_t f = -1;
-    int r, o, cnt;
 
     printf("httpd: client thread started, sock %d\n", hs->socket);
 
@@ -296,23 +298,12 @@ void *client_thread(void *p) {
 
         send_ok(hs, ct);
 
-        while((cnt = fs_read(f, buf, BUFSIZE)) != 0) {
-            o = 0;
-
-            while(cnt > 0) {
-                r = write(hs->socket, buf + o, cnt);
-
-                if(r <= 0)
-                    goto out;
-
-                cnt -= r;
-                o += r;
-            }
-        }
+        /* Let the stack pull the file right into its send buffer, rather than
+           reading it into ours and copying it over from there. */
+        while(sendfile(hs->socket, f, NULL, BUFSIZE) > 0)
+            ;
     }
 
-    fs_close(f);
-
 out:
     free(buf);
     printf("httpd: closed client connection %d\n", hs->socket);
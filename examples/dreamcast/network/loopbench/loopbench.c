@@ -0,0 +1,658 @@
+/* KallistiOS ##version##
+
+   loopbench.c
+   Copyright (C) 2026 The KallistiOS Team
+
+   This example measures how fast the network stack itself is, without any
+   network hardware at all. It brings the stack up on the software device
+   (see net_loop_init()), which hands everything sent on it straight back,
+   and then times UDP and TCP traffic from the Dreamcast to itself: how many
+   bytes a second get through, and how long a small message takes to go there
+   and back.
+
+   Each test is run a few times over, with the software device set up to act
+   like a different kind of network each time (a perfect one, a slow and lossy
+   one, and one that mixes up the order of packets).
+
+   The first round is also recorded to a pcap file on the PC if dcload is in
+   use, which can be opened in Wireshark to see what the stack got up to.
+
+   Last of all, it looks at what happens to UDP datagrams between arriving and
+   being read. Each one waits on its socket in a slot from a pool that the
+   stack keeps around, so a steady stream of them (like the state updates of a
+   multiplayer game) doesn't touch the heap at all; only datagrams too big for
+   a slot get allocated on their own. A socket that isn't being read fast
+   enough drops whatever doesn't fit in its SO_RCVBUF, rather than eating up
+   all the memory there is.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <arch/timer.h>
+#include <kos/init.h>
+#include <kos/net.h>
+#include <kos/thread.h>
+
+/* No INIT_NET: we bring the network up ourselves, on the software device. */
+KOS_INIT_FLAGS(INIT_DEFAULT);
+
+#define UDP_PORT        5001
+#define TCP_PORT        5002
+#define SINK_PORT       5003
+
+#define UDP_COUNT       2000
+#define UDP_SIZE        1024
+#define TCP_BYTES       (1024 * 1024)
+#define TCP_CHUNK       8192
+#define PING_SIZE       64
+#define PING_ROUNDS     200
+
+#define QUEUE_SMALL     128
+#define QUEUE_LARGE     4000
+#define BURST_COUNT     200
+#define BURST_SIZE      1024
+#define BURST_PACE      16
+#define SMALL_RCVBUF    8192
+
+#define PCAP_FILE       "/pc/loopbench.pcap"
+
+typedef struct profile {
+    const char *name;
+    net_loop_params_t params;
+} profile_t;
+
+static const profile_t profiles[] = {
+    { "Perfect network",          { 0,  0,  0,  0, 1 } },
+    { "20ms, 1% loss",            { 20, 5,  10, 0, 1 } },
+    { "5ms, 5% reordered",        { 5,  0,  0, 50, 1 } },
+};
+
+static struct sockaddr_in self_addr;
+static volatile int sender_done, echo_done;
+
+/* Each TCP test gets a port of its own, so that nothing is left over from
+   the last connection on it. */
+static int tcp_port = TCP_PORT;
+
+static void set_port(struct sockaddr_in *addr, int port) {
+    *addr = self_addr;
+    addr->sin_port = htons(port);
+}
+
+static double elapsed_ms(uint64_t start) {
+    return (timer_us_gettime64() - start) / 1000.0;
+}
+
+static int set_nonblock(int sock) {
+    return fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+}
+
+/* Wait (up to timeout ms) for something to read on a non-blocking socket. */
+static ssize_t recv_wait(int sock, void *buf, size_t len, int timeout) {
+    uint64_t start = timer_ms_gettime64();
+    ssize_t rv;
+
+    for(;;) {
+        rv = recv(sock, buf, len, 0);
+
+        if(rv >= 0 || errno != EAGAIN)
+            return rv;
+
+        if(timer_ms_gettime64() - start > (uint64_t)timeout)
+            return -1;
+
+        thd_pass();
+    }
+}
+
+/*****************************************************************************/
+/* UDP */
+
+static void *udp_sender(void *param) {
+    struct sockaddr_in addr;
+    uint8_t buf[UDP_SIZE];
+    int sock, i;
+
+    (void)param;
+
+    memset(buf, 0xA5, sizeof(buf));
+    set_port(&addr, UDP_PORT);
+
+    if((sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
+        perror("socket");
+        sender_done = 1;
+        return NULL;
+    }
+
+    for(i = 0; i < UDP_COUNT; ++i) {
+        if(sendto(sock, buf, sizeof(buf), 0, (struct sockaddr *)&addr,
+                  sizeof(addr)) < 0)
+            thd_pass();
+    }
+
+    close(sock);
+    sender_done = 1;
+    return NULL;
+}
+
+static void udp_throughput(void) {
+    struct sockaddr_in addr;
+    uint8_t buf[UDP_SIZE];
+    kthread_t *thd;
+    uint64_t start = 0, last = 0;
+    ssize_t rv;
+    int sock, count = 0;
+    size_t bytes = 0;
+
+    set_port(&addr, UDP_PORT);
+
+    if((sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0 ||
+       bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+       set_nonblock(sock) < 0) {
+        perror("udp_throughput");
+        return;
+    }
+
+    sender_done = 0;
+    thd = thd_create(false, udp_sender, NULL);
+
+    /* Keep going until everything is in, or it's gone quiet after the sender
+       has finished (which means the rest were lost). */
+    while(count < UDP_COUNT) {
+        if((rv = recv_wait(sock, buf, sizeof(buf), 500)) < 0) {
+            if(sender_done)
+                break;
+
+            continue;
+        }
+
+        last = timer_us_gettime64();
+
+        if(!count)
+            start = last;
+
+        bytes += rv;
+        ++count;
+    }
+
+    thd_join(thd, NULL);
+    close(sock);
+
+    printf("  UDP throughput: %d/%d datagrams, %.1f KiB/s\n", count, UDP_COUNT,
+           last > start ? bytes * 1000000.0 / 1024 / (last - start) : 0.0);
+}
+
+static void *udp_echo(void *param) {
+    static uint8_t buf[QUEUE_LARGE];
+    struct sockaddr_in addr;
+    socklen_t alen;
+    ssize_t rv;
+    int sock = (int)(intptr_t)param;
+
+    while(!echo_done) {
+        alen = sizeof(addr);
+
+        if((rv = recvfrom(sock, buf, sizeof(buf), 0, (struct sockaddr *)&addr,
+                          &alen)) < 0) {
+            if(errno != EAGAIN)
+                break;
+
+            thd_pass();
+            continue;
+        }
+
+        sendto(sock, buf, rv, 0, (struct sockaddr *)&addr, alen);
+    }
+
+    return NULL;
+}
+
+static void print_latency(const char *what, double min, double total,
+                          double max, int count) {
+    if(count)
+        printf("  %s latency: min %.2f / avg %.2f / max %.2f ms (%d/%d)\n",
+               what, min, total / count, max, count, PING_ROUNDS);
+    else
+        printf("  %s latency: no replies\n", what);
+}
+
+static void udp_latency(void) {
+    struct sockaddr_in addr;
+    uint8_t buf[PING_SIZE];
+    kthread_t *thd;
+    uint64_t start;
+    double rtt, min = 1e9, max = 0, total = 0;
+    int esock, sock, i, count = 0;
+
+    set_port(&addr, UDP_PORT);
+
+    if((esock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0 ||
+       bind(esock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+       set_nonblock(esock) < 0) {
+        perror("udp_latency");
+        return;
+    }
+
+    if((sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0 ||
+       set_nonblock(sock) < 0) {
+        perror("udp_latency");
+        close(esock);
+        return;
+    }
+
+    echo_done = 0;
+    thd = thd_create(false, udp_echo, (void *)(intptr_t)esock);
+    memset(buf, 0, sizeof(buf));
+
+    for(i = 0; i < PING_ROUNDS; ++i) {
+        memcpy(buf, &i, sizeof(i));
+        start = timer_us_gettime64();
+        sendto(sock, buf, sizeof(buf), 0, (struct sockaddr *)&addr,
+               sizeof(addr));
+
+        /* Anything left over from a ping that was given up on is skipped. */
+        while(recv_wait(sock, buf, sizeof(buf), 1000) ==
+              (ssize_t)sizeof(buf)) {
+            if(!memcmp(buf, &i, sizeof(i))) {
+                rtt = elapsed_ms(start);
+                min = rtt < min ? rtt : min;
+                max = rtt > max ? rtt : max;
+                total += rtt;
+                ++count;
+                break;
+            }
+        }
+    }
+
+    echo_done = 1;
+    thd_join(thd, NULL);
+    close(sock);
+    close(esock);
+
+    print_latency("UDP", min, total, max, count);
+}
+
+/*****************************************************************************/
+/* TCP */
+
+static int tcp_listen(void) {
+    struct sockaddr_in addr;
+    int sock;
+
+    set_port(&addr, ++tcp_port);
+
+    if((sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
+        return -1;
+
+    if(bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+       listen(sock, 1) < 0) {
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+static int tcp_connect(void) {
+    struct sockaddr_in addr;
+    int sock, one = 1;
+
+    set_port(&addr, tcp_port);
+
+    if((sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
+        return -1;
+
+    if(connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return sock;
+}
+
+static void *tcp_sender(void *param) {
+    static uint8_t buf[TCP_CHUNK];
+    size_t left = TCP_BYTES;
+    ssize_t rv;
+    int sock;
+
+    (void)param;
+
+    if((sock = tcp_connect()) < 0) {
+        perror("tcp_sender");
+        return NULL;
+    }
+
+    while(left) {
+        if((rv = send(sock, buf, left < sizeof(buf) ? left : sizeof(buf),
+                      0)) < 0) {
+            perror("send");
+            break;
+        }
+
+        left -= rv;
+    }
+
+    close(sock);
+    return NULL;
+}
+
+static void tcp_throughput(void) {
+    static uint8_t buf[TCP_CHUNK];
+    kthread_t *thd;
+    uint64_t start;
+    size_t bytes = 0;
+    ssize_t rv;
+    int lsock, sock;
+    double ms;
+
+    if((lsock = tcp_listen()) < 0) {
+        perror("tcp_throughput");
+        return;
+    }
+
+    thd = thd_create(false, tcp_sender, NULL);
+
+    if((sock = accept(lsock, NULL, NULL)) < 0) {
+        perror("accept");
+        close(lsock);
+        thd_join(thd, NULL);
+        return;
+    }
+
+    start = timer_us_gettime64();
+
+    while((rv = recv(sock, buf, sizeof(buf), 0)) > 0)
+        bytes += rv;
+
+    ms = elapsed_ms(start);
+    thd_join(thd, NULL);
+    close(sock);
+    close(lsock);
+
+    printf("  TCP throughput: %u bytes, %.1f KiB/s\n", (unsigned int)bytes,
+           ms > 0 ? bytes * 1000.0 / 1024 / ms : 0.0);
+}
+
+static void *tcp_echo(void *param) {
+    uint8_t buf[PING_SIZE];
+    ssize_t rv;
+    int lsock = (int)(intptr_t)param, sock, one = 1;
+
+    if((sock = accept(lsock, NULL, NULL)) < 0)
+        return NULL;
+
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    while((rv = recv(sock, buf, sizeof(buf), 0)) > 0)
+        send(sock, buf, rv, 0);
+
+    close(sock);
+    return NULL;
+}
+
+static void tcp_latency(void) {
+    uint8_t buf[PING_SIZE];
+    kthread_t *thd;
+    uint64_t start;
+    double rtt, min = 1e9, max = 0, total = 0;
+    ssize_t rv;
+    size_t got;
+    int lsock, sock, i, count = 0;
+
+    if((lsock = tcp_listen()) < 0) {
+        perror("tcp_latency");
+        return;
+    }
+
+    thd = thd_create(false, tcp_echo, (void *)(intptr_t)lsock);
+
+    if((sock = tcp_connect()) < 0) {
+        perror("tcp_latency");
+        close(lsock);
+        thd_join(thd, NULL);
+        return;
+    }
+
+    memset(buf, 0, sizeof(buf));
+
+    for(i = 0; i < PING_ROUNDS; ++i) {
+        start = timer_us_gettime64();
+
+        if(send(sock, buf, sizeof(buf), 0) < 0)
+            break;
+
+        for(got = 0; got < sizeof(buf); got += rv) {
+            if((rv = recv(sock, buf + got, sizeof(buf) - got, 0)) <= 0)
+                break;
+        }
+
+        if(got < sizeof(buf))
+            break;
+
+        rtt = elapsed_ms(start);
+        min = rtt < min ? rtt : min;
+        max = rtt > max ? rtt : max;
+        total += rtt;
+        ++count;
+    }
+
+    close(sock);
+    thd_join(thd, NULL);
+    close(lsock);
+
+    print_latency("TCP", min, total, max, count);
+}
+
+/*****************************************************************************/
+/* UDP receive queue */
+
+/* Round trips, with datagrams small enough for a slot and ones that aren't. */
+static void queue_round_trips(const char *name, size_t size) {
+    static uint8_t buf[QUEUE_LARGE];
+    struct sockaddr_in addr;
+    net_udp_stats_t before, after;
+    kthread_t *thd;
+    uint64_t start;
+    double rtt, min = 1e9, max = 0, total = 0;
+    int esock, sock, i, count = 0;
+
+    set_port(&addr, UDP_PORT);
+
+    if((esock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0 ||
+       bind(esock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+       set_nonblock(esock) < 0) {
+        perror("queue_round_trips");
+        return;
+    }
+
+    if((sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0 ||
+       set_nonblock(sock) < 0) {
+        perror("queue_round_trips");
+        close(esock);
+        return;
+    }
+
+    echo_done = 0;
+    thd = thd_create(false, udp_echo, (void *)(intptr_t)esock);
+    memset(buf, 0x5A, size);
+    before = net_udp_get_stats();
+
+    for(i = 0; i < PING_ROUNDS; ++i) {
+        start = timer_us_gettime64();
+
+        if(sendto(sock, buf, size, 0, (struct sockaddr *)&addr,
+                  sizeof(addr)) < 0 ||
+           recv_wait(sock, buf, sizeof(buf), 500) != (ssize_t)size)
+            continue;
+
+        rtt = elapsed_ms(start);
+        min = rtt < min ? rtt : min;
+        max = rtt > max ? rtt : max;
+        total += rtt;
+        ++count;
+    }
+
+    after = net_udp_get_stats();
+    echo_done = 1;
+    thd_join(thd, NULL);
+    close(sock);
+    close(esock);
+
+    if(!count) {
+        printf("  %s: no replies\n", name);
+        return;
+    }
+
+    printf("  %s: %.3f/%.3f/%.3f ms min/avg/max, %lu heap allocations\n",
+           name, min, total / count, max,
+           (unsigned long)(after.pkt_recv_heap - before.pkt_recv_heap));
+}
+
+/* A burst of datagrams at a socket that isn't reading them. */
+static void queue_burst(int rcvbuf) {
+    static uint8_t buf[BURST_SIZE];
+    struct sockaddr_in addr;
+    net_udp_stats_t before, after;
+    int sink, sock, i, queued = 0;
+
+    set_port(&addr, SINK_PORT);
+
+    if((sink = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0 ||
+       bind(sink, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+       set_nonblock(sink) < 0) {
+        perror("queue_burst");
+        return;
+    }
+
+    if((sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
+        perror("queue_burst");
+        close(sink);
+        return;
+    }
+
+    if(rcvbuf)
+        setsockopt(sink, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    memset(buf, 0xA5, sizeof(buf));
+    before = net_udp_get_stats();
+
+    /* Every so often, let the software device catch up, so that everything
+       makes it to the socket, rather than being lost on the way there. */
+    for(i = 0; i < BURST_COUNT; ++i) {
+        sendto(sock, buf, sizeof(buf), 0, (struct sockaddr *)&addr,
+               sizeof(addr));
+
+        if(!((i + 1) % BURST_PACE))
+            thd_sleep(1);
+    }
+
+    /* Give the last of them a moment to land, then see what made it. */
+    thd_sleep(100);
+    after = net_udp_get_stats();
+
+    while(recv(sink, buf, sizeof(buf), 0) > 0)
+        ++queued;
+
+    close(sock);
+    close(sink);
+
+    printf("  SO_RCVBUF %-7s %3d queued, %3lu dropped, pool now %lu slots\n",
+           rcvbuf ? "8 KiB:" : "default:", queued,
+           (unsigned long)(after.pkt_recv_dropped - before.pkt_recv_dropped),
+           (unsigned long)after.pool_slots);
+}
+
+static void udp_queue(void) {
+    net_loop_params_t perfect;
+
+    memset(&perfect, 0, sizeof(perfect));
+    net_loop_set_params(&perfect);
+
+    printf("UDP receive queue:\n");
+    queue_round_trips("128 bytes (pool) ", QUEUE_SMALL);
+    queue_round_trips("4000 bytes (heap)", QUEUE_LARGE);
+    queue_burst(0);
+    queue_burst(SMALL_RCVBUF);
+}
+
+/*****************************************************************************/
+
+int main(int argc, char *argv[]) {
+    net_loop_stats_t st;
+    net_tcp_stats_t tst;
+    net_udp_stats_t ust;
+    netif_t *lo;
+    size_t i;
+
+    (void)argc;
+    (void)argv;
+
+    if(!(lo = net_loop_init()) || net_init(0) < 0) {
+        printf("Couldn't bring up the network\n");
+        return EXIT_FAILURE;
+    }
+
+    memset(&self_addr, 0, sizeof(self_addr));
+    self_addr.sin_family = AF_INET;
+    self_addr.sin_addr.s_addr = htonl(net_ipv4_address(lo->ip_addr));
+
+    for(i = 0; i < sizeof(profiles) / sizeof(profiles[0]); ++i) {
+        printf("%s:\n", profiles[i].name);
+        net_loop_set_params(&profiles[i].params);
+
+        if(i == 0 && net_loop_pcap_record(PCAP_FILE) == 0)
+            printf("  (recording to %s)\n", PCAP_FILE);
+
+        udp_throughput();
+        udp_latency();
+        tcp_throughput();
+        tcp_latency();
+
+        if(i == 0)
+            net_loop_pcap_record(NULL);
+    }
+
+    udp_queue();
+
+    st = net_loop_get_stats();
+    printf("Frames: %lu sent, %lu received, %lu lost, %lu reordered, "
+           "%lu overflowed\n", (unsigned long)st.tx, (unsigned long)st.rx,
+           (unsigned long)st.lost, (unsigned long)st.reordered,
+           (unsigned long)st.overflow);
+
+    tst = net_tcp_get_stats();
+    printf("TCP segments: %lu fast path ACKs, %lu fast path data, %lu slow "
+           "path\n", (unsigned long)tst.fast_acks,
+           (unsigned long)tst.fast_data, (unsigned long)tst.slow_path);
+    printf("TCP sent: %lu segments, %lu with data, %lu pure ACKs, %lu ACKs "
+           "delayed, %lu small segments held back\n",
+           (unsigned long)tst.pkt_sent, (unsigned long)tst.pkt_sent_data,
+           (unsigned long)tst.acks_sent, (unsigned long)tst.acks_delayed,
+           (unsigned long)tst.segs_held);
+
+    ust = net_udp_get_stats();
+    printf("UDP: %lu received, %lu dropped (buffer full), %lu dropped (no "
+           "memory), %lu from the heap\n", (unsigned long)ust.pkt_recv,
+           (unsigned long)ust.pkt_recv_dropped,
+           (unsigned long)ust.pkt_recv_no_mem,
+           (unsigned long)ust.pkt_recv_heap);
+
+    net_shutdown();
+    net_loop_shutdown();
+
+    return 0;
+}
@@ -0,0 +1,259 @@
+/* KallistiOS ##version##
+
+   sendfile.c
+   Copyright (C) 2026 The KallistiOS Team
+
+   This example shows how much work sendfile() saves a server that hands out
+   files, like the httpd example does. The usual way to do that is to read()
+   each piece of the file into a buffer and then send() it, which copies every
+   byte into the buffer, and then again from there into the socket. With
+   sendfile(), the network stack takes the data right out of the file (here, a
+   file on the ramdisk, which it can memory map), so it's only copied once.
+
+   A tiny HTTP server and a client to download from it both run on the
+   Dreamcast itself, over the software loopback device, so there's no need for
+   a network. The same file is downloaded both ways, and the CPU time that the
+   whole system spent doing so is compared.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <arch/timer.h>
+#include <kos/init.h>
+#include <kos/fs.h>
+#include <kos/net.h>
+#include <kos/thread.h>
+
+KOS_INIT_FLAGS(INIT_DEFAULT);
+
+#define HTTP_PORT       8080
+#define FILE_NAME       "/ram/bench.bin"
+#define FILE_SIZE       (512 * 1024)
+#define READ_CHUNK      16384
+#define ROUNDS          8
+
+/* Odd rounds use sendfile(), and even ones read() and send(). */
+static const char *const mode_names[2] = { "read() + send()", "sendfile()" };
+
+static struct sockaddr_in server_addr;
+static kthread_t *idle_thd;
+
+/*****************************************************************************/
+/* The server. It answers any request it gets with the whole file. */
+
+static int send_all(int sock, const uint8_t *buf, size_t len) {
+    ssize_t rv;
+
+    while(len) {
+        if((rv = send(sock, buf, len, 0)) <= 0)
+            return -1;
+
+        buf += rv;
+        len -= rv;
+    }
+
+    return 0;
+}
+
+static void serve(int sock, int use_sendfile) {
+    static uint8_t buf[READ_CHUNK];
+    static const char hdr[] = "HTTP/1.0 200 OK\r\n"
+                              "Content-type: application/octet-stream\r\n"
+                              "Connection: close\r\n\r\n";
+    ssize_t rv;
+    size_t got = 0;
+    file_t f;
+
+    /* Wait for the end of the request. We don't care what's in it. */
+    while(got < 4 || memcmp(buf + got - 4, "\r\n\r\n", 4)) {
+        if(got == sizeof(buf) || (rv = recv(sock, buf + got,
+                                            sizeof(buf) - got, 0)) <= 0)
+            return;
+
+        got += rv;
+    }
+
+    if((f = fs_open(FILE_NAME, O_RDONLY)) < 0)
+        return;
+
+    send(sock, hdr, sizeof(hdr) - 1, MSG_MORE);
+
+    if(use_sendfile) {
+        while(sendfile(sock, f, NULL, FILE_SIZE) > 0)
+            ;
+    }
+    else {
+        while((rv = fs_read(f, buf, sizeof(buf))) > 0) {
+            if(send_all(sock, buf, rv) < 0)
+                break;
+        }
+    }
+
+    fs_close(f);
+}
+
+static void *server(void *param) {
+    int lsock = (int)(intptr_t)param, sock, i;
+
+    for(i = 0; i < ROUNDS; ++i) {
+        if((sock = accept(lsock, NULL, NULL)) < 0)
+            break;
+
+        serve(sock, i & 1);
+        close(sock);
+    }
+
+    return NULL;
+}
+
+/*****************************************************************************/
+/* The client. */
+
+static const char request[] = "GET /bench.bin HTTP/1.0\r\n\r\n";
+
+/* Download the file once, returning how many bytes of it came back. */
+static ssize_t download(void) {
+    static uint8_t buf[8192];
+    ssize_t rv, total = 0;
+    int sock;
+
+    if((sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
+        return -1;
+
+    if(connect(sock, (struct sockaddr *)&server_addr,
+               sizeof(server_addr)) < 0 ||
+       send(sock, request, sizeof(request) - 1, 0) < 0) {
+        close(sock);
+        return -1;
+    }
+
+    while((rv = recv(sock, buf, sizeof(buf), 0)) > 0)
+        total += rv;
+
+    close(sock);
+    return total;
+}
+
+static int find_idle(kthread_t *thd, void *data) {
+    (void)data;
+
+    if(!strcmp(thd_get_label(thd), "[idle]"))
+        idle_thd = thd;
+
+    return 0;
+}
+
+/* CPU time that something other than the idle thread got, in ns. */
+static uint64_t busy_time(void) {
+    return thd_get_total_cpu_time() - thd_get_cpu_time(idle_thd);
+}
+
+static int make_file(void) {
+    uint8_t *buf;
+    file_t f;
+    int i, rv;
+
+    if(!(buf = (uint8_t *)malloc(FILE_SIZE)))
+        return -1;
+
+    for(i = 0; i < FILE_SIZE; ++i)
+        buf[i] = (uint8_t)(i * 7);
+
+    if((f = fs_open(FILE_NAME, O_WRONLY | O_TRUNC)) < 0) {
+        free(buf);
+        return -1;
+    }
+
+    rv = fs_write(f, buf, FILE_SIZE) == FILE_SIZE ? 0 : -1;
+    fs_close(f);
+    free(buf);
+
+    return rv;
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t busy[2] = { 0, 0 }, wall[2] = { 0, 0 }, b, w;
+    size_t bytes[2] = { 0, 0 };
+    kthread_t *thd;
+    netif_t *lo;
+    ssize_t rv;
+    int lsock, i, m;
+
+    (void)argc;
+    (void)argv;
+
+    if(make_file() < 0) {
+        perror(FILE_NAME);
+        return EXIT_FAILURE;
+    }
+
+    if(!(lo = net_loop_init()) || net_init(0) < 0) {
+        printf("Couldn't bring up the network\n");
+        return EXIT_FAILURE;
+    }
+
+    thd_each(find_idle, NULL);
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(HTTP_PORT);
+    server_addr.sin_addr.s_addr = htonl(net_ipv4_address(lo->ip_addr));
+
+    if((lsock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0 ||
+       bind(lsock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0 ||
+       listen(lsock, 1) < 0) {
+        perror("server");
+        return EXIT_FAILURE;
+    }
+
+    thd = thd_create(false, server, (void *)(intptr_t)lsock);
+
+    printf("Downloading a %d KiB file %d times each way...\n",
+           FILE_SIZE / 1024, ROUNDS / 2);
+
+    /* Take turns, so that both ways see the same conditions. */
+    for(i = 0; i < ROUNDS; ++i) {
+        m = i & 1;
+        b = busy_time();
+        w = timer_us_gettime64();
+
+        if((rv = download()) < FILE_SIZE) {
+            printf("  %s: download failed\n", mode_names[m]);
+            break;
+        }
+
+        wall[m] += timer_us_gettime64() - w;
+        busy[m] += busy_time() - b;
+        bytes[m] += rv;
+    }
+
+    thd_join(thd, NULL);
+    close(lsock);
+
+    for(m = 0; m < 2; ++m) {
+        if(!bytes[m])
+            continue;
+
+        printf("  %-16s %7.1f KiB/s, %6.2f ns of CPU per byte\n",
+               mode_names[m],
+               wall[m] ? bytes[m] * 1000000.0 / 1024 / wall[m] : 0.0,
+               (double)busy[m] / bytes[m]);
+    }
+
+    net_shutdown();
+    net_loop_shutdown();
+    fs_unlink(FILE_NAME);
+
+    return 0;
+}
@@ -53,6 +53,8 @@ __BEGIN_DECLS
 #include <kos/exports.h>
 #include <kos/dbgio.h>
 #include <kos/blockdev.h>
+#include <kos/blockdev_cache.h>
+#include <kos/partition.h>
 #include <kos/dbglog.h>
 #include <kos/elf.h>
 #include <kos/fs_socket.h>
@@ -131,6 +131,42 @@ typedef struct kos_blockdev {
     int (*flush)(struct kos_blockdev *d);
 } kos_blockdev_t;
 
+/** \brief  Create a block device backed by a block of memory.
+
+    This function creates a block device whose contents live entirely in RAM.
+    It is mostly useful for testing filesystems and the block cache, or for
+    holding a small disk image that has been loaded from elsewhere.
+
+    \param  mem             The memory to use, or NULL to allocate (and clear)
+                            a new block that will be freed on shutdown. Memory
+                            passed in here is never freed by the device.
+    \param  block_count     The number of blocks on the device.
+    \param  l_block_size    Log base 2 of the bytes per block.
+    \param  rv              Storage for the new block device.
+    \retval 0               On success.
+    \retval -1              On failure, errno will be set as appropriate.
+*/
+int blockdev_ram_create(void *mem, uint64_t block_count,
+                        uint32_t l_block_size, kos_blockdev_t *rv);
+
+/** \brief  Create a block device backed by a file.
+
+    This function creates a block device on top of a disk image file in the
+    VFS, such as one on /pc (when using dcload) or in /ram. The file is opened
+    here and stays open until the device is shut down. The number of blocks on
+    the device is the size of the file divided by the block size; any partial
+    block at the end of the file is ignored.
+
+    \param  fn              The path to the image file.
+    \param  mode            O_RDONLY or O_RDWR.
+    \param  l_block_size    Log base 2 of the bytes per block.
+    \param  rv              Storage for the new block device.
+    \retval 0               On success.
+    \retval -1              On failure, errno will be set as appropriate.
+*/
+int blockdev_file_create(const char *fn, int mode, uint32_t l_block_size,
+                         kos_blockdev_t *rv);
+
 /** @} */
 
 __END_DECLS
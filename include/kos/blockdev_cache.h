@@ -0,0 +1,146 @@
+/* KallistiOS ##version##
+
+   kos/blockdev_cache.h
+   Copyright (C) 2026 The KallistiOS Team
+*/
+
+/** \file    kos/blockdev_cache.h
+    \brief   Caching layer that can be stacked on any block device.
+    \ingroup vfs_blockdev_cache
+
+    This file contains the interface to a generic block cache that wraps an
+    existing block device and presents itself as a new kos_blockdev_t. The
+    cache keeps a configurable number of device blocks in memory, can defer
+    writes until the device is flushed (write-back), sorts the deferred writes
+    by block number so they go out in one sweep across the device, and reads
+    ahead when it detects sequential access.
+
+    Because the result is just another block device, the cache can be put
+    underneath any of the filesystems in the tree without them needing their
+    own caching code, and it works equally well with the SD card, the G1 ATA
+    devices, or one of the RAM/file backed devices.
+
+    \author The KallistiOS Team
+*/
+
+#ifndef __KOS_BLOCKDEV_CACHE_H
+#define __KOS_BLOCKDEV_CACHE_H
+
+#include <kos/cdefs.h>
+__BEGIN_DECLS
+
+#include <stdint.h>
+#include <stddef.h>
+#include <kos/blockdev.h>
+
+/** \defgroup vfs_blockdev_cache    Block Cache
+    \brief                          Stackable cache for block devices
+    \ingroup                        vfs_blockdev
+
+    @{
+*/
+
+/** \brief  Enable write-back caching.
+
+    If this flag is set, writes are kept in the cache and only written to the
+    underlying device when the block must be evicted, when the device is
+    flushed, or when it is shut down. Without it, every write goes straight
+    through to the underlying device.
+*/
+#define BLOCKDEV_CACHE_WRITEBACK    0x00000001
+
+/** \brief  Default number of blocks held in the cache. */
+#define BLOCKDEV_CACHE_DEFAULT_BLOCKS       64
+
+/** \brief  Default number of blocks read ahead on sequential access. */
+#define BLOCKDEV_CACHE_DEFAULT_READAHEAD    8
+
+/** \brief  Default maximum number of blocks in one request to the device. */
+#define BLOCKDEV_CACHE_DEFAULT_MAX_IO       16
+
+/** \brief  Block cache configuration.
+
+    Any field left as zero (other than flags and readahead) is replaced with
+    its default value.
+
+    \headerfile kos/blockdev_cache.h
+*/
+typedef struct blockdev_cache_params {
+    size_t cache_blocks;    /**< \brief Number of blocks to cache */
+    size_t readahead;       /**< \brief Blocks to prefetch (0 to disable) */
+    size_t max_io_blocks;   /**< \brief Largest coalesced device request */
+    uint32_t flags;         /**< \brief BLOCKDEV_CACHE_* flags */
+} blockdev_cache_params_t;
+
+/** \brief  Block cache statistics.
+
+    All counters start at zero when the cache is created and are never reset.
+
+    \headerfile kos/blockdev_cache.h
+*/
+typedef struct blockdev_cache_stats {
+    uint64_t read_reqs;         /**< \brief read_blocks() calls */
+    uint64_t write_reqs;        /**< \brief write_blocks() calls */
+    uint64_t read_hits;         /**< \brief Blocks read from the cache */
+    uint64_t read_misses;       /**< \brief Blocks read from the device */
+    uint64_t readahead_blocks;  /**< \brief Blocks prefetched */
+    uint64_t write_blocks;      /**< \brief Blocks written by the caller */
+    uint64_t writeback_blocks;  /**< \brief Dirty blocks written back */
+    uint64_t evictions;         /**< \brief Valid blocks dropped */
+    uint64_t dev_reads;         /**< \brief read_blocks() calls on device */
+    uint64_t dev_writes;        /**< \brief write_blocks() calls on device */
+    uint64_t flushes;           /**< \brief Full write-back passes */
+} blockdev_cache_stats_t;
+
+/** \brief  Stack a cache on top of a block device.
+
+    This function creates a new block device that caches accesses to the one
+    given. The contents of base are copied, so the caller's structure is not
+    referenced afterwards and it is fine for base and rv to point to the same
+    structure. The cached device takes ownership of the underlying one: its
+    init(), shutdown() and flush() functions are called by the corresponding
+    functions of the cached device.
+
+    \param  base            The block device to cache.
+    \param  params          Cache configuration, or NULL for the defaults
+                            (which include write-back caching).
+    \param  rv              Storage for the new block device.
+    \retval 0               On success.
+    \retval -1              On failure, errno will be set as appropriate.
+
+    \par    Error Conditions:
+    \em     EFAULT - base or rv is NULL \n
+    \em     EINVAL - base does not provide the functions the cache needs \n
+    \em     ENOMEM - out of memory
+*/
+int blockdev_cache_create(kos_blockdev_t *base,
+                          const blockdev_cache_params_t *params,
+                          kos_blockdev_t *rv);
+
+/** \brief  Retrieve the statistics of a cached block device.
+
+    \param  d               A device created by blockdev_cache_create().
+    \param  stats           Storage for the statistics.
+    \retval 0               On success.
+    \retval -1              If d is not a cached block device (errno will be
+                            set to EINVAL).
+*/
+int blockdev_cache_get_stats(kos_blockdev_t *d, blockdev_cache_stats_t *stats);
+
+/** \brief  Write back and drop everything in the cache.
+
+    This is useful for removable media, where the contents of the underlying
+    device may have changed behind the cache's back.
+
+    \param  d               A device created by blockdev_cache_create().
+    \retval 0               On success.
+    \retval -1              On failure, errno will be set as appropriate. Any
+                            blocks that could not be written back are kept.
+*/
+int blockdev_cache_invalidate(kos_blockdev_t *d);
+
+/** @} */
+
+__END_DECLS
+
+#endif /* !__KOS_BLOCKDEV_CACHE_H */
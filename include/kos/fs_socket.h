@@ -377,6 +377,57 @@ typedef struct fs_socket_proto {
                             currently true in the socket. 0 if none are true.
     */
     short (*poll)(net_socket_t *s, short events);
+
+    /** \brief  Receive a batch of messages on a socket created with the
+                protocol.
+
+        This function should implement the ::recvmmsg() system call for the
+        protocol, and through it, ::recvmsg() (which calls this with a vlen of
+        1). The semantics are exactly as expected for those functions. This is
+        optional; if it is NULL, those calls are built on top of recvfrom.
+
+        \param  s           The socket to receive on
+        \param  msgvec      The messages to fill in
+        \param  vlen        The number of elements in msgvec
+        \param  flags       Flags to the function
+        \retval -1          On error (set errno appropriately)
+        \retval n           The number of messages received
+    */
+    int (*recvmmsg)(net_socket_t *s, struct mmsghdr *msgvec,
+                    unsigned int vlen, int flags);
+
+    /** \brief  Send a batch of messages on a socket created with the protocol.
+
+        This function should implement the ::sendmmsg() system call for the
+        protocol, and through it, ::sendmsg(). This is optional; if it is NULL,
+        those calls are built on top of sendto.
+
+        \param  s           The socket to send on
+        \param  msgvec      The messages to send
+        \param  vlen        The number of elements in msgvec
+        \param  flags       Flags to the function
+        \retval -1          On error, if no messages were sent (set errno
+                            appropriately)
+        \retval n           The number of messages sent
+    */
+    int (*sendmmsg)(net_socket_t *s, struct mmsghdr *msgvec,
+                    unsigned int vlen, int flags);
+
+    /** \brief  Send data from a file on a socket created with the protocol.
+
+        This function should implement the ::sendfile() system call for the
+        protocol, sending up to count bytes from the current position in fd and
+        leaving that position just past the last byte sent. This is optional;
+        if it is NULL, the data is read into a buffer and sent with sendto.
+
+        \param  s           The socket to send on
+        \param  fd          The file to send data from
+        \param  count       The most bytes to send
+        \retval -1          On error, if nothing was sent (set errno
+                            appropriately)
+        \retval n           The number of bytes sent
+    */
+    ssize_t (*sendfile)(net_socket_t *s, file_t fd, size_t count);
 } fs_socket_proto_t;
 
 /** \brief   Initializer for the entry field in the fs_socket_proto_t struct. 
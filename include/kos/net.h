@@ -42,6 +42,140 @@ __BEGIN_DECLS
     \ingroup                        networking
 */
 
+/** \defgroup networking_pbuf   Packet Buffers
+    \brief                      Buffers for outgoing packets
+    \ingroup                    networking_drivers
+
+    Outgoing packets are passed down through the network stack as a chain of
+    packet buffers, so that the headers and the data don't have to be copied
+    into one block of memory at each layer. Each buffer in the chain describes
+    one piece of the packet, in order. A buffer can have some free space in
+    front of its data (the headroom), which lower layers can put their headers
+    into with net_pbuf_push().
+
+    There are two kinds of buffers. Ones from net_pbuf_alloc() live on the heap
+    and are reference counted. Ones set up with net_pbuf_init() point at memory
+    owned by someone else (usually on the stack, or in a socket's buffer), and
+    are only good until the function that made them returns. A driver that
+    needs to keep a packet around after its transmit function returns must
+    make its own copy of it with net_pbuf_copy().
+
+    @{
+*/
+
+/** \brief  Headroom to leave for the link and IP headers.
+
+    This is enough room for an ethernet header and an IPv6 (or option-less
+    IPv4) header.
+*/
+#define NET_PBUF_HEADROOM   64
+
+/** \brief  One piece of a packet.
+
+    \headerfile kos/net.h
+*/
+typedef struct net_pbuf {
+    struct net_pbuf *next;  /**< \brief Next piece of the packet, or NULL */
+    uint8_t *data;          /**< \brief Start of the data in this piece */
+    size_t len;             /**< \brief Length of the data in this piece */
+    uint8_t *head;          /**< \brief Start of the space for the data */
+    int ref;                /**< \brief Reference count (0 if not from
+                                        net_pbuf_alloc()) */
+} net_pbuf_t;
+
+/** \brief  Allocate a packet buffer on the heap.
+
+    The new buffer has one reference, and is not part of a chain.
+
+    \param  headroom        Space to leave in front of the data.
+    \param  len             Length of the data.
+    \return                 The new buffer, or NULL if out of memory.
+*/
+net_pbuf_t *net_pbuf_alloc(size_t headroom, size_t len);
+
+/** \brief  Set up a packet buffer for memory owned by the caller.
+
+    \param  pb              The buffer to set up.
+    \param  buf             The memory to use.
+    \param  headroom        How much of buf is headroom.
+    \param  len             Length of the data after the headroom.
+*/
+void net_pbuf_init(net_pbuf_t *pb, void *buf, size_t headroom, size_t len);
+
+/** \brief  Add a reference to a heap-allocated packet buffer.
+    \param  pb              The buffer in question.
+*/
+void net_pbuf_ref(net_pbuf_t *pb);
+
+/** \brief  Drop a reference to a chain of packet buffers.
+
+    Each buffer from net_pbuf_alloc() that runs out of references is freed,
+    along with its reference on the rest of the chain. Buffers set up with
+    net_pbuf_init() are left alone.
+
+    \param  pb              The first buffer of the chain.
+*/
+void net_pbuf_free(net_pbuf_t *pb);
+
+/** \brief  Make room for a header in front of the data in a packet buffer.
+    \param  pb              The buffer in question.
+    \param  len             The length of the header.
+    \return                 The new start of the data, or NULL if there isn't
+                            enough headroom.
+*/
+uint8_t *net_pbuf_push(net_pbuf_t *pb, size_t len);
+
+/** \brief  Get the total length of a chain of packet buffers.
+    \param  pb              The first buffer of the chain.
+    \return                 The length of the data in the whole chain.
+*/
+size_t net_pbuf_length(const net_pbuf_t *pb);
+
+/** \brief  Copy the data in a chain of packet buffers into one block.
+    \param  pb              The first buffer of the chain.
+    \param  dst             Where to copy the data to.
+    \param  size            The size of dst.
+    \return                 The number of bytes copied.
+*/
+size_t net_pbuf_copy_out(const net_pbuf_t *pb, void *dst, size_t size);
+
+/** \brief  Copy a chain of packet buffers into one new heap-allocated buffer.
+    \param  pb              The first buffer of the chain.
+    \param  headroom        Space to leave in front of the data.
+    \return                 The new buffer, or NULL if out of memory.
+*/
+net_pbuf_t *net_pbuf_copy(const net_pbuf_t *pb, size_t headroom);
+
+/** @} */
+
+/** \brief   Per-device statistics.
+    \ingroup networking_drivers
+
+    Each device keeps these counters in its netif_t, so they can be read for
+    any device in the list from net_get_if_list(). Drivers count what they
+    can; counters for things a device doesn't do just stay at zero.
+
+    \headerfile kos/net.h
+*/
+typedef struct netif_stats {
+    uint32_t  tx_pkts;        /**< \brief Packets handed to the hardware */
+    uint32_t  tx_bytes;       /**< \brief Bytes handed to the hardware */
+    uint32_t  tx_errors;      /**< \brief Packets that failed to send */
+    uint32_t  tx_busy;        /**< \brief Times there was no room to send */
+    uint32_t  tx_fast_copies; /**< \brief Packets copied out with DMA or the
+                                            store queues */
+    uint32_t  tx_commits;     /**< \brief Times the transmit queue was flushed */
+    uint32_t  rx_pkts;        /**< \brief Packets passed up to the stack */
+    uint32_t  rx_bytes;       /**< \brief Bytes passed up to the stack */
+    uint32_t  rx_errors;      /**< \brief Bad packets received */
+    uint32_t  rx_dropped;     /**< \brief Packets dropped for lack of room */
+    uint32_t  rx_intrs;       /**< \brief Receive interrupts taken */
+    uint32_t  rx_wakeups;     /**< \brief Times received packets were
+                                            handed up (in one batch each) */
+    uint32_t  rx_polled;      /**< \brief Receive passes made with the
+                                            receive interrupt held off */
+} netif_stats_t;
+
 /** \brief   Structure describing one usable network device.
     \ingroup networking_drivers
 
@@ -181,6 +315,24 @@ typedef struct knetif {
         \param  count       The number of addresses in list.
     */
     int (*if_set_mc)(struct knetif *self, const uint8_t *list, int count);
+
+    /** \brief  Queue a chain of packet buffers for transmission.
+
+        This is optional. Drivers that can gather a packet from several pieces
+        on their own should set it, so that the network stack doesn't have to
+        copy each packet into one block first. Otherwise, the packet is
+        copied and passed to if_tx.
+
+        \param  self        The network device in question.
+        \param  pkt         The packet to transmit.
+        \param  blocking    1 if we should block if needed, 0 otherwise.
+        \return             The same values as if_tx.
+        \see    networking_pbuf
+    */
+    int (*if_tx_pbuf)(struct knetif *self, net_pbuf_t *pkt, int blocking);
+
+    /** \brief  Statistics for the device. */
+    netif_stats_t       stats;
 } netif_t;
 
 /** \defgroup net_drivers_flags netif_t Flags
@@ -287,6 +439,9 @@ int net_arp_init(void);
 
 /** \brief   Shutdown ARP. 
     \ingroup networking_arp
+
+    This frees the neighbor cache, so it must only be called once the network
+    thread has stopped (net_shutdown() takes care of that).
  */
 void net_arp_shutdown(void);
 
@@ -311,7 +466,8 @@ int net_arp_insert(netif_t *nif, const uint8_t mac[6], const uint8_t ip[4],
 
     If no entry is found, then an ARP query will be sent and an error will be
     returned. If you specify a packet with the call, it will be sent when the
-    reply comes in.
+    reply comes in (a few packets are held on to for each address while the
+    query is outstanding, after which the oldest ones are dropped).
 
     \param  nif             The network device in use.
     \param  ip_in           The IP address to lookup.
@@ -322,8 +478,11 @@ int net_arp_insert(netif_t *nif, const uint8_t mac[6], const uint8_t ip[4],
     \param  data_size       The size of data.
 
     \retval 0               On success.
-    \retval -1              A query is outstanding for that address.
-    \retval -2              Address not found, query generated.
+    \retval -1              A query is outstanding for that address, and no
+                            packet was given (or it couldn't be saved).
+    \retval -2              Address not found, query generated or already
+                            outstanding. Any packet given will be sent when
+                            the reply comes in.
     \retval -3              Error allocating memory.
 */
 int net_arp_lookup(netif_t *nif, const uint8_t ip_in[4], uint8_t mac_out[6],
@@ -732,11 +891,17 @@ net_ipv6_stats_t net_ipv6_get_stats(void);
 */
 int net_ndp_init(void);
 
-/** \brief  Shutdown NDP. */
+/** \brief  Shutdown NDP.
+
+    This frees the neighbor cache, so it must only be called once the network
+    thread has stopped (net_shutdown() takes care of that).
+*/
 void net_ndp_shutdown(void);
 
 /** \brief  Garbage collect timed out NDP entries.
-    This will be called periodically as NDP queries come in.
+
+    This doesn't do anything anymore, since NDP entries are aged out on their
+    own timers. It is only kept for compatibility.
 */
 void net_ndp_gc(void);
 
@@ -792,6 +957,16 @@ typedef struct net_udp_stats {
     uint32_t  pkt_recv_bad_size;      /**< \brief Packets of a bad size */
     uint32_t  pkt_recv_bad_chksum;    /**< \brief Packets with a bad checksum */
     uint32_t  pkt_recv_no_sock;       /**< \brief Packets with to a closed port */
+    uint32_t  pkt_recv_dropped;       /**< \brief Packets dropped because the
+                                                  socket's receive buffer was
+                                                  full */
+    uint32_t  pkt_recv_no_mem;        /**< \brief Packets dropped for lack of
+                                                  memory */
+    uint32_t  pkt_recv_heap;          /**< \brief Packets that couldn't use a
+                                                  slot from the pool, and were
+                                                  allocated on their own */
+    uint32_t  pool_slots;             /**< \brief Packet slots in the pool */
+    uint32_t  pool_free;              /**< \brief Slots not holding a packet */
 } net_udp_stats_t;
 
 /** \brief  Retrieve statistics from the UDP layer.
@@ -819,6 +994,39 @@ void net_udp_shutdown(void);
     @{
 */
 
+/** \brief  TCP statistics structure.
+
+    This structure holds some basic statistics about the TCP layer of the stack,
+    including how many segments on established connections were handled by the
+    fast path (header prediction) and how many had to go through the full state
+    machine, and how many segments and ACKs went out (and how many were saved
+    by delaying ACKs and holding back small segments).
+
+    \headerfile kos/net.h
+*/
+typedef struct net_tcp_stats {
+    uint32_t  pkt_recv;               /**< \brief Segments received */
+    uint32_t  pkt_recv_bad_chksum;    /**< \brief Segments with a bad checksum */
+    uint32_t  pkt_recv_no_sock;       /**< \brief Segments with no socket */
+    uint32_t  fast_acks;              /**< \brief Pure ACKs on the fast path */
+    uint32_t  fast_data;              /**< \brief In-order data on the fast path */
+    uint32_t  slow_path;              /**< \brief Segments on the slow path */
+    uint32_t  pkt_sent;               /**< \brief Segments sent */
+    uint32_t  pkt_sent_data;          /**< \brief Segments sent with data */
+    uint32_t  acks_sent;              /**< \brief Pure ACKs sent */
+    uint32_t  acks_delayed;           /**< \brief ACKs held back to be sent
+                                                 later (or not at all) */
+    uint32_t  segs_held;              /**< \brief Times a small segment was held
+                                                 back (Nagle, TCP_CORK or
+                                                 MSG_MORE) */
+} net_tcp_stats_t;
+
+/** \brief  Retrieve statistics from the TCP layer.
+
+    \return                 The global TCP stats struct.
+*/
+net_tcp_stats_t net_tcp_get_stats(void);
+
 /** \brief  Init TCP.
     \retval 0               On success (no error conditions defined).
 */
@@ -919,6 +1127,136 @@ void net_multicast_shutdown(void);
 
 /** @} */
 
+/***** net_loop.c *********************************************************/
+
+/** \defgroup networking_loop   Software Device
+    \brief                      A network device that talks to itself
+    \ingroup                    networking_drivers
+
+    The software device ("lo") is an Ethernet device that isn't hooked up to
+    any hardware: every frame sent on it comes straight back in on it, as if
+    it were plugged into itself. Give it an IP address that isn't in 127/8
+    (those never reach a device) and anything sent to that address goes all
+    the way down through ARP/NDP and back up again, which makes it handy for
+    testing and benchmarking the stack without a network, or without a
+    Dreamcast network adapter at all.
+
+    Frames can be delayed, dropped and reordered on the way through, and
+    everything that comes in on the device can be written to a pcap file for
+    a look in Wireshark or tcpdump. A pcap file can also be played back into
+    the stack, as if the frames in it had just come in on the device.
+
+    To use it as the default device, call net_loop_init() before net_init()
+    (and don't use INIT_NET, which would bring up any real hardware first).
+    @{
+*/
+
+/** \brief  Impairments applied to frames sent on the software device.
+
+    All of these are zero to start with, which delivers each frame as soon as
+    the network thread gets to it. Jitter never reorders frames on its own;
+    a frame never arrives before one that was sent before it, unless it was
+    chosen to be reordered.
+
+    \headerfile kos/net.h
+*/
+typedef struct net_loop_params {
+    uint32_t  delay;    /**< \brief How long each frame takes to arrive (ms) */
+    uint32_t  jitter;   /**< \brief Up to this much more delay, at random (ms) */
+    uint32_t  loss;     /**< \brief Chance of dropping a frame, in 1/1000ths */
+    uint32_t  reorder;  /**< \brief Chance of a frame skipping the delay and
+                                    going in front of the ones queued up, in
+                                    1/1000ths */
+    uint32_t  seed;     /**< \brief Seed for the random choices, so runs can
+                                    be repeated (0 picks a fixed default) */
+} net_loop_params_t;
+
+/** \brief  Software device statistics structure.
+
+    \headerfile kos/net.h
+*/
+typedef struct net_loop_stats {
+    uint32_t  tx;           /**< \brief Frames sent on the device */
+    uint32_t  rx;           /**< \brief Frames delivered back to the stack */
+    uint32_t  lost;         /**< \brief Frames dropped on purpose */
+    uint32_t  reordered;    /**< \brief Frames sent ahead of their turn */
+    uint32_t  overflow;     /**< \brief Frames dropped for lack of queue space */
+    uint32_t  recorded;     /**< \brief Frames written to the pcap file */
+    uint32_t  replayed;     /**< \brief Frames played back from a pcap file */
+} net_loop_stats_t;
+
+/** \brief  Flag for net_loop_pcap_replay(): keep the capture's timing.
+
+    Without this, frames are played back as fast as the stack takes them.
+*/
+#define NET_LOOP_REPLAY_TIMED   0x00000001
+
+/** \brief  Set up the software device and register it.
+
+    The device starts out with the IPv4 address 10.0.0.1/24 (which can be
+    changed before calling net_init()), and with an IPv6 link-local address
+    made from its MAC address. It is ready to use as soon as this returns,
+    whether or not net_init() has been called yet.
+
+    \return                 The device, or NULL on failure (with errno set).
+*/
+netif_t *net_loop_init(void);
+
+/** \brief  Unregister the software device and free everything it uses. */
+void net_loop_shutdown(void);
+
+/** \brief  Set the impairments applied to frames sent on the software device.
+
+    Frames that are already on their way aren't affected.
+
+    \param  params          The new settings.
+*/
+void net_loop_set_params(const net_loop_params_t *params);
+
+/** \brief  Retrieve statistics from the software device.
+
+    \return                 The software device's stats struct.
+*/
+net_loop_stats_t net_loop_get_stats(void);
+
+/** \brief  Start or stop recording frames to a pcap file.
+
+    Every frame that comes in on the software device, including ones played
+    back from a file, is written to the file with the time it came in. Frames
+    dropped on the way aren't, just like on the far end of a real cable.
+
+    \param  fn              The file to write (which is replaced if it already
+                            exists), or NULL to stop recording.
+
+    \retval 0               On success.
+    \retval -1              On error (with errno set).
+*/
+int net_loop_pcap_record(const char *fn);
+
+/** \brief  Start or stop playing back a pcap file into the stack.
+
+    Frames from the file are fed to the stack from the network thread, as if
+    they had come in on the software device, until the end of the file. Only
+    Ethernet captures can be played back; frames that were cut short in the
+    capture, or that are too big for the device, are skipped.
+
+    \param  fn              The file to play back, or NULL to stop playing.
+    \param  flags           NET_LOOP_REPLAY_TIMED, or 0.
+
+    \retval 0               On success.
+    \retval -1              On error (with errno set).
+*/
+int net_loop_pcap_replay(const char *fn, int flags);
+
+/** \brief  Wait for a pcap file to finish playing back.
+
+    \warning
+    Don't call this from the network thread, as that's what plays the file.
+*/
+void net_loop_pcap_replay_wait(void);
+
+/** @} */
+
 /***** net_core.c *********************************************************/
 
 /** \brief   Interface list; note: do not manipulate directly!
@@ -132,6 +132,16 @@ __BEGIN_DECLS
 #define FS_RAMDISK_MAX_FILES 8
 #endif
 
+/** \brief  The size of the chunks that large ramdisk files are stored in.
+
+    Files up to this size are kept in a single block of memory. Larger files
+    are split into chunks of this size, so that growing them never requires
+    copying the data that is already there. Must be a power of two.
+*/
+#ifndef FS_RAMDISK_CHUNK_SIZE
+#define FS_RAMDISK_CHUNK_SIZE 4096
+#endif
+
 /** \brief  The number of distinct file descriptors, including files and
             network sockets, that can be in use at a time. Decreasing this
             value can reduce memory usage.  */
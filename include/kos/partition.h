@@ -0,0 +1,164 @@
+/* KallistiOS ##version##
+
+   kos/partition.h
+   Copyright (C) 2026 The KallistiOS Team
+*/
+
+/** \file    kos/partition.h
+    \brief   Partition table parsing for block devices.
+    \ingroup vfs_partition
+
+    This file contains a small partition table parser that works on top of any
+    block device. It understands classic MBR partition tables (including
+    logical partitions inside of an extended partition) and GUID Partition
+    Tables (GPT), which are what most large SD cards and modern disks use.
+
+    The parsed table can be kept around by the caller, so the disk only needs
+    to be read once, and any entry in it can be turned into a block device that
+    only covers that partition.
+
+    \author The KallistiOS Team
+*/
+
+#ifndef __KOS_PARTITION_H
+#define __KOS_PARTITION_H
+
+#include <kos/cdefs.h>
+__BEGIN_DECLS
+
+#include <stdint.h>
+#include <stddef.h>
+#include <kos/blockdev.h>
+
+/** \defgroup vfs_partition     Partitions
+    \brief                      Partition table support for block devices
+    \ingroup                    vfs_blockdev
+
+    @{
+*/
+
+/** \name   Partition table schemes
+    @{
+*/
+#define PARTITION_SCHEME_MBR    1   /**< \brief MBR (DOS) partition table */
+#define PARTITION_SCHEME_GPT    2   /**< \brief GUID Partition Table */
+/** @} */
+
+/** \name   Partition flags
+    @{
+*/
+#define PARTITION_FLAG_BOOTABLE 0x01    /**< \brief Marked as active/bootable */
+#define PARTITION_FLAG_LOGICAL  0x02    /**< \brief Inside an extended part. */
+/** @} */
+
+/** \brief  Partition type reported for GPT partitions of an unknown type.
+
+    GPT partitions identify their contents with a GUID rather than a single
+    byte. The well-known ones (EFI system, Microsoft basic data, Linux
+    filesystem and Linux swap) are reported with the equivalent MBR type, and
+    anything else gets this value. The full GUID is always available in the
+    type_guid field.
+*/
+#define PARTITION_TYPE_GPT_OTHER    0xEE
+
+/** \brief  A single partition.
+
+    An entry with a type of 0 is an unused slot in the table.
+
+    \headerfile kos/partition.h
+*/
+typedef struct kos_partition {
+    uint64_t start_block;       /**< \brief First block of the partition */
+    uint64_t block_count;       /**< \brief Number of blocks */
+    uint8_t type;               /**< \brief MBR system ID (or equivalent) */
+    uint8_t flags;              /**< \brief PARTITION_FLAG_* */
+    uint8_t type_guid[16];      /**< \brief GPT partition type GUID */
+    uint8_t guid[16];           /**< \brief GPT unique partition GUID */
+} kos_partition_t;
+
+/** \brief  A parsed partition table.
+
+    For MBR disks, entries 0 through 3 are always the four primary partition
+    slots (an extended partition shows up here with its own type), and any
+    logical partitions follow starting at entry 4. For GPT disks, the entries
+    are in the same order as on the disk.
+
+    \headerfile kos/partition.h
+*/
+typedef struct kos_partition_table {
+    int scheme;                 /**< \brief PARTITION_SCHEME_* */
+    size_t count;               /**< \brief Number of entries */
+    kos_partition_t *parts;     /**< \brief The entries themselves */
+} kos_partition_table_t;
+
+/** \brief  Read the partition table from a block device.
+
+    \param  dev             The (whole disk) block device to read from.
+    \param  rv              Used to return the table. Free it with
+                            partition_table_free().
+    \retval 0               On success.
+    \retval -1              On error, errno will be set as appropriate.
+
+    \par    Error Conditions:
+    \em     EFAULT - dev or rv was NULL \n
+    \em     ENOENT - no partition table was found \n
+    \em     EIO - an I/O error occurred in reading data \n
+    \em     ENOMEM - out of memory
+*/
+int partition_table_read(kos_blockdev_t *dev, kos_partition_table_t **rv);
+
+/** \brief  Free a partition table.
+
+    \param  table           The table to free (may be NULL).
+*/
+void partition_table_free(kos_partition_table_t *table);
+
+/** \brief  Look up an entry in a partition table.
+
+    \param  table           The table to look in.
+    \param  partition       The entry number.
+    \return                 The entry, or NULL on error (errno will be set to
+                            EINVAL for a negative number, or ENOENT if there
+                            is no such partition).
+*/
+const kos_partition_t *partition_table_get(const kos_partition_table_t *table,
+                                           int partition);
+
+/** \brief  Check whether a range of blocks lies inside one partition.
+
+    Block device drivers that keep a table around use this to tell when a write
+    to the whole disk might have changed the table itself: anything that isn't
+    entirely inside a single (non-extended) partition could have touched the
+    MBR, an EBR, or one of the GPT headers or entry arrays, and the table should
+    be read again before it is used.
+
+    \param  table           The table to check against (may be NULL).
+    \param  block           The first block of the range.
+    \param  count           The number of blocks in the range.
+    \return                 1 if the whole range is inside one partition, 0
+                            otherwise.
+*/
+int partition_table_contains(const kos_partition_table_t *table,
+                             uint64_t block, size_t count);
+
+/** \brief  Create a block device for one partition of another block device.
+
+    The new device simply offsets all accesses by the start of the partition
+    and refuses any that would go past its end. The parent device is referenced
+    by pointer (so it must outlive the new device), and shutting down the new
+    device does not shut down the parent.
+
+    \param  dev             The block device that the partition is on.
+    \param  part            The partition, as returned by partition_table_get().
+    \param  rv              Storage for the new block device.
+    \retval 0               On success.
+    \retval -1              On error, errno will be set as appropriate.
+*/
+int partition_blockdev_create(kos_blockdev_t *dev, const kos_partition_t *part,
+                              kos_blockdev_t *rv);
+
+/** @} */
+
+__END_DECLS
+
+#endif /* !__KOS_PARTITION_H */
@@ -121,6 +121,49 @@ struct sockaddr_in6 {
     uint32_t        sin6_scope_id;
 };
 
+/** \brief   Packet information for IPv4 datagrams.
+    \ingroup networking_ipv4
+
+    This is the ancillary data that comes with each datagram received on a
+    socket with the IP_PKTINFO option set (with a level of IPPROTO_IP and a type
+    of IP_PKTINFO). It can also be passed to sendmsg() to pick the source
+    address for a datagram. Interface indexes aren't supported, so ipi_ifindex
+    is always 0 on receive and is ignored on send.
+
+    \headerfile netinet/in.h
+*/
+struct in_pktinfo {
+    /** \brief  Interface index. */
+    int            ipi_ifindex;
+
+    /** \brief  Local address of the datagram (used as the source address on
+                send, if not INADDR_ANY). */
+    struct in_addr ipi_spec_dst;
+
+    /** \brief  Destination address in the datagram's header. */
+    struct in_addr ipi_addr;
+};
+
+/** \brief   Packet information for IPv6 datagrams.
+    \ingroup networking_ipv6
+
+    This is the ancillary data that comes with each datagram received on a
+    socket with the IPV6_RECVPKTINFO option set (with a level of IPPROTO_IPV6
+    and a type of IPV6_PKTINFO). It can also be passed to sendmsg() to pick the
+    source address for a datagram. As with struct in_pktinfo, ipi6_ifindex is
+    always 0 on receive and is ignored on send.
+
+    \headerfile netinet/in.h
+*/
+struct in6_pktinfo {
+    /** \brief  Destination address of the datagram on receive, or the
+                source address to use on send. */
+    struct in6_addr ipi6_addr;
+
+    /** \brief  Interface index. */
+    unsigned int    ipi6_ifindex;
+};
+
 /** \brief   Local IPv4 host address.
     \ingroup networking_ipv4
 
@@ -237,6 +280,8 @@ extern const struct in6_addr in6addr_loopback;
 */
 
 #define IP_TTL              24  /**< \brief TTL for unicast (get/set) */
+#define IP_PKTINFO          25  /**< \brief Receive struct in_pktinfo with
+                                         datagrams (get/set) */
 
 /** @} */
 
@@ -266,6 +311,10 @@ extern const struct in6_addr in6addr_loopback;
 #define IPV6_MULTICAST_LOOP 21  /**< \brief Multicasts loopback (get/set) */
 #define IPV6_UNICAST_HOPS   22  /**< \brief Hop limit for unicast (get/set) */
 #define IPV6_V6ONLY         23  /**< \brief IPv6 only -- no IPv4 (get/set) */
+#define IPV6_RECVPKTINFO    24  /**< \brief Receive struct in6_pktinfo with
+                                         datagrams (get/set) */
+#define IPV6_PKTINFO        25  /**< \brief Ancillary data type for struct
+                                         in6_pktinfo */
 
 /** @} */
 
@@ -22,6 +22,7 @@
 #define __NETINET_TCP_H
 
 #include <kos/cdefs.h>
+#include <stdint.h>
 
 __BEGIN_DECLS
 
@@ -46,9 +47,75 @@ __BEGIN_DECLS
 */
 
 #define TCP_NODELAY             1 /**< \brief Don't delay to coalesce. */
+#define TCP_CORK                3 /**< \brief Only send full segments, until
+                                       this is turned off again (or for up
+                                       to 200ms). */
+#define TCP_INFO               11 /**< \brief Get connection info (read-only).
+                                       Takes a struct tcp_info. */
+#define TCP_CONGESTION         13 /**< \brief Congestion control algorithm.
+                                       Takes the name as a string. */
 
 /** @} */
 
+/** \brief  Maximum length of a congestion control algorithm name for
+            TCP_CONGESTION, including the NUL terminator. */
+#define TCP_CA_NAME_MAX         16
+
+/** \defgroup tcp_ca_states             Congestion states
+    \brief                              Values for tcpi_ca_state
+    \ingroup                            networking_tcp
+
+    @{
+*/
+#define TCP_CA_OPEN             0 /**< \brief Normal operation. */
+#define TCP_CA_RECOVERY         3 /**< \brief In fast recovery. */
+#define TCP_CA_LOSS             4 /**< \brief Recovering from a timeout. */
+/** @} */
+
+/** \defgroup tcpi_opts                Connection options
+    \brief                              Flags for tcpi_options
+    \ingroup                            networking_tcp
+
+    @{
+*/
+#define TCPI_OPT_TIMESTAMPS     1 /**< \brief Timestamps are in use. */
+#define TCPI_OPT_SACK           2 /**< \brief Selective acks are in use. */
+#define TCPI_OPT_WSCALE         4 /**< \brief Window scaling is in use. */
+/** @} */
+
+/** \brief  TCP connection information.
+    \ingroup networking_tcp
+
+    This is what is returned by getsockopt() for the TCP_INFO option. This is
+    modeled after the structure of the same name on Linux, but only contains a
+    subset of it. Also unlike Linux, all window sizes here are in bytes, not
+    segments.
+
+    The available congestion control algorithms are "newreno" (the default)
+    and "cubic". These can be selected per-socket with TCP_CONGESTION.
+*/
+struct tcp_info {
+    uint8_t  tcpi_ca_state;         /**< \brief Congestion state. */
+    uint8_t  tcpi_retransmits;      /**< \brief Timeouts in a row. */
+    uint8_t  tcpi_options;          /**< \brief Options in use.
+                                         \see tcpi_opts */
+    uint8_t  tcpi_snd_wscale : 4;   /**< \brief Peer's window scale shift. */
+    uint8_t  tcpi_rcv_wscale : 4;   /**< \brief Our window scale shift. */
+    uint32_t tcpi_snd_mss;          /**< \brief Max data per segment sent. */
+    uint32_t tcpi_unacked;          /**< \brief Bytes in flight. */
+    uint32_t tcpi_snd_ssthresh;     /**< \brief Slow start threshold. */
+    uint32_t tcpi_snd_cwnd;         /**< \brief Congestion window. */
+    uint32_t tcpi_snd_wnd;          /**< \brief Peer's receive window. */
+    uint32_t tcpi_rcv_wnd;          /**< \brief Our receive window. */
+    uint32_t tcpi_total_retrans;    /**< \brief Segments retransmitted. */
+    uint32_t tcpi_rto;              /**< \brief Retransmission timeout
+                                         (in microseconds). */
+    uint32_t tcpi_rtt;              /**< \brief Smoothed round trip time
+                                         (in microseconds). */
+    uint32_t tcpi_rttvar;           /**< \brief Round trip time variation
+                                         (in microseconds). */
+};
+
 __END_DECLS
 
 #endif /* !__NETINET_TCP_H */
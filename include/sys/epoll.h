@@ -0,0 +1,172 @@
+/* KallistiOS ##version##
+
+   sys/epoll.h
+   Copyright (C) 2026 The KallistiOS Team
+
+*/
+
+/** \file    sys/epoll.h
+    \brief   Event-driven polling of file descriptors.
+    \ingroup threading_polling
+
+    This file contains an interface modeled after Linux's epoll. Unlike poll(),
+    which has to be handed the whole set of file descriptors on every call, an
+    epoll instance keeps its set of file descriptors between calls, and only
+    has to look at the ones that something has actually happened on. This makes
+    it a much better fit for programs that have a lot of sockets open, but only
+    a few of them busy at any given time.
+
+    As with poll(), this only really works for sockets at the moment. Anything
+    without a poll method of its own (regular files, for instance) is always
+    considered readable and writable.
+
+    \author The KallistiOS Team
+*/
+
+#ifndef __SYS_EPOLL_H
+#define __SYS_EPOLL_H
+
+#include <kos/cdefs.h>
+__BEGIN_DECLS
+
+#include <stdint.h>
+#include <poll.h>
+
+/** \defgroup epoll_events              Events for epoll
+    \brief                              Masks for the events field of struct
+                                        epoll_event
+    \ingroup                            threading_polling
+
+    The event bits here are the same as the ones used by poll(), so they can be
+    used interchangeably. EPOLLERR and EPOLLHUP are always reported, whether
+    they were asked for or not.
+
+    @{
+*/
+#define EPOLLIN         POLLIN      /**< \brief Data may be read */
+#define EPOLLRDNORM     POLLRDNORM  /**< \brief Normal data may be read */
+#define EPOLLRDBAND     POLLRDBAND  /**< \brief Priority data may be read */
+#define EPOLLPRI        POLLPRI     /**< \brief High-priority data may be read */
+#define EPOLLOUT        POLLOUT     /**< \brief Normal data may be written */
+#define EPOLLWRNORM     POLLWRNORM  /**< \brief Normal data may be written */
+#define EPOLLWRBAND     POLLWRBAND  /**< \brief Priority data may be written */
+#define EPOLLERR        POLLERR     /**< \brief Error has occurred */
+#define EPOLLHUP        POLLHUP     /**< \brief Peer disconnected */
+
+/** \brief  Only report the file descriptor when something new happens on it.
+
+    Without this, the file descriptor is reported by every call to
+    epoll_wait() for as long as it stays ready (level-triggered). With it, the
+    file descriptor is only reported again once a new event comes in for it
+    (edge-triggered), so the program has to read or write until it would block
+    before waiting again. */
+#define EPOLLET         (1U << 31)
+
+/** \brief  Stop watching the file descriptor after it is reported once.
+
+    The file descriptor stays in the set, but won't be reported again until it
+    is re-armed with EPOLL_CTL_MOD. */
+#define EPOLLONESHOT    (1U << 30)
+/** @} */
+
+/** \defgroup epoll_ctl_ops             Operations for epoll_ctl()
+    \brief                              Values for the op parameter
+    \ingroup                            threading_polling
+
+    @{
+*/
+#define EPOLL_CTL_ADD   1   /**< \brief Add a file descriptor to the set */
+#define EPOLL_CTL_DEL   2   /**< \brief Remove a file descriptor from the set */
+#define EPOLL_CTL_MOD   3   /**< \brief Change the events for a descriptor */
+/** @} */
+
+/** \brief  Flag for epoll_create1(). Accepted, but does nothing, as there is no
+            exec() to close things on. */
+#define EPOLL_CLOEXEC   0x80000
+
+/** \brief   User data attached to a file descriptor in an epoll set.
+    \ingroup threading_polling
+
+    This is handed back as-is with each event for the file descriptor.
+*/
+typedef union epoll_data {
+    void *ptr;              /**< \brief Pointer value */
+    int fd;                 /**< \brief File descriptor */
+    uint32_t u32;           /**< \brief 32-bit value */
+    uint64_t u64;           /**< \brief 64-bit value */
+} epoll_data_t;
+
+/** \brief   An event on a file descriptor in an epoll set.
+    \ingroup threading_polling
+    \headerfile sys/epoll.h
+*/
+struct epoll_event {
+    uint32_t events;        /**< \brief Events (see \ref epoll_events) */
+    epoll_data_t data;      /**< \brief User data for the file descriptor */
+};
+
+/** \brief   Create a new epoll instance.
+    \ingroup threading_polling
+
+    \param  size        Ignored, other than it must be greater than zero.
+    \return             A file descriptor for the new instance, or -1 on error
+                        (sets errno as appropriate). Close it with close() when
+                        it is no longer needed.
+*/
+int epoll_create(int size);
+
+/** \brief   Create a new epoll instance.
+    \ingroup threading_polling
+
+    \param  flags       0 or EPOLL_CLOEXEC.
+    \return             A file descriptor for the new instance, or -1 on error
+                        (sets errno as appropriate).
+*/
+int epoll_create1(int flags);
+
+/** \brief   Add, change, or remove a file descriptor in an epoll set.
+    \ingroup threading_polling
+
+    A file descriptor that is closed while it is still in the set is reported
+    once with POLLNVAL, and then it is removed from the set (one that has been
+    disabled by EPOLLONESHOT is removed without being reported). Whatever gets
+    that file descriptor number next is not watched until it is added.
+
+    \param  epfd        The epoll instance.
+    \param  op          What to do (see \ref epoll_ctl_ops).
+    \param  fd          The file descriptor to work with.
+    \param  event       The events to watch for and the data to hand back with
+                        them. Not used for EPOLL_CTL_DEL.
+    \return             0 on success, or -1 on error (sets errno as
+                        appropriate).
+
+    \par    Error Conditions:
+    \em     EBADF - epfd or fd is not a valid file descriptor \n
+    \em     EINVAL - epfd is not an epoll instance, fd is epfd, or op is
+                     invalid \n
+    \em     EEXIST - op is EPOLL_CTL_ADD and fd is already in the set \n
+    \em     ENOENT - op is EPOLL_CTL_MOD or EPOLL_CTL_DEL and fd is not in the
+                     set \n
+    \em     EFAULT - event is NULL \n
+    \em     ENOMEM - out of memory
+*/
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event);
+
+/** \brief   Wait for events on an epoll set.
+    \ingroup threading_polling
+
+    \param  epfd        The epoll instance.
+    \param  events      Where to put the events.
+    \param  maxevents   The most events to return. Must be greater than zero.
+    \param  timeout     Maximum amount of time to block, in milliseconds. Pass
+                        0 to return right away and -1 to block until an event
+                        occurs.
+    \return             The number of events put in events (0 if the timeout
+                        expired), or -1 on error (sets errno as appropriate).
+*/
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents,
+               int timeout);
+
+__END_DECLS
+
+#endif /* !__SYS_EPOLL_H */
@@ -0,0 +1,56 @@
+/* KallistiOS ##version##
+
+   sys/sendfile.h
+   Copyright (C) 2026 The KallistiOS Team
+
+*/
+
+/** \file    sys/sendfile.h
+    \brief   Sending files on sockets.
+    \ingroup vfs_sockets
+
+    This file contains the sendfile() function, which sends data from a file
+    out on a socket without it having to pass through a buffer of the caller's
+    own. This works the same way as the function of the same name on Linux.
+*/
+
+#ifndef __SYS_SENDFILE_H
+#define __SYS_SENDFILE_H
+
+#include <sys/cdefs.h>
+#include <sys/types.h>
+
+__BEGIN_DECLS
+
+/** \brief  Send data from a file on a socket.
+
+    This function sends up to count bytes from the file in_fd on the socket
+    out_fd. For files that can be memory mapped (like those on the romdisk or
+    ramdisk), TCP copies the data straight from the file into its send buffer,
+    and for anything else it reads the file right into that buffer, so the
+    data is only copied once on its way out.
+
+    If offset is NULL, the data is read from the current position in the file,
+    and that position is moved past what was sent. Otherwise, the data is read
+    starting at *offset, which is then updated to point just past the last byte
+    sent, and the position in the file is left alone.
+
+    On a blocking socket, this will wait until everything has been sent (or
+    the end of the file is reached). On a non-blocking one, it sends as much as
+    there is room for and returns.
+
+    \param  out_fd      The socket to send on.
+    \param  in_fd       The file to read from.
+    \param  offset      Where to start reading the file, or NULL to use the
+                        file's position.
+    \param  count       The most bytes to send.
+
+    \return             The number of bytes sent (0 at the end of the file), or
+                        -1 on error if nothing could be sent (sets errno as
+                        appropriate).
+*/
+ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count);
+
+__END_DECLS
+
+#endif /* __SYS_SENDFILE_H */
@@ -24,9 +24,12 @@
 #include <sys/cdefs.h>
 #include <sys/types.h>
 #include <sys/uio.h>
+#include <stddef.h>
 
 __BEGIN_DECLS
 
+struct timespec;
+
 /** \defgroup networking_sockets    Sockets
     \brief                          POSIX Sockets Interface for IPv4 and IPv6
                                     Address Families
@@ -87,6 +90,94 @@ struct sockaddr_storage {
     char _ss_pad2[_SS_PAD2SIZE];
 };
 
+/** \brief  Message header for sendmsg() and recvmsg().
+    \headerfile sys/socket.h
+*/
+struct msghdr {
+    /** \brief  Address to send to, or space for the address received from
+                (may be NULL). */
+    void *msg_name;
+    /** \brief  Size of the address. */
+    socklen_t msg_namelen;
+    /** \brief  Scatter/gather array for the data. */
+    struct iovec *msg_iov;
+    /** \brief  Number of elements in msg_iov. */
+    int msg_iovlen;
+    /** \brief  Ancillary data (may be NULL). */
+    void *msg_control;
+    /** \brief  Size of the ancillary data buffer. */
+    socklen_t msg_controllen;
+    /** \brief  Flags on the received message (see \ref msg_flags). */
+    int msg_flags;
+};
+
+/** \brief  Ancillary data object header.
+    \headerfile sys/socket.h
+
+    Each object in the msg_control buffer of a struct msghdr starts with one of
+    these, followed by the data itself. Use the CMSG_* macros to get at them.
+*/
+struct cmsghdr {
+    /** \brief  Length of the object, including this header. */
+    socklen_t cmsg_len;
+    /** \brief  Protocol level (for instance, IPPROTO_IP). */
+    int cmsg_level;
+    /** \brief  Type of data (for instance, IP_PKTINFO). */
+    int cmsg_type;
+};
+
+/** \brief  Round a length up to the alignment of ancillary data objects. */
+#define CMSG_ALIGN(len) \
+    (((len) + sizeof(long) - 1) & ~(sizeof(long) - 1))
+
+/** \brief  Get a pointer to the data of an ancillary data object. */
+#define CMSG_DATA(cmsg) \
+    ((unsigned char *)(cmsg) + CMSG_ALIGN(sizeof(struct cmsghdr)))
+
+/** \brief  Space taken up by an ancillary data object with len bytes of data,
+            including any padding after it. */
+#define CMSG_SPACE(len) \
+    (CMSG_ALIGN(sizeof(struct cmsghdr)) + CMSG_ALIGN(len))
+
+/** \brief  Value of cmsg_len for an object with len bytes of data. */
+#define CMSG_LEN(len) \
+    (CMSG_ALIGN(sizeof(struct cmsghdr)) + (len))
+
+/** \brief  Get the first ancillary data object in a message (or NULL). */
+#define CMSG_FIRSTHDR(mhdr) \
+    ((mhdr)->msg_controllen >= sizeof(struct cmsghdr) ? \
+     (struct cmsghdr *)(mhdr)->msg_control : (struct cmsghdr *)NULL)
+
+/** \brief  Get the ancillary data object after cmsg in a message (or NULL). */
+#define CMSG_NXTHDR(mhdr, cmsg) __cmsg_nxthdr((mhdr), (cmsg))
+
+/** \cond */
+static __inline__ struct cmsghdr *__cmsg_nxthdr(const struct msghdr *mhdr,
+                                                const struct cmsghdr *cmsg) {
+    const unsigned char *end = (const unsigned char *)mhdr->msg_control +
+        mhdr->msg_controllen;
+    const unsigned char *next = (const unsigned char *)cmsg +
+        CMSG_ALIGN(cmsg->cmsg_len);
+
+    if(cmsg->cmsg_len < sizeof(struct cmsghdr) ||
+       next + sizeof(struct cmsghdr) > end ||
+       next + CMSG_ALIGN(((const struct cmsghdr *)next)->cmsg_len) > end)
+        return NULL;
+
+    return (struct cmsghdr *)next;
+}
+/** \endcond */
+
+/** \brief  Message header for sendmmsg() and recvmmsg().
+    \headerfile sys/socket.h
+*/
+struct mmsghdr {
+    /** \brief  The message itself. */
+    struct msghdr msg_hdr;
+    /** \brief  Number of bytes sent or received for it. */
+    unsigned int msg_len;
+};
+
 /** \brief  Datagram socket type.
 
     This socket type specifies that the socket in question transmits datagrams
@@ -154,23 +245,28 @@ struct sockaddr_storage {
     \ingroup                            networking_sockets
 
     The following flags can be used with the recv(), recvfrom(), send(),
-    and sendto() functions as the flags parameter.
+    and sendto() functions (and their msghdr-based counterparts) as the flags
+    parameter.
 
     Note that not all of these are currently supported, but they are listed for
     completeness. Those that are unsupported have (U) at the end of their
-    description. Also, for the time being, the supported flags are only
-    supported for TCP.
+    description. MSG_TRUNC and MSG_CTRUNC are set in the msg_flags field by
+    recvmsg() on UDP sockets when the data or ancillary data didn't fit.
 
     @{
 */
-#define MSG_CTRUNC      0x01    /**< \brief Control data truncated (U) */
+#define MSG_CTRUNC      0x01    /**< \brief Control data truncated */
 #define MSG_DONTROUTE   0x02    /**< \brief Send without routing (U) */
 #define MSG_EOR         0x04    /**< \brief Terminate a record (U) */
 #define MSG_OOB         0x08    /**< \brief Out-of-band data (U) */
 #define MSG_PEEK        0x10    /**< \brief Leave received data in queue */
-#define MSG_TRUNC       0x20    /**< \brief Normal data truncated (U) */
+#define MSG_TRUNC       0x20    /**< \brief Normal data truncated */
 #define MSG_WAITALL     0x40    /**< \brief Attempt to fill read buffer */
 #define MSG_DONTWAIT    0x80    /**< \brief Make this call non-blocking (non-standard) */
+#define MSG_WAITFORONE  0x100   /**< \brief recvmmsg(): only block for the first
+                                             message (non-standard) */
+#define MSG_MORE        0x200   /**< \brief TCP: more data is coming, so hold on
+                                             to a partial segment (non-standard) */
 /** @} */
 
 /** \addtogroup networking_sockets
@@ -339,6 +435,79 @@ ssize_t send(int socket, const void *message, size_t length, int flags);
 ssize_t sendto(int socket, const void *message, size_t length, int flags,
                const struct sockaddr *dest_addr, socklen_t dest_len);
 
+/** \brief  Receive a message on a socket, with scatter/gather and ancillary
+            data.
+
+    This works like recvfrom(), but the data is scattered across the buffers
+    in msg->msg_iov, and any ancillary data that has been asked for (with the
+    IP_PKTINFO or IPV6_RECVPKTINFO socket options) is put in msg->msg_control.
+    On return, msg->msg_namelen and msg->msg_controllen are set to the amount of
+    space used, and msg->msg_flags has MSG_TRUNC or MSG_CTRUNC set if anything
+    didn't fit.
+
+    \param  socket      The socket to receive on.
+    \param  msg         The message header.
+    \param  flags       The type of message reception.
+
+    \return             On success, the length of the message in bytes. If no
+                        messages are available, and the socket has been shut
+                        down, 0. On error, -1, and sets errno as appropriate.
+*/
+ssize_t recvmsg(int socket, struct msghdr *msg, int flags);
+
+/** \brief  Send a message on a socket, with scatter/gather and ancillary data.
+
+    This works like sendto(), but the data is gathered from the buffers in
+    msg->msg_iov. On UDP sockets, an IP_PKTINFO or IPV6_PKTINFO object in
+    msg->msg_control sets the source address to use for the datagram.
+
+    \param  socket      The socket to send on.
+    \param  msg         The message header.
+    \param  flags       The type of message transmission.
+
+    \return             On success, the number of bytes sent. On error, -1,
+                        and sets errno as appropriate.
+*/
+ssize_t sendmsg(int socket, const struct msghdr *msg, int flags);
+
+/** \brief  Receive a batch of messages on a socket.
+
+    This receives up to vlen messages, as if by recvmsg(), setting msg_len in
+    each element to the size of that message. On UDP sockets, the whole batch
+    is pulled off of the socket's queue at once.
+
+    Like on Linux, a blocking call waits until all vlen messages have been
+    received, unless MSG_WAITFORONE is set in flags, in which case it only waits
+    for the first one.
+
+    \param  socket      The socket to receive on.
+    \param  msgvec      The messages.
+    \param  vlen        The number of elements in msgvec.
+    \param  flags       The type of message reception.
+    \param  timeout     Not supported. Must be NULL.
+
+    \return             The number of messages received, or -1 on error (sets
+                        errno as appropriate).
+*/
+int recvmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen, int flags,
+             struct timespec *timeout);
+
+/** \brief  Send a batch of messages on a socket.
+
+    This sends up to vlen messages, as if by sendmsg(), setting msg_len in each
+    element to the number of bytes sent for it. On UDP sockets, the socket only
+    has to be looked at once for the whole batch.
+
+    \param  socket      The socket to send on.
+    \param  msgvec      The messages.
+    \param  vlen        The number of elements in msgvec.
+    \param  flags       The type of message transmission.
+
+    \return             The number of messages sent, or -1 on error if none
+                        could be sent (sets errno as appropriate).
+*/
+int sendmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen, int flags);
+
 /** \brief  Shutdown socket send and receive operations.
 
     This function closes a specific socket for the set of specified operations.
@@ -22,10 +22,18 @@ This is a whole new module that sits between the fs_vmu module and the maple
 VMU driver. It's based loosely on the stuff in the old fs_vmu, but it's been
 rewritten and reworked to be clearer, more clean, use threads better, etc.
 
-Unlike the fs_vmu module, this code is stateless. You make a call and you get
-back data (or have written it). There are no handles involved or anything
-else like that. The new fs_vmu sits on top of this and provides a (mostly)
-nice VFS interface similar to the old fs_vmu.
+Unlike the fs_vmu module, this code has no handles. You make a call and you get
+back data (or have written it). The new fs_vmu sits on top of this and provides
+a (mostly) nice VFS interface similar to the old fs_vmu.
+
+The higher level functions do keep a copy of the root block, directory and FAT
+of each VMU in memory, since reading all of that over the maple bus for every
+call made each save take dozens of slow block transfers. Each card slot has a
+generation count that the VMU driver bumps whenever a card is attached or
+removed (this happens in an interrupt, so that's all it can do), and a cached
+copy is only used while the count still matches the one it was read under.
+Only the directory blocks that actually changed (see the dirty flag notes in
+vmufs.h) and the FAT, if it changed, are written back.
 
 This module tends to do more work than it really needs to for some
 functions (like reading a named file) but it does it that way to have very
@@ -89,6 +97,8 @@ int vmufs_root_read(maple_device_t * dev, vmu_root_t * root_buf) {
 }
 
 int vmufs_root_write(maple_device_t * dev, vmu_root_t * root_buf) {
+    vmufs_invalidate(dev);
+
     /* XXX: Assume root is at 255.. is there some way to figure this out dynamically? */
     if(vmu_block_write(dev, 255, (uint8 *)root_buf) != 0) {
         dbglog(DBG_ERROR, "vmufs_root_write: can't write block %d on device %c%c\n",
@@ -160,6 +170,7 @@ int vmufs_dir_read(maple_device_t * dev, vmu_root_t * root, vmu_dir_t * dir_buf)
 }
 
 int vmufs_dir_write(maple_device_t * dev, vmu_root_t * root, vmu_dir_t * dir_buf) {
+    vmufs_invalidate(dev);
     return vmufs_dir_ops(dev, root, dir_buf, 1);
 }
 
@@ -201,6 +212,7 @@ int vmufs_fat_read(maple_device_t * dev, vmu_root_t * root, uint16 * fat_buf) {
 }
 
 int vmufs_fat_write(maple_device_t * dev, vmu_root_t * root, uint16 * fat_buf) {
+    vmufs_invalidate(dev);
     return vmufs_fat_ops(dev, root, fat_buf, 1);
 }
 
@@ -498,9 +510,96 @@ int vmufs_mutex_unlock(void) {
 
 /* ****************** Higher level functions ******************** */
 
-/* Internal function gets everything setup for you */
-static int vmufs_setup(maple_device_t * dev, vmu_root_t * root, vmu_dir_t ** dir, int * dirsize,
-                       uint16 ** fat, int * fatsize) {
+/* In-memory copy of the filesystem metadata of one VMU. The dir and FAT are
+   only read the first time they're needed. */
+typedef struct {
+    uint32      gen;        /* Value of cache_gen this was read under */
+    vmu_root_t  root;       /* Root block */
+    vmu_dir_t   * dir;      /* Directory (or NULL if not read yet) */
+    int         dirsize;    /* Size of the directory in bytes */
+    uint16      * fat;      /* FAT (or NULL if not read yet) */
+    int         fatsize;    /* Size of the FAT in bytes */
+    int         fat_dirty;  /* Has the FAT changed since it was read? */
+} vmufs_cache_t;
+
+static vmufs_cache_t *cache[MAPLE_PORT_COUNT][MAPLE_UNIT_COUNT];
+static volatile uint32 cache_gen[MAPLE_PORT_COUNT][MAPLE_UNIT_COUNT];
+
+void vmufs_invalidate(maple_device_t * dev) {
+    if(dev)
+        ++cache_gen[dev->port][dev->unit];
+}
+
+static void vmufs_cache_free(vmufs_cache_t * c) {
+    if(c) {
+        free(c->dir);
+        free(c->fat);
+        free(c);
+    }
+}
+
+/* Throw away the cache for a device, usually because we can't be sure it
+   matches the card anymore. Assumes the mutex is held. */
+static void vmufs_cache_drop(maple_device_t * dev) {
+    vmufs_cache_free(cache[dev->port][dev->unit]);
+    cache[dev->port][dev->unit] = NULL;
+}
+
+/* Is there anything in the cache that hasn't been written out yet? */
+static int vmufs_cache_dirty(const vmufs_cache_t * c) {
+    int i;
+
+    if(c->fat_dirty)
+        return 1;
+
+    for(i = 0; c->dir && i < c->dirsize / (int)sizeof(vmu_dir_t); i++) {
+        if(c->dir[i].dirty)
+            return 1;
+    }
+
+    return 0;
+}
+
+/* Write back whatever has changed in the cached dir and FAT. The order the
+   two are written in decides what happens if the second write fails, so the
+   caller gets to pick. Assumes the mutex is held. Note that if the cache is
+   stale and clean, it gets dropped, so c can't be used after that. */
+static int vmufs_cache_flush(maple_device_t * dev, vmufs_cache_t * c, int dir_first) {
+    /* If the card was swapped out from under us, don't write anything to
+       the new one. That's only a problem if there was something to write. */
+    if(c->gen != cache_gen[dev->port][dev->unit]) {
+        if(!vmufs_cache_dirty(c)) {
+            vmufs_cache_drop(dev);
+            return 0;
+        }
+
+        dbglog(DBG_ERROR, "vmufs_flush: device %c%c changed, changes lost\n",
+               dev->port + 'A', dev->unit + '0');
+        return -1;
+    }
+
+    if(dir_first && c->dir && vmufs_dir_ops(dev, &c->root, c->dir, 1) < 0)
+        return -1;
+
+    if(c->fat_dirty) {
+        if(vmufs_fat_ops(dev, &c->root, c->fat, 1) < 0)
+            return -1;
+
+        c->fat_dirty = 0;
+    }
+
+    if(!dir_first && c->dir && vmufs_dir_ops(dev, &c->root, c->dir, 1) < 0)
+        return -1;
+
+    return 0;
+}
+
+/* Internal function gets everything setup for you. The returned cache has
+   its root block loaded, along with the dir and/or FAT if asked for. */
+static vmufs_cache_t * vmufs_setup(maple_device_t * dev, int need_dir, int need_fat) {
+    vmufs_cache_t * c;
+    uint32 gen;
+
     /* Check to make sure this is a valid device right now */
     if(!dev || !(dev->info.functions & MAPLE_FUNC_MEMCARD)) {
         if(!dev)
@@ -509,127 +608,136 @@ static int vmufs_setup(maple_device_t * dev, vmu_root_t * root, vmu_dir_t ** dir
             dbglog(DBG_ERROR, "vmufs_setup: device %c%c is not a memory card\n",
                    dev->port + 'A', dev->unit + '0');
 
-        return -1;
+        return NULL;
     }
 
     vmufs_mutex_lock();
 
-    /* Read its root block */
-    if(!root || vmufs_root_read(dev, root) < 0)
-        goto dead;
+    /* Toss out what we have if the card has changed since we read it */
+    gen = cache_gen[dev->port][dev->unit];
+    c = cache[dev->port][dev->unit];
+
+    if(c && c->gen != gen) {
+        vmufs_cache_drop(dev);
+        c = NULL;
+    }
+
+    if(!c) {
+        if(!(c = (vmufs_cache_t *)calloc(1, sizeof(vmufs_cache_t)))) {
+            dbglog(DBG_ERROR, "vmufs_setup: can't alloc cache for device %c%c\n",
+                   dev->port + 'A', dev->unit + '0');
+            goto dead;
+        }
+
+        c->gen = gen;
 
-    if(dir) {
+        /* Read its root block */
+        if(vmufs_root_read(dev, &c->root) < 0) {
+            free(c);
+            goto dead;
+        }
+
+        cache[dev->port][dev->unit] = c;
+    }
+
+    if(need_dir && !c->dir) {
         /* Alloc enough space for the whole dir */
-        *dirsize = vmufs_dir_blocks(root);
-        *dir = (vmu_dir_t *)malloc(*dirsize);
+        c->dirsize = vmufs_dir_blocks(&c->root);
+        c->dir = (vmu_dir_t *)calloc(1, c->dirsize);
 
-        if(!*dir) {
+        if(!c->dir) {
             dbglog(DBG_ERROR, "vmufs_setup: can't alloc %d bytes for dir on device %c%c\n",
-                   *dirsize, dev->port + 'A', dev->unit + '0');
+                   c->dirsize, dev->port + 'A', dev->unit + '0');
             goto dead;
         }
 
-        /* Ensure that the dir is 0'd to avoid possible uninitialized reads */
-        memset(*dir, 0, sizeof(*dirsize));
-
         /* Read it */
-        if(vmufs_dir_read(dev, root, *dir) < 0) {
-            free(*dir);
-            *dir = NULL;
+        if(vmufs_dir_read(dev, &c->root, c->dir) < 0) {
+            free(c->dir);
+            c->dir = NULL;
             goto dead;
         }
     }
 
-    if(fat) {
+    if(need_fat && !c->fat) {
         /* Alloc enough space for the fat */
-        *fatsize = vmufs_fat_blocks(root);
-        *fat = (uint16 *)malloc(*fatsize);
+        c->fatsize = vmufs_fat_blocks(&c->root);
+        c->fat = (uint16 *)malloc(c->fatsize);
 
-        if(!*fat) {
+        if(!c->fat) {
             dbglog(DBG_ERROR, "vmufs_setup: can't alloc %d bytes for FAT on device %c%c\n",
-                   *fatsize, dev->port + 'A', dev->unit + '0');
-            if(dir)
-                free(*dir);
+                   c->fatsize, dev->port + 'A', dev->unit + '0');
             goto dead;
         }
 
         /* Read it */
-        if(vmufs_fat_read(dev, root, *fat) < 0) {
-            free(*fat);
-            if(dir)
-                free(*dir);
+        if(vmufs_fat_read(dev, &c->root, c->fat) < 0) {
+            free(c->fat);
+            c->fat = NULL;
             goto dead;
         }
     }
 
     /* Ok, everything's cool */
-    return 0;
+    return c;
 
 dead:
     vmufs_mutex_unlock();
-    return -1;
+    return NULL;
 }
 
 /* Internal function to tear everything down for you */
-static void vmufs_teardown(vmu_dir_t * dir, uint16 * fat) {
-    if(dir)
-        free(dir);
-
-    if(fat)
-        free(fat);
-
+static void vmufs_teardown(void) {
     vmufs_mutex_unlock();
 }
 
 int vmufs_readdir(maple_device_t * dev, vmu_dir_t ** outbuf, int * outcnt) {
-    vmu_root_t root;
-    vmu_dir_t *dir;
-    int dircnt, dirsize, rv = 0;
-    unsigned int i, j;
+    vmufs_cache_t * c;
+    vmu_dir_t *out;
+    int dircnt, rv = 0;
+    unsigned int i;
 
     *outbuf = NULL;
     *outcnt = 0;
 
     /* Init everything */
-    if(vmufs_setup(dev, &root, &dir, &dirsize, NULL, NULL) < 0)
+    if(!(c = vmufs_setup(dev, 1, 0)))
         return -1;
 
-    /* Go through and move all entries to the lowest-numbered spots. */
+    /* Count up the entries, so we know how much space is needed */
     dircnt = 0;
 
-    for(i = 0; i < dirsize / sizeof(vmu_dir_t); i++) {
-        /* Skip blanks */
-        if(dir[i].filetype == 0)
-            continue;
-
-        /* Not a blank -- look for an earlier slot that's empty. If
-           we don't find one, just leave it alone. */
-        for(j = 0; j < i; j++) {
-            if(dir[j].filetype == 0) {
-                memcpy(dir + j, dir + i, sizeof(vmu_dir_t));
-                dir[i].filetype = 0;
-                break;
-            }
-        }
-
-        /* Update the entry count */
-        dircnt++;
+    for(i = 0; i < c->dirsize / sizeof(vmu_dir_t); i++) {
+        if(c->dir[i].filetype != 0)
+            dircnt++;
     }
 
-    /* Resize the buffer to match the number of entries */
-    *outcnt = dircnt;
-    *outbuf = (vmu_dir_t *)realloc(dir, dircnt * sizeof(vmu_dir_t));
+    if(!dircnt)
+        goto ex;
 
-    if(!*outbuf && dircnt) {
-        dbglog(DBG_ERROR, "vmufs_readdir: can't realloc %d bytes for dir on device %c%c\n",
+    if(!(out = (vmu_dir_t *)malloc(dircnt * sizeof(vmu_dir_t)))) {
+        dbglog(DBG_ERROR, "vmufs_readdir: can't alloc %d bytes for dir on device %c%c\n",
                dircnt * sizeof(vmu_dir_t), dev->port + 'A', dev->unit + '0');
-        free(dir);
         rv = -2;
         goto ex;
     }
 
+    /* Copy out all the entries, skipping blanks. The dirty flags are ours,
+       so don't pass them along. */
+    *outbuf = out;
+    *outcnt = dircnt;
+
+    for(i = 0; i < c->dirsize / sizeof(vmu_dir_t); i++) {
+        if(c->dir[i].filetype == 0)
+            continue;
+
+        memcpy(out, c->dir + i, sizeof(vmu_dir_t));
+        out->dirty = 0;
+        out++;
+    }
+
 ex:
-    vmufs_teardown(NULL, NULL);
+    vmufs_teardown();
     return rv;
 }
 
@@ -657,20 +765,18 @@ static int vmufs_read_common(maple_device_t * dev, vmu_dir_t * dirent, uint16 *
 }
 
 int vmufs_read(maple_device_t * dev, const char * fn, void ** outbuf, int * outsize) {
-    vmu_root_t  root;
-    vmu_dir_t   * dir = NULL;
-    uint16      * fat = NULL;
-    int     fatsize, dirsize, idx, rv = 0;
+    vmufs_cache_t * c;
+    int     idx, rv = 0;
 
     *outbuf = NULL;
     *outsize = 0;
 
     /* Init everything */
-    if(vmufs_setup(dev, &root, &dir, &dirsize, &fat, &fatsize) < 0)
+    if(!(c = vmufs_setup(dev, 1, 1)))
         return -1;
 
     /* Look for the file we want */
-    idx = vmufs_dir_find(&root, dir, fn);
+    idx = vmufs_dir_find(&c->root, c->dir, fn);
 
     if(idx < 0) {
         //dbglog(DBG_ERROR, "vmufs_read: can't find file '%s' on device %c%c\n",
@@ -679,41 +785,39 @@ int vmufs_read(maple_device_t * dev, const char * fn, void ** outbuf, int * outs
         goto ex;
     }
 
-    if(vmufs_read_common(dev, dir + idx, fat, outbuf, outsize) < 0) {
+    if(vmufs_read_common(dev, c->dir + idx, c->fat, outbuf, outsize) < 0) {
         rv = -3;
         goto ex;
     }
 
 ex:
-    vmufs_teardown(dir, fat);
+    vmufs_teardown();
     return rv;
 }
 
 int vmufs_read_dirent(maple_device_t * dev, vmu_dir_t * dirent, void ** outbuf, int * outsize) {
-    vmu_root_t  root;
-    uint16      * fat = NULL;
-    int     fatsize, rv = 0;
+    vmufs_cache_t * c;
+    int     rv = 0;
 
     *outbuf = NULL;
     *outsize = 0;
 
     /* Init everything */
-    if(vmufs_setup(dev, &root, NULL, NULL, &fat, &fatsize) < 0)
+    if(!(c = vmufs_setup(dev, 0, 1)))
         return -1;
 
-    if(vmufs_read_common(dev, dirent, fat, outbuf, outsize) < 0)
+    if(vmufs_read_common(dev, dirent, c->fat, outbuf, outsize) < 0)
         rv = -2;
 
-    vmufs_teardown(NULL, fat);
+    vmufs_teardown();
     return rv;
 }
 
 /* Returns 0 for success, -7 for 'not enough space', and other values for other errors. :-)  */
 int vmufs_write(maple_device_t * dev, const char * fn, void * inbuf, int insize, int flags) {
-    vmu_root_t  root;
-    vmu_dir_t   * dir = NULL, nd;
-    uint16      * fat = NULL;
-    int     oldinsize, fatsize, dirsize, idx, rv = 0, st, fnlength;
+    vmufs_cache_t * c;
+    vmu_dir_t   nd;
+    int     oldinsize, idx, rv = 0, st, fnlength;
 
     /* Round up the size if necessary */
     oldinsize = insize;
@@ -727,11 +831,11 @@ int vmufs_write(maple_device_t * dev, const char * fn, void * inbuf, int insize,
     }
 
     /* Init everything */
-    if(vmufs_setup(dev, &root, &dir, &dirsize, &fat, &fatsize) < 0)
+    if(!(c = vmufs_setup(dev, 1, 1)))
         return -1;
 
     /* Check if the file already exists */
-    idx = vmufs_dir_find(&root, dir, fn);
+    idx = vmufs_dir_find(&c->root, c->dir, fn);
 
     if(idx >= 0) {
         if(!(flags & VMUFS_OVERWRITE)) {
@@ -741,7 +845,7 @@ int vmufs_write(maple_device_t * dev, const char * fn, void * inbuf, int insize,
             goto ex;
         }
         else {
-            if(vmufs_file_delete(&root, fat, dir, fn) < 0) {
+            if(vmufs_file_delete(&c->root, c->fat, c->dir, fn) < 0) {
                 dbglog(DBG_ERROR, "vmufs_write: can't delete old file '%s' on device %c%c\n",
                        fn, dev->port + 'A', dev->unit + '0');
                 rv = -3;
@@ -771,7 +875,7 @@ int vmufs_write(maple_device_t * dev, const char * fn, void * inbuf, int insize,
     // If any of these fail, the action to take can be decided by the caller.
 
     /* Write out the data and update our structs */
-    if((st = vmufs_file_write(dev, &root, fat, dir, &nd, inbuf, insize / 512)) < 0) {
+    if((st = vmufs_file_write(dev, &c->root, c->fat, c->dir, &nd, inbuf, insize / 512)) < 0) {
         if(st == -2)
             rv = -7;
         else
@@ -779,82 +883,106 @@ int vmufs_write(maple_device_t * dev, const char * fn, void * inbuf, int insize,
         goto ex;
     }
 
-    /* Ok, everything's looking good so far.. update the FAT */
-    if(vmufs_fat_write(dev, &root, fat) < 0) {
-        rv = -5;
+    c->fat_dirty = 1;
+
+    if(flags & VMUFS_NOFLUSH)
         goto ex;
-    }
 
-    /* This is the critical point. If the dir doesn't save correctly, then
-       we may have an unusable card (until it's reformatted) or leaked
+    /* Ok, everything's looking good so far.. update the FAT, and then the
+       dir. This is the critical point. If the dir doesn't save correctly,
+       then we may have an unusable card (until it's reformatted) or leaked
        blocks not attached to a file. Cross your fingers! */
-    if(vmufs_dir_write(dev, &root, dir) < 0) {
+    if(vmufs_cache_flush(dev, c, 0) < 0) {
         /* doh! */
         dbglog(DBG_ERROR, "vmufs_write: warning, card may be corrupted or leaking blocks!\n");
-        rv = -6;
+        rv = c->fat_dirty ? -5 : -6;
         goto ex;
     }
 
     /* Looks like everything was good */
 ex:
-    vmufs_teardown(dir, fat);
+    /* If we didn't make it, what we have in memory may not match the card
+       anymore, so start over next time. */
+    if(rv < 0 && rv != -2)
+        vmufs_cache_drop(dev);
+
+    vmufs_teardown();
     return rv;
 }
 
 int vmufs_delete(maple_device_t * dev, const char * fn) {
-    vmu_root_t  root;
-    vmu_dir_t   * dir = NULL;
-    uint16      * fat = NULL;
-    int     fatsize, dirsize, rv = 0;
+    vmufs_cache_t * c;
+    int     rv = 0;
 
     /* Init everything */
-    if(vmufs_setup(dev, &root, &dir, &dirsize, &fat, &fatsize) < 0)
+    if(!(c = vmufs_setup(dev, 1, 1)))
         return -2;
 
     /* Ok, try to delete the file */
-    rv = vmufs_file_delete(&root, fat, dir, fn);
+    rv = vmufs_file_delete(&c->root, c->fat, c->dir, fn);
 
-    if(rv < 0) goto ex;
+    if(rv < 0) {
+        /* Not finding the file doesn't change anything, but running into a
+           corrupt FAT may have left it half done. */
+        if(rv != -1)
+            vmufs_cache_drop(dev);
 
-    /* If we succeeded, write back the dir and fat */
-    if(vmufs_dir_write(dev, &root, dir) < 0) {
-        rv = -2;
         goto ex;
     }
 
-    /* This is the critical point. If the fat doesn't save correctly, then
-       we may have an unusable card (until it's reformatted) or leaked
-       blocks not attached to a file. Cross your fingers! */
-    if(vmufs_fat_write(dev, &root, fat) < 0) {
+    c->fat_dirty = 1;
+
+    /* If we succeeded, write back the dir and then the fat. This is the
+       critical point. If the fat doesn't save correctly, then we may have
+       an unusable card (until it's reformatted) or leaked blocks not
+       attached to a file. Cross your fingers! */
+    if(vmufs_cache_flush(dev, c, 1) < 0) {
         /* doh! */
         dbglog(DBG_ERROR, "vmufs_delete: warning, card may be corrupted or leaking blocks!\n");
+        vmufs_cache_drop(dev);
         rv = -2;
         goto ex;
     }
 
     /* Looks like everything was good */
 ex:
-    vmufs_teardown(dir, fat);
+    vmufs_teardown();
     return rv;
 }
 
 int vmufs_free_blocks(maple_device_t * dev) {
-    vmu_root_t  root;
-    uint16      * fat = NULL;
-    int     fatsize, rv = 0;
+    vmufs_cache_t * c;
+    int     rv = 0;
 
     /* Init everything */
-    if(vmufs_setup(dev, &root, NULL, NULL, &fat, &fatsize) < 0)
+    if(!(c = vmufs_setup(dev, 0, 1)))
         return -1;
 
-    rv = vmufs_fat_free(&root, fat);
+    rv = vmufs_fat_free(&c->root, c->fat);
 
-    vmufs_teardown(NULL, fat);
+    vmufs_teardown();
     return rv;
 }
 
+int vmufs_flush(maple_device_t * dev) {
+    vmufs_cache_t * c;
+    int     rv = 0;
 
+    if(!dev)
+        return -1;
 
+    vmufs_mutex_lock();
+
+    /* Nothing cached means nothing to write */
+    if((c = cache[dev->port][dev->unit]) && vmufs_cache_flush(dev, c, 0) < 0) {
+        dbglog(DBG_ERROR, "vmufs_flush: warning, card may be corrupted or leaking blocks!\n");
+        vmufs_cache_drop(dev);
+        rv = -1;
+    }
+
+    vmufs_mutex_unlock();
+    return rv;
+}
 
 int vmufs_init(void) {
     mutex_init(&mutex, MUTEX_TYPE_NORMAL);
@@ -862,6 +990,15 @@ int vmufs_init(void) {
 }
 
 int vmufs_shutdown(void) {
+    int p, u;
+
+    for(p = 0; p < MAPLE_PORT_COUNT; p++) {
+        for(u = 0; u < MAPLE_UNIT_COUNT; u++) {
+            vmufs_cache_free(cache[p][u]);
+            cache[p][u] = NULL;
+        }
+    }
+
     mutex_destroy(&mutex);
     return 0;
 }
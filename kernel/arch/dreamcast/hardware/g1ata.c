@@ -13,6 +13,7 @@
 #include <dc/asic.h>
 
 #include <kos/dbglog.h>
+#include <kos/partition.h>
 #include <kos/sem.h>
 #include <kos/mutex.h>
 #include <kos/thread.h>
@@ -77,6 +78,12 @@ typedef struct ata_devdata {
     uint64_t end_block;
 } ata_devdata_t;
 
+/* The device's partition table, read the first time it is needed. Writes that
+   might have changed the table on the disk mark it as stale, so that it gets
+   read again the next time it is needed. Both are protected by the mutex. */
+static kos_partition_table_t *part_table = NULL;
+static int part_table_stale = 0;
+
 /* ATA-related registers. Some of these serve very different purposes when read
    than they do when written (hence why some addresses are duplicated). */
 #define G1_ATA_ALTSTATUS        0xA05F7018      /* Read */
@@ -222,6 +229,13 @@ inline int g1_ata_mutex_unlock(void) {
     return mutex_unlock(&_g1_ata_mutex);
 }
 
+/* Mark the partition table as stale if a write might have touched it. Call
+   this with the mutex held. */
+static void g1_ata_part_written(uint64_t sector, size_t count) {
+    if(part_table && !partition_table_contains(part_table, sector, count))
+        part_table_stale = 1;
+}
+
 static void g1_ata_set_sector_and_count(uint64_t sector, size_t count, int lba28) {
     if(!lba28) {
         OUT8(G1_ATA_SECTOR_COUNT, (uint8_t)(count >> 8));
@@ -500,6 +514,9 @@ int g1_ata_write_chs(uint16_t c, uint8_t h, uint8_t s, size_t count,
     if(g1_ata_mutex_lock())
         return -1;
 
+    g1_ata_part_written(((uint64_t)c * device.heads + h) * device.sectors +
+                        s - 1, count);
+
     /* Wait for the device to signal it is ready. */
     g1_ata_wait_bsydrq();
 
@@ -791,6 +808,8 @@ int g1_ata_write_lba(uint64_t sector, size_t count, const void *buf) {
     if(g1_ata_mutex_lock())
         return -1;
 
+    g1_ata_part_written(sector, count);
+
     /* Wait for the device to signal it is ready. */
     g1_ata_wait_bsydrq();
 
@@ -920,6 +939,8 @@ int g1_ata_write_lba_dma(uint64_t sector, size_t count, const void *buf,
         return -1;
     }
 
+    g1_ata_part_written(sector, count);
+
     /* Set the settings for this transfer and re-enable IRQs. */
     dma_blocking = block;
     dma_in_progress = 1;
@@ -1284,9 +1305,12 @@ static kos_blockdev_t ata_blockdev_chs = {
 
 int g1_ata_blockdev_for_partition(int partition, int dma, kos_blockdev_t *rv,
                                   uint8_t *partition_type) {
-    uint8_t buf[512];
-    int pval;
+    kos_blockdev_t whole;
+    kos_partition_table_t *table = NULL;
+    const kos_partition_t *part;
+    kos_partition_t entry;
     ata_devdata_t *ddata;
+    int err, stale;
 
     if(!initted) {
         errno = ENXIO;
@@ -1298,42 +1322,60 @@ int g1_ata_blockdev_for_partition(int partition, int dma, kos_blockdev_t *rv,
         return -1;
     }
 
-    /* Make sure the partition asked for is sane */
-    if(partition < 0 || partition > 3) {
-        dbglog(DBG_DEBUG, "Invalid partition number given: %d\n", partition);
-        errno = EINVAL;
+    if(g1_ata_mutex_lock())
         return -1;
-    }
 
-    /* Read the MBR from the disk */
-    if(device.max_lba) {
-        if(g1_ata_read_lba(0, 1, (uint16_t *)buf) < 0)
+    stale = !part_table || part_table_stale;
+    g1_ata_mutex_unlock();
+
+    /* Read the partition table from the disk, unless we already have an up to
+       date copy of it. It doesn't matter whether we're using CHS or LBA for
+       this... The tables only store LBA information that we care about, which
+       is valid either way. */
+    if(stale) {
+        if(g1_ata_blockdev_for_device(0, &whole))
             return -1;
-    }
-    else {
-        if(g1_ata_read_chs(0, 0, 1, 1, (uint16_t *)buf) < 0)
+
+        err = partition_table_read(&whole, &table) ? errno : 0;
+        whole.shutdown(&whole);
+
+        if(err) {
+            dbglog(DBG_DEBUG, "ATA device doesn't appear to have a partition "
+                   "table\n");
+            errno = err;
             return -1;
+        }
     }
 
-    /* Make sure the ATA disk uses MBR partitions.
-       TODO: Support GPT partitioning at some point. */
-    if(buf[0x01FE] != 0x55 || buf[0x1FF] != 0xAA) {
-        dbglog(DBG_DEBUG, "ATA device doesn't appear to have a MBR %02x %02x\n",
-               buf[0x01fe], buf[0x01ff]);
-        errno = ENOENT;
+    /* Swap in the new table (if any), and copy out the entry while we still
+       hold the lock, since a write could mark the table as stale as soon as
+       we let go of it. */
+    if(g1_ata_mutex_lock()) {
+        partition_table_free(table);
         return -1;
     }
 
-    /* Figure out where the partition record we're concerned with is, and make
-       sure that the partition actually exists. */
-    pval = 16 * partition + 0x01BE;
+    if(table) {
+        partition_table_free(part_table);
+        part_table = table;
+        part_table_stale = 0;
+    }
 
-    if(buf[pval + 4] == 0) {
+    if((part = partition_table_get(part_table, partition)))
+        entry = *part;
+
+    err = errno;
+    g1_ata_mutex_unlock();
+
+    /* Make sure that the partition actually exists. */
+    if(!part) {
         dbglog(DBG_DEBUG, "Partition %d appears to be empty\n", partition);
-        errno = ENOENT;
+        errno = err;
         return -1;
     }
 
+    part = &entry;
+
     /* Allocate the device data */
     if(!(ddata = (ata_devdata_t *)malloc(sizeof(ata_devdata_t)))) {
         errno = ENOMEM;
@@ -1351,16 +1393,11 @@ int g1_ata_blockdev_for_partition(int partition, int dma, kos_blockdev_t *rv,
         memcpy(rv, &ata_blockdev_chs, sizeof(kos_blockdev_t));
     }
 
-    /* It doesn't matter whether we're using CHS or LBA... We only bother to
-       parse out the LBA information from the MBR. Should be valid either
-       way (whereas the CHS stuff may very well be invalid). */
-    ddata->block_count = buf[pval + 0x0C] | (buf[pval + 0x0D] << 8) |
-                         (buf[pval + 0x0E] << 16) | (buf[pval + 0x0F] << 24);
-    ddata->start_block = buf[pval + 0x08] | (buf[pval + 0x09] << 8) |
-                         (buf[pval + 0x0A] << 16) | (buf[pval + 0x0B] << 24);
+    ddata->block_count = part->block_count;
+    ddata->start_block = part->start_block;
     ddata->end_block = ddata->start_block + ddata->block_count - 1;
     rv->dev_data = ddata;
-    *partition_type = buf[pval + 4];
+    *partition_type = part->type;
 
     return 0;
 }
@@ -1449,6 +1486,10 @@ void g1_ata_shutdown(void) {
 
     memset(&device, 0, sizeof(device));
 
+    partition_table_free(part_table);
+    part_table = NULL;
+    part_table_stale = 0;
+
     /* Unhook the events and disable the IRQs. */
     if(old_dma_irq.hdl) {
         /* CDROM driver uses the same handler for 3 events. */
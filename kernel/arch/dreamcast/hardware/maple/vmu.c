@@ -92,9 +92,17 @@ static void vmu_datetime_from_tm(vmu_datetime_t *dt, const struct tm *bt) {
 static int vmu_attach(maple_driver_t *drv, maple_device_t *dev) {
     (void)drv;
     dev->status_valid = 1;
+
+    /* This may not be the same card that was here before. */
+    vmufs_invalidate(dev);
     return 0;
 }
 
+static void vmu_detach(maple_driver_t *drv, maple_device_t *dev) {
+    (void)drv;
+    vmufs_invalidate(dev);
+}
+
 static void vmu_poll_reply(maple_state_t *st, maple_frame_t *frm) {
     (void)st;
 
@@ -184,7 +192,7 @@ static maple_driver_t vmu_drv = {
     .periodic = NULL,
     .status_size = sizeof(vmu_state_t),
     .attach = vmu_attach,
-    .detach = NULL
+    .detach = vmu_detach
 };
 
 /* Add the VMU to the driver chain */
@@ -19,6 +19,7 @@
 #include <arch/irq.h>
 #include <arch/cache.h>
 #include <arch/memory.h>
+#include <arch/timer.h>
 #include <kos/dbglog.h>
 #include <kos/net.h>
 #include <kos/thread.h>
@@ -46,20 +47,62 @@
 /* This was originally set as ASIC_IRQB */
 #define BBA_ASIC_IRQ ASIC_IRQ_DEFAULT
 
-/* DMA transfer will be used only if the amount of bytes exceeds that threshold */
+/* DMA transfer (for RX) and store queue copies (for TX) will be used only if
+   the amount of bytes exceeds that threshold */
 #define DMA_THRESHOLD 128 // looks like a good value
 
 /* Since callbacks will be running with interrupts enabled,
    it might be a good idea to protect bba_tx with a semaphore from inside.
    I'm not sure lwip needs that, but dcplaya does when using both lwip and its
-   own dcload syscalls emulation.*/
-#define TX_SEMA
+   own dcload syscalls emulation.
+   Note that this (like the other switches here) has to be defined to 1, since
+   it's checked with __is_defined(). The switches that are commented out
+   haven't been tried on a real adapter yet. */
+#define TX_SEMA 1
+
+/* If this is defined, big packets are put together in RAM and copied out to
+   the card with the store queues, rather than written over the G2 bus a piece
+   at a time. This needs TX_SEMA, since the buffer they're put together in is
+   shared. */
+//#define TX_SQ_COPY 1
 
 /* If this is defined, the dma buffer will be located in P2 area, and no call to
    dcache_inval_range need to be done before receiving data.
    TODO : make some benchmark to see which method is faster */
 //#define USE_P2_AREA
 
+/* If this is defined, the receive interrupt is held off while packets are
+   coming in quickly, and they're picked up from the chip's timer interrupt
+   instead, so that a burst of packets doesn't cost an interrupt apiece. */
+//#define RX_MITIGATION 1
+
+/* Start holding off the receive interrupt after this many of them in a row
+   come less than RX_MITIGATE_GAP microseconds apart... */
+#define RX_MITIGATE_ENTER       4
+#define RX_MITIGATE_GAP         200
+
+/* ... and go back to it once a tick of the timer turns up no more than this
+   many packets. */
+#define RX_MITIGATE_EXIT        1
+
+/* The timer ticks at the 33MHz PCI clock. The time between polls is halved
+   when a poll finds RX_MITIGATE_BUSY packets or more, and doubled when it
+   finds fewer than half that, staying between these two. */
+#define RX_MITIGATE_MIN         (33 * 50)   /* 50us */
+#define RX_MITIGATE_MAX         (33 * 400)  /* 400us */
+#define RX_MITIGATE_BUSY        8
+
+/* Interrupts we normally want to hear about */
+#define RT_INT_DEFAULT          (RT_INT_PCIERR | \
+                                 RT_INT_TIMEOUT | \
+                                 RT_INT_RXFIFO_OVERFLOW | \
+                                 RT_INT_RXFIFO_UNDERRUN | /* +link change */ \
+                                 RT_INT_RXBUF_OVERFLOW | \
+                                 RT_INT_TX_ERR | \
+                                 RT_INT_TX_OK | \
+                                 RT_INT_RX_ERR | \
+                                 RT_INT_RX_OK)
+
 /*
 
 Contains a low-level ethernet driver for the "Broadband Adapter", which
@@ -226,6 +269,13 @@ static uint32 const txdesc[TX_NB_BUFFERS] = {
 /* Is the link stabilized? */
 static volatile int link_stable;
 
+/* Receive interrupt mitigation state (see RX_MITIGATION) */
+static int rx_mitigating;       /* Polling on the timer right now? */
+static int rx_burst;            /* Interrupts in a row that came quickly */
+static uint64 rx_last_intr;     /* When the last one came (us) */
+static uint32 rx_mitigate_ticks;
+static int rx_tick_pkts;        /* Packets in since the last timer tick */
+
 /* Receive callback */
 static eth_rx_callback_t eth_rx_callback;
 
@@ -367,18 +417,11 @@ static int bba_hw_init(void) {
     asic_evt_set_handler(ASIC_EVT_EXP_PCI, bba_irq_hnd, NULL);
     asic_evt_enable(ASIC_EVT_EXP_PCI, BBA_ASIC_IRQ);
 
-    /* Enable receive interrupts */
+    /* Enable receive interrupts, with the timer stopped until we need it */
     /* XXX need to handle more! */
+    g2_write_32(NIC(RT_TIMERINT), 0);
     g2_write_16(NIC(RT_INTRSTATUS), 0xffff);
-    g2_write_16(NIC(RT_INTRMASK), RT_INT_PCIERR |
-                RT_INT_TIMEOUT |
-                RT_INT_RXFIFO_OVERFLOW |
-                RT_INT_RXFIFO_UNDERRUN |    // +link change
-                RT_INT_RXBUF_OVERFLOW |
-                RT_INT_TX_ERR |
-                RT_INT_TX_OK |
-                RT_INT_RX_ERR |
-                RT_INT_RX_OK);
+    g2_write_16(NIC(RT_INTRMASK), RT_INT_DEFAULT);
 
     /* Reset RXMISSED counter */
     g2_write_32(NIC(RT_RXMISSED), 0);
@@ -419,6 +462,11 @@ static void bba_hw_shutdown(void) {
     /* Disable receiver */
     g2_write_32(NIC(RT_RXCONFIG), 0);
 
+    /* Stop the timer, if we were polling with it */
+    g2_write_32(NIC(RT_TIMERINT), 0);
+    rx_mitigating = 0;
+    rx_burst = 0;
+
     /* Disable G2 interrupts */
     asic_evt_disable(ASIC_EVT_EXP_PCI, BBA_ASIC_IRQ);
     asic_evt_remove_handler(ASIC_EVT_EXP_PCI);
@@ -483,14 +531,34 @@ static semaphore_t bba_rx_sema;
 static int bba_rx_exit_thread;
 static semaphore_t bba_rx_sema2;
 
+/* Set when the RX thread has been signalled and hasn't woken up yet, so that
+   a burst of packets only wakes it once. */
+static volatile int rx_wake_pending;
+
 static void bba_rx(void);
 
 static semaphore_t tx_sema;
 
+/* Packets big enough to be worth it are gathered up in here and copied out to
+   the chip with the store queues. */
+static uint8 tx_bounce[TX_BUFFER_LEN] __attribute__((aligned(32)));
+
+extern netif_t bba_if;
+
 static uint8 * next_dst;
 static uint8 * next_src;
 static int next_len;
 
+/* Wake up the RX thread, unless it's already on its way. It takes everything
+   that's queued up when it wakes. */
+static void rx_wake(void) {
+    if(!rx_wake_pending) {
+        rx_wake_pending = 1;
+        sem_signal(&bba_rx_sema);
+        thd_schedule(true);
+    }
+}
+
 static void rx_finish_enq(int room) {
     /* Tell the chip where we are for overflow checking */
     rtl.cur_rx = (rtl.cur_rx + rx_size + 4 + 3) & ~3;
@@ -498,8 +566,11 @@ static void rx_finish_enq(int room) {
 
     if(room > 0 && (((rxin + 1) % MAX_PKTS) != rxout)) {
         rxin = (rxin + 1) % MAX_PKTS;
-        sem_signal(&bba_rx_sema);
-        thd_schedule(true);
+        ++rx_tick_pkts;
+        rx_wake();
+    }
+    else {
+        ++bba_if.stats.rx_dropped;
     }
 }
 
@@ -608,48 +679,110 @@ static int rx_enq(int ring_offset, size_t pkt_size) {
         return 1;
 }
 
-/* Transmit a single packet */
-static int bba_rtx(const uint8 * pkt, int len, int wait)
+/* Copy part of a packet out to RTL memory. Use the widest writes that the
+   alignment of both sides allows. Any extra bytes written at the end by the
+   wider writes get overwritten by the next part of the packet. */
+static void bba_tx_copy(const uint8 *data, uint32 dst, int len) {
+    if(!(((uint32)data | dst) & 0x03)) {
+        g2_write_block_32((uint32 *)data, dst, (len + 3) >> 2);
+    }
+    else if(!(((uint32)data | dst) & 0x01)) {
+        g2_write_block_16((uint16 *)data, dst, (len + 1) >> 1);
+    }
+    else {
+        g2_write_block_8(data, dst, len);
+    }
+}
+
+/* Copy a whole packet out to RTL memory from tx_bounce with the store queues.
+   This is the same dance as spu_memload_sq() does for sound RAM. The copy is
+   rounded up to a multiple of 32 bytes, which the TX buffers have room for. */
+static void bba_tx_copy_sq(uint32 dst, int len) {
+    g2_ctx_t ctx;
+
+    sq_lock(NULL);
+    ctx = g2_lock();
+    g2_fifo_wait();
+
+    sq_cpy((void *)dst, tx_bounce, (len + 31) & ~31);
+
+    sq_unlock();
+    sq_wait();
+    g2_unlock(ctx);
+}
+
+/* Wait for the chip to be done with a TX buffer, giving up after a while if
+   it never is. Returns 0 once it's done, -1 on timeout. */
+static int bba_tx_wait(int desc, int timeout) {
+    uint64 start = timer_ms_gettime64();
+    uint32 status;
+
+    while(!((status = g2_read_32(NIC(RT_TXSTATUS0 + 4 * desc))) &
+            RT_TX_HOST_OWNS)) {
+        if(status & RT_TX_ABORTED)
+            g2_write_32(NIC(RT_TXSTATUS0 + 4 * desc), status | 1);
+
+        if(timeout && timer_ms_gettime64() - start > (uint64)timeout)
+            return -1;
+    }
+
+    return 0;
+}
+
+/* Transmit a single packet, gathering it up from however many pieces it is
+   in. */
+static int bba_rtx(const net_pbuf_t *pkt, int wait)
 {
+    int len = 0, total;
+
     if(!link_stable) {
         if(wait == BBA_TX_WAIT) {
             while(!link_stable)
                 ;
         }
-        else
+        else {
+            ++bba_if.stats.tx_busy;
             return BBA_TX_AGAIN;
-    }
-
-    /* Wait till it's clear to transmit */
-    if(wait == BBA_TX_WAIT) {
-        while(!(g2_read_32(NIC(RT_TXSTATUS0 + 4 * rtl.cur_tx)) & RT_TX_HOST_OWNS)) {
-            if(g2_read_32(NIC(RT_TXSTATUS0 + 4 * rtl.cur_tx)) & RT_TX_ABORTED)
-                g2_write_32(NIC(RT_TXSTATUS0 + 4 * rtl.cur_tx),
-                            g2_read_32(NIC(RT_TXSTATUS0 + 4 * rtl.cur_tx)) | 1);
         }
     }
-    else {
-        if(!(g2_read_32(NIC(RT_TXSTATUS0 + 4 * rtl.cur_tx)) & RT_TX_HOST_OWNS)) {
-            return BBA_TX_AGAIN;
-        }
+
+    total = net_pbuf_length(pkt);
+
+    if(total > TX_BUFFER_LEN) {
+        ++bba_if.stats.tx_errors;
+        return BBA_TX_ERROR;
     }
 
-    /* Copy the packet out to RTL memory */
-    /* XXX could use store queues or memcpy8 here */
+    /* Wait till it's clear to transmit. The four TX buffers are used in turn,
+       so there's only ever waiting here if all of them are still going out. */
+    if(!(g2_read_32(NIC(RT_TXSTATUS0 + 4 * rtl.cur_tx)) & RT_TX_HOST_OWNS)) {
+        ++bba_if.stats.tx_busy;
 
-    //g2_write_block_8(pkt, txdesc[rtl.cur_tx], len);
+        if(wait != BBA_TX_WAIT)
+            return BBA_TX_AGAIN;
 
-    /* Check alignment of the packet, if its 32-bit aligned, use
-       g2_write_block_32, if its 16-bit aligned, use g2_write_block_16,
-       otherwise, use g2_write_block_8. */
-    if(!((uint32)pkt & 0x03)) {
-        g2_write_block_32((uint32 *) pkt, txdesc[rtl.cur_tx], (len + 3) >> 2);
+        bba_tx_wait(rtl.cur_tx, 0);
     }
-    else if(!((uint32)pkt & 0x01)) {
-        g2_write_block_16((uint16 *) pkt, txdesc[rtl.cur_tx], (len + 1) >> 1);
+
+    /* Copy the packet out to RTL memory. Big packets are put together in RAM
+       first and sent over with the store queues, which beats writing them
+       over the G2 bus a word at a time. The store queues can't be used inside
+       an interrupt though, and tx_bounce is only safe to use under tx_sema. */
+    if(__is_defined(TX_SQ_COPY) && __is_defined(TX_SEMA) &&
+       total > DMA_THRESHOLD && !irq_inside_int()) {
+        for(; pkt; pkt = pkt->next) {
+            memcpy(tx_bounce + len, pkt->data, pkt->len);
+            len += pkt->len;
+        }
+
+        bba_tx_copy_sq(txdesc[rtl.cur_tx], len);
+        ++bba_if.stats.tx_fast_copies;
     }
     else {
-        g2_write_block_8(pkt, txdesc[rtl.cur_tx], len);
+        for(; pkt; pkt = pkt->next) {
+            bba_tx_copy(pkt->data, txdesc[rtl.cur_tx] + len, pkt->len);
+            len += pkt->len;
+        }
     }
 
     /* All packets must be at least 60 bytes, pad them with null bytes if
@@ -661,6 +794,8 @@ static int bba_rtx(const uint8 * pkt, int len, int wait)
 
     /* Transmit from the current TX buffer */
     g2_write_32(NIC(RT_TXSTATUS0 + 4 * rtl.cur_tx), len);
+    ++bba_if.stats.tx_pkts;
+    bba_if.stats.tx_bytes += len;
 
     /* Go to the next TX buffer */
     rtl.cur_tx = (rtl.cur_tx + 1) % TX_NB_BUFFERS;
@@ -668,27 +803,36 @@ static int bba_rtx(const uint8 * pkt, int len, int wait)
     return BBA_TX_OK;
 }
 
-int bba_tx(const uint8 * pkt, int len, int wait) {
+static int bba_tx_pbuf(const net_pbuf_t *pkt, int wait) {
     int res;
 
     if(!__is_defined(TX_SEMA))
-        return bba_rtx(pkt, len, wait);
+        return bba_rtx(pkt, wait);
 
     if(irq_inside_int()) {
+        /* A thread is in the middle of sending, and we can't wait for it
+           here. Count it, and let the caller know it didn't go out. */
         if(sem_trywait(&tx_sema)) {
-            //printf("bba_tx called from an irq while a thread was running it !\n");
-            return BBA_TX_OK;   /* sorry guys ... */
+            ++bba_if.stats.tx_busy;
+            return BBA_TX_AGAIN;
         }
     }
     else
         sem_wait(&tx_sema);
 
-    res = bba_rtx(pkt, len, wait);
+    res = bba_rtx(pkt, wait);
     sem_signal(&tx_sema);
 
     return res;
 }
 
+int bba_tx(const uint8 * pkt, int len, int wait) {
+    net_pbuf_t pb;
+
+    net_pbuf_init(&pb, (uint8 *)pkt, 0, len);
+    return bba_tx_pbuf(&pb, wait);
+}
+
 void bba_lock(void) {
     //sem_wait(&bba_rx_sema2);
     //asic_evt_disable(ASIC_EVT_EXP_PCI, BBA_ASIC_IRQ);
@@ -699,6 +843,18 @@ void bba_unlock(void) {
     //sem_signal(&bba_rx_sema2);
 }
 
+/* Hand everything that's been received up to the callback. */
+static void bba_rx_deliver(void) {
+    while(rxout != rxin) {
+        /* Call the callback to process it */
+        eth_rx_callback(rx_pkt[rxout].rxbuff, rx_pkt[rxout].pkt_size);
+
+        ++bba_if.stats.rx_pkts;
+        bba_if.stats.rx_bytes += rx_pkt[rxout].pkt_size;
+        rxout = (rxout + 1) % MAX_PKTS;
+    }
+}
+
 static void *bba_rx_threadfunc(void *dummy) {
     (void)dummy;
 
@@ -709,16 +865,13 @@ static void *bba_rx_threadfunc(void *dummy) {
         if(bba_rx_exit_thread)
             break;
 
-        bba_lock();
-
-        if(rxout != rxin) {
-
-            /* Call the callback to process it */
-            eth_rx_callback(rx_pkt[rxout].rxbuff, rx_pkt[rxout].pkt_size);
-
-            rxout = (rxout + 1) % MAX_PKTS;
-        }
+        /* Anything that comes in from here on needs another wakeup, since
+           it might come in after we've stopped looking. */
+        rx_wake_pending = 0;
+        ++bba_if.stats.rx_wakeups;
 
+        bba_lock();
+        bba_rx_deliver();
         bba_unlock();
     }
 
@@ -759,6 +912,7 @@ static void bba_rx(void) {
             }
 
             dbglog(DBG_KDEBUG, "bba: bogus packet receive detected; skipping packet\n");
+            ++bba_if.stats.rx_errors;
             rx_reset();
             break;
         }
@@ -791,6 +945,73 @@ static void bba_link_change(void) {
     }
 }
 
+/* Hold off the receive interrupt, and poll for packets on the timer instead. */
+static void rx_mitigate_start(void) {
+    rx_mitigating = 1;
+    rx_tick_pkts = 0;
+    rx_mitigate_ticks = RX_MITIGATE_MIN;
+
+    g2_write_16(NIC(RT_INTRMASK), RT_INT_DEFAULT & ~RT_INT_RX_OK);
+    g2_write_32(NIC(RT_TIMERINT), rx_mitigate_ticks);
+    g2_write_32(NIC(RT_TIMER), 0);
+}
+
+static void rx_mitigate_stop(void) {
+    rx_mitigating = 0;
+    rx_burst = 0;
+
+    /* Anything that came in since the last poll is still flagged, so turning
+       the interrupt back on raises it right away. */
+    g2_write_32(NIC(RT_TIMERINT), 0);
+    g2_write_16(NIC(RT_INTRMASK), RT_INT_DEFAULT);
+}
+
+/* Called on each receive interrupt, to see if they're coming in fast enough
+   that we'd be better off polling. */
+static void rx_mitigate_check(void) {
+    uint64 now = timer_us_gettime64();
+
+    if(now - rx_last_intr < RX_MITIGATE_GAP) {
+        if(++rx_burst >= RX_MITIGATE_ENTER)
+            rx_mitigate_start();
+    }
+    else {
+        rx_burst = 0;
+    }
+
+    rx_last_intr = now;
+}
+
+/* Called on each tick of the timer while polling. */
+static void rx_mitigate_tick(void) {
+    int pkts;
+
+    ++bba_if.stats.rx_polled;
+
+    g2_write_16(NIC(RT_INTRSTATUS), RT_INT_RX_ACK);
+
+    if(!dma_used)
+        bba_rx();
+
+    /* This counts the packets that finished coming in since the last tick,
+       including any that were still being copied by DMA then. */
+    pkts = rx_tick_pkts;
+    rx_tick_pkts = 0;
+
+    if(pkts <= RX_MITIGATE_EXIT) {
+        rx_mitigate_stop();
+        return;
+    }
+
+    if(pkts >= RX_MITIGATE_BUSY && rx_mitigate_ticks > RX_MITIGATE_MIN)
+        rx_mitigate_ticks >>= 1;
+    else if(pkts < RX_MITIGATE_BUSY / 2 && rx_mitigate_ticks < RX_MITIGATE_MAX)
+        rx_mitigate_ticks <<= 1;
+
+    g2_write_32(NIC(RT_TIMERINT), rx_mitigate_ticks);
+    g2_write_32(NIC(RT_TIMER), 0);
+}
+
 /* Ethernet IRQ handler */
 static void bba_irq_hnd(uint32 code, void *data) {
     int intr, hnd;
@@ -815,6 +1036,20 @@ static void bba_irq_hnd(uint32 code, void *data) {
         /* so that the irq is not called again and again */
         g2_write_16(NIC(RT_INTRSTATUS), RT_INT_RX_ACK);
 
+        if(!rx_mitigating) {
+            ++bba_if.stats.rx_intrs;
+
+            if(__is_defined(RX_MITIGATION))
+                rx_mitigate_check();
+        }
+
+        hnd = 1;
+    }
+
+    if(intr & RT_INT_TIMEOUT) {
+        if(rx_mitigating)
+            rx_mitigate_tick();
+
         hnd = 1;
     }
 
@@ -822,6 +1057,11 @@ static void bba_irq_hnd(uint32 code, void *data) {
         hnd = 1;
     }
 
+    if(intr & RT_INT_TX_ERR) {
+        ++bba_if.stats.tx_errors;
+        hnd = 1;
+    }
+
     if(intr & RT_INT_LINK_CHANGE) {
         bba_link_change();
         hnd = 1;
@@ -829,6 +1069,7 @@ static void bba_irq_hnd(uint32 code, void *data) {
 
     if(intr & RT_INT_RXBUF_OVERFLOW) {
         dbglog(DBG_KDEBUG, "bba: RX overrun\n");
+        ++bba_if.stats.rx_dropped;
         rx_reset();
         hnd = 1;
     }
@@ -917,6 +1158,7 @@ static int bba_if_start(netif_t *self) {
 
     // Start the BBA RX thread.
     assert(bba_rx_thread == NULL);
+    rx_wake_pending = 0;
     sem_init(&bba_rx_sema, 0);
     sem_init(&bba_rx_sema2, 1);
     bba_rx_thread = thd_create(0, bba_rx_threadfunc, 0);
@@ -976,9 +1218,24 @@ static int bba_if_tx(netif_t *self, const uint8 *data, int len, int blocking) {
     return 0;
 }
 
-/* We'll auto-commit for now */
+static int bba_if_tx_pbuf(netif_t *self, net_pbuf_t *pkt, int blocking) {
+    (void)self;
+
+    if(!(bba_if.flags & NETIF_RUNNING))
+        return -1;
+
+    if(bba_tx_pbuf(pkt, blocking) != BBA_TX_OK)
+        return -1;
+
+    return 0;
+}
+
+/* We'll auto-commit for now: each packet is started as soon as it's copied
+   into one of the four TX buffers, so there's nothing left to flush here. */
 static int bba_if_tx_commit(netif_t *self) {
     (void)self;
+
+    ++bba_if.stats.tx_commits;
     return 0;
 }
 
@@ -996,12 +1253,7 @@ static int bba_if_rx_poll(netif_t *self) {
         g2_write_16(NIC(RT_INTRSTATUS), RT_INT_RX_ACK);
     }
 
-    if(rxout != rxin) {
-        /* Call the callback to process it */
-        eth_rx_callback(rx_pkt[rxout].rxbuff, rx_pkt[rxout].pkt_size);
-
-        rxout = (rxout + 1) % MAX_PKTS;
-    }
+    bba_rx_deliver();
 
     return 0;
 }
@@ -1138,6 +1390,7 @@ int bba_init(void) {
     bba_if.if_stop = bba_if_stop;
     bba_if.if_tx = bba_if_tx;
     bba_if.if_tx_commit = bba_if_tx_commit;
+    bba_if.if_tx_pbuf = bba_if_tx_pbuf;
     bba_if.if_rx_poll = bba_if_rx_poll;
     bba_if.if_set_flags = bba_if_set_flags;
     bba_if.if_set_mc = bba_if_set_mc;
@@ -21,6 +21,7 @@
 #include <kos/net.h>
 
 #include <kos/blockdev.h>
+#include <kos/partition.h>
 #include <kos/dbglog.h>
 
 #define MAX_RETRIES     500000
@@ -51,6 +52,12 @@ typedef struct sd_devdata {
     uint64_t start_block;
 } sd_devdata_t;
 
+/* The card's partition table, read the first time it is needed. Writes that
+   might have changed the table on the card mark it as stale, so that it gets
+   read again the next time it is needed. */
+static kos_partition_table_t *part_table = NULL;
+static bool part_table_stale = false;
+
 /* Table/algorithm generated by pycrc. I really wanted to have a much smaller
    table here, but unfortunately, the code pycrc generated just did not work. */
 static const uint8 crc7_table[256] = {
@@ -422,6 +429,10 @@ int sd_shutdown(void) {
     spi_shutdown();
     initted = false;
 
+    partition_table_free(part_table);
+    part_table = NULL;
+    part_table_stale = false;
+
     return 0;
 }
 
@@ -557,6 +568,10 @@ int sd_write_blocks(uint32 block, size_t count, const uint8 *buf) {
         return -1;
     }
 
+    /* Anything outside of a partition might be part of the table itself. */
+    if(part_table && !partition_table_contains(part_table, block, count))
+        part_table_stale = true;
+
     /* If we're in byte addressing mode, scale the block up. */
     if(byte_mode)
         block <<= 9;
@@ -751,9 +766,11 @@ static kos_blockdev_t sd_blockdev = {
 
 int sd_blockdev_for_partition(int partition, kos_blockdev_t *rv,
                               uint8 *partition_type) {
-    uint8 buf[512];
-    int pval;
+    kos_blockdev_t whole;
+    kos_partition_table_t *table;
+    const kos_partition_t *part;
     sd_devdata_t *ddata;
+    int err;
 
     if(!initted) {
         errno = ENXIO;
@@ -765,33 +782,30 @@ int sd_blockdev_for_partition(int partition, kos_blockdev_t *rv,
         return -1;
     }
 
-    /* Make sure the partition asked for is sane */
-    if(partition < 0 || partition > 3) {
-        dbglog(DBG_DEBUG, "Invalid partition number given: %d\n", partition);
-        errno = EINVAL;
-        return -1;
-    }
+    /* Read the partition table from the card, unless we already have an up
+       to date copy of it. */
+    if(!part_table || part_table_stale) {
+        if(sd_blockdev_for_device(&whole))
+            return -1;
 
-    /* Read the MBR from the card */
-    if(sd_read_blocks(0, 1, buf)) {
-        return -1;
-    }
+        err = partition_table_read(&whole, &table) ? errno : 0;
+        whole.shutdown(&whole);
 
-    /* Make sure the SD card uses MBR partitions.
-       TODO: Support GPT partitioning at some point. */
-    if(buf[0x01FE] != 0x55 || buf[0x1FF] != 0xAA) {
-        dbglog(DBG_DEBUG, "SD card doesn't appear to have a MBR\n");
-        errno = ENOENT;
-        return -1;
-    }
+        if(err) {
+            dbglog(DBG_DEBUG, "SD card doesn't appear to have a partition "
+                   "table\n");
+            errno = err;
+            return -1;
+        }
 
-    /* Figure out where the partition record we're concerned with is, and make
-       sure that the partition actually exists. */
-    pval = 16 * partition + 0x01BE;
+        partition_table_free(part_table);
+        part_table = table;
+        part_table_stale = false;
+    }
 
-    if(buf[pval + 4] == 0) {
+    /* Make sure that the partition actually exists. */
+    if(!(part = partition_table_get(part_table, partition))) {
         dbglog(DBG_DEBUG, "Partition %d appears to be empty\n", partition);
-        errno = ENOENT;
         return -1;
     }
 
@@ -803,12 +817,10 @@ int sd_blockdev_for_partition(int partition, kos_blockdev_t *rv,
 
     /* Copy in the template block device and fill it in */
     memcpy(rv, &sd_blockdev, sizeof(kos_blockdev_t));
-    ddata->block_count = buf[pval + 0x0C] | (buf[pval + 0x0D] << 8) |
-        (buf[pval + 0x0E] << 16) | (buf[pval + 0x0F] << 24);
-    ddata->start_block = buf[pval + 0x08] | (buf[pval + 0x09] << 8) |
-        (buf[pval + 0x0A] << 16) | (buf[pval + 0x0B] << 24);
+    ddata->block_count = part->block_count;
+    ddata->start_block = part->start_block;
     rv->dev_data = ddata;
-    *partition_type = buf[pval + 4];
+    *partition_type = part->type;
 
     return 0;
 }
@@ -832,6 +844,7 @@ int sd_blockdev_for_device(kos_blockdev_t *rv) {
         return -1;
     }
 
+    memcpy(rv, &sd_blockdev, sizeof(kos_blockdev_t));
     ddata->start_block = 0;
     ddata->block_count = (sd_get_size() / 512);
     rv->dev_data = ddata;
@@ -451,7 +451,10 @@ int g1_ata_lba_mode(void);
     the attached ATA device. This block device is used to interface with various
     filesystems on the device.
 
-    \param  partition       The partition number (0-3) to use.
+    \param  partition       The partition number to use. On MBR disks, 0-3 are
+                            the primary partitions and any logical partitions
+                            start at 4. On GPT disks, this is the entry number
+                            in the partition table.
     \param  dma             Set to 1 to use DMA for reads/writes on the device,
                             if available.
     \param  rv              Used to return the block device. Must be non-NULL.
@@ -462,14 +465,17 @@ int g1_ata_lba_mode(void);
     \par    Error Conditions:
     \em     ENXIO - ATA support not initialized or no device attached \n
     \em     EIO - an I/O error occurred in reading data \n
-    \em     EINVAL - invalid partition number was given \n
+    \em     EINVAL - a negative partition number was given \n
     \em     EFAULT - rv or partition_type was NULL \n
-    \em     ENOENT - no MBR found \n
+    \em     ENOENT - no partition table found \n
     \em     ENOENT - no partition at the specified position \n
     \em     ENOMEM - out of memory
 
-    \note   This interface currently only supports MBR-formatted disks. There
-            is currently no support for GPT partition tables.
+    \note   The partition table is read the first time this is called and kept
+            until the ATA driver is shut down. Any write that isn't
+            entirely inside one partition marks it as stale, and it is read
+            again on the next call. Block devices that were already created
+            keep the bounds they were created with.
 */
 int g1_ata_blockdev_for_partition(int partition, int dma, kos_blockdev_t *rv,
                                   uint8_t *partition_type);
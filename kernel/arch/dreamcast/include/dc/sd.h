@@ -181,7 +181,10 @@ uint64 sd_get_size(void);
     the attached SD card. This block device is used to interface with various
     filesystems on the device.
 
-    \param  partition       The partition number (0-3) to use.
+    \param  partition       The partition number to use. On MBR disks, 0-3 are
+                            the primary partitions and any logical partitions
+                            start at 4. On GPT disks, this is the entry number
+                            in the partition table.
     \param  rv              Used to return the block device. Must be non-NULL.
     \param  partition_type  Used to return the partition type. Must be non-NULL.
     \retval 0               On success.
@@ -190,14 +193,17 @@ uint64 sd_get_size(void);
     \par    Error Conditions:
     \em     ENXIO - SD card support was not initialized \n
     \em     EIO - an I/O error occurred in reading data \n
-    \em     EINVAL - invalid partition number was given \n
+    \em     EINVAL - a negative partition number was given \n
     \em     EFAULT - rv or partition_type was NULL \n
-    \em     ENOENT - no MBR found \n
+    \em     ENOENT - no partition table found \n
     \em     ENOENT - no partition at the specified position \n
     \em     ENOMEM - out of memory
 
-    \note   This interface currently only supports MBR-formatted SD cards. There
-            is currently no support for GPT partition tables.
+    \note   The partition table is read the first time this is called and kept
+            until the SD card driver is shut down. Any write that isn't
+            entirely inside one partition marks it as stale, and it is read
+            again on the next call. Block devices that were already created
+            keep the bounds they were created with.
 */
 int sd_blockdev_for_partition(int partition, kos_blockdev_t *rv,
                               uint8 *partition_type);
@@ -347,6 +347,7 @@ int vmufs_read_dirent(maple_device_t * dev, vmu_dir_t * dirent, void ** outbuf,
 #define VMUFS_OVERWRITE 1   /**< \brief Overwrite existing files */
 #define VMUFS_VMUGAME   2   /**< \brief This file is a VMU game */
 #define VMUFS_NOCOPY    4   /**< \brief Set the no-copy flag */
+#define VMUFS_NOFLUSH   8   /**< \brief Don't write back the dir and FAT yet */
 
 /** \brief Write a file to the VMU.
 
@@ -355,12 +356,20 @@ int vmufs_read_dirent(maple_device_t * dev, vmu_dir_t * dirent, void ** outbuf,
     one is written (this all happens atomically). On partial failure, some data
     blocks may have been written, but in general the card should not be damaged.
 
+    If VMUFS_NOFLUSH is set, the file data is written but the updated directory
+    and FAT are only kept in memory. This is useful for saving several files in
+    a row, as the directory and FAT then only get written once, by the last
+    call made without the flag (or by vmufs_flush()). Until that happens, the
+    new files aren't actually on the card, and if the card is removed, they're
+    lost (and any files they replaced may be damaged). Unwritten changes are
+    also thrown away if a later call fails partway through changing them.
+
     \param  dev             The VMU to write to.
     \param  fn              The filename to write.
     \param  inbuf           The data to write to the file.
     \param  insize          The size of the file in bytes.
     \param  flags           Flags for the write (i.e, VMUFS_OVERWRITE,
-                            VMUFS_VMUGAME, VMUFS_NOCOPY).
+                            VMUFS_VMUGAME, VMUFS_NOCOPY, VMUFS_NOFLUSH).
     \return                 0 on success, or <0 for failure.
 */
 int vmufs_write(maple_device_t * dev, const char * fn, void * inbuf, int insize, int flags);
@@ -381,6 +390,33 @@ int vmufs_delete(maple_device_t * dev, const char * fn);
 */
 int vmufs_free_blocks(maple_device_t * dev);
 
+/** \brief  Write back any changes to a VMU's directory and FAT.
+
+    The higher level functions keep a copy of each VMU's root block, directory
+    and FAT in memory, so that they don't have to be read from the card on
+    every call. This function writes back the parts of the directory and FAT
+    that have been changed but not yet written, which only happens when
+    vmufs_write() has been called with VMUFS_NOFLUSH.
+
+    \param  dev             The VMU to flush.
+    \retval 0               On success (or if there was nothing to write).
+    \retval -1              On failure.
+*/
+int vmufs_flush(maple_device_t * dev);
+
+/** \brief  Throw away the in-memory copy of a VMU's filesystem metadata.
+
+    This is done automatically when a VMU is attached or removed, and when any
+    of the low-level functions write a root block, directory or FAT. If you
+    write to the filesystem blocks of a card with vmu_block_write() directly,
+    call this afterwards so that the changes are seen. Any changes that have
+    not been flushed yet are lost. This function is safe to call from an
+    interrupt.
+
+    \param  dev             The VMU whose metadata should be re-read.
+*/
+void vmufs_invalidate(maple_device_t * dev);
+
 
 /** \brief  Initialize vmufs.
 
@@ -0,0 +1,277 @@
+/* KallistiOS ##version##
+
+   blockdev.c
+   Copyright (C) 2026 The KallistiOS Team
+*/
+
+/* This file implements a couple of very simple block devices that aren't tied
+   to any particular piece of hardware: one that keeps its blocks in RAM and
+   one that uses a disk image file from the VFS. Neither does any caching of
+   its own -- stack a blockdev_cache on top if that is desired. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include <kos/fs.h>
+#include <kos/mutex.h>
+#include <kos/blockdev.h>
+
+/* The type of the dev_data in the RAM block device structure */
+typedef struct ram_devdata {
+    uint8_t *mem;
+    uint64_t block_count;
+    int allocated;
+} ram_devdata_t;
+
+/* The type of the dev_data in the file block device structure */
+typedef struct file_devdata {
+    file_t fd;
+    int mode;
+    uint64_t block_count;
+    mutex_t lock;
+} file_devdata_t;
+
+static int ramb_init(kos_blockdev_t *d) {
+    (void)d;
+    return 0;
+}
+
+static int ramb_shutdown(kos_blockdev_t *d) {
+    ram_devdata_t *data = (ram_devdata_t *)d->dev_data;
+
+    if(data->allocated)
+        free(data->mem);
+
+    free(data);
+    return 0;
+}
+
+static int ramb_read_blocks(kos_blockdev_t *d, uint64_t block, size_t count,
+                            void *buf) {
+    ram_devdata_t *data = (ram_devdata_t *)d->dev_data;
+
+    if(block >= data->block_count || count > data->block_count - block) {
+        errno = EIO;
+        return -1;
+    }
+
+    memcpy(buf, data->mem + (block << d->l_block_size),
+           count << d->l_block_size);
+    return 0;
+}
+
+static int ramb_write_blocks(kos_blockdev_t *d, uint64_t block, size_t count,
+                             const void *buf) {
+    ram_devdata_t *data = (ram_devdata_t *)d->dev_data;
+
+    if(block >= data->block_count || count > data->block_count - block) {
+        errno = EIO;
+        return -1;
+    }
+
+    memcpy(data->mem + (block << d->l_block_size), buf,
+           count << d->l_block_size);
+    return 0;
+}
+
+static uint64_t ramb_count_blocks(kos_blockdev_t *d) {
+    ram_devdata_t *data = (ram_devdata_t *)d->dev_data;
+
+    return data->block_count;
+}
+
+static int ramb_flush(kos_blockdev_t *d) {
+    (void)d;
+    return 0;
+}
+
+static kos_blockdev_t ram_blockdev = {
+    NULL,                   /* dev_data */
+    9,                      /* l_block_size */
+    &ramb_init,             /* init */
+    &ramb_shutdown,         /* shutdown */
+    &ramb_read_blocks,      /* read_blocks */
+    &ramb_write_blocks,     /* write_blocks */
+    &ramb_count_blocks,     /* count_blocks */
+    &ramb_flush             /* flush */
+};
+
+int blockdev_ram_create(void *mem, uint64_t block_count,
+                        uint32_t l_block_size, kos_blockdev_t *rv) {
+    ram_devdata_t *ddata;
+
+    if(!rv) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    if(!block_count || l_block_size > 16) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(!(ddata = (ram_devdata_t *)malloc(sizeof(ram_devdata_t)))) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if(mem) {
+        ddata->mem = (uint8_t *)mem;
+        ddata->allocated = 0;
+    }
+    else {
+        if(!(ddata->mem = (uint8_t *)calloc(block_count, 1 << l_block_size))) {
+            free(ddata);
+            errno = ENOMEM;
+            return -1;
+        }
+
+        ddata->allocated = 1;
+    }
+
+    ddata->block_count = block_count;
+
+    memcpy(rv, &ram_blockdev, sizeof(kos_blockdev_t));
+    rv->l_block_size = l_block_size;
+    rv->dev_data = ddata;
+
+    return 0;
+}
+
+static int fileb_init(kos_blockdev_t *d) {
+    (void)d;
+    return 0;
+}
+
+static int fileb_shutdown(kos_blockdev_t *d) {
+    file_devdata_t *data = (file_devdata_t *)d->dev_data;
+
+    fs_close(data->fd);
+    mutex_destroy(&data->lock);
+    free(data);
+    return 0;
+}
+
+static int fileb_read_blocks(kos_blockdev_t *d, uint64_t block, size_t count,
+                             void *buf) {
+    file_devdata_t *data = (file_devdata_t *)d->dev_data;
+    ssize_t len = (ssize_t)(count << d->l_block_size);
+
+    if(block >= data->block_count || count > data->block_count - block) {
+        errno = EIO;
+        return -1;
+    }
+
+    mutex_lock_scoped(&data->lock);
+
+    if(fs_seek64(data->fd, (_off64_t)(block << d->l_block_size),
+                 SEEK_SET) < 0)
+        return -1;
+
+    if(fs_read(data->fd, buf, len) != len) {
+        errno = EIO;
+        return -1;
+    }
+
+    return 0;
+}
+
+static int fileb_write_blocks(kos_blockdev_t *d, uint64_t block, size_t count,
+                              const void *buf) {
+    file_devdata_t *data = (file_devdata_t *)d->dev_data;
+    ssize_t len = (ssize_t)(count << d->l_block_size);
+
+    if((data->mode & O_MODE_MASK) == O_RDONLY) {
+        errno = EROFS;
+        return -1;
+    }
+
+    if(block >= data->block_count || count > data->block_count - block) {
+        errno = EIO;
+        return -1;
+    }
+
+    mutex_lock_scoped(&data->lock);
+
+    if(fs_seek64(data->fd, (_off64_t)(block << d->l_block_size),
+                 SEEK_SET) < 0)
+        return -1;
+
+    if(fs_write(data->fd, buf, len) != len) {
+        errno = EIO;
+        return -1;
+    }
+
+    return 0;
+}
+
+static uint64_t fileb_count_blocks(kos_blockdev_t *d) {
+    file_devdata_t *data = (file_devdata_t *)d->dev_data;
+
+    return data->block_count;
+}
+
+static int fileb_flush(kos_blockdev_t *d) {
+    /* The VFS has no notion of syncing a file, so there's nothing to do. */
+    (void)d;
+    return 0;
+}
+
+static kos_blockdev_t file_blockdev = {
+    NULL,                   /* dev_data */
+    9,                      /* l_block_size */
+    &fileb_init,            /* init */
+    &fileb_shutdown,        /* shutdown */
+    &fileb_read_blocks,     /* read_blocks */
+    &fileb_write_blocks,    /* write_blocks */
+    &fileb_count_blocks,    /* count_blocks */
+    &fileb_flush            /* flush */
+};
+
+int blockdev_file_create(const char *fn, int mode, uint32_t l_block_size,
+                         kos_blockdev_t *rv) {
+    file_devdata_t *ddata;
+    uint64_t size;
+    int mm = mode & O_MODE_MASK;
+
+    if(!fn || !rv) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    if((mm != O_RDONLY && mm != O_RDWR) || l_block_size > 16) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(!(ddata = (file_devdata_t *)malloc(sizeof(file_devdata_t)))) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if((ddata->fd = fs_open(fn, mm)) < 0) {
+        free(ddata);
+        return -1;
+    }
+
+    ddata->mode = mm;
+    size = fs_total64(ddata->fd);
+
+    if(size == (uint64_t)-1 || !(size >> l_block_size)) {
+        fs_close(ddata->fd);
+        free(ddata);
+        errno = EINVAL;
+        return -1;
+    }
+
+    ddata->block_count = size >> l_block_size;
+    mutex_init(&ddata->lock, MUTEX_TYPE_NORMAL);
+
+    memcpy(rv, &file_blockdev, sizeof(kos_blockdev_t));
+    rv->l_block_size = l_block_size;
+    rv->dev_data = ddata;
+
+    return 0;
+}
@@ -0,0 +1,549 @@
+/* KallistiOS ##version##
+
+   blockdev_cache.c
+   Copyright (C) 2026 The KallistiOS Team
+*/
+
+/* This file implements a block cache that can be stacked on top of any
+   kos_blockdev_t. Cached blocks are found through a small hash table and
+   replaced in LRU order. In write-back mode, dirty blocks stay in the cache
+   until they have to be evicted or the device is flushed; at that point all of
+   the dirty blocks are sorted by block number and written out in a single
+   sweep (starting from where the last sweep ended, like an elevator), with
+   adjacent blocks coalesced into one request to the underlying device.
+
+   Sequential reads are detected by remembering where the last read ended. When
+   a read starts there, the blocks following it are prefetched into the cache
+   in one request so that the next read (hopefully) hits. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <malloc.h>
+#include <errno.h>
+
+#include <kos/mutex.h>
+#include <kos/blockdev.h>
+#include <kos/blockdev_cache.h>
+#include <sys/queue.h>
+
+/* Flags for cache entries */
+#define BC_FLAG_VALID   0x01
+#define BC_FLAG_DIRTY   0x02
+
+typedef struct bc_entry {
+    uint64_t block;                 /* Block number on the device */
+    uint8_t *data;                  /* Block data (in the pool) */
+    int flags;                      /* BC_FLAG_* */
+    struct bc_entry *hnext;         /* Next entry in the hash chain */
+    TAILQ_ENTRY(bc_entry) lru;      /* LRU list entry (head is newest) */
+} bc_entry_t;
+
+TAILQ_HEAD(bc_lru, bc_entry);
+
+/* The type of the dev_data in the cached block device structure */
+typedef struct bc_devdata {
+    kos_blockdev_t base;            /* The device we are caching */
+    mutex_t lock;
+
+    uint32_t flags;                 /* BLOCKDEV_CACHE_* */
+    size_t nblocks;                 /* Cache capacity in blocks */
+    size_t readahead;               /* Blocks to prefetch */
+    size_t max_io;                  /* Blocks in the scratch buffer */
+    size_t ndirty;                  /* Dirty blocks in the cache */
+
+    bc_entry_t *entries;
+    bc_entry_t **hash;
+    bc_entry_t **sorted;            /* Scratch space for write-back */
+    uint32_t hash_mask;
+    struct bc_lru lru;
+
+    uint8_t *pool;                  /* Data for all entries */
+    uint8_t *scratch;               /* Used for coalesced device requests */
+
+    uint64_t next_seq;              /* Where the last read ended */
+    uint64_t head;                  /* Where the last write-back ended */
+
+    blockdev_cache_stats_t stats;
+} bc_devdata_t;
+
+static int bc_read_blocks(kos_blockdev_t *d, uint64_t block, size_t count,
+                          void *buf);
+
+static inline uint32_t bc_hash(const bc_devdata_t *c, uint64_t block) {
+    uint32_t h = (uint32_t)block ^ (uint32_t)(block >> 32);
+
+    return ((h * 0x9E3779B1) >> 7) & c->hash_mask;
+}
+
+static bc_entry_t *bc_lookup(bc_devdata_t *c, uint64_t block) {
+    bc_entry_t *e;
+
+    for(e = c->hash[bc_hash(c, block)]; e; e = e->hnext) {
+        if(e->block == block)
+            return e;
+    }
+
+    return NULL;
+}
+
+static void bc_hash_insert(bc_devdata_t *c, bc_entry_t *e) {
+    uint32_t h = bc_hash(c, e->block);
+
+    e->hnext = c->hash[h];
+    c->hash[h] = e;
+}
+
+static void bc_hash_remove(bc_devdata_t *c, bc_entry_t *e) {
+    bc_entry_t **p = &c->hash[bc_hash(c, e->block)];
+
+    while(*p != e)
+        p = &(*p)->hnext;
+
+    *p = e->hnext;
+}
+
+static inline void bc_touch(bc_devdata_t *c, bc_entry_t *e) {
+    TAILQ_REMOVE(&c->lru, e, lru);
+    TAILQ_INSERT_HEAD(&c->lru, e, lru);
+}
+
+static inline void bc_clean(bc_devdata_t *c, bc_entry_t *e) {
+    if(e->flags & BC_FLAG_DIRTY) {
+        e->flags &= ~BC_FLAG_DIRTY;
+        --c->ndirty;
+    }
+}
+
+static int bc_cmp_block(const void *a, const void *b) {
+    const bc_entry_t *ea = *(const bc_entry_t **)a;
+    const bc_entry_t *eb = *(const bc_entry_t **)b;
+
+    if(ea->block < eb->block)
+        return -1;
+
+    return ea->block > eb->block;
+}
+
+/* Write back the dirty entries sorted[first..last), merging runs of adjacent
+   blocks into one device request. */
+static int bc_writeback_range(bc_devdata_t *c, size_t first, size_t last) {
+    size_t i = first, n, j;
+    size_t bsz = 1 << c->base.l_block_size;
+    const void *src;
+
+    while(i < last) {
+        /* Find how many blocks follow this one on the device. */
+        for(n = 1; i + n < last && n < c->max_io; ++n) {
+            if(c->sorted[i + n]->block != c->sorted[i]->block + n)
+                break;
+        }
+
+        if(n == 1) {
+            src = c->sorted[i]->data;
+        }
+        else {
+            for(j = 0; j < n; ++j)
+                memcpy(c->scratch + j * bsz, c->sorted[i + j]->data, bsz);
+
+            src = c->scratch;
+        }
+
+        if(c->base.write_blocks(&c->base, c->sorted[i]->block, n, src))
+            return -1;
+
+        ++c->stats.dev_writes;
+        c->stats.writeback_blocks += n;
+        c->head = c->sorted[i]->block + n;
+
+        for(j = 0; j < n; ++j)
+            bc_clean(c, c->sorted[i + j]);
+
+        i += n;
+    }
+
+    return 0;
+}
+
+/* Write back every dirty block in the cache. Assumes we hold the lock. */
+static int bc_writeback(bc_devdata_t *c) {
+    size_t i, n = 0, start;
+
+    if(!c->ndirty)
+        return 0;
+
+    for(i = 0; i < c->nblocks; ++i) {
+        if(c->entries[i].flags & BC_FLAG_DIRTY)
+            c->sorted[n++] = &c->entries[i];
+    }
+
+    qsort(c->sorted, n, sizeof(bc_entry_t *), &bc_cmp_block);
+    ++c->stats.flushes;
+
+    /* Sweep upwards from where the last pass left off, then wrap around. */
+    for(start = 0; start < n; ++start) {
+        if(c->sorted[start]->block >= c->head)
+            break;
+    }
+
+    if(bc_writeback_range(c, start, n))
+        return -1;
+
+    return bc_writeback_range(c, 0, start);
+}
+
+/* Grab the least recently used entry for reuse, writing back the cache if it
+   happens to be dirty. Assumes we hold the lock. */
+static bc_entry_t *bc_victim(bc_devdata_t *c) {
+    bc_entry_t *e = TAILQ_LAST(&c->lru, bc_lru);
+
+    if((e->flags & BC_FLAG_DIRTY) && bc_writeback(c))
+        return NULL;
+
+    if(e->flags & BC_FLAG_VALID) {
+        bc_hash_remove(c, e);
+        ++c->stats.evictions;
+    }
+
+    e->flags = 0;
+    return e;
+}
+
+/* Put a copy of a block in the cache. Assumes we hold the lock. */
+static int bc_insert(bc_devdata_t *c, uint64_t block, const void *src,
+                     int dirty) {
+    bc_entry_t *e;
+
+    if(!(e = bc_lookup(c, block))) {
+        if(!(e = bc_victim(c)))
+            return -1;
+
+        e->block = block;
+        e->flags = BC_FLAG_VALID;
+        bc_hash_insert(c, e);
+    }
+
+    memcpy(e->data, src, 1 << c->base.l_block_size);
+
+    if(dirty && !(e->flags & BC_FLAG_DIRTY)) {
+        e->flags |= BC_FLAG_DIRTY;
+        ++c->ndirty;
+    }
+
+    bc_touch(c, e);
+    return 0;
+}
+
+/* Prefetch the blocks starting at the given one. Failures are ignored, since
+   nobody asked for these blocks yet. Assumes we hold the lock. */
+static void bc_readahead(bc_devdata_t *c, uint64_t block) {
+    uint64_t total = c->base.count_blocks(&c->base);
+    size_t n, i, bsz = 1 << c->base.l_block_size;
+    size_t max = c->readahead < c->max_io ? c->readahead : c->max_io;
+
+    /* Skip over anything we already have. */
+    for(i = 0; i < max && block < total && bc_lookup(c, block); ++i)
+        ++block;
+
+    if(block >= total)
+        return;
+
+    max -= i;
+
+    if(block + max > total)
+        max = total - block;
+
+    for(n = 0; n < max; ++n) {
+        if(bc_lookup(c, block + n))
+            break;
+    }
+
+    if(!n || c->base.read_blocks(&c->base, block, n, c->scratch))
+        return;
+
+    ++c->stats.dev_reads;
+    c->stats.readahead_blocks += n;
+
+    /* Prefetching isn't worth a write-back (which would also clobber the
+       scratch buffer), so stop if we'd have to evict a dirty block. */
+    for(i = 0; i < n; ++i) {
+        if(TAILQ_LAST(&c->lru, bc_lru)->flags & BC_FLAG_DIRTY)
+            break;
+
+        bc_insert(c, block + i, c->scratch + i * bsz, 0);
+    }
+}
+
+static int bc_init(kos_blockdev_t *d) {
+    bc_devdata_t *c = (bc_devdata_t *)d->dev_data;
+
+    return c->base.init(&c->base);
+}
+
+static int bc_shutdown(kos_blockdev_t *d) {
+    bc_devdata_t *c = (bc_devdata_t *)d->dev_data;
+    int rv = 0;
+
+    mutex_lock(&c->lock);
+
+    if(bc_writeback(c))
+        rv = -1;
+
+    if(c->base.shutdown(&c->base))
+        rv = -1;
+
+    mutex_unlock(&c->lock);
+    mutex_destroy(&c->lock);
+
+    free(c->scratch);
+    free(c->pool);
+    free(c->sorted);
+    free(c->hash);
+    free(c->entries);
+    free(c);
+
+    return rv;
+}
+
+static int bc_read_blocks(kos_blockdev_t *d, uint64_t block, size_t count,
+                          void *buf) {
+    bc_devdata_t *c = (bc_devdata_t *)d->dev_data;
+    uint8_t *out = (uint8_t *)buf;
+    size_t i = 0, n, j, bsz = 1 << d->l_block_size;
+    bc_entry_t *e;
+
+    mutex_lock_scoped(&c->lock);
+    ++c->stats.read_reqs;
+
+    while(i < count) {
+        if((e = bc_lookup(c, block + i))) {
+            memcpy(out + i * bsz, e->data, bsz);
+            bc_touch(c, e);
+            ++c->stats.read_hits;
+            ++i;
+            continue;
+        }
+
+        /* Read the whole run of missing blocks straight into the caller's
+           buffer in one go. */
+        for(n = 1; i + n < count; ++n) {
+            if(bc_lookup(c, block + i + n))
+                break;
+        }
+
+        if(c->base.read_blocks(&c->base, block + i, n, out + i * bsz))
+            return -1;
+
+        ++c->stats.dev_reads;
+        c->stats.read_misses += n;
+
+        /* Don't bother caching huge reads, they'd just flush everything else
+           out of the cache. */
+        if(n <= c->nblocks / 2) {
+            for(j = 0; j < n; ++j) {
+                if(bc_insert(c, block + i + j, out + (i + j) * bsz, 0))
+                    break;
+            }
+        }
+
+        i += n;
+    }
+
+    if(c->readahead && block == c->next_seq)
+        bc_readahead(c, block + count);
+
+    c->next_seq = block + count;
+
+    return 0;
+}
+
+static int bc_write_blocks(kos_blockdev_t *d, uint64_t block, size_t count,
+                           const void *buf) {
+    bc_devdata_t *c = (bc_devdata_t *)d->dev_data;
+    const uint8_t *in = (const uint8_t *)buf;
+    size_t i, bsz = 1 << d->l_block_size;
+    bc_entry_t *e;
+
+    mutex_lock_scoped(&c->lock);
+    ++c->stats.write_reqs;
+    c->stats.write_blocks += count;
+
+    if((c->flags & BLOCKDEV_CACHE_WRITEBACK) && count <= c->nblocks / 2) {
+        for(i = 0; i < count; ++i) {
+            if(bc_insert(c, block + i, in + i * bsz, 1))
+                return -1;
+        }
+
+        return 0;
+    }
+
+    /* Write-through (or a write too big to be worth caching). Send it to the
+       device and refresh any copies we're holding. */
+    if(c->base.write_blocks(&c->base, block, count, buf))
+        return -1;
+
+    ++c->stats.dev_writes;
+
+    for(i = 0; i < count; ++i) {
+        if((e = bc_lookup(c, block + i))) {
+            memcpy(e->data, in + i * bsz, bsz);
+            bc_clean(c, e);
+        }
+    }
+
+    return 0;
+}
+
+static uint64_t bc_count_blocks(kos_blockdev_t *d) {
+    bc_devdata_t *c = (bc_devdata_t *)d->dev_data;
+
+    return c->base.count_blocks(&c->base);
+}
+
+static int bc_flush(kos_blockdev_t *d) {
+    bc_devdata_t *c = (bc_devdata_t *)d->dev_data;
+
+    mutex_lock_scoped(&c->lock);
+
+    if(bc_writeback(c))
+        return -1;
+
+    return c->base.flush ? c->base.flush(&c->base) : 0;
+}
+
+static kos_blockdev_t bc_blockdev = {
+    NULL,                   /* dev_data */
+    9,                      /* l_block_size */
+    &bc_init,               /* init */
+    &bc_shutdown,           /* shutdown */
+    &bc_read_blocks,        /* read_blocks */
+    &bc_write_blocks,       /* write_blocks */
+    &bc_count_blocks,       /* count_blocks */
+    &bc_flush               /* flush */
+};
+
+int blockdev_cache_create(kos_blockdev_t *base,
+                          const blockdev_cache_params_t *params,
+                          kos_blockdev_t *rv) {
+    bc_devdata_t *c;
+    size_t i, bsz, hsize;
+
+    if(!base || !rv) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    if(!base->read_blocks || !base->write_blocks || !base->count_blocks ||
+       !base->init || !base->shutdown) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(!(c = (bc_devdata_t *)calloc(1, sizeof(bc_devdata_t)))) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    memcpy(&c->base, base, sizeof(kos_blockdev_t));
+
+    if(params) {
+        c->flags = params->flags;
+        c->nblocks = params->cache_blocks;
+        c->readahead = params->readahead;
+        c->max_io = params->max_io_blocks;
+    }
+    else {
+        c->flags = BLOCKDEV_CACHE_WRITEBACK;
+        c->readahead = BLOCKDEV_CACHE_DEFAULT_READAHEAD;
+    }
+
+    if(!c->nblocks)
+        c->nblocks = BLOCKDEV_CACHE_DEFAULT_BLOCKS;
+
+    if(!c->max_io)
+        c->max_io = BLOCKDEV_CACHE_DEFAULT_MAX_IO;
+
+    /* Keep the hash table about half full. */
+    for(hsize = 16; hsize < c->nblocks * 2; hsize <<= 1)
+        ;
+
+    c->hash_mask = hsize - 1;
+    bsz = 1 << base->l_block_size;
+
+    c->entries = (bc_entry_t *)calloc(c->nblocks, sizeof(bc_entry_t));
+    c->hash = (bc_entry_t **)calloc(hsize, sizeof(bc_entry_t *));
+    c->sorted = (bc_entry_t **)malloc(c->nblocks * sizeof(bc_entry_t *));
+    c->pool = (uint8_t *)memalign(32, c->nblocks * bsz);
+    c->scratch = (uint8_t *)memalign(32, c->max_io * bsz);
+
+    if(!c->entries || !c->hash || !c->sorted || !c->pool || !c->scratch) {
+        free(c->scratch);
+        free(c->pool);
+        free(c->sorted);
+        free(c->hash);
+        free(c->entries);
+        free(c);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    TAILQ_INIT(&c->lru);
+
+    for(i = 0; i < c->nblocks; ++i) {
+        c->entries[i].data = c->pool + i * bsz;
+        TAILQ_INSERT_TAIL(&c->lru, &c->entries[i], lru);
+    }
+
+    c->next_seq = (uint64_t)-1;
+    mutex_init(&c->lock, MUTEX_TYPE_NORMAL);
+
+    memcpy(rv, &bc_blockdev, sizeof(kos_blockdev_t));
+    rv->l_block_size = c->base.l_block_size;
+    rv->dev_data = c;
+
+    return 0;
+}
+
+int blockdev_cache_get_stats(kos_blockdev_t *d, blockdev_cache_stats_t *stats) {
+    bc_devdata_t *c;
+
+    if(!d || d->read_blocks != &bc_read_blocks || !stats) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    c = (bc_devdata_t *)d->dev_data;
+
+    mutex_lock_scoped(&c->lock);
+    memcpy(stats, &c->stats, sizeof(blockdev_cache_stats_t));
+
+    return 0;
+}
+
+int blockdev_cache_invalidate(kos_blockdev_t *d) {
+    bc_devdata_t *c;
+    size_t i;
+
+    if(!d || d->read_blocks != &bc_read_blocks) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    c = (bc_devdata_t *)d->dev_data;
+
+    mutex_lock_scoped(&c->lock);
+
+    if(bc_writeback(c))
+        return -1;
+
+    for(i = 0; i < c->nblocks; ++i) {
+        if(c->entries[i].flags & BC_FLAG_VALID) {
+            bc_hash_remove(c, &c->entries[i]);
+            c->entries[i].flags = 0;
+        }
+    }
+
+    c->next_seq = (uint64_t)-1;
+
+    return 0;
+}
@@ -331,6 +331,8 @@ static fs_hnd_t *fs_map_hnd(file_t fd) {
     return fd_table[fd];
 }
 
+extern void __poll_fd_closed(int fd);
+
 /* Close a file and clean up the handle */
 int fs_close(file_t fd) {
     int retval;
@@ -342,6 +344,10 @@ int fs_close(file_t fd) {
     retval = fs_hnd_unref(h);
 
     fd_table[fd] = NULL;
+
+    /* Make sure nothing polling it is left looking at a stale fd. */
+    __poll_fd_closed(fd);
+
     return retval ? -1 : 0;
 }
 
@@ -14,13 +14,22 @@ many operating systems would do, this file system keeps the directory structure
 and file data in allocated chunks of RAM. This also means that the ramdisk can
 get as big as the memory available, there's no arbitrary limit.
 
+Small files are kept in a single block of memory. Once a file grows past
+FS_RAMDISK_CHUNK_SIZE, its data is moved into a table of fixed-size chunks
+instead, so that appending to a large file never has to copy what's already
+there (the chunk table itself grows geometrically). Chunks that have never been
+written (i.e. the file was extended by seeking past the end) aren't allocated
+at all and read back as zeroes. Since mmap() needs the whole file in one
+piece, mapping a chunked file gathers it back into a single block first.
+
 A note of warning about thread usage here as well. This FS is protected against
 thread contention at a file handle and data structure level. This means that the
-directory structures and the file handles will never become inconsistent. However,
-it is not protected at the individual file level. Because of this limitation, only
-one file handle may be open to an individual file for writing at any given time.
-If the file is already open for reading, it cannot be written to. Likewise, if
-the file is open for writing, you can't open it for reading or writing.
+directory structures and the file handles will never become inconsistent. The
+data of each file is protected by a lock of its own, so reading and writing
+different files doesn't contend on the global lock. However, only one file handle
+may be open to an individual file for writing at any given time. If the file is
+already open for reading, it cannot be written to. Likewise, if the file is open
+for writing, you can't open it for reading or writing.
 
 So for example, if you wanted to cache an MP3 in the ramdisk, you'd copy the data
 to the ramdisk in write mode, then close the file and let the library re-open it
@@ -36,6 +45,7 @@ cache data from disk rather than as a general purpose file system.
 #include <kos/fs_ramdisk.h>
 #include <kos/opts.h>
 
+#include <ctype.h>
 #include <string.h>
 #include <strings.h>
 #include <stdint.h>
@@ -54,33 +64,65 @@ char *strdup(const char *);
 /* File definition */
 typedef struct rd_file {
     char    * name;     /* File name -- allocated */
+    size_t    namelen;  /* Length of the name */
+    uint32_t  hash;     /* Hash of the name (see ramdisk_hash) */
     uint32_t  size;     /* Actual file size */
     int type;       /* File type */
     int openfor;    /* Lock constant */
     int usage;      /* Usage count (unopened is 0) */
 
-    /* For the following two members:
-      - In files, this is a block of allocated memory containing the
-        actual file data. Each time we need to expand it beyond its
-        current capacity, we realloc() with enough to hold the new
-        data plus 4k (to avoid realloc thrashing). All files start
-        out with a 1K block of space.
-      - In directories, this is just a pointer to an rd_dir struct,
+    /* For the following members:
+      - In files that are stored contiguously (chunks == NULL), data is a
+        block of allocated memory containing the actual file data, and
+        datasize is its size. The block doubles in size each time it needs
+        to grow, up until RD_CHUNK_SIZE.
+      - In chunked files, data is NULL and chunks is a table of nchunks
+        pointers to RD_CHUNK_SIZE byte blocks, any of which may be NULL
+        for a hole. datasize is the number of bytes in allocated chunks.
+      - In either case, any allocated bytes past the end of the file are
+        kept zeroed, so that extending the file doesn't need to clear them.
+      - In directories, data is just a pointer to an rd_dir struct,
         which is defined below. datasize has no meaning for a
         directory. */
     void    * data;     /* Data block pointer */
-    uint32_t  datasize; /* Size of data block pointer */
+    uint32_t  datasize; /* Bytes of allocated file data */
+    uint8_t ** chunks;  /* Chunk table (or NULL) */
+    uint32_t  nchunks;  /* Number of entries in the chunk table */
+
+    mutex_t   lock;     /* Protects the file data */
 
+    struct rd_dir * parent;         /* Directory we're in (NULL for root) */
     LIST_ENTRY(rd_file) dirlist;    /* Directory list entry */
+    LIST_ENTRY(rd_file) hashlist;   /* Directory hash bucket entry */
 } rd_file_t;
 
+#define RD_CHUNK_SIZE   FS_RAMDISK_CHUNK_SIZE
+#define RD_MIN_ALLOC    1024
+
 /* Lock constants */
 #define OPENFOR_NOTHING 0   /* Not opened */
 #define OPENFOR_READ    1   /* Opened read-only */
 #define OPENFOR_WRITE   2   /* Opened read-write */
 
-/* Directory definition -- just basically a list of files we contain */
-typedef LIST_HEAD(rd_dir, rd_file) rd_dir_t;
+/* Directory definition. The list of files is what readdir walks, so its order
+   never changes once a file is in it. Small directories are searched by
+   walking the list, but once a directory has more than RD_HASH_THRESHOLD
+   entries, a hash table of the names is built to search instead. The table
+   doubles in size whenever the average chain gets longer than
+   RD_HASH_LOAD entries. If we can't get the memory for the table, we just
+   keep on using the list. */
+LIST_HEAD(rd_file_list, rd_file);
+
+typedef struct rd_dir {
+    struct rd_file_list files;      /* All entries, in readdir order */
+    struct rd_file_list *buckets;   /* Hash buckets (or NULL) */
+    uint32_t nbuckets;              /* Number of buckets (a power of two) */
+    uint32_t count;                 /* Number of entries */
+} rd_dir_t;
+
+#define RD_HASH_THRESHOLD   32
+#define RD_HASH_MIN_BUCKETS 64
+#define RD_HASH_LOAD        2
 
 /* Pointer to the root diretctory */
 static rd_file_t *root = NULL;
@@ -102,28 +144,117 @@ static struct {
 /* Mutex for file system structs */
 static mutex_t rd_mutex;
 
+/* Hash a file name. Names are compared without regard to case, so they
+   have to be hashed that way too. This is FNV-1a. */
+static uint32_t ramdisk_hash(const char *name, size_t namelen) {
+    uint32_t h = 2166136261U;
+
+    while(namelen--) {
+        h ^= (uint8_t)tolower((unsigned char)*name++);
+        h *= 16777619U;
+    }
+
+    return h;
+}
+
+static void ramdisk_dir_init(rd_dir_t *d) {
+    LIST_INIT(&d->files);
+    d->buckets = NULL;
+    d->nbuckets = 0;
+    d->count = 0;
+}
+
+/* (Re)build the hash table of a directory with the given number of buckets.
+   Assumes we hold rd_mutex. */
+static void ramdisk_dir_rehash(rd_dir_t *d, uint32_t nbuckets) {
+    struct rd_file_list *b;
+    rd_file_t *f;
+    uint32_t i;
+
+    if(!(b = (struct rd_file_list *)malloc(nbuckets * sizeof(*b))))
+        return;
+
+    for(i = 0; i < nbuckets; ++i)
+        LIST_INIT(&b[i]);
+
+    LIST_FOREACH(f, &d->files, dirlist) {
+        LIST_INSERT_HEAD(&b[f->hash & (nbuckets - 1)], f, hashlist);
+    }
+
+    free(d->buckets);
+    d->buckets = b;
+    d->nbuckets = nbuckets;
+}
+
+/* Add a file to a directory. Assumes we hold rd_mutex. */
+static void ramdisk_dir_add(rd_dir_t *d, rd_file_t *f) {
+    f->parent = d;
+    LIST_INSERT_HEAD(&d->files, f, dirlist);
+    ++d->count;
+
+    if(d->buckets) {
+        LIST_INSERT_HEAD(&d->buckets[f->hash & (d->nbuckets - 1)], f,
+                         hashlist);
+
+        if(d->count > d->nbuckets * RD_HASH_LOAD)
+            ramdisk_dir_rehash(d, d->nbuckets << 1);
+    }
+    else if(d->count > RD_HASH_THRESHOLD) {
+        ramdisk_dir_rehash(d, RD_HASH_MIN_BUCKETS);
+    }
+}
+
+/* Remove a file from the directory it's in. Assumes we hold rd_mutex. */
+static void ramdisk_dir_remove(rd_file_t *f) {
+    rd_dir_t *d = f->parent;
+
+    LIST_REMOVE(f, dirlist);
+
+    if(d->buckets)
+        LIST_REMOVE(f, hashlist);
+
+    --d->count;
+    f->parent = NULL;
+}
+
 /* Search a directory for the named file; return the struct if
    we find it. Assumes we hold rd_mutex. */
 static rd_file_t *ramdisk_find(rd_dir_t *parent, const char *name, size_t namelen) {
     rd_file_t   *f;
+    uint32_t    hash = ramdisk_hash(name, namelen);
+
+    if(parent->buckets) {
+        LIST_FOREACH(f, &parent->buckets[hash & (parent->nbuckets - 1)],
+                     hashlist) {
+            if(f->hash == hash && f->namelen == namelen &&
+               !strncasecmp(name, f->name, namelen))
+                return f;
+        }
 
-    LIST_FOREACH(f, parent, dirlist) {
-        if((strlen(f->name) == namelen) && !strncasecmp(name, f->name, namelen))
+        return NULL;
+    }
+
+    LIST_FOREACH(f, &parent->files, dirlist) {
+        if(f->hash == hash && f->namelen == namelen &&
+           !strncasecmp(name, f->name, namelen))
             return f;
     }
 
     return NULL;
 }
 
-/* Find a path-named file in the ramdisk. There should not be a
-   slash at the beginning, nor at the end. Assumes we hold rd_mutex. */
-static rd_file_t * ramdisk_find_path(rd_dir_t * parent, const char * fn, int dir) {
+/* Find a path-named file in the ramdisk, looking at only the first len
+   characters of fn. There should not be a slash at the beginning, nor at the
+   end. Assumes we hold rd_mutex. */
+static rd_file_t * ramdisk_find_path(rd_dir_t * parent, const char * fn,
+                                     size_t len, int dir) {
     rd_file_t * f = NULL;
-    char * cur;
+    const char * end = fn + len;
+    const char * cur;
 
     /* If the object is in a sub-tree, traverse the tree looking
        for the right directory */
-    while((cur = strchr(fn, '/'))) {
+    while((cur = memchr(fn, '/', end - fn))) {
         /* We've got another part to look at */
         if(cur != fn) {
             /* Look for it in the parent dir.. if it's not a dir
@@ -146,8 +277,8 @@ static rd_file_t * ramdisk_find_path(rd_dir_t * parent, const char * fn, int dir
 
     /* If there was a remaining file part, then look for it
        in the dir. */
-    if(fn[0] != 0) {
-        f = ramdisk_find(parent, fn, strlen(fn));
+    if(fn != end) {
+        f = ramdisk_find(parent, fn, end - fn);
 
         if((f == NULL) || (!dir && f->type == STAT_TYPE_DIR) || (dir && f->type != STAT_TYPE_DIR))
             return NULL;
@@ -164,7 +295,6 @@ static rd_file_t * ramdisk_find_path(rd_dir_t * parent, const char * fn, int dir
 /* Find the parent directory and file name in the path-named file */
 static int ramdisk_get_parent(rd_dir_t * parent, const char * fn, rd_dir_t ** dout, const char **fnout) {
     const char  * p;
-    char        * pname;
     rd_file_t   * f;
 
     p = strrchr(fn, '/');
@@ -174,16 +304,7 @@ static int ramdisk_get_parent(rd_dir_t * parent, const char * fn, rd_dir_t ** do
         *fnout = fn;
     }
     else {
-        pname = (char *)malloc((p - fn) + 1);
-
-        if(!pname)
-            return -2;
-
-        strncpy(pname, fn, p - fn);
-        pname[p - fn] = 0;
-
-        f = ramdisk_find_path(parent, pname, 1);
-        free(pname);
+        f = ramdisk_find_path(parent, fn, p - fn, 1);
 
         if(!f)
             return -1;
@@ -196,6 +317,185 @@ static int ramdisk_get_parent(rd_dir_t * parent, const char * fn, rd_dir_t ** do
     return 0;
 }
 
+/* Free the data of a file, leaving it empty. Assumes we hold the file's lock
+   (or that nobody else can see the file). */
+static void ramdisk_free_data(rd_file_t *f) {
+    uint32_t i;
+
+    if(f->chunks) {
+        for(i = 0; i < f->nchunks; ++i)
+            free(f->chunks[i]);
+
+        free(f->chunks);
+        f->chunks = NULL;
+        f->nchunks = 0;
+    }
+
+    free(f->data);
+    f->data = NULL;
+    f->datasize = 0;
+    f->size = 0;
+}
+
+/* Move a contiguous file's data into chunks. Assumes we hold the file's
+   lock. */
+static int ramdisk_to_chunks(rd_file_t *f, uint32_t needed) {
+    uint32_t i, n, cnt, used = (f->size + RD_CHUNK_SIZE - 1) / RD_CHUNK_SIZE;
+    uint8_t **tbl;
+
+    /* Leave some room in the table to grow into. */
+    n = needed / RD_CHUNK_SIZE + 1;
+    n = n < 8 ? 8 : n * 2;
+
+    if(!(tbl = (uint8_t **)calloc(n, sizeof(uint8_t *)))) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for(i = 0; i < used; ++i) {
+        if(!(tbl[i] = (uint8_t *)malloc(RD_CHUNK_SIZE)))
+            goto fail;
+
+        cnt = f->size - i * RD_CHUNK_SIZE;
+
+        if(cnt >= RD_CHUNK_SIZE) {
+            memcpy(tbl[i], (uint8_t *)f->data + i * RD_CHUNK_SIZE,
+                   RD_CHUNK_SIZE);
+        }
+        else {
+            memcpy(tbl[i], (uint8_t *)f->data + i * RD_CHUNK_SIZE, cnt);
+            memset(tbl[i] + cnt, 0, RD_CHUNK_SIZE - cnt);
+        }
+    }
+
+    free(f->data);
+    f->data = NULL;
+    f->chunks = tbl;
+    f->nchunks = n;
+    f->datasize = used * RD_CHUNK_SIZE;
+
+    return 0;
+
+fail:
+    while(i--)
+        free(tbl[i]);
+
+    free(tbl);
+    errno = ENOMEM;
+    return -1;
+}
+
+/* Gather a chunked file back into one block of memory (for mmap). Assumes we
+   hold the file's lock. */
+static int ramdisk_make_contiguous(rd_file_t *f) {
+    uint32_t i, cnt, alloc;
+    uint8_t *np;
+
+    if(!f->chunks) {
+        if(f->data)
+            return 0;
+
+        alloc = RD_MIN_ALLOC;
+    }
+    else {
+        alloc = f->size > RD_MIN_ALLOC ? f->size : RD_MIN_ALLOC;
+    }
+
+    if(!(np = (uint8_t *)malloc(alloc))) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for(i = 0; f->chunks && i * RD_CHUNK_SIZE < f->size; ++i) {
+        cnt = f->size - i * RD_CHUNK_SIZE;
+
+        if(cnt > RD_CHUNK_SIZE)
+            cnt = RD_CHUNK_SIZE;
+
+        if(i < f->nchunks && f->chunks[i])
+            memcpy(np + i * RD_CHUNK_SIZE, f->chunks[i], cnt);
+        else
+            memset(np + i * RD_CHUNK_SIZE, 0, cnt);
+    }
+
+    memset(np + f->size, 0, alloc - f->size);
+
+    /* Throw away the chunks, but keep the size. */
+    cnt = f->size;
+    ramdisk_free_data(f);
+    f->data = np;
+    f->datasize = alloc;
+    f->size = cnt;
+
+    return 0;
+}
+
+/* Make sure a contiguous file has room for the given number of bytes, moving
+   it to chunks if it would get too big. Assumes we hold the file's lock. */
+static int ramdisk_grow(rd_file_t *f, uint32_t needed) {
+    uint32_t ns;
+    void *np;
+
+    if(needed <= f->datasize)
+        return 0;
+
+    if(needed > RD_CHUNK_SIZE)
+        return ramdisk_to_chunks(f, needed);
+
+    ns = f->datasize ? f->datasize : RD_MIN_ALLOC;
+
+    while(ns < needed)
+        ns <<= 1;
+
+    if(ns > RD_CHUNK_SIZE)
+        ns = RD_CHUNK_SIZE;
+
+    if(!(np = realloc(f->data, ns))) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    memset((uint8_t *)np + f->datasize, 0, ns - f->datasize);
+    f->data = np;
+    f->datasize = ns;
+
+    return 0;
+}
+
+/* Get the chunk for the given index of a chunked file, allocating it (and
+   growing the chunk table, if needed). A new chunk is zeroed, except for the
+   part that the caller is about to write. Assumes we hold the file's lock. */
+static uint8_t *ramdisk_chunk(rd_file_t *f, uint32_t idx, uint32_t off,
+                              uint32_t cnt) {
+    uint8_t *chunk;
+    uint32_t n;
+    uint8_t **tbl;
+
+    if(idx >= f->nchunks) {
+        for(n = f->nchunks * 2; n <= idx; n <<= 1)
+            ;
+
+        if(!(tbl = (uint8_t **)realloc(f->chunks, n * sizeof(uint8_t *))))
+            return NULL;
+
+        memset(tbl + f->nchunks, 0, (n - f->nchunks) * sizeof(uint8_t *));
+        f->chunks = tbl;
+        f->nchunks = n;
+    }
+
+    if(!(chunk = f->chunks[idx])) {
+        if(!(chunk = (uint8_t *)malloc(RD_CHUNK_SIZE)))
+            return NULL;
+
+        memset(chunk, 0, off);
+        memset(chunk + off + cnt, 0, RD_CHUNK_SIZE - off - cnt);
+        f->chunks[idx] = chunk;
+        f->datasize += RD_CHUNK_SIZE;
+    }
+
+    return chunk;
+}
+
 /* Create a path-named file in the ramdisk. There should not be a
    slash at the beginning, nor at the end. Assumes we hold rd_mutex. */
 static rd_file_t * ramdisk_create_file(rd_dir_t * parent, const char * fn, int dir) {
@@ -217,27 +517,32 @@ static rd_file_t * ramdisk_create_file(rd_dir_t * parent, const char * fn, int d
         return NULL;
     }
 
+    f->namelen = strlen(p);
+    f->hash = ramdisk_hash(p, f->namelen);
+
     f->size = 0;
     f->type = dir ? STAT_TYPE_DIR : STAT_TYPE_FILE;
     f->openfor = OPENFOR_NOTHING;
     f->usage = 0;
+    f->datasize = 0;
+    f->chunks = NULL;
+    f->nchunks = 0;
 
+    /* File data is allocated on the first write. */
     if(!dir) {
-        f->data = malloc(1024);
-        f->datasize = 1024;
-    }
-    else {
-        f->data = malloc(sizeof(rd_dir_t));
-        f->datasize = 0;
+        f->data = NULL;
     }
-
-    if(f->data == NULL) {
+    else if(!(f->data = malloc(sizeof(rd_dir_t)))) {
         free(f->name);
         free(f);
         return NULL;
     }
+    else {
+        ramdisk_dir_init((rd_dir_t *)f->data);
+    }
 
-    LIST_INSERT_HEAD(pdir, f, dirlist);
+    mutex_init(&f->lock, MUTEX_TYPE_NORMAL);
+    ramdisk_dir_add(pdir, f);
 
     return f;
 }
@@ -266,7 +571,7 @@ static void * ramdisk_open(vfs_handler_t * vfs, const char *fn, int mode) {
         f = root;
     }
     else {
-        f = ramdisk_find_path(rootdir, fn, mode & O_DIR);
+        f = ramdisk_find_path(rootdir, fn, strlen(fn), mode & O_DIR);
 
         if(f == NULL) {
             /* Are we planning to write anyway? */
@@ -321,10 +626,9 @@ static void * ramdisk_open(vfs_handler_t * vfs, const char *fn, int mode) {
             fh[fd].ptr = f->size;
         /* If we're opening with O_TRUNC, kill the existing contents */
         else if(mode & O_TRUNC) {
-            free(f->data);
-            f->data = malloc(1024);
-            f->datasize = 1024;
-            f->size = 0;
+            mutex_lock(&f->lock);
+            ramdisk_free_data(f);
+            mutex_unlock(&f->lock);
             fh[fd].ptr = 0;
         }
         else
@@ -337,7 +641,7 @@ static void * ramdisk_open(vfs_handler_t * vfs, const char *fn, int mode) {
     /* If we opened a dir, then ptr is actually a pointer to the first
        file entry. */
     if(mode & O_DIR) {
-        fh[fd].ptr = (uint32_t)LIST_FIRST((rd_dir_t *)f->data);
+        fh[fd].ptr = (uint32_t)LIST_FIRST(&((rd_dir_t *)f->data)->files);
     }
 
     /* Increase the usage count */
@@ -379,77 +683,149 @@ static int ramdisk_close(void * h) {
     return 0;
 }
 
+/* Look up the file behind a file handle. The global lock is only held for
+   the lookup; the caller is expected to lock the file itself. */
+static rd_file_t *ramdisk_get_file(file_t fd) {
+    mutex_lock_scoped(&rd_mutex);
+
+    if(fd < FS_RAMDISK_MAX_FILES && fh[fd].file != NULL && !fh[fd].dir)
+        return fh[fd].file;
+
+    return NULL;
+}
+
 /* Read from a file */
 static ssize_t ramdisk_read(void * h, void *buf, size_t bytes) {
-    ssize_t rv = -1;
     file_t  fd = (file_t)h;
+    rd_file_t *f;
+    uint8_t *out = (uint8_t *)buf;
+    uint32_t pos, idx, off, cnt;
+    size_t left;
 
-    mutex_lock_scoped(&rd_mutex);
+    if(!(f = ramdisk_get_file(fd)))
+        return -1;
 
-    /* Check that the fd is valid */
-    if(fd < FS_RAMDISK_MAX_FILES && fh[fd].file != NULL && !fh[fd].dir) {
-        /* Is there enough left? */
-        if((fh[fd].ptr + bytes) > fh[fd].file->size)
-            bytes = fh[fd].file->size - fh[fd].ptr;
+    mutex_lock_scoped(&f->lock);
 
-        /* Copy out the requested amount */
-        memcpy(buf, ((uint8_t *)fh[fd].file->data) + fh[fd].ptr, bytes);
-        fh[fd].ptr += bytes;
+    /* Is there enough left? */
+    pos = fh[fd].ptr;
+
+    if(pos >= f->size)
+        return 0;
 
-        rv = bytes;
+    if(bytes > f->size - pos)
+        bytes = f->size - pos;
+
+    /* Copy out the requested amount */
+    if(!f->chunks) {
+        memcpy(out, ((uint8_t *)f->data) + pos, bytes);
     }
+    else {
+        for(left = bytes; left; left -= cnt) {
+            idx = pos / RD_CHUNK_SIZE;
+            off = pos % RD_CHUNK_SIZE;
+            cnt = RD_CHUNK_SIZE - off;
 
-    return rv;
+            if(cnt > left)
+                cnt = left;
+
+            if(idx < f->nchunks && f->chunks[idx])
+                memcpy(out, f->chunks[idx] + off, cnt);
+            else
+                memset(out, 0, cnt);
+
+            out += cnt;
+            pos += cnt;
+        }
+    }
+
+    fh[fd].ptr += bytes;
+
+    return bytes;
 }
 
 /* Write to a file */
 static ssize_t ramdisk_write(void * h, const void *buf, size_t bytes) {
-    ssize_t rv = -1;
     file_t  fd = (file_t)h;
+    rd_file_t *f;
+    const uint8_t *in = (const uint8_t *)buf;
+    uint32_t pos, end, idx, off, cnt;
+    uint8_t *chunk;
+    size_t left;
 
-    mutex_lock_scoped(&rd_mutex);
+    if(!(f = ramdisk_get_file(fd)) || f->openfor != OPENFOR_WRITE)
+        return -1;
 
-    /* Check that the fd is valid */
-    if(fd < FS_RAMDISK_MAX_FILES && fh[fd].file != NULL && !fh[fd].dir && fh[fd].file->openfor == OPENFOR_WRITE) {
-        /* Is there enough left? */
-        if((fh[fd].ptr + bytes) > fh[fd].file->datasize) {
-            /* We need to realloc the block */
-            void * np = realloc(fh[fd].file->data, (fh[fd].ptr + bytes) + 4096);
+    mutex_lock_scoped(&f->lock);
 
-            if(np == NULL)
-                return -1;
+    pos = fh[fd].ptr;
+    end = pos + bytes;
 
-            fh[fd].file->data = np;
-            fh[fd].file->datasize = (fh[fd].ptr + bytes) + 4096;
-        }
+    if(end < pos) {
+        errno = EFBIG;
+        return -1;
+    }
 
-        /* Copy out the requested amount */
-        memcpy(((uint8_t *)fh[fd].file->data) + fh[fd].ptr, buf, bytes);
-        fh[fd].ptr += bytes;
+    /* Is there enough room? */
+    if(!f->chunks && ramdisk_grow(f, end))
+        return -1;
 
-        if(fh[fd].file->size < fh[fd].ptr) {
-            fh[fd].file->size = fh[fd].ptr;
+    /* Copy in the requested amount */
+    if(!f->chunks) {
+        memcpy(((uint8_t *)f->data) + pos, in, bytes);
+        pos = end;
+    }
+    else {
+        for(left = bytes; left; left -= cnt) {
+            idx = pos / RD_CHUNK_SIZE;
+            off = pos % RD_CHUNK_SIZE;
+            cnt = RD_CHUNK_SIZE - off;
+
+            if(cnt > left)
+                cnt = left;
+
+            if(!(chunk = ramdisk_chunk(f, idx, off, cnt))) {
+                /* Keep whatever we managed to write. */
+                if(pos == fh[fd].ptr) {
+                    errno = ENOMEM;
+                    return -1;
+                }
+
+                break;
+            }
+
+            memcpy(chunk + off, in, cnt);
+            in += cnt;
+            pos += cnt;
         }
+    }
+
+    bytes = pos - fh[fd].ptr;
+    fh[fd].ptr += bytes;
 
-        rv = bytes;
+    if(f->size < fh[fd].ptr) {
+        f->size = fh[fd].ptr;
     }
 
-    return rv;
+    return bytes;
 }
 
 /* Seek elsewhere in a file */
 static off_t ramdisk_seek(void * h, off_t offset, int whence) {
     file_t  fd = (file_t)h;
-
-    mutex_lock_scoped(&rd_mutex);
+    rd_file_t *f;
 
     /* Check that the fd is valid */
-    if(fd >= FS_RAMDISK_MAX_FILES || !fh[fd].file || fh[fd].dir) {
+    if(!(f = ramdisk_get_file(fd))) {
         errno = EBADF;
         return -1;
     }
 
-    /* Update current position according to arguments */
+    mutex_lock_scoped(&f->lock);
+
+    /* Update current position according to arguments. Seeking past the end
+       of the file is fine; writing there leaves a hole that reads back as
+       zeroes. */
     switch(whence) {
         case SEEK_SET:
             if(offset < 0) {
@@ -470,12 +846,12 @@ static off_t ramdisk_seek(void * h, off_t offset, int whence) {
             break;
 
         case SEEK_END:
-            if(offset < 0 && ((uint32_t)-offset) > fh[fd].file->size) {
+            if(offset < 0 && ((uint32_t)-offset) > f->size) {
                 errno = EINVAL;
                 return -1;
             }
 
-            fh[fd].ptr = fh[fd].file->size + offset;
+            fh[fd].ptr = f->size + offset;
             break;
 
         default:
@@ -483,35 +859,33 @@ static off_t ramdisk_seek(void * h, off_t offset, int whence) {
             return -1;
     }
 
-    /* Check bounds */
-    // XXXX: Technically this isn't correct. Fix it sometime.
-    if(fh[fd].ptr > fh[fd].file->size) fh[fd].ptr = fh[fd].file->size;
-
     return fh[fd].ptr;
 }
 
 /* Tell where in the file we are */
 static off_t ramdisk_tell(void * h) {
     file_t  fd = (file_t)h;
+    rd_file_t *f;
 
-    mutex_lock_scoped(&rd_mutex);
+    if(!(f = ramdisk_get_file(fd)))
+        return -1;
 
-    if(fd < FS_RAMDISK_MAX_FILES && fh[fd].file != NULL && !fh[fd].dir)
-        return fh[fd].ptr;
+    mutex_lock_scoped(&f->lock);
 
-    return -1;
+    return fh[fd].ptr;
 }
 
 /* Tell how big the file is */
 static size_t ramdisk_total(void * h) {
     file_t  fd = (file_t)h;
+    rd_file_t *f;
 
-    mutex_lock_scoped(&rd_mutex);
+    if(!(f = ramdisk_get_file(fd)))
+        return -1;
 
-    if(fd < FS_RAMDISK_MAX_FILES && fh[fd].file != NULL && !fh[fd].dir)
-        return fh[fd].file->size;
+    mutex_lock_scoped(&f->lock);
 
-    return -1;
+    return f->size;
 }
 
 /* Read a directory entry */
@@ -556,17 +930,18 @@ static int ramdisk_unlink(vfs_handler_t * vfs, const char *fn) {
     mutex_lock_scoped(&rd_mutex);
 
     /* Find the file */
-    f = ramdisk_find_path(rootdir, fn, 0);
+    f = ramdisk_find_path(rootdir, fn, strlen(fn), 0);
 
     if(f) {
         /* Make sure it's not in use */
         if(f->usage == 0) {
             /* Free its data */
             free(f->name);
-            free(f->data);
+            ramdisk_free_data(f);
+            mutex_destroy(&f->lock);
 
-            /* Remove it from the parent list */
-            LIST_REMOVE(f, dirlist);
+            /* Remove it from the parent directory */
+            ramdisk_dir_remove(f);
 
             /* Free the entry itself */
             free(f);
@@ -579,13 +954,19 @@ static int ramdisk_unlink(vfs_handler_t * vfs, const char *fn) {
 
 static void * ramdisk_mmap(void * h) {
     file_t  fd = (file_t)h;
+    rd_file_t *f;
 
-    mutex_lock_scoped(&rd_mutex);
+    if(!(f = ramdisk_get_file(fd)))
+        return NULL;
 
-    if(fd < FS_RAMDISK_MAX_FILES && fh[fd].file != NULL && !fh[fd].dir)
-        return fh[fd].file->data;
+    mutex_lock_scoped(&f->lock);
 
-    return NULL;
+    /* The mapping has to be contiguous, so gather up the chunks if the file
+       has been split up. */
+    if(ramdisk_make_contiguous(f))
+        return NULL;
+
+    return f->data;
 }
 
 static int ramdisk_stat(vfs_handler_t *vfs, const char *path, struct stat *st,
@@ -610,7 +991,7 @@ static int ramdisk_stat(vfs_handler_t *vfs, const char *path, struct stat *st,
     mutex_lock_scoped(&rd_mutex);
 
     /* Find the file */
-    f = ramdisk_find_path(rootdir, path, 0);
+    f = ramdisk_find_path(rootdir, path, len, 0);
     if(!f) {
         errno = ENOENT;
         return -1;
@@ -621,7 +1002,7 @@ static int ramdisk_stat(vfs_handler_t *vfs, const char *path, struct stat *st,
     st->st_mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
     st->st_mode |= (f->type == STAT_TYPE_DIR) ? 
         (S_IFDIR | S_IXUSR | S_IXGRP | S_IXOTH) : S_IFREG;
-    st->st_size = (f->type == STAT_TYPE_DIR) ? -1 : (int)f->datasize;
+    st->st_size = (f->type == STAT_TYPE_DIR) ? -1 : (int)f->size;
     st->st_nlink = (f->type == STAT_TYPE_DIR) ? 2 : 1;
     st->st_blksize = 1024;
     st->st_blocks = f->datasize >> 10;
@@ -670,7 +1051,7 @@ static int ramdisk_rewinddir(void * h) {
     }
 
     /* Rewind to the first file. */
-    fh[fd].ptr = (uint32_t)LIST_FIRST((rd_dir_t *)fh[fd].file->data);
+    fh[fd].ptr = (uint32_t)LIST_FIRST(&((rd_dir_t *)fh[fd].file->data)->files);
 
     return 0;
 }
@@ -694,7 +1075,7 @@ static int ramdisk_fstat(void *h, struct stat *st) {
     st->st_dev = (dev_t)('r' | ('a' << 8) | ('m' << 16));
     st->st_mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
     st->st_mode |= (f->type == STAT_TYPE_DIR) ? S_IFDIR : S_IFREG;
-    st->st_size = (f->type == STAT_TYPE_DIR) ? -1 : (int)f->datasize;
+    st->st_size = (f->type == STAT_TYPE_DIR) ? -1 : (int)f->size;
     st->st_nlink = (f->type == STAT_TYPE_DIR) ? 2 : 1;
     st->st_blksize = 1024;
     st->st_blocks = f->datasize >> 10;
@@ -763,10 +1144,12 @@ int fs_ramdisk_attach(const char * fn, void * obj, size_t size) {
 
     /* Ditch the data block we had and replace it with the user one. */
     f = fh[(int)fd].file;
-    free(f->data);
+    mutex_lock(&f->lock);
+    ramdisk_free_data(f);
     f->data = obj;
     f->datasize = size;
     f->size = size;
+    mutex_unlock(&f->lock);
 
     /* Close the file */
     ramdisk_close(fd);
@@ -791,13 +1174,23 @@ int fs_ramdisk_detach(const char * fn, void ** obj, size_t * size) {
     assert(size != NULL);
 
     f = fh[(int)fd].file;
+    mutex_lock(&f->lock);
+
+    /* The caller gets a single block of memory, so gather up the chunks if
+       the file has been split up. */
+    if(ramdisk_make_contiguous(f)) {
+        mutex_unlock(&f->lock);
+        ramdisk_close(fd);
+        return -1;
+    }
+
     *obj = f->data;
     *size = f->size;
 
-    /* Ditch the data block we had and replace it with a fake one. */
-    f->data = malloc(64);
-    f->datasize = 64;
-    f->size = 64;
+    /* The block belongs to the caller now. */
+    f->data = NULL;
+    ramdisk_free_data(f);
+    mutex_unlock(&f->lock);
 
     /* Close the file */
     ramdisk_close(fd);
@@ -831,14 +1224,20 @@ void fs_ramdisk_init(void) {
         return;
     }
 
+    root->namelen = 1;
+    root->hash = ramdisk_hash(root->name, 1);
+    root->parent = NULL;
     root->size = 0;
     root->type = STAT_TYPE_DIR;
     root->openfor = OPENFOR_NOTHING;
     root->usage = 0;
     root->data = rootdir;
     root->datasize = 0;
+    root->chunks = NULL;
+    root->nchunks = 0;
+    mutex_init(&root->lock, MUTEX_TYPE_NORMAL);
 
-    LIST_INIT(rootdir);
+    ramdisk_dir_init(rootdir);
 
     /* Reset fd's */
     memset(fh, 0, sizeof(fh));
@@ -850,28 +1249,40 @@ void fs_ramdisk_init(void) {
     nmmgr_handler_add(&vh.nmmgr);
 }
 
-/* De-init the file system */
-void fs_ramdisk_shutdown(void) {
+/* Free everything in a directory, and the directory itself. */
+static void ramdisk_free_dir(rd_dir_t *d) {
     rd_file_t *f1, *f2;
 
-    /* Test if initted */
-    if(rootdir == NULL)
-        return;
-
-    /* For now assume there's only the root dir, since mkdir and
-       rmdir aren't even implemented... */
-    f1 = LIST_FIRST(rootdir);
+    f1 = LIST_FIRST(&d->files);
 
     while(f1) {
         f2 = LIST_NEXT(f1, dirlist);
         free(f1->name);
-        free(f1->data);
+
+        if(f1->type == STAT_TYPE_DIR)
+            ramdisk_free_dir((rd_dir_t *)f1->data);
+        else
+            ramdisk_free_data(f1);
+
+        mutex_destroy(&f1->lock);
         free(f1);
         f1 = f2;
     }
 
-    free(rootdir);
+    free(d->buckets);
+    free(d);
+}
+
+/* De-init the file system */
+void fs_ramdisk_shutdown(void) {
+    /* Test if initted */
+    if(rootdir == NULL)
+        return;
+
+    ramdisk_free_dir(rootdir);
+    rootdir = NULL;
     free(root->name);
+    mutex_destroy(&root->lock);
     free(root);
 
     mutex_destroy(&rd_mutex);
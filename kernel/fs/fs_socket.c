@@ -16,6 +16,7 @@
 
 #include <sys/queue.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
@@ -505,6 +506,318 @@ ssize_t sendto(int sock, const void *message, size_t length, int flags,
                                  dest_len);
 }
 
+/* These two build recvmsg() and sendmsg() out of recvfrom and sendto, for
+   protocols that don't have anything better. Each buffer gets its own call, and
+   after the first, receiving won't block for any more data. */
+static ssize_t sock_recvmsg(net_socket_t *hnd, struct msghdr *msg, int flags) {
+    ssize_t rv, total = 0;
+    int i, err = errno;
+
+    msg->msg_controllen = 0;
+    msg->msg_flags = 0;
+
+    for(i = 0; i < msg->msg_iovlen; ++i) {
+        if(!msg->msg_iov[i].iov_len)
+            continue;
+
+        rv = hnd->protocol->recvfrom(hnd, msg->msg_iov[i].iov_base,
+                                     msg->msg_iov[i].iov_len, flags,
+                                     total ? NULL : msg->msg_name,
+                                     (total || !msg->msg_name) ? NULL :
+                                     &msg->msg_namelen);
+
+        if(rv < 0) {
+            if(!total)
+                return -1;
+
+            errno = err;
+            break;
+        }
+
+        total += rv;
+
+        if((size_t)rv < msg->msg_iov[i].iov_len)
+            break;
+
+        flags |= MSG_DONTWAIT;
+    }
+
+    return total;
+}
+
+static ssize_t sock_sendmsg(net_socket_t *hnd, const struct msghdr *msg,
+                            int flags) {
+    ssize_t rv, total = 0;
+    int i;
+
+    for(i = 0; i < msg->msg_iovlen; ++i) {
+        if(!msg->msg_iov[i].iov_len)
+            continue;
+
+        rv = hnd->protocol->sendto(hnd, msg->msg_iov[i].iov_base,
+                                   msg->msg_iov[i].iov_len, flags,
+                                   (const struct sockaddr *)msg->msg_name,
+                                   msg->msg_namelen);
+
+        if(rv < 0)
+            return total ? total : -1;
+
+        total += rv;
+
+        if((size_t)rv < msg->msg_iov[i].iov_len)
+            break;
+    }
+
+    return total;
+}
+
+ssize_t recvmsg(int sock, struct msghdr *msg, int flags) {
+    net_socket_t *hnd;
+    struct mmsghdr m;
+
+    hnd = (net_socket_t *)fs_get_handle(sock);
+
+    if(hnd == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+
+    /* Make sure this is actually a socket. */
+    if(fs_get_handler(sock) != &vh) {
+        errno = ENOTSOCK;
+        return -1;
+    }
+
+    if(msg == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    if(!hnd->protocol->recvmmsg)
+        return sock_recvmsg(hnd, msg, flags);
+
+    m.msg_hdr = *msg;
+    m.msg_len = 0;
+
+    if(hnd->protocol->recvmmsg(hnd, &m, 1, flags) < 0)
+        return -1;
+
+    *msg = m.msg_hdr;
+    return m.msg_len;
+}
+
+ssize_t sendmsg(int sock, const struct msghdr *msg, int flags) {
+    net_socket_t *hnd;
+    struct mmsghdr m;
+
+    hnd = (net_socket_t *)fs_get_handle(sock);
+
+    if(hnd == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+
+    /* Make sure this is actually a socket. */
+    if(fs_get_handler(sock) != &vh) {
+        errno = ENOTSOCK;
+        return -1;
+    }
+
+    if(msg == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    if(!hnd->protocol->sendmmsg)
+        return sock_sendmsg(hnd, msg, flags);
+
+    m.msg_hdr = *msg;
+    m.msg_len = 0;
+
+    if(hnd->protocol->sendmmsg(hnd, &m, 1, flags) < 0)
+        return -1;
+
+    return m.msg_len;
+}
+
+int recvmmsg(int sock, struct mmsghdr *msgvec, unsigned int vlen, int flags,
+             struct timespec *timeout) {
+    net_socket_t *hnd;
+    unsigned int i;
+    ssize_t rv;
+
+    hnd = (net_socket_t *)fs_get_handle(sock);
+
+    if(hnd == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+
+    /* Make sure this is actually a socket. */
+    if(fs_get_handler(sock) != &vh) {
+        errno = ENOTSOCK;
+        return -1;
+    }
+
+    if(timeout) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(msgvec == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    if(hnd->protocol->recvmmsg)
+        return hnd->protocol->recvmmsg(hnd, msgvec, vlen, flags);
+
+    for(i = 0; i < vlen; ++i) {
+        if((rv = sock_recvmsg(hnd, &msgvec[i].msg_hdr, flags)) < 0)
+            return i ? (int)i : -1;
+
+        msgvec[i].msg_len = rv;
+
+        /* A stream that's been closed isn't going to give us any more. */
+        if(!rv)
+            return i + 1;
+
+        if(flags & MSG_WAITFORONE)
+            flags |= MSG_DONTWAIT;
+    }
+
+    return i;
+}
+
+int sendmmsg(int sock, struct mmsghdr *msgvec, unsigned int vlen, int flags) {
+    net_socket_t *hnd;
+    unsigned int i;
+    ssize_t rv;
+
+    hnd = (net_socket_t *)fs_get_handle(sock);
+
+    if(hnd == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+
+    /* Make sure this is actually a socket. */
+    if(fs_get_handler(sock) != &vh) {
+        errno = ENOTSOCK;
+        return -1;
+    }
+
+    if(msgvec == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    if(hnd->protocol->sendmmsg)
+        return hnd->protocol->sendmmsg(hnd, msgvec, vlen, flags);
+
+    for(i = 0; i < vlen; ++i) {
+        if((rv = sock_sendmsg(hnd, &msgvec[i].msg_hdr, flags)) < 0)
+            return i ? (int)i : -1;
+
+        msgvec[i].msg_len = rv;
+    }
+
+    return i;
+}
+
+/* How much sendfile() reads at a time for protocols that can't take the data
+   straight from the file. */
+#define SENDFILE_CHUNK  4096
+
+/* Build sendfile() out of fs_read() and sendto, for protocols that don't have
+   anything better. Whatever doesn't get sent is left unread in the file. */
+static ssize_t sock_sendfile(net_socket_t *hnd, file_t fd, size_t count) {
+    uint8_t *buf;
+    ssize_t rv, sent, total = 0;
+    size_t len;
+
+    if(!(buf = (uint8_t *)malloc(SENDFILE_CHUNK))) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    while((size_t)total < count) {
+        len = count - total;
+
+        if(len > SENDFILE_CHUNK)
+            len = SENDFILE_CHUNK;
+
+        if((rv = fs_read(fd, buf, len)) <= 0) {
+            if(rv < 0 && !total)
+                total = -1;
+
+            break;
+        }
+
+        sent = hnd->protocol->sendto(hnd, buf, rv, 0, NULL, 0);
+
+        if(sent < rv) {
+            fs_seek(fd, sent > 0 ? sent - rv : -rv, SEEK_CUR);
+
+            if(sent > 0)
+                total += sent;
+            else if(!total)
+                total = -1;
+
+            break;
+        }
+
+        total += sent;
+    }
+
+    free(buf);
+    return total;
+}
+
+ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count) {
+    net_socket_t *hnd;
+    ssize_t rv;
+    off_t pos = 0;
+    int err;
+
+    hnd = (net_socket_t *)fs_get_handle(out_fd);
+
+    if(hnd == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+
+    /* Make sure this is actually a socket. */
+    if(fs_get_handler(out_fd) != &vh) {
+        errno = ENOTSOCK;
+        return -1;
+    }
+
+    /* With an offset, read from there and put the file back where it was when
+       we're done. */
+    if(offset) {
+        if((pos = fs_tell(in_fd)) < 0 ||
+           fs_seek(in_fd, *offset, SEEK_SET) < 0)
+            return -1;
+    }
+
+    if(hnd->protocol->sendfile)
+        rv = hnd->protocol->sendfile(hnd, in_fd, count);
+    else
+        rv = sock_sendfile(hnd, in_fd, count);
+
+    if(offset) {
+        if(rv > 0)
+            *offset += rv;
+
+        err = errno;
+        fs_seek(in_fd, pos, SEEK_SET);
+        errno = err;
+    }
+
+    return rv;
+}
+
 int shutdown(int sock, int how) {
     net_socket_t *hnd;
 
@@ -0,0 +1,520 @@
+/* KallistiOS ##version##
+
+   partition.c
+   Copyright (C) 2026 The KallistiOS Team
+*/
+
+/* This file implements MBR and GPT partition table parsing on top of the
+   generic block device interface, so that each block device driver doesn't
+   have to do it on its own.
+
+   For GPT, the primary header at LBA 1 is used if its CRCs check out, and the
+   backup header at the end of the disk is tried otherwise. For MBR, logical
+   partitions are found by following the chain of extended boot records inside
+   of the (first) extended partition. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include <kos/net.h>
+#include <kos/dbglog.h>
+#include <kos/blockdev.h>
+#include <kos/partition.h>
+
+/* Limits to keep a corrupt disk from sending us off into the weeds. */
+#define MAX_LOGICAL         128
+#define MAX_GPT_ENTRIES     1024
+
+/* Entries are 128 bytes on just about every disk out there. Anything much
+   bigger than a block is either corrupt or hostile. */
+#define MAX_GPT_ENTRY_SIZE  4096
+
+#define MBR_TYPE_GPT        0xEE
+
+/* The type of the dev_data in the partition block device structure */
+typedef struct part_devdata {
+    kos_blockdev_t *parent;
+    uint64_t start_block;
+    uint64_t block_count;
+} part_devdata_t;
+
+/* Well-known GPT partition type GUIDs (in on-disk byte order), and the MBR
+   partition type that corresponds to each one. */
+static const struct {
+    uint8_t guid[16];
+    uint8_t mbr_type;
+} gpt_types[] = {
+    /* EFI System Partition */
+    { { 0x28, 0x73, 0x2A, 0xC1, 0x1F, 0xF8, 0xD2, 0x11,
+        0xBA, 0x4B, 0x00, 0xA0, 0xC9, 0x3E, 0xC9, 0x3B }, 0xEF },
+    /* Microsoft basic data */
+    { { 0xA2, 0xA0, 0xD0, 0xEB, 0xE5, 0xB9, 0x33, 0x44,
+        0x87, 0xC0, 0x68, 0xB6, 0xB7, 0x26, 0x99, 0xC7 }, 0x0C },
+    /* Linux filesystem data */
+    { { 0xAF, 0x3D, 0xC6, 0x0F, 0x83, 0x84, 0x72, 0x47,
+        0x8E, 0x79, 0x3D, 0x69, 0xD8, 0x47, 0x7D, 0xE4 }, 0x83 },
+    /* Linux swap */
+    { { 0x6D, 0xFD, 0x57, 0x06, 0xAB, 0xA4, 0xC4, 0x43,
+        0x84, 0xE5, 0x09, 0x33, 0xC8, 0x4B, 0x4F, 0x4F }, 0x82 }
+};
+
+static inline uint32_t get_le32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint64_t get_le64(const uint8_t *p) {
+    return get_le32(p) | ((uint64_t)get_le32(p + 4) << 32);
+}
+
+static inline int is_extended(uint8_t type) {
+    return type == 0x05 || type == 0x0F || type == 0x85;
+}
+
+static int table_append(kos_partition_table_t *t, size_t *cap,
+                        const kos_partition_t *p) {
+    kos_partition_t *np;
+
+    if(t->count == *cap) {
+        if(!(np = (kos_partition_t *)realloc(t->parts, *cap * 2 *
+                                             sizeof(kos_partition_t)))) {
+            errno = ENOMEM;
+            return -1;
+        }
+
+        t->parts = np;
+        *cap *= 2;
+    }
+
+    t->parts[t->count++] = *p;
+    return 0;
+}
+
+static void mbr_entry(const uint8_t *ent, uint64_t base, kos_partition_t *p) {
+    memset(p, 0, sizeof(kos_partition_t));
+    p->type = ent[4];
+
+    if(p->type) {
+        p->start_block = base + get_le32(ent + 8);
+        p->block_count = get_le32(ent + 12);
+
+        if(ent[0] & 0x80)
+            p->flags |= PARTITION_FLAG_BOOTABLE;
+    }
+}
+
+/* Follow the chain of EBRs in an extended partition, appending each logical
+   partition to the table. */
+static int read_logical(kos_blockdev_t *dev, uint8_t *buf, uint64_t ext_start,
+                        kos_partition_table_t *t, size_t *cap) {
+    uint64_t ebr = ext_start;
+    kos_partition_t p;
+    int i;
+
+    for(i = 0; i < MAX_LOGICAL; ++i) {
+        if(dev->read_blocks(dev, ebr, 1, buf)) {
+            errno = EIO;
+            return -1;
+        }
+
+        if(buf[0x1FE] != 0x55 || buf[0x1FF] != 0xAA)
+            break;
+
+        /* The first entry is the logical partition, relative to this EBR. */
+        mbr_entry(buf + 0x1BE, ebr, &p);
+
+        if(p.type && p.block_count) {
+            p.flags |= PARTITION_FLAG_LOGICAL;
+
+            if(table_append(t, cap, &p))
+                return -1;
+        }
+
+        /* The second points at the next EBR, relative to the start of the
+           extended partition. */
+        if(!is_extended(buf[0x1CE + 4]))
+            break;
+
+        ebr = ext_start + get_le32(buf + 0x1CE + 8);
+    }
+
+    return 0;
+}
+
+static int read_mbr(kos_blockdev_t *dev, uint8_t *buf,
+                    kos_partition_table_t *t) {
+    size_t cap = 8;
+    uint64_t ext_start = 0;
+    int i;
+
+    if(!(t->parts = (kos_partition_t *)malloc(cap * sizeof(kos_partition_t)))) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    t->scheme = PARTITION_SCHEME_MBR;
+
+    for(i = 0; i < 4; ++i) {
+        mbr_entry(buf + 0x1BE + 16 * i, 0, &t->parts[i]);
+
+        if(!ext_start && is_extended(t->parts[i].type))
+            ext_start = t->parts[i].start_block;
+    }
+
+    t->count = 4;
+
+    if(ext_start)
+        return read_logical(dev, buf, ext_start, t, &cap);
+
+    return 0;
+}
+
+/* Read and check a GPT header at the given block. Returns the number of
+   entries on success. */
+static int gpt_header(kos_blockdev_t *dev, uint8_t *buf, uint64_t lba,
+                      uint64_t *entry_lba, uint32_t *entry_size,
+                      uint32_t *entry_crc) {
+    uint32_t hsize, crc, n;
+    size_t bsz = 1 << dev->l_block_size;
+
+    if(dev->read_blocks(dev, lba, 1, buf)) {
+        errno = EIO;
+        return -1;
+    }
+
+    if(memcmp(buf, "EFI PART", 8))
+        goto invalid;
+
+    hsize = get_le32(buf + 12);
+
+    if(hsize < 92 || hsize > bsz)
+        goto invalid;
+
+    /* The header CRC is calculated with the CRC field itself zeroed. */
+    crc = get_le32(buf + 16);
+    memset(buf + 16, 0, 4);
+
+    if(net_crc32le(buf, (int)hsize) != crc || get_le64(buf + 24) != lba)
+        goto invalid;
+
+    n = get_le32(buf + 80);
+    *entry_lba = get_le64(buf + 72);
+    *entry_size = get_le32(buf + 84);
+    *entry_crc = get_le32(buf + 88);
+
+    if(n > MAX_GPT_ENTRIES || *entry_size < 128 ||
+       *entry_size > MAX_GPT_ENTRY_SIZE || (*entry_size & 7))
+        goto invalid;
+
+    return (int)n;
+
+invalid:
+    errno = ENOENT;
+    return -1;
+}
+
+static int read_gpt_at(kos_blockdev_t *dev, uint8_t *buf, uint64_t lba,
+                       kos_partition_table_t *t) {
+    uint64_t entry_lba;
+    uint32_t entry_size, entry_crc;
+    size_t bytes, blocks, j;
+    uint8_t *ents, *e;
+    kos_partition_t *p;
+    int n, i;
+
+    if((n = gpt_header(dev, buf, lba, &entry_lba, &entry_size,
+                       &entry_crc)) < 0)
+        return -1;
+
+    /* The limits in gpt_header() keep this well clear of overflowing, but
+       make sure of it, since everything below trusts it. */
+    if(n && entry_size > SIZE_MAX / (size_t)n) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    bytes = (size_t)n * entry_size;
+    blocks = (bytes + (1 << dev->l_block_size) - 1) >> dev->l_block_size;
+
+    if(!blocks)
+        blocks = 1;
+
+    if(!(ents = (uint8_t *)malloc(blocks << dev->l_block_size))) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if(dev->read_blocks(dev, entry_lba, blocks, ents)) {
+        free(ents);
+        errno = EIO;
+        return -1;
+    }
+
+    if(net_crc32le(ents, (int)bytes) != entry_crc) {
+        free(ents);
+        errno = ENOENT;
+        return -1;
+    }
+
+    if(!(t->parts = (kos_partition_t *)calloc(n ? n : 1,
+                                              sizeof(kos_partition_t)))) {
+        free(ents);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    t->scheme = PARTITION_SCHEME_GPT;
+    t->count = n;
+
+    for(i = 0; i < n; ++i) {
+        e = ents + (size_t)i * entry_size;
+        p = &t->parts[i];
+
+        memcpy(p->type_guid, e, 16);
+        memcpy(p->guid, e + 16, 16);
+
+        /* An all-zero type GUID marks an unused entry. */
+        for(j = 0; j < 16 && !e[j]; ++j)
+            ;
+
+        if(j == 16 || get_le64(e + 40) < get_le64(e + 32))
+            continue;
+
+        p->start_block = get_le64(e + 32);
+        p->block_count = get_le64(e + 40) - p->start_block + 1;
+        p->type = PARTITION_TYPE_GPT_OTHER;
+
+        /* Bit 2 is the "legacy BIOS bootable" attribute. */
+        if(get_le64(e + 48) & 4)
+            p->flags |= PARTITION_FLAG_BOOTABLE;
+
+        for(j = 0; j < sizeof(gpt_types) / sizeof(gpt_types[0]); ++j) {
+            if(!memcmp(e, gpt_types[j].guid, 16)) {
+                p->type = gpt_types[j].mbr_type;
+                break;
+            }
+        }
+    }
+
+    free(ents);
+    return 0;
+}
+
+static int read_gpt(kos_blockdev_t *dev, uint8_t *buf,
+                    kos_partition_table_t *t) {
+    uint64_t last;
+
+    if(!read_gpt_at(dev, buf, 1, t))
+        return 0;
+
+    if(errno == ENOMEM)
+        return -1;
+
+    /* The primary header or table is damaged, so try the backup copy. */
+    dbglog(DBG_DEBUG, "partition: primary GPT is invalid, trying backup\n");
+    last = dev->count_blocks(dev);
+
+    if(last > 2 && !read_gpt_at(dev, buf, last - 1, t))
+        return 0;
+
+    if(errno != ENOMEM && errno != EIO)
+        errno = ENOENT;
+
+    return -1;
+}
+
+int partition_table_read(kos_blockdev_t *dev, kos_partition_table_t **rv) {
+    kos_partition_table_t *t;
+    uint8_t *buf;
+    int i, err = 0;
+
+    if(!dev || !rv) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    /* We need at least a full 512 byte sector to find the MBR signature. */
+    if(dev->l_block_size < 9) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    if(!(t = (kos_partition_table_t *)calloc(1, sizeof(*t)))) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if(!(buf = (uint8_t *)malloc(1 << dev->l_block_size))) {
+        free(t);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if(dev->read_blocks(dev, 0, 1, buf)) {
+        err = EIO;
+        goto out;
+    }
+
+    if(buf[0x1FE] != 0x55 || buf[0x1FF] != 0xAA) {
+        dbglog(DBG_DEBUG, "partition: device doesn't appear to have a MBR\n");
+        err = ENOENT;
+        goto out;
+    }
+
+    /* A protective MBR entry means the real table is a GPT. */
+    for(i = 0; i < 4; ++i) {
+        if(buf[0x1BE + 16 * i + 4] == MBR_TYPE_GPT)
+            break;
+    }
+
+    if(i < 4) {
+        if(read_gpt(dev, buf, t))
+            err = errno;
+    }
+    else if(read_mbr(dev, buf, t)) {
+        err = errno;
+    }
+
+out:
+    free(buf);
+
+    if(err) {
+        partition_table_free(t);
+        errno = err;
+        return -1;
+    }
+
+    *rv = t;
+    return 0;
+}
+
+void partition_table_free(kos_partition_table_t *table) {
+    if(table) {
+        free(table->parts);
+        free(table);
+    }
+}
+
+const kos_partition_t *partition_table_get(const kos_partition_table_t *table,
+                                           int partition) {
+    if(!table || partition < 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if((size_t)partition >= table->count || !table->parts[partition].type) {
+        errno = ENOENT;
+        return NULL;
+    }
+
+    return &table->parts[partition];
+}
+
+int partition_table_contains(const kos_partition_table_t *table,
+                             uint64_t block, size_t count) {
+    const kos_partition_t *p;
+    size_t i;
+
+    if(!table)
+        return 0;
+
+    for(i = 0; i < table->count; ++i) {
+        p = &table->parts[i];
+
+        /* Extended partitions hold the EBR chain, so they never count. */
+        if(!p->type || !p->block_count || is_extended(p->type))
+            continue;
+
+        if(block >= p->start_block &&
+           block - p->start_block <= p->block_count &&
+           count <= p->block_count - (block - p->start_block))
+            return 1;
+    }
+
+    return 0;
+}
+
+static int partb_init(kos_blockdev_t *d) {
+    (void)d;
+    return 0;
+}
+
+static int partb_shutdown(kos_blockdev_t *d) {
+    free(d->dev_data);
+    return 0;
+}
+
+static int partb_read_blocks(kos_blockdev_t *d, uint64_t block, size_t count,
+                             void *buf) {
+    part_devdata_t *data = (part_devdata_t *)d->dev_data;
+
+    if(block + count > data->block_count) {
+        errno = EOVERFLOW;
+        return -1;
+    }
+
+    return data->parent->read_blocks(data->parent, block + data->start_block,
+                                     count, buf);
+}
+
+static int partb_write_blocks(kos_blockdev_t *d, uint64_t block, size_t count,
+                              const void *buf) {
+    part_devdata_t *data = (part_devdata_t *)d->dev_data;
+
+    if(block + count > data->block_count) {
+        errno = EOVERFLOW;
+        return -1;
+    }
+
+    return data->parent->write_blocks(data->parent, block + data->start_block,
+                                      count, buf);
+}
+
+static uint64_t partb_count_blocks(kos_blockdev_t *d) {
+    part_devdata_t *data = (part_devdata_t *)d->dev_data;
+
+    return data->block_count;
+}
+
+static int partb_flush(kos_blockdev_t *d) {
+    part_devdata_t *data = (part_devdata_t *)d->dev_data;
+
+    return data->parent->flush ? data->parent->flush(data->parent) : 0;
+}
+
+static kos_blockdev_t part_blockdev = {
+    NULL,                   /* dev_data */
+    9,                      /* l_block_size */
+    &partb_init,            /* init */
+    &partb_shutdown,        /* shutdown */
+    &partb_read_blocks,     /* read_blocks */
+    &partb_write_blocks,    /* write_blocks */
+    &partb_count_blocks,    /* count_blocks */
+    &partb_flush            /* flush */
+};
+
+int partition_blockdev_create(kos_blockdev_t *dev, const kos_partition_t *part,
+                              kos_blockdev_t *rv) {
+    part_devdata_t *ddata;
+
+    if(!dev || !part || !rv) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    if(!(ddata = (part_devdata_t *)malloc(sizeof(part_devdata_t)))) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    ddata->parent = dev;
+    ddata->start_block = part->start_block;
+    ddata->block_count = part->block_count;
+
+    memcpy(rv, &part_blockdev, sizeof(kos_blockdev_t));
+    rv->l_block_size = dev->l_block_size;
+    rv->dev_data = ddata;
+
+    return 0;
+}
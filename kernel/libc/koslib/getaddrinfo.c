@@ -18,25 +18,34 @@
    The implementations of getaddrinfo() and freeaddrinfo() are new to this
    version of the code though.
 
-   Eventually, I'd like to add some sort of caching of results to this file so
-   that if you look something up more than once, it doesn't have to go back out
-   to the server to do so. But, for now, there is no local database of cached
-   addresses...
+   Answers from the server are kept in a small cache, keyed by name and record
+   type, for as long as the records' TTLs say they may be. Answers saying that
+   a name doesn't exist (or has no records of the type) are cached too, for as
+   long as the SOA record sent with them allows (RFC 2308). If one thread asks
+   about a name that another is already waiting on the server for, it waits for
+   that answer instead of sending its own query. When both IPv4 and IPv6
+   addresses are wanted, the two queries are sent at the same time on the same
+   socket, so that the lookup only takes one round trip.
 */
 
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
 #include <poll.h>
+#include <sys/queue.h>
 
 #include <netdb.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 
+#include <arch/timer.h>
 #include <kos/net.h>
+#include <kos/mutex.h>
+#include <kos/cond.h>
 #include <kos/dbglog.h>
 
 /* How many attempts to make at contacting the DNS server before giving up. */
@@ -45,14 +54,28 @@
 /* How long to wait between attempts. */
 #define DNS_TIMEOUT     500
 
+/* How many answers to keep in the cache. */
+#define DNS_CACHE_SIZE  32
+
+/* The most addresses of one type kept for a name. */
+#define DNS_MAX_ADDRS   8
+
+/* The longest that anything is kept in the cache, in seconds, whatever the
+   server says. */
+#define DNS_MAX_TTL     86400
+
+/* The longest name that can be looked up (RFC 1035, section 2.3.4). */
+#define DNS_NAME_MAX    253
+
+/* How big a message can be over UDP (RFC 1035, section 2.3.4). */
+#define DNS_MSG_MAX     512
+
 /*
    This performs a simple DNS A-record query. It hasn't been tested extensively
    but so far it seems to work fine.
 
    This relies on the really sketchy UDP support in the KOS lwIP port, so it
    can be cleaned up later once that's improved.
-
-   We really need to be setting errno in here too...
  */
 
 
@@ -74,8 +97,12 @@ typedef struct dnsmsg {
 static uint16_t qnum = 0;
 
 #define QTYPE_A         1
+#define QTYPE_CNAME     5
+#define QTYPE_SOA       6
 #define QTYPE_AAAA      28
 
+#define QCLASS_IN       1
+
 /* Flags:
    Query/Response (1 bit) -- 0 = Query, 1 = Response
    Opcode (4 bits) -- 0 = Standard, 1 = Inverse, 2 = Status
@@ -113,73 +140,96 @@ static uint16_t qnum = 0;
      MX     15
      TXT    16
      AAAA   28
+
+   Some resolvers can't handle more than one question in a query, so an A and
+   an AAAA lookup are always sent as two separate queries, each with an ID of
+   its own.
  */
 
-// Construct a DNS query for an A record by host name. "buf" should
-// be at least 1500 bytes, to make sure there's room.
-static size_t dns_make_query(const char *host, dnsmsg_t *buf, int ip4,
-                             int ip6) {
-    int i, o = 0, ls, t;
+/* The records of one type that the server gave back for a name, or the reason
+   it didn't give any. */
+typedef struct dns_rrset {
+    int err;                /* 0, or the EAI_* value to return */
+    int errnum;             /* errno to go with EAI_SYSTEM */
+    uint32_t ttl;           /* In seconds, 0 to not cache it at all */
+    int naddrs;
+    uint8_t addrs[DNS_MAX_ADDRS][16];
+} dns_rrset_t;
+
+/* An answer in the cache. The list is kept with the most recently used entry
+   at the front, so the one at the back is the one to throw out. */
+typedef struct dns_entry {
+    TAILQ_ENTRY(dns_entry) entry;
+    char name[DNS_NAME_MAX + 1];
+    uint16_t qtype;
+    uint64_t expires;       /* In ms, on timer_ms_gettime64() */
+    dns_rrset_t rrs;
+} dns_entry_t;
+
+/* A query that is out to the server. Anyone else that wants the same answer
+   holds a reference to it and waits for it to be done. */
+typedef struct dns_pending {
+    TAILQ_ENTRY(dns_pending) entry;
+    char name[DNS_NAME_MAX + 1];
+    uint16_t qtype;
+    uint16_t id;
+    int done;
+    int refs;
+    dns_rrset_t rrs;
+} dns_pending_t;
+
+TAILQ_HEAD(dns_entry_list, dns_entry);
+TAILQ_HEAD(dns_pending_list, dns_pending);
+
+static struct dns_entry_list dns_cache = TAILQ_HEAD_INITIALIZER(dns_cache);
+static struct dns_pending_list dns_pending =
+    TAILQ_HEAD_INITIALIZER(dns_pending);
+static int dns_cache_count = 0;
+
+/* The server that the cache was filled from. If it changes (say, from a new
+   DHCP lease), nothing in the cache can be trusted any more. */
+static uint32_t dns_cache_server = 0;
+
+static mutex_t dns_mutex = MUTEX_INITIALIZER;
+static condvar_t dns_cond = COND_INITIALIZER;
+
+// Construct a DNS query for one record type by host name. "buf" should
+// be at least DNS_MSG_MAX bytes, to make sure there's room.
+static size_t dns_make_query(const char *host, dnsmsg_t *buf, uint16_t qtype,
+                             uint16_t id) {
+    int i, o, ls, t;
 
     // Build up the header.
-    buf->id = htons(qnum++);
+    buf->id = htons(id);
     buf->flags = htons(0x0100);
-    buf->qdcount = htons(ip4 + ip6);
+    buf->qdcount = htons(1);
     buf->ancount = htons(0);
     buf->nscount = htons(0);
     buf->arcount = htons(0);
 
-    /* Fill in the question section(s). */
+    /* Fill in the question section. */
     ls = 0;
-
-    if(ip4) {
-        o = ls + 1;
-        t = strlen(host);
-
-        for(i = 0; i <= t; i++) {
-            if(host[i] == '.' || i == t) {
-                buf->data[ls] = (o - ls) - 1;
-                ls = o;
-                o++;
-            }
-            else {
-                buf->data[o++] = host[i];
-            }
+    o = ls + 1;
+    t = strlen(host);
+
+    for(i = 0; i <= t; i++) {
+        if(host[i] == '.' || i == t) {
+            buf->data[ls] = (o - ls) - 1;
+            ls = o;
+            o++;
         }
-
-        buf->data[ls] = 0;
-
-        // Might be unaligned now... so just build it by hand.
-        buf->data[o++] = (uint8_t)(QTYPE_A >> 8);
-        buf->data[o++] = (uint8_t)QTYPE_A;
-        buf->data[o++] = 0x00;
-        buf->data[o++] = 0x01;
-        ls = o;
-    }
-
-    if(ip6) {
-        o = ls + 1;
-        t = strlen(host);
-
-        for(i = 0; i <= t; i++) {
-            if(host[i] == '.' || i == t) {
-                buf->data[ls] = (o - ls) - 1;
-                ls = o;
-                o++;
-            }
-            else {
-                buf->data[o++] = host[i];
-            }
+        else {
+            buf->data[o++] = host[i];
         }
+    }
 
-        buf->data[ls] = 0;
+    buf->data[ls] = 0;
 
-        // Might be unaligned now... so just build it by hand.
-        buf->data[o++] = (uint8_t)(QTYPE_AAAA >> 8);
-        buf->data[o++] = (uint8_t)QTYPE_AAAA;
-        buf->data[o++] = 0x00;
-        buf->data[o++] = 0x01;
-    }
+    // Might be unaligned now... so just build it by hand.
+    buf->data[o++] = (uint8_t)(qtype >> 8);
+    buf->data[o++] = (uint8_t)qtype;
+    buf->data[o++] = 0x00;
+    buf->data[o++] = QCLASS_IN;
 
     // Return the full message size.
     return (size_t)(o + sizeof(dnsmsg_t));
@@ -209,218 +259,459 @@ static size_t dns_make_query(const char *host, dnsmsg_t *buf, int ip4,
    When doing queries on the internet you may also get back CNAME
    entries. In these responses you may have more than one answer
    section (e.g. a 5 and a 1). The CNAME answer will contain the real
-   name, and the A answer contains the address.
+   name, and the A answer contains the address. The answer can only be
+   cached for as long as the shortest TTL along that chain.
+
+   When the name doesn't exist, or has no records of the type asked
+   for, the server puts the SOA record of the zone in the authority
+   section. The smaller of its TTL and the MINIMUM field (the last four
+   bytes of its RDATA) is how long that can be cached.
  */
 
-// Scans through and skips a label in the data payload, starting
-// at the given offset. The new offset (after the label) will be
-// returned.
-static int dns_skip_label(dnsmsg_t *resp, int o) {
-    int cnt;
+static inline uint16_t dns_get16(const uint8_t *p) {
+    return (p[0] << 8) | p[1];
+}
+
+static inline uint32_t dns_get32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
 
-    // End of the label?
-    while(resp->data[o] != 0) {
+// Scans through and skips a label in the message, starting at the
+// given offset. The new offset (after the label) will be returned,
+// or -1 if the label runs off the end of the message.
+static int dns_skip_label(const uint8_t *msg, int size, int o) {
+    while(o < size) {
         // Is it a pointer?
-        if((resp->data[o] & 0xc0) == 0xc0)
-            return o + 2;
+        if((msg[o] & 0xc0) == 0xc0)
+            return o + 2 <= size ? o + 2 : -1;
+
+        // End of the label?
+        if(msg[o] == 0)
+            return o + 1;
 
         // Skip this part.
-        cnt = resp->data[o++];
-        o += cnt;
+        o += msg[o] + 1;
+    }
+
+    return -1;
+}
+
+// Parse a response packet from the DNS server, for a query of the
+// given type. The addresses (or the error to return instead) are
+// filled in, along with how long they can be cached.
+static void dns_parse_response(const uint8_t *msg, int size, uint16_t qtype,
+                               dns_rrset_t *rrs) {
+    const dnsmsg_t *resp = (const dnsmsg_t *)msg;
+    int i, o, alen = qtype == QTYPE_A ? 4 : 16;
+    uint16_t flags, cnt, type, class, len;
+    uint32_t ttl, neg_ttl = 0;
+
+    memset(rrs, 0, sizeof(dns_rrset_t));
+    rrs->ttl = DNS_MAX_TTL;
+
+    /* Check the flags first to see if it was successful. */
+    flags = ntohs(resp->flags);
+
+    if(!(flags & 0x8000))
+        goto bad;
+
+    /* Did the server report an error? Only a name error says anything about
+       the name itself, so that's the only one worth caching. */
+    switch(flags & 0x000f) {
+        case 0:   /* No error */
+        case 3:   /* Name error */
+            break;
+
+        case 2:   /* Server failure */
+            rrs->err = EAI_AGAIN;
+            rrs->ttl = 0;
+            return;
+
+        case 1:   /* Format error */
+        case 4:   /* Not implemented */
+        case 5:   /* Refused */
+        default:
+            goto bad;
+    }
+
+    /* If we have any query sections (should have at least one), skip 'em. */
+    o = sizeof(dnsmsg_t);
+    cnt = ntohs(resp->qdcount);
+
+    for(i = 0; i < cnt; i++) {
+        /* Skip the label, and the two type fields. */
+        if((o = dns_skip_label(msg, size, o)) < 0 || (o += 4) > size)
+            goto bad;
     }
 
-    // Skip the terminator
-    o++;
+    /* Ok, now the answer section (what we're interested in). */
+    cnt = ntohs(resp->ancount);
+
+    for(i = 0; i < cnt; i++) {
+        if((o = dns_skip_label(msg, size, o)) < 0 || o + 10 > size)
+            goto bad;
+
+        type = dns_get16(msg + o);
+        class = dns_get16(msg + o + 2);
+        ttl = dns_get32(msg + o + 4);
+        len = dns_get16(msg + o + 8);
+        o += 10;
 
-    return o;
+        if(o + len > size)
+            goto bad;
+
+        if(class == QCLASS_IN && type == qtype && len == alen) {
+            if(rrs->naddrs < DNS_MAX_ADDRS)
+                memcpy(rrs->addrs[rrs->naddrs++], msg + o, alen);
+
+            if(ttl < rrs->ttl)
+                rrs->ttl = ttl;
+        }
+        else if(class == QCLASS_IN && type == QTYPE_CNAME) {
+            if(ttl < rrs->ttl)
+                rrs->ttl = ttl;
+        }
+
+        o += len;
+    }
+
+    /* Did we find something? */
+    if(rrs->naddrs > 0)
+        return;
+
+    /* Nope. Look for the SOA record to know how long to remember that. Without
+       one, the answer can't be cached at all. */
+    cnt = ntohs(resp->nscount);
+
+    for(i = 0; i < cnt; i++) {
+        if((o = dns_skip_label(msg, size, o)) < 0 || o + 10 > size)
+            break;
+
+        type = dns_get16(msg + o);
+        ttl = dns_get32(msg + o + 4);
+        len = dns_get16(msg + o + 8);
+        o += 10;
+
+        if(o + len > size)
+            break;
+
+        if(type == QTYPE_SOA && len >= 4) {
+            neg_ttl = dns_get32(msg + o + len - 4);
+
+            if(ttl < neg_ttl)
+                neg_ttl = ttl;
+
+            break;
+        }
+
+        o += len;
+    }
+
+    rrs->err = EAI_NONAME;
+    rrs->ttl = neg_ttl < DNS_MAX_TTL ? neg_ttl : DNS_MAX_TTL;
+    return;
+
+bad:
+    memset(rrs, 0, sizeof(dns_rrset_t));
+    rrs->err = EAI_FAIL;
 }
 
-// Scans through and copies out a label in the data payload,
-// starting at the given offset. The new offset (after the label)
-// will be returned as well as the label string.
-static int dns_copy_label(dnsmsg_t *resp, int o, char *outbuf) {
-    int cnt;
-    int rv = -1;
+/* Ask the server about each of the queries at once, all on one socket, and fill
+   in their answers. */
+static void dns_query(const char *name, uint32_t server,
+                      dns_pending_t *qs[], int count) {
+    struct sockaddr_in toaddr;
+    uint8_t qb[DNS_MSG_MAX];
+    size_t size;
+    int sock, tries, i, err, left = count, answered[2] = { 0, 0 };
+    ssize_t rsize;
+    struct pollfd pfd;
+    uint64_t deadline, now;
+    uint16_t id;
 
-    // Do each part.
-    outbuf[0] = 0;
+    /* Make a socket to talk to the DNS server. */
+    if((sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0)
+        goto err;
 
-    for(;;) {
-        // Is it a pointer?
-        if((resp->data[o] & 0xc0) == 0xc0) {
-            int offs = ((resp->data[o] & ~0xc0) << 8) | resp->data[o + 1];
+    /* "Connect" the socket to the DNS server's address. */
+    memset(&toaddr, 0, sizeof(toaddr));
+    toaddr.sin_family = AF_INET;
+    toaddr.sin_port = htons(53);
+    toaddr.sin_addr.s_addr = htonl(server);
+
+    if(connect(sock, (struct sockaddr *)&toaddr, sizeof(toaddr)))
+        goto err_sock;
+
+    /* Set up the structure we'll use to feed to the poll function. */
+    pfd.fd = sock;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
 
-            if(rv < 0)
-                rv = o + 2;
+    for(tries = 0; tries < DNS_ATTEMPTS && left; ++tries) {
+        /* Send (or resend) everything that hasn't been answered yet. */
+        for(i = 0; i < count; ++i) {
+            if(answered[i])
+                continue;
 
-            o = offs - sizeof(dnsmsg_t);
+            size = dns_make_query(name, (dnsmsg_t *)qb, qs[i]->qtype,
+                                  qs[i]->id);
+
+            if(send(sock, qb, size, 0) < 0)
+                goto err_sock;
         }
-        else {
-            cnt = resp->data[o++];
 
-            if(cnt) {
-                if(outbuf[0] != 0)
-                    strcat(outbuf, ".");
+        /* Wait for the timeout to expire or for us to get the responses. */
+        deadline = timer_ms_gettime64() + DNS_TIMEOUT;
 
-                strncat(outbuf, (char *)(resp->data + o), cnt);
-                o += cnt;
-            }
-            else {
+        while(left && (now = timer_ms_gettime64()) < deadline) {
+            if(poll(&pfd, 1, (int)(deadline - now)) != 1)
                 break;
+
+            /* Get the response. */
+            if((rsize = recv(sock, qb, sizeof(qb), 0)) < 0)
+                goto err_sock;
+
+            if(rsize < (ssize_t)sizeof(dnsmsg_t))
+                continue;
+
+            /* Match it up with the query it answers. Anything else is a
+               leftover from an earlier query (or not from the server at all),
+               so it gets ignored. */
+            id = ntohs(((dnsmsg_t *)qb)->id);
+
+            for(i = 0; i < count; ++i) {
+                if(!answered[i] && qs[i]->id == id) {
+                    dns_parse_response(qb, (int)rsize, qs[i]->qtype,
+                                       &qs[i]->rrs);
+                    answered[i] = 1;
+                    --left;
+                    break;
+                }
             }
         }
     }
 
-    if(rv < 0)
-        return o;
-    else
-        return rv;
+    /* Close the socket */
+    close(sock);
+
+    /* If we never actually got a response, then there's probably a problem with
+       the server on the other end. I'm not entirely sure what to return in that
+       case, to be perfectly honest. I suppose that EAI_SYSTEM + ETIMEDOUT would
+       make the most sense, since that's really what happened... */
+    for(i = 0; i < count; ++i) {
+        if(!answered[i]) {
+            qs[i]->rrs.err = EAI_SYSTEM;
+            qs[i]->rrs.errnum = ETIMEDOUT;
+        }
+    }
+
+    return;
+
+err_sock:
+    err = errno;
+    close(sock);
+    errno = err;
+err:
+    for(i = 0; i < count; ++i) {
+        if(!answered[i]) {
+            qs[i]->rrs.err = EAI_SYSTEM;
+            qs[i]->rrs.errnum = errno;
+        }
+    }
 }
 
-/* Forward declaration... */
-static struct addrinfo *add_ipv4_ai(uint32_t ip, uint16_t port,
-                                    struct addrinfo *h, struct addrinfo *tail);
-static struct addrinfo *add_ipv6_ai(const struct in6_addr *ip, uint16_t port,
-                                    struct addrinfo *h, struct addrinfo *tail);
+static void dns_cache_flush(void) {
+    dns_entry_t *e;
 
-// Parse a response packet from the DNS server. The IP address
-// will be filled in upon a successful return, otherwise the
-// return value will be <0.
-static int dns_parse_response(dnsmsg_t *resp, struct addrinfo *hints,
-                              uint16_t port, struct addrinfo **res) {
-    int i, o, arecs;
-    uint16_t flags;
-    char tmp[64];
-    uint16_t ancnt, len;
-    struct addrinfo *ptr = NULL;
+    while((e = TAILQ_FIRST(&dns_cache))) {
+        TAILQ_REMOVE(&dns_cache, e, entry);
+        free(e);
+    }
 
-    /* Check the flags first to see if it was successful. */
-    flags = ntohs(resp->flags);
+    dns_cache_count = 0;
+}
+
+/* Find an answer in the cache that hasn't expired yet. Must be called with the
+   mutex held. */
+static dns_entry_t *dns_cache_find(const char *name, uint16_t qtype,
+                                   uint64_t now) {
+    dns_entry_t *e;
+
+    TAILQ_FOREACH(e, &dns_cache, entry) {
+        if(e->qtype != qtype || strcasecmp(e->name, name))
+            continue;
+
+        if(e->expires <= now) {
+            TAILQ_REMOVE(&dns_cache, e, entry);
+            free(e);
+            --dns_cache_count;
+            return NULL;
+        }
 
-    if(!(flags & 0x8000)) {
-        /* Not our response! */
-        return EAI_AGAIN;
+        /* Move it to the front, since it's just been used. */
+        TAILQ_REMOVE(&dns_cache, e, entry);
+        TAILQ_INSERT_HEAD(&dns_cache, e, entry);
+        return e;
     }
 
-    /* Did the server report an error? */
-    switch(flags & 0x000f) {
-        case 0:   /* No error */
-            break;
+    return NULL;
+}
 
-        case 1:   /* Format error */
-        case 4:   /* Not implemented */
-        case 5:   /* Refused */
-        default:
-            return EAI_FAIL;
+/* Put the answer to a query into the cache, throwing out the least recently
+   used entry if it is full. Must be called with the mutex held. */
+static void dns_cache_add(const dns_pending_t *q, uint64_t now) {
+    dns_entry_t *e;
 
-        case 3:   /* Name error */
-            return EAI_NONAME;
+    if(!q->rrs.ttl)
+        return;
 
-        case 2:   /* Server failure */
-            return EAI_AGAIN;
+    if(dns_cache_count >= DNS_CACHE_SIZE) {
+        e = TAILQ_LAST(&dns_cache, dns_entry_list);
+        TAILQ_REMOVE(&dns_cache, e, entry);
+    }
+    else if((e = (dns_entry_t *)malloc(sizeof(dns_entry_t)))) {
+        ++dns_cache_count;
+    }
+    else {
+        return;
     }
 
-    /* Getting zero answers is also a failure. */
-    ancnt = ntohs(resp->ancount);
-
-    if(ancnt < 1)
-        return EAI_NONAME;
+    strcpy(e->name, q->name);
+    e->qtype = q->qtype;
+    e->expires = now + q->rrs.ttl * 1000ULL;
+    e->rrs = q->rrs;
+    TAILQ_INSERT_HEAD(&dns_cache, e, entry);
+}
 
-    /* If we have any query sections (should have at least one), skip 'em. */
-    o = 0;
-    len = ntohs(resp->qdcount);
+/* Look up the records of each type for the name: from the cache if they're in
+   it, by waiting on someone else's query if one is already out for them, or by
+   asking the server otherwise. */
+static void dns_lookup(const char *name, uint32_t server,
+                       const uint16_t qtypes[], dns_rrset_t out[], int count) {
+    dns_pending_t *own[2], *wait[2], *q;
+    dns_entry_t *e;
+    int i, nown = 0;
 
-    for(i = 0; i < len; i++) {
-        /* Skip the label. */
-        o = dns_skip_label(resp, o);
+    mutex_lock(&dns_mutex);
 
-        /* And the two type fields. */
-        o += 4;
+    if(server != dns_cache_server) {
+        dns_cache_flush();
+        dns_cache_server = server;
     }
 
-    /* Ok, now the answer section (what we're interested in). */
-    arecs = 0;
+    for(i = 0; i < count; ++i) {
+        wait[i] = NULL;
+
+        if((e = dns_cache_find(name, qtypes[i], timer_ms_gettime64()))) {
+            out[i] = e->rrs;
+            continue;
+        }
 
-    for(i = 0; i < ancnt; i++) {
-        /* Copy out the label, in case we need it. */
-        o = dns_copy_label(resp, o, tmp);
+        /* Is somebody already asking about this one? */
+        TAILQ_FOREACH(q, &dns_pending, entry) {
+            if(q->qtype == qtypes[i] && !strcasecmp(q->name, name))
+                break;
+        }
 
-        /* Get the type code. If it's not A or AAAA, skip it. */
-        if(resp->data[o] == 0 && resp->data[o + 1] == 1 &&
-           (hints->ai_family == AF_INET || hints->ai_family == AF_UNSPEC)) {
-            uint32_t addr;
+        if(!q) {
+            if(!(q = (dns_pending_t *)calloc(1, sizeof(dns_pending_t)))) {
+                memset(&out[i], 0, sizeof(dns_rrset_t));
+                out[i].err = EAI_MEMORY;
+                continue;
+            }
 
-            o += 8;
-            len = (resp->data[o] << 8) | resp->data[o + 1];
-            o += 2;
+            strcpy(q->name, name);
+            q->qtype = qtypes[i];
+            q->id = qnum++;
+            TAILQ_INSERT_TAIL(&dns_pending, q, entry);
+            own[nown++] = q;
+        }
 
-            /* Grab the address from the response. */
-            addr = htonl((resp->data[o] << 24) | (resp->data[o + 1] << 16) |
-                         (resp->data[o + 2] << 8) | resp->data[o + 3]);
+        ++q->refs;
+        wait[i] = q;
+    }
 
-            /* Add this address to the chain. */
-            if(!(ptr = add_ipv4_ai(addr, port, hints, ptr)))
-                /* If something goes wrong in here, it's in calling malloc, so
-                   it is definitely a system error. */
-                return EAI_SYSTEM;
+    mutex_unlock(&dns_mutex);
 
-            if(!*res)
-                *res = ptr;
+    if(nown)
+        dns_query(name, server, own, nown);
 
-            o += len;
-            arecs++;
+    mutex_lock(&dns_mutex);
+
+    if(nown) {
+        for(i = 0; i < nown; ++i) {
+            own[i]->done = 1;
+            TAILQ_REMOVE(&dns_pending, own[i], entry);
+
+            /* Only cache it if the server didn't change while we were out. */
+            if(server == dns_cache_server)
+                dns_cache_add(own[i], timer_ms_gettime64());
         }
-        else if(resp->data[o] == 0 && resp->data[o + 1] == 28 &&
-                (hints->ai_family == AF_INET6 || hints->ai_family == AF_UNSPEC)) {
-            struct in6_addr addr;
 
-            o += 8;
-            len = (resp->data[o] << 8) | resp->data[o + 1];
-            o += 2;
+        cond_broadcast(&dns_cond);
+    }
 
-            /* Grab the address from the response. */
-            memcpy(addr.s6_addr, &resp->data[o], 16);
+    for(i = 0; i < count; ++i) {
+        if(!(q = wait[i]))
+            continue;
 
-            /* Add this address to the chain. */
-            if(!(ptr = add_ipv6_ai(&addr, port, hints, ptr)))
-                /* If something goes wrong in here, it's in calling malloc, so
-                   it is definitely a system error. */
-                return EAI_SYSTEM;
+        while(!q->done)
+            cond_wait(&dns_cond, &dns_mutex);
 
-            if(!*res)
-                *res = ptr;
+        out[i] = q->rrs;
 
-            o += len;
-            arecs++;
-        }
-        else if(resp->data[o] == 0 && resp->data[o + 1] == 5) {
-            char tmp2[64];
+        if(!--q->refs)
+            free(q);
+    }
+
+    mutex_unlock(&dns_mutex);
+}
 
-            o += 8;
-            len = (resp->data[o] << 8) | resp->data[o + 1];
-            o += 2;
-            o = dns_copy_label(resp, o, tmp2);
+/* Forward declaration... */
+static struct addrinfo *add_ipv4_ai(uint32_t ip, uint16_t port,
+                                    struct addrinfo *h, struct addrinfo *tail);
+static struct addrinfo *add_ipv6_ai(const struct in6_addr *ip, uint16_t port,
+                                    struct addrinfo *h, struct addrinfo *tail);
+
+/* Add the addresses from a set of records onto the end of the chain. */
+static int dns_add_ais(const dns_rrset_t *rrs, uint16_t qtype,
+                       struct addrinfo *hints, uint16_t port,
+                       struct addrinfo **res, struct addrinfo **tail) {
+    struct addrinfo *ptr = *tail;
+    struct in6_addr addr6;
+    uint32_t addr;
+    int i;
+
+    for(i = 0; i < rrs->naddrs; ++i) {
+        if(qtype == QTYPE_A) {
+            memcpy(&addr, rrs->addrs[i], 4);
+            ptr = add_ipv4_ai(addr, port, hints, ptr);
         }
         else {
-            o += 8;
-            len = (resp->data[o] << 8) | resp->data[o + 1];
-            o += 2 + len;
+            memcpy(addr6.s6_addr, rrs->addrs[i], 16);
+            ptr = add_ipv6_ai(&addr6, port, hints, ptr);
         }
+
+        /* If something goes wrong in here, it's in calling malloc, so it is
+           definitely a system error. */
+        if(!ptr)
+            return EAI_SYSTEM;
+
+        if(!*res)
+            *res = ptr;
     }
 
-    /* Did we find something? */
-    return arecs > 0 ? 0 : EAI_NONAME;
+    *tail = ptr;
+    return 0;
 }
 
 static int getaddrinfo_dns(const char *name, struct addrinfo *hints,
                            uint16_t port, struct addrinfo **res) {
-    struct sockaddr_in toaddr;
-    uint8_t qb[512];
-    size_t size;
-    int sock, rv, tries;
-    in_addr_t raddr;
-    ssize_t rsize = 0;
-    struct pollfd pfd;
+    uint16_t qtypes[2];
+    dns_rrset_t rrs[2];
+    struct addrinfo *tail = NULL;
+    uint32_t server;
+    int i, count, rv = EAI_NONAME, found = 0;
 
     /* Make sure we have a network device to communicate on. */
     if(!net_default_dev) {
@@ -434,86 +725,58 @@ static int getaddrinfo_dns(const char *name, struct addrinfo *hints,
         return EAI_FAIL;
     }
 
-    /* Setup a query */
-    if(hints->ai_family == AF_UNSPEC)
-        /* Note: This should (in theory) work, but it seems that some resolvers
-           cannot handle multiple questions in one query. So... while the code
-           here supports multiple questions in one query, this branch will never
-           actually be taken -- getaddrinfo() will always make two separate
-           calls if we need to do both IPv4 and IPv6. */
-        size = dns_make_query(name, (dnsmsg_t *)qb, 1, 1);
-    else if(hints->ai_family == AF_INET)
-        size = dns_make_query(name, (dnsmsg_t *)qb, 1, 0);
-    else if(hints->ai_family == AF_INET6)
-        size = dns_make_query(name, (dnsmsg_t *)qb, 0, 1);
+    server = (net_default_dev->dns[0] << 24) | (net_default_dev->dns[1] << 16) |
+             (net_default_dev->dns[2] << 8) | net_default_dev->dns[3];
+
+    /* Anything longer than this can't be put in a query. */
+    if(strlen(name) > DNS_NAME_MAX)
+        return EAI_NONAME;
+
+    /* Figure out what we're asking for. */
+    if(hints->ai_family == AF_UNSPEC) {
+        qtypes[0] = QTYPE_A;
+        qtypes[1] = QTYPE_AAAA;
+        count = 2;
+    }
+    else if(hints->ai_family == AF_INET) {
+        qtypes[0] = QTYPE_A;
+        count = 1;
+    }
+    else if(hints->ai_family == AF_INET6) {
+        qtypes[0] = QTYPE_AAAA;
+        count = 1;
+    }
     else {
         errno = EAFNOSUPPORT;
         return EAI_SYSTEM;
     }
 
-    /* Make a socket to talk to the DNS server. */
-    if((sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0)
-        return EAI_SYSTEM;
+    dns_lookup(name, server, qtypes, rrs, count);
 
-    /* "Connect" the socket to the DNS server's address. */
-    raddr = (net_default_dev->dns[0] << 24) | (net_default_dev->dns[1] << 16) |
-            (net_default_dev->dns[2] << 8) | net_default_dev->dns[3];
+    /* A failure on the first lookup is reported as-is, unless it just means
+       there weren't any addresses of that type. If the second lookup fails,
+       whatever the first found is still good. */
+    if(rrs[0].err && rrs[0].err != EAI_NONAME) {
+        if(rrs[0].err == EAI_SYSTEM)
+            errno = rrs[0].errnum;
 
-    memset(&toaddr, 0, sizeof(toaddr));
-    toaddr.sin_family = AF_INET;
-    toaddr.sin_port = htons(53);
-    toaddr.sin_addr.s_addr = htonl(raddr);
-
-    if(connect(sock, (struct sockaddr *)&toaddr, sizeof(toaddr))) {
-        close(sock);
-        return EAI_SYSTEM;
+        return rrs[0].err;
     }
 
-    /* Set up the structure we'll use to feed to the poll function. */
-    pfd.fd = sock;
-    pfd.events = POLLIN;
-    pfd.revents = 0;
+    for(i = 0; i < count; ++i) {
+        if(rrs[i].err)
+            continue;
 
-    for(tries = 0; tries < DNS_ATTEMPTS; ++tries) {
-        /* Send the query to the server. */
-        if(send(sock, qb, size, 0) < 0) {
-            return EAI_SYSTEM;
+        if((rv = dns_add_ais(&rrs[i], qtypes[i], hints, port, res, &tail))) {
+            freeaddrinfo(*res);
+            *res = NULL;
+            return rv;
         }
 
-        /* Wait for the timeout to expire or for us to get the response. */
-        if(poll(&pfd, 1, DNS_TIMEOUT) == 1) {
-            /* Get the response. */
-            if((rsize = recv(sock, qb, 512, 0)) < 0) {
-                return EAI_SYSTEM;
-            }
-
-            break;
-        }
+        found = 1;
     }
 
-    /* Close the socket */
-    close(sock);
-
-    /* If we never actually got a response, then there's probably a problem with
-       the server on the other end. I'm not entirely sure what to return in that
-       case, to be perfectly honest. I suppose that EAI_SYSTEM + ETIMEDOUT would
-       make the most sense, since that's really what happened... */
-    if(!rsize) {
-        errno = ETIMEDOUT;
-        return EAI_SYSTEM;
-    }
-
-    /* Parse the response. */
-    rv = dns_parse_response((dnsmsg_t *)qb, hints, port, res);
-
-    /* If we got something in the result, but got an error value in the return,
-       free whatever we got. */
-    if(rv != 0 && *res) {
-        freeaddrinfo(*res);
-        *res = NULL;
-    }
-
-    return rv;
+    return found ? 0 : EAI_NONAME;
 }
 
 /* New stuff below here... */
@@ -729,46 +992,6 @@ int getaddrinfo(const char *nodename, const char *servname,
         }
     }
 
-    /* If we've gotten this far, do the lookup. */
-    if(ihints.ai_family == AF_UNSPEC) {
-        /* It seems that some resolvers really don't like multi-part questions.
-           So, make sure we only ever send one part at a time... */
-        struct addrinfo *res1 = NULL, *res2 = NULL;
-        int rv;
-
-        ihints.ai_family = AF_INET;
-        rv = getaddrinfo_dns(nodename, &ihints, port, &res1);
-
-        if(rv && rv != EAI_NONAME)
-            return rv;
-
-        ihints.ai_family = AF_INET6;
-        getaddrinfo_dns(nodename, &ihints, port, &res2);
-
-        /* Figure out what to do with the result(s). */
-        if(res1 && res2) {
-            *res = res1;
-
-            /* Go to the end of the chain. */
-            while(res1->ai_next) {
-                res1 = res1->ai_next;
-            }
-
-            res1->ai_next = res2;
-            return 0;
-        }
-        else if(res1) {
-            *res = res1;
-            return 0;
-        }
-        else if(res2) {
-            *res = res2;
-            return 0;
-        }
-        else {
-            return EAI_NONAME;
-        }
-    }
-
+    /* If we've gotten this far, ask the DNS. */
     return getaddrinfo_dns(nodename, &ihints, port, res);
 }
@@ -7,131 +7,612 @@
 
 #include <poll.h>
 #include <errno.h>
+#include <stdlib.h>
 #include <sys/queue.h>
+#include <sys/epoll.h>
 
 #include <arch/irq.h>
+#include <arch/timer.h>
 #include <kos/fs.h>
 #include <kos/mutex.h>
 #include <kos/cond.h>
 
-struct poll_int {
-    LIST_ENTRY(poll_int) entry;
-    struct pollfd *fds;
-    nfds_t nfds;
-    int nmatched;
+/* Both poll() and epoll are built on the same thing here: a set of items, one
+   for each file descriptor being watched, that each belong to an instance.
+   Each file descriptor has a list of the items watching it, so when something
+   happens on a socket, only the items for that one socket have to be looked at.
+   Those get put on their instance's ready list, and whoever is waiting on the
+   instance gets woken up. When that happens, only the items on the ready list
+   get checked with the file descriptor's poll method.
+
+   The difference between the two is that an epoll instance (and its items)
+   stick around between calls, whereas poll() builds a new instance each time
+   it is called, and throws it away when it is done.
+
+   When a file descriptor is closed, its items are taken off of its list (so
+   that they can't fire for whatever gets that number next) and get an fd of -1,
+   which poll_check() reports as POLLNVAL. An epoll item is dropped from its
+   set once that has been reported. */
+
+struct poll_item;
+
+LIST_HEAD(poll_item_list, poll_item);
+TAILQ_HEAD(poll_item_queue, poll_item);
+
+struct poll_inst {
+    struct poll_item_list items;        /* Everything in the set */
+    struct poll_item_queue ready;       /* Things that might be ready */
     condvar_t cv;
+    int fd;                             /* -1 for poll()'s instances */
+    int waiters;                        /* Threads blocked in poll_wait() */
+    int closed;                         /* Set once close() has started */
+};
+
+struct poll_item {
+    LIST_ENTRY(poll_item) fd_entry;     /* On the fd's list */
+    LIST_ENTRY(poll_item) inst_entry;   /* On the instance's list */
+    TAILQ_ENTRY(poll_item) ready_entry; /* On the instance's ready list */
+    struct poll_inst *inst;
+    int fd;
+    int ready;
+    int disabled;
+    uint32_t events;
+    uint32_t revents;
+    epoll_data_t data;
 };
 
-LIST_HEAD(polllist, poll_int) poll_list;
+/* How deep to go with epoll instances that watch other epoll instances. */
+#define POLL_MAX_NEST       4
 
-static mutex_t mutex = MUTEX_INITIALIZER;
+/* The events that a file descriptor's poll method knows about. */
+#define POLL_EVENT_MASK     0xFFFF
+
+static struct poll_item_list fd_items[FD_SETSIZE];
+
+/* How deep epoll_poll() currently is. Only touched with the mutex held. */
+static int epoll_depth;
+
+/* This is recursive, since the poll method of an epoll instance can end up
+   being called with it already held. */
+static mutex_t mutex = RECURSIVE_MUTEX_INITIALIZER;
+
+static void poll_trigger(int fd, uint32_t event, int depth);
+
+static void poll_make_ready(struct poll_item *i, int depth) {
+    struct poll_inst *inst = i->inst;
+    int wasempty;
+
+    if(i->ready || i->disabled)
+        return;
+
+    wasempty = TAILQ_EMPTY(&inst->ready);
+    TAILQ_INSERT_TAIL(&inst->ready, i, ready_entry);
+    i->ready = 1;
+
+    cond_broadcast(&inst->cv);
+
+    /* If something is watching this instance, let it know too. */
+    if(wasempty && inst->fd >= 0 && depth < POLL_MAX_NEST)
+        poll_trigger(inst->fd, POLLRDNORM, depth + 1);
+}
+
+static void poll_trigger(int fd, uint32_t event, int depth) {
+    struct poll_item *i;
+
+    LIST_FOREACH(i, &fd_items[fd], fd_entry) {
+        if(event & (i->events | POLLERR | POLLHUP))
+            poll_make_ready(i, depth);
+    }
+}
 
 void __poll_event_trigger(int fd, short event) {
-    struct poll_int *i;
-    nfds_t j;
-    int gotone = 0;
-    short mask;
+    if(fd < 0 || fd >= FD_SETSIZE)
+        return;
 
     if(mutex_lock_irqsafe(&mutex))
         /* XXXX: Uhh... this is bad... */
         return;
 
-    /* Look through the list of poll fds for any that match */
-    LIST_FOREACH(i, &poll_list, entry) {
-        for(j = 0; j < i->nfds; ++j) {
-            if(i->fds[j].fd == fd) {
-                mask = i->fds[j].events | POLLERR | POLLHUP | POLLNVAL;
-                if(event & mask) {
-                    i->fds[j].revents |= event & mask;
-                    ++i->nmatched;
-                    gotone = 1;
-                }
-            }
-        }
+    poll_trigger(fd, (uint16_t)event, 0);
+    mutex_unlock(&mutex);
+}
+
+static void poll_item_remove(struct poll_item *i);
+
+/* Called by fs_close() once fd no longer refers to anything. */
+void __poll_fd_closed(int fd) {
+    struct poll_item *i;
+
+    if(fd < 0 || fd >= FD_SETSIZE)
+        return;
 
-        /* If we got any events, signal the waiting thread to wake it up. */
-        if(gotone) {
-            cond_signal(&i->cv);
-            gotone = 0;
+    if(mutex_lock_irqsafe(&mutex))
+        return;
+
+    while((i = LIST_FIRST(&fd_items[fd]))) {
+        LIST_REMOVE(i, fd_entry);
+        i->fd = -1;
+
+        /* A disabled epoll item would never get reported, so there's no reason
+           to keep it around. */
+        if(i->disabled && i->inst->fd >= 0) {
+            poll_item_remove(i);
+            free(i);
+            continue;
         }
+
+        poll_make_ready(i, 0);
     }
 
     mutex_unlock(&mutex);
 }
 
-int poll(struct pollfd fds[], nfds_t nfds, int timeout) {
-    struct poll_int p = { { 0 }, fds, nfds, 0, COND_INITIALIZER };
-    int tmp;
-    nfds_t i;
+/* Ask a file descriptor what's going on with it. This is inlined, since
+   poll() calls it for every descriptor it's given. */
+static inline uint32_t poll_check(int fd, uint32_t events) {
     vfs_handler_t *hndl;
     void *hnd;
+    short rv;
 
-    if(mutex_lock_irqsafe(&mutex))
-        return -1;
+    events &= POLL_EVENT_MASK;
 
-    /* Check if any of the fds already match */
-    for(i = 0; i < nfds; ++i) {
-        hndl = fs_get_handler(fds[i].fd);
-        hnd = fs_get_handle(fds[i].fd);
-        fds[i].revents = 0;
-
-        /* If we didn't get one of these, then assume its a bad fd. */
-        if(!hndl || !hnd) {
-            fds[i].revents = POLLNVAL;
-            ++p.nmatched;
+    /* If we didn't get one of these, then assume its a bad fd. */
+    if(fd < 0 || fd >= FD_SETSIZE || !(hndl = fs_get_handler(fd)) ||
+       !(hnd = fs_get_handle(fd)))
+        return POLLNVAL;
+
+    /* Assume its a regular file if there's no poll method in the handler. */
+    if(!hndl->poll)
+        return events & (POLLRDNORM | POLLWRNORM);
+
+    rv = hndl->poll(hnd, (short)events);
+
+    return (uint16_t)rv & (events | POLLERR | POLLHUP | POLLNVAL);
+}
+
+static void poll_item_add(struct poll_inst *inst, struct poll_item *i, int fd,
+                          uint32_t events) {
+    i->inst = inst;
+    i->fd = fd;
+    i->ready = 0;
+    i->disabled = 0;
+    i->events = events;
+    i->revents = 0;
+
+    if(fd >= 0 && fd < FD_SETSIZE)
+        LIST_INSERT_HEAD(&fd_items[fd], i, fd_entry);
+
+    LIST_INSERT_HEAD(&inst->items, i, inst_entry);
+}
+
+static void poll_item_remove(struct poll_item *i) {
+    if(i->fd >= 0 && i->fd < FD_SETSIZE)
+        LIST_REMOVE(i, fd_entry);
+
+    LIST_REMOVE(i, inst_entry);
+
+    if(i->ready)
+        TAILQ_REMOVE(&i->inst->ready, i, ready_entry);
+}
+
+/* Check the things on the ready list, and report up to max of the ones that
+   really are ready. Level-triggered items that were reported go back on the end
+   of the list, so that they get checked again next time; anything else has to
+   wait for a new event to get back on it. */
+static int poll_harvest(struct poll_inst *inst, struct epoll_event *events,
+                        int max) {
+    struct poll_item_queue pending;
+    struct poll_item *i;
+    int n = 0;
+
+    TAILQ_INIT(&pending);
+    TAILQ_CONCAT(&pending, &inst->ready, ready_entry);
+
+    while(n < max && (i = TAILQ_FIRST(&pending))) {
+        TAILQ_REMOVE(&pending, i, ready_entry);
+        i->ready = 0;
+
+        /* Checking it might have put it right back on the ready list, so it
+           has to be off of both lists before then. */
+        if(!(i->revents = poll_check(i->fd, i->events)))
             continue;
+
+        if(events) {
+            events[n].events = i->revents;
+            events[n].data = i->data;
         }
 
-        if(!hndl->poll) {
-            /* Assume its a regular file if there's no poll method in the
-               handler. */
-            if(fds[i].events & (POLLRDNORM | POLLWRNORM)) {
-                fds[i].revents |= (POLLRDNORM | POLLWRNORM) & fds[i].events;
-                ++p.nmatched;
-            }
+        ++n;
+
+        /* The file descriptor was closed, and now the program knows. */
+        if(i->fd < 0 && inst->fd >= 0) {
+            poll_item_remove(i);
+            free(i);
+        }
+        else if(i->events & EPOLLONESHOT)
+            i->disabled = 1;
+        else if(!(i->events & EPOLLET) && !(i->revents & POLLNVAL) &&
+                !i->ready) {
+            TAILQ_INSERT_TAIL(&inst->ready, i, ready_entry);
+            i->ready = 1;
+        }
+    }
+
+    /* Anything we didn't get to goes back on the front. */
+    TAILQ_CONCAT(&pending, &inst->ready, ready_entry);
+    TAILQ_CONCAT(&inst->ready, &pending, ready_entry);
+
+    return n;
+}
+
+/* Wait for something on the instance to be ready. The mutex must be held. */
+static int poll_wait(struct poll_inst *inst, struct epoll_event *events,
+                     int max, int timeout) {
+    uint64_t deadline = 0, now;
+    int n, tmp;
+
+    if(timeout > 0)
+        deadline = timer_ms_gettime64() + timeout;
+
+    for(;;) {
+        if((n = poll_harvest(inst, events, max)) || !timeout)
+            return n;
+
+        /* Map to the value used by cond_wait_timed() */
+        if(timeout < 0) {
+            tmp = 0;
+        }
+        else if((now = timer_ms_gettime64()) >= deadline) {
+            return 0;
         }
         else {
-            if((fds[i].revents = hndl->poll(hnd, fds[i].events))) {
-                ++p.nmatched;
-            }
+            tmp = (int)(deadline - now);
         }
+
+        /* We can't actually wait while we're in an interrupt, so if we got
+           this far it is an error. */
+        if(irq_inside_int()) {
+            errno = EPERM;
+            return -1;
+        }
+
+        n = errno;
+        ++inst->waiters;
+
+        if(cond_wait_timed(&inst->cv, &mutex, tmp))
+            errno = n;
+
+        --inst->waiters;
+
+        /* The instance is being closed, and epoll_close() is waiting for us
+           to be done with it. */
+        if(inst->closed) {
+            cond_broadcast(&inst->cv);
+            errno = EBADF;
+            return -1;
+        }
+    }
+}
+
+int poll(struct pollfd fds[], nfds_t nfds, int timeout) {
+    struct poll_inst p;
+    struct poll_item *items;
+    nfds_t i;
+    int rv = 0;
+
+    if(mutex_lock_irqsafe(&mutex))
+        return -1;
+
+    /* Check if any of the fds already match */
+    for(i = 0; i < nfds; ++i) {
+        if((fds[i].revents = (short)poll_check(fds[i].fd, fds[i].events)))
+            ++rv;
     }
 
     /* If the user specified a 0 timeout, or we've already matched something,
        bail out now. */
-    if(p.nmatched || !timeout) {
+    if(rv || !timeout) {
         mutex_unlock(&mutex);
-        return p.nmatched;
+        return rv;
     }
 
-    /* We can't actually wait while we're in an interrupt, so if we got this far
-       it is an error. */
-    if(irq_inside_int()) {
+    /* Otherwise, watch all of them until something happens. Nothing about
+       the instance is set up until now, so that the common case of something
+       already being ready costs no more than checking the descriptors. */
+    if(!(items = (struct poll_item *)malloc(sizeof(struct poll_item) * nfds))) {
         mutex_unlock(&mutex);
-        errno = EPERM;
+        errno = ENOMEM;
         return -1;
     }
 
-    /* Map to the value used by cond_wait_timed() */
-    if(timeout == -1)
-        timeout = 0;
+    LIST_INIT(&p.items);
+    TAILQ_INIT(&p.ready);
+    cond_init(&p.cv);
+    p.fd = -1;
+    p.waiters = 0;
+    p.closed = 0;
 
-    /* Add this instance to the list */
-    LIST_INSERT_HEAD(&poll_list, &p, entry);
+    for(i = 0; i < nfds; ++i)
+        poll_item_add(&p, &items[i], fds[i].fd, (uint16_t)fds[i].events);
 
-    tmp = errno;
-    if(cond_wait_timed(&p.cv, &mutex, timeout)) {
-        errno = tmp;
-        tmp = 0;
-        goto out;
+    rv = poll_wait(&p, NULL, (int)nfds, timeout);
+
+    for(i = 0; i < nfds; ++i) {
+        if(rv > 0)
+            fds[i].revents = (short)items[i].revents;
+
+        poll_item_remove(&items[i]);
     }
 
-    tmp = p.nmatched;
+    mutex_unlock(&mutex);
+    cond_destroy(&p.cv);
+    free(items);
+
+    return rv;
+}
 
-out:
-    /* Remove this instance from the list */
-    LIST_REMOVE(&p, entry);
+static int epoll_close(void *hnd) {
+    struct poll_inst *inst = (struct poll_inst *)hnd;
+    struct poll_item *i;
 
+    if(mutex_lock_irqsafe(&mutex))
+        return -1;
+
+    while((i = LIST_FIRST(&inst->items))) {
+        poll_item_remove(i);
+        free(i);
+    }
+
+    /* Kick out anyone still waiting on it, and don't free it until they've
+       all noticed. */
+    inst->closed = 1;
+    cond_broadcast(&inst->cv);
+
+    while(inst->waiters)
+        cond_wait(&inst->cv, &mutex);
+
+    cond_destroy(&inst->cv);
+    free(inst);
     mutex_unlock(&mutex);
-    return tmp;
+
+    return 0;
+}
+
+/* The instance is readable if something on its ready list really is ready.
+   This doesn't take anything off of the list; that's epoll_wait()'s job. */
+static short epoll_poll(void *hnd, short events) {
+    struct poll_inst *inst = (struct poll_inst *)hnd;
+    struct poll_item *i;
+    short rv = 0;
+
+    if(mutex_lock_irqsafe(&mutex))
+        return 0;
+
+    /* Instances can watch each other, so don't go around in circles. */
+    if(epoll_depth < POLL_MAX_NEST) {
+        ++epoll_depth;
+
+        TAILQ_FOREACH(i, &inst->ready, ready_entry) {
+            if(!i->disabled && poll_check(i->fd, i->events)) {
+                rv = events & POLLRDNORM;
+                break;
+            }
+        }
+
+        --epoll_depth;
+    }
+
+    mutex_unlock(&mutex);
+
+    return rv;
+}
+
+/* VFS handler for epoll instances. These are only ever opened with
+   fs_open_handle(), so this never gets registered anywhere. */
+static vfs_handler_t epoll_vh = {
+    /* Name handler */
+    {
+        "/epoll",       /* Name */
+        0,              /* tbfi */
+        0x00010000,     /* Version 1.0 */
+        0,              /* Flags */
+        NMMGR_TYPE_VFS,
+        NMMGR_LIST_INIT,
+    },
+
+    0, NULL,        /* No cache, privdata */
+
+    NULL,           /* open */
+    epoll_close,    /* close */
+    NULL,           /* read */
+    NULL,           /* write */
+    NULL,           /* seek */
+    NULL,           /* tell */
+    NULL,           /* total */
+    NULL,           /* readdir */
+    NULL,           /* ioctl */
+    NULL,           /* rename */
+    NULL,           /* unlink */
+    NULL,           /* mmap */
+    NULL,           /* complete */
+    NULL,           /* stat */
+    NULL,           /* mkdir */
+    NULL,           /* rmdir */
+    NULL,           /* fcntl */
+    epoll_poll,     /* poll */
+    NULL,           /* link */
+    NULL,           /* symlink */
+    NULL,           /* seek64 */
+    NULL,           /* tell64 */
+    NULL,           /* total64 */
+    NULL,           /* readlink */
+    NULL,           /* rewinddir */
+    NULL            /* fstat */
+};
+
+static struct poll_inst *epoll_get(int epfd) {
+    if(epfd < 0 || epfd >= FD_SETSIZE || !fs_get_handler(epfd)) {
+        errno = EBADF;
+        return NULL;
+    }
+
+    if(fs_get_handler(epfd) != &epoll_vh) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    return (struct poll_inst *)fs_get_handle(epfd);
+}
+
+int epoll_create1(int flags) {
+    struct poll_inst *inst;
+
+    if(flags & ~EPOLL_CLOEXEC) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(!(inst = (struct poll_inst *)malloc(sizeof(struct poll_inst)))) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    LIST_INIT(&inst->items);
+    TAILQ_INIT(&inst->ready);
+    cond_init(&inst->cv);
+    inst->waiters = 0;
+    inst->closed = 0;
+
+    if((inst->fd = fs_open_handle(&epoll_vh, inst)) < 0) {
+        cond_destroy(&inst->cv);
+        free(inst);
+        return -1;
+    }
+
+    return inst->fd;
+}
+
+int epoll_create(int size) {
+    if(size <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return epoll_create1(0);
+}
+
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event) {
+    struct poll_inst *inst;
+    struct poll_item *i;
+
+    if(mutex_lock_irqsafe(&mutex))
+        return -1;
+
+    if(!(inst = epoll_get(epfd)))
+        goto err;
+
+    if(fd < 0 || fd >= FD_SETSIZE || !fs_get_handler(fd) || inst->closed) {
+        errno = EBADF;
+        goto err;
+    }
+
+    if(fd == epfd) {
+        errno = EINVAL;
+        goto err;
+    }
+
+    if(op != EPOLL_CTL_DEL && !event) {
+        errno = EFAULT;
+        goto err;
+    }
+
+    LIST_FOREACH(i, &fd_items[fd], fd_entry) {
+        if(i->inst == inst)
+            break;
+    }
+
+    switch(op) {
+        case EPOLL_CTL_ADD:
+            if(i) {
+                errno = EEXIST;
+                goto err;
+            }
+
+            if(!(i = (struct poll_item *)malloc(sizeof(struct poll_item)))) {
+                errno = ENOMEM;
+                goto err;
+            }
+
+            i->data = event->data;
+            poll_item_add(inst, i, fd, event->events);
+
+            /* Check it right away, in case it's already ready. */
+            poll_make_ready(i, 0);
+            break;
+
+        case EPOLL_CTL_MOD:
+            if(!i) {
+                errno = ENOENT;
+                goto err;
+            }
+
+            i->events = event->events;
+            i->data = event->data;
+            i->disabled = 0;
+            poll_make_ready(i, 0);
+            break;
+
+        case EPOLL_CTL_DEL:
+            if(!i) {
+                errno = ENOENT;
+                goto err;
+            }
+
+            poll_item_remove(i);
+            free(i);
+            break;
+
+        default:
+            errno = EINVAL;
+            goto err;
+    }
+
+    mutex_unlock(&mutex);
+    return 0;
+
+err:
+    mutex_unlock(&mutex);
+    return -1;
+}
+
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents,
+               int timeout) {
+    struct poll_inst *inst;
+    int rv = -1;
+
+    if(maxevents <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(!events) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    if(mutex_lock_irqsafe(&mutex))
+        return -1;
+
+    /* Look it up with the mutex held, so it can't be closed out from under
+       us before we're counted as waiting on it. */
+    if((inst = epoll_get(epfd))) {
+        if(inst->closed)
+            errno = EBADF;
+        else
+            rv = poll_wait(inst, events, maxevents, timeout);
+    }
+
+    mutex_unlock(&mutex);
+
+    return rv;
 }
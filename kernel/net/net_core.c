@@ -19,6 +19,7 @@
 #include "net_thd.h"
 #include "net_ipv4.h"
 #include "net_ipv6.h"
+#include "net_frag.h"
 
 /*
 
@@ -166,8 +167,8 @@ int net_init(uint32_t ip) {
     /* Initialize the NDP cache */
     net_ndp_init();
 
-    /* Initialize IPv4 fragmentation support */
-    net_ipv4_frag_init();
+    /* Initialize IPv4 and IPv6 fragment reassembly */
+    net_frag_init();
 
     /* Initialize multicast support */
     net_multicast_init();
@@ -239,8 +240,13 @@ void net_shutdown(void) {
     /* Shut down multicast support */
     net_multicast_shutdown();
 
-    /* Shut down IPv4 fragmentation support */
-    net_ipv4_frag_shutdown();
+    /* Shut down fragment reassembly */
+    net_frag_shutdown();
+
+    /* Shut down the network thread. This has to come before the ARP and NDP
+       caches go, since one of their timers could already be running on it,
+       and cancelling it then wouldn't stop it from using the entry. */
+    net_thd_shutdown();
 
     /* Shut down the NDP cache */
     net_ndp_shutdown();
@@ -248,9 +254,6 @@ void net_shutdown(void) {
     /* Shut down the ARP cache */
     net_arp_shutdown();
 
-    /* Shut down the network thread */
-    net_thd_shutdown();
-
     /* Shut down all activated network devices */
     LIST_FOREACH(cur, &net_if_list, if_list) {
         if(cur->flags & NETIF_RUNNING && cur->if_stop)
@@ -33,6 +33,9 @@
 
 #define DHCP_MIN_OPTIONS_SIZE 64
 
+/* How often to check for replies while waiting on the server (in ms). */
+#define DHCP_POLL_INTERVAL 50
+
 
 static int dhcp_sock = -1;
 struct sockaddr_in srv_addr;
@@ -50,7 +53,7 @@ STAILQ_HEAD(dhcp_pkt_queue, dhcp_pkt_out);
 
 static struct dhcp_pkt_queue dhcp_pkts = STAILQ_HEAD_INITIALIZER(dhcp_pkts);
 static mutex_t dhcp_lock = RECURSIVE_MUTEX_INITIALIZER;
-static int dhcp_cbid = -1;
+static net_timer_t dhcp_timer;
 static uint64_t renew_time = 0xFFFFFFFFFFFFFFFFULL;
 static uint64_t rebind_time = 0xFFFFFFFFFFFFFFFFULL;
 static uint64_t lease_expires = 0xFFFFFFFFFFFFFFFFULL;
@@ -269,6 +272,7 @@ int net_dhcp_request(uint32_t required_address) {
     STAILQ_INSERT_TAIL(&dhcp_pkts, qpkt, pkt_queue);
 
     state = DHCP_STATE_SELECTING;
+    net_timer_arm(&dhcp_timer, timer_ms_gettime64());
     mutex_unlock(&dhcp_lock);
 
     /* We need to wait til we're either bound to an IP address, or until we give
@@ -618,11 +622,23 @@ static void net_dhcp_thd(void *obj) {
             qpkt->next_delay <<= 1;
         }
     }
+
+    /* While we're waiting to hear back from the server, keep checking the
+       socket. Otherwise, there's nothing to do until the lease needs to be
+       renewed. */
+    if(!STAILQ_EMPTY(&dhcp_pkts))
+        net_timer_arm(&dhcp_timer, now + DHCP_POLL_INTERVAL);
+    else if(state == DHCP_STATE_BOUND && renew_time != 0xFFFFFFFFFFFFFFFFULL)
+        net_timer_arm(&dhcp_timer, renew_time);
 }
 
 int net_dhcp_init(void) {
     struct sockaddr_in addr;
 
+    /* Set up the timer for processing DHCP packets. It gets started when
+       there's a request to send. */
+    net_timer_init(&dhcp_timer, &net_dhcp_thd, NULL);
+
     /* Create the DHCP socket */
     dhcp_sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
 
@@ -649,17 +665,11 @@ int net_dhcp_init(void) {
     /* Make the socket non-blocking */
     fs_fcntl(dhcp_sock, F_SETFL, O_NONBLOCK);
 
-    /* Create the callback for processing DHCP packets */
-    dhcp_cbid = net_thd_add_callback(&net_dhcp_thd, NULL, 50);
-
     return 0;
 }
 
 void net_dhcp_shutdown(void) {
-    if(dhcp_cbid != -1) {
-        net_thd_del_callback(dhcp_cbid);
-        dhcp_cbid = -1;
-    }
+    net_timer_cancel(&dhcp_timer);
 
     if(dhcp_sock != -1) {
         close(dhcp_sock);
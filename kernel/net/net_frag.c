@@ -0,0 +1,545 @@
+/* KallistiOS ##version##
+
+   kernel/net/net_frag.c
+   Copyright (C) 2026 The KallistiOS Team
+
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/queue.h>
+#include <arpa/inet.h>
+
+#include <kos/net.h>
+#include <kos/mutex.h>
+#include <arch/timer.h>
+
+#include "net_frag.h"
+#include "net_ipv4.h"
+#include "net_ipv6.h"
+#include "net_thd.h"
+
+/* Reassembly used to keep every datagram on one list, which was walked for
+   each fragment that came in, with a buffer that was realloc()ed bigger as
+   pieces showed up and an 8KiB bitmap of which blocks had arrived. There was no
+   limit on how many datagrams there could be, so a burst of fragments could eat
+   up all of the memory there was.
+
+   Datagrams are now hashed on their source address and identification, and
+   each keeps a short, sorted list of the byte ranges that have arrived so far,
+   so fragments can show up in any order. Their buffers come in a few size
+   classes, some of which are allocated up front, so the usual case of a
+   datagram that's a few fragments long doesn't go to malloc() at all. The total
+   size of all the buffers in use is capped, and the oldest datagrams are thrown
+   out to make room for new ones when it is hit. Each datagram has its own
+   timer, and gets dropped (with a Time Exceeded sent back, if its first
+   fragment came in) when that goes off. */
+
+#define FRAG_HASH_BITS          5
+#define FRAG_HASH_SIZE          (1 << FRAG_HASH_BITS)
+
+#define FRAG_MAX_DATAGRAMS      32          /* Being reassembled at once */
+#define FRAG_MAX_RANGES         32          /* Separate pieces per datagram */
+#define FRAG_MEM_LIMIT          (256 * 1024) /* Total buffer space */
+#define FRAG_MAX_HDR            60          /* IPv4 header with options */
+#define FRAG_ICMP6_DATA         256         /* Data sent back in Time Exceeded */
+
+#define FRAG_CLASSES            3
+
+static const size_t frag_class_size[FRAG_CLASSES] = {
+    4096, 16384, FRAG_MAX_SIZE
+};
+
+/* How many buffers of each class are kept around when they're not in use. */
+static const int frag_class_keep[FRAG_CLASSES] = { 8, 2, 0 };
+
+typedef struct frag_buf {
+    SLIST_ENTRY(frag_buf) entry;
+    int cls;
+    uint8_t data[];
+} frag_buf_t;
+
+SLIST_HEAD(frag_buf_list, frag_buf);
+
+typedef struct frag_range {
+    uint32_t start;
+    uint32_t end;
+} frag_range_t;
+
+typedef struct frag_ctx {
+    LIST_ENTRY(frag_ctx) hash_entry;
+    TAILQ_ENTRY(frag_ctx) age_entry;        /* Or the free list */
+    net_timer_t timer;
+    uint64_t expires;
+    netif_t *nif;
+    struct in6_addr src;
+    struct in6_addr dst;
+    uint32_t ident;
+    int domain;                             /* Zero when not in use */
+    uint8_t proto;
+    int nranges;
+    size_t hdr_len;                         /* Zero until the first fragment */
+    size_t total;                           /* Zero until the last fragment */
+    frag_buf_t *buf;
+    frag_range_t ranges[FRAG_MAX_RANGES];
+    uint8_t hdr[FRAG_MAX_HDR];
+} frag_ctx_t;
+
+LIST_HEAD(frag_hash_list, frag_ctx);
+TAILQ_HEAD(frag_ctx_list, frag_ctx);
+
+static frag_ctx_t frag_ctxs[FRAG_MAX_DATAGRAMS];
+static struct frag_hash_list frag_hash[FRAG_HASH_SIZE];
+static struct frag_ctx_list frag_age;       /* Oldest first */
+static struct frag_ctx_list frag_free;
+static struct frag_buf_list frag_bufs[FRAG_CLASSES];
+static int frag_buf_count[FRAG_CLASSES];
+static size_t frag_mem;
+static mutex_t frag_mutex = RECURSIVE_MUTEX_INITIALIZER;
+static int initted = 0;
+
+static inline unsigned int frag_bucket(const struct in6_addr *src,
+                                       uint32_t ident) {
+    uint32_t h = src->__s6_addr.__s6_addr32[0] ^ src->__s6_addr.__s6_addr32[1] ^
+                 src->__s6_addr.__s6_addr32[2] ^ src->__s6_addr.__s6_addr32[3] ^
+                 ident;
+
+    return (h * 0x9E3779B1) >> (32 - FRAG_HASH_BITS);
+}
+
+static frag_ctx_t *frag_find(const net_frag_t *f) {
+    frag_ctx_t *c;
+
+    LIST_FOREACH(c, &frag_hash[frag_bucket(&f->src, f->ident)], hash_entry) {
+        if(c->ident == f->ident && c->proto == f->proto &&
+           c->domain == f->domain &&
+           !memcmp(&c->src, &f->src, sizeof(struct in6_addr)) &&
+           !memcmp(&c->dst, &f->dst, sizeof(struct in6_addr)))
+            return c;
+    }
+
+    return NULL;
+}
+
+static int frag_class(size_t size) {
+    int i;
+
+    for(i = 0; i < FRAG_CLASSES - 1; ++i) {
+        if(size <= frag_class_size[i])
+            break;
+    }
+
+    return i;
+}
+
+static void frag_buf_put(frag_buf_t *b) {
+    frag_mem -= frag_class_size[b->cls];
+
+    if(frag_buf_count[b->cls] < frag_class_keep[b->cls]) {
+        SLIST_INSERT_HEAD(&frag_bufs[b->cls], b, entry);
+        ++frag_buf_count[b->cls];
+    }
+    else {
+        free(b);
+    }
+}
+
+static void frag_drop(frag_ctx_t *c) {
+    net_timer_cancel(&c->timer);
+
+    if(c->buf) {
+        frag_buf_put(c->buf);
+        c->buf = NULL;
+    }
+
+    c->domain = 0;
+    LIST_REMOVE(c, hash_entry);
+    TAILQ_REMOVE(&frag_age, c, age_entry);
+    TAILQ_INSERT_HEAD(&frag_free, c, age_entry);
+}
+
+/* Get a buffer for the given datagram, throwing out older datagrams if that's
+   what it takes to stay under the limit. */
+static frag_buf_t *frag_buf_get(int cls, frag_ctx_t *keep) {
+    size_t size = frag_class_size[cls];
+    frag_ctx_t *c;
+    frag_buf_t *b;
+
+    while(frag_mem + size > FRAG_MEM_LIMIT) {
+        c = TAILQ_FIRST(&frag_age);
+
+        if(c == keep)
+            c = TAILQ_NEXT(c, age_entry);
+
+        if(!c)
+            return NULL;
+
+        frag_drop(c);
+    }
+
+    if((b = SLIST_FIRST(&frag_bufs[cls]))) {
+        SLIST_REMOVE_HEAD(&frag_bufs[cls], entry);
+        --frag_buf_count[cls];
+    }
+    else if(!(b = (frag_buf_t *)malloc(sizeof(frag_buf_t) + size))) {
+        return NULL;
+    }
+
+    b->cls = cls;
+    frag_mem += size;
+
+    return b;
+}
+
+static frag_ctx_t *frag_new(netif_t *src, const net_frag_t *f) {
+    frag_ctx_t *c;
+
+    /* If every slot is taken, throw out the oldest datagram. */
+    if(TAILQ_EMPTY(&frag_free))
+        frag_drop(TAILQ_FIRST(&frag_age));
+
+    c = TAILQ_FIRST(&frag_free);
+    TAILQ_REMOVE(&frag_free, c, age_entry);
+
+    c->nif = src;
+    c->src = f->src;
+    c->dst = f->dst;
+    c->ident = f->ident;
+    c->domain = f->domain;
+    c->proto = f->proto;
+    c->nranges = 0;
+    c->hdr_len = 0;
+    c->total = 0;
+    c->buf = NULL;
+
+    LIST_INSERT_HEAD(&frag_hash[frag_bucket(&f->src, f->ident)], c,
+                     hash_entry);
+    TAILQ_INSERT_TAIL(&frag_age, c, age_entry);
+
+    c->expires = timer_ms_gettime64() + f->timeout;
+    net_timer_arm(&c->timer, c->expires);
+
+    return c;
+}
+
+/* Note that the given range of the datagram has arrived. Returns 1 if all of it
+   was already there, and -1 if the datagram should be thrown out. */
+static int frag_add_range(frag_ctx_t *c, uint32_t start, uint32_t end) {
+    frag_range_t *r = c->ranges;
+    int i, j, n = c->nranges;
+
+    /* Find the ranges that this one overlaps or touches. */
+    for(i = 0; i < n && r[i].end < start; ++i) ;
+
+    for(j = i; j < n && r[j].start <= end; ++j) {
+        if(r[j].start <= start && r[j].end >= end)
+            return 1;
+
+        /* Overlapping fragments are how some attacks on reassembly work, so
+           RFC 5722 says to throw the whole datagram out for IPv6. IPv4 has to
+           put up with them. */
+        if(c->domain == AF_INET6 && r[j].start < end && r[j].end > start)
+            return -1;
+    }
+
+    if(i == j) {
+        if(n == FRAG_MAX_RANGES)
+            return -1;
+
+        memmove(r + i + 1, r + i, (n - i) * sizeof(frag_range_t));
+        r[i].start = start;
+        r[i].end = end;
+        ++c->nranges;
+        return 0;
+    }
+
+    /* Merge everything it touches into one. */
+    if(r[i].start < start)
+        start = r[i].start;
+
+    if(r[j - 1].end > end)
+        end = r[j - 1].end;
+
+    r[i].start = start;
+    r[i].end = end;
+    memmove(r + i + 1, r + j, (n - j) * sizeof(frag_range_t));
+    c->nranges -= j - i - 1;
+
+    return 0;
+}
+
+/* Pass a finished datagram on. */
+static int frag_deliver(frag_ctx_t *c) {
+    uint8_t hdr[FRAG_MAX_HDR];
+    frag_buf_t *b = c->buf;
+    size_t hdr_len = c->hdr_len, total = c->total;
+    netif_t *nif = c->nif;
+    int domain = c->domain;
+    ip_hdr_t *ip;
+    ipv6_hdr_t *ip6;
+    int rv;
+
+    /* Get rid of the context before passing the datagram on, in case that ends
+       up back in here (through loopback, for instance). */
+    memcpy(hdr, c->hdr, hdr_len);
+
+    if(domain == AF_INET6) {
+        ip6 = (ipv6_hdr_t *)hdr;
+        ip6->next_header = c->proto;
+    }
+
+    c->buf = NULL;
+    frag_drop(c);
+
+    if(domain == AF_INET) {
+        ip = (ip_hdr_t *)hdr;
+        ip->length = htons(total + hdr_len);
+        ip->flags_frag_offs = 0;
+        ip->checksum = 0;
+        ip->checksum = net_ipv4_checksum(hdr, hdr_len, 0);
+
+        rv = net_ipv4_input_proto(nif, ip, b->data);
+    }
+    else {
+        ip6 = (ipv6_hdr_t *)hdr;
+        ip6->length = htons(total);
+
+        rv = net_ipv6_input_proto(nif, ip6, b->data, total);
+    }
+
+    frag_buf_put(b);
+
+    return rv;
+}
+
+/* Tell the sender that we gave up on their datagram. This only gets called if
+   the first fragment arrived, since that's how they'll know which one it
+   was. */
+static void frag_time_exceeded(frag_ctx_t *c) {
+    uint8_t msg[sizeof(ipv6_hdr_t) + sizeof(ipv6_frag_hdr_t) + FRAG_ICMP6_DATA];
+    size_t n = c->ranges[0].end;
+    ipv6_hdr_t *ip6;
+    ipv6_frag_hdr_t *fh;
+
+    if(c->domain == AF_INET) {
+        /* The original IP header and the first 8 bytes of its data. */
+        if(n > 8)
+            n = 8;
+
+        memset(msg, 0, FRAG_MAX_HDR + 8);
+        memcpy(msg, c->hdr, c->hdr_len);
+        memcpy(msg + c->hdr_len, c->buf->data, n);
+
+        net_icmp_send_time_exceeded(c->nif, ICMP_REASSEMBLY_TIME_EXCEEDED, msg);
+    }
+    else {
+        /* As much of the first fragment as we care to send back. */
+        if(n > FRAG_ICMP6_DATA)
+            n = FRAG_ICMP6_DATA;
+
+        ip6 = (ipv6_hdr_t *)msg;
+        fh = (ipv6_frag_hdr_t *)(msg + sizeof(ipv6_hdr_t));
+
+        memcpy(ip6, c->hdr, sizeof(ipv6_hdr_t));
+        ip6->next_header = IPV6_HDR_EXT_FRAGMENT;
+        ip6->length = htons(sizeof(ipv6_frag_hdr_t) + n);
+        fh->next_header = c->proto;
+        fh->reserved = 0;
+        fh->frag_offs = htons(IPV6_FRAG_MORE);
+        fh->ident = c->ident;
+        memcpy(msg + sizeof(ipv6_hdr_t) + sizeof(ipv6_frag_hdr_t),
+               c->buf->data, n);
+
+        net_icmp6_send_time_exceeded(c->nif, ICMP6_TIME_EXCEEDED_FRAGMENT, msg,
+                                     sizeof(ipv6_hdr_t) +
+                                     sizeof(ipv6_frag_hdr_t) + n);
+    }
+}
+
+static void frag_timeout(void *data) {
+    frag_ctx_t *c = (frag_ctx_t *)data;
+
+    mutex_lock(&frag_mutex);
+
+    /* Make sure this is still the datagram the timer was started for, and not
+       one that got the same slot after it was dropped. */
+    if(c->domain && c->expires <= timer_ms_gettime64()) {
+        if(c->hdr_len)
+            frag_time_exceeded(c);
+
+        frag_drop(c);
+    }
+
+    mutex_unlock(&frag_mutex);
+}
+
+int net_frag_input(netif_t *src, const net_frag_t *f, const uint8_t *data,
+                   size_t size) {
+    size_t end = f->offset + size, need;
+    frag_buf_t *b;
+    frag_ctx_t *c;
+    int rv;
+
+    /* Everything but the last fragment has to have some multiple of 8 bytes of
+       data in it, and none of it can go past the largest possible datagram. */
+    if(end > FRAG_MAX_SIZE || (f->more && (!size || (size & 7)))) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* This is usually called inside an interrupt, so try to safely lock the
+       mutex, and bail if we can't. */
+    if(mutex_lock_irqsafe(&frag_mutex))
+        return -1;
+
+    if(!initted) {
+        mutex_unlock(&frag_mutex);
+        errno = ENETDOWN;
+        return -1;
+    }
+
+    if(!(c = frag_find(f)))
+        c = frag_new(src, f);
+
+    /* Make sure this agrees with what we know about the size of the datagram
+       already. */
+    if(c->total && end > c->total)
+        goto drop;
+
+    if(!f->more) {
+        if(c->total && c->total != end)
+            goto drop;
+
+        if(c->nranges && c->ranges[c->nranges - 1].end > end)
+            goto drop;
+
+        c->total = end;
+    }
+
+    if(size) {
+        if((rv = frag_add_range(c, f->offset, end)) < 0)
+            goto drop;
+
+        /* If it's new, make sure there's room for it and copy it in. The
+           buffer is sized for the whole datagram if we know how big that is,
+           or what's arrived so far if we don't. */
+        if(!rv) {
+            need = c->total ? c->total : c->ranges[c->nranges - 1].end;
+
+            if(!c->buf || frag_class_size[c->buf->cls] < need) {
+                if(!(b = frag_buf_get(frag_class(need), c)))
+                    goto drop;
+
+                if(c->buf) {
+                    memcpy(b->data, c->buf->data,
+                           frag_class_size[c->buf->cls]);
+                    frag_buf_put(c->buf);
+                }
+
+                c->buf = b;
+            }
+
+            memcpy(c->buf->data + f->offset, data, size);
+        }
+    }
+
+    /* Hang on to the header from the first fragment, to send along with the
+       finished datagram. */
+    if(!f->offset && !c->hdr_len) {
+        if(f->hdr_len > FRAG_MAX_HDR)
+            goto drop;
+
+        memcpy(c->hdr, f->hdr, f->hdr_len);
+        c->hdr_len = f->hdr_len;
+        c->nif = src;
+    }
+
+    rv = 0;
+
+    /* Is that everything? */
+    if(c->total && c->hdr_len && c->nranges == 1 &&
+       !c->ranges[0].start && c->ranges[0].end == c->total)
+        rv = frag_deliver(c);
+
+    mutex_unlock(&frag_mutex);
+    return rv;
+
+drop:
+    frag_drop(c);
+    mutex_unlock(&frag_mutex);
+    return -1;
+}
+
+int net_frag_init(void) {
+    frag_buf_t *b;
+    int i, j;
+
+    mutex_lock(&frag_mutex);
+
+    if(initted) {
+        mutex_unlock(&frag_mutex);
+        return 0;
+    }
+
+    TAILQ_INIT(&frag_age);
+    TAILQ_INIT(&frag_free);
+
+    for(i = 0; i < FRAG_HASH_SIZE; ++i)
+        LIST_INIT(&frag_hash[i]);
+
+    for(i = 0; i < FRAG_MAX_DATAGRAMS; ++i) {
+        net_timer_init(&frag_ctxs[i].timer, &frag_timeout, &frag_ctxs[i]);
+        frag_ctxs[i].domain = 0;
+        frag_ctxs[i].buf = NULL;
+        TAILQ_INSERT_TAIL(&frag_free, &frag_ctxs[i], age_entry);
+    }
+
+    /* Allocate the buffers we keep around up front. It's not the end of the
+       world if some of them can't be, they'll just be malloc()ed later. */
+    for(i = 0; i < FRAG_CLASSES; ++i) {
+        SLIST_INIT(&frag_bufs[i]);
+        frag_buf_count[i] = 0;
+
+        for(j = 0; j < frag_class_keep[i]; ++j) {
+            if(!(b = (frag_buf_t *)malloc(sizeof(frag_buf_t) +
+                                          frag_class_size[i])))
+                break;
+
+            b->cls = i;
+            SLIST_INSERT_HEAD(&frag_bufs[i], b, entry);
+            ++frag_buf_count[i];
+        }
+    }
+
+    frag_mem = 0;
+    initted = 1;
+
+    mutex_unlock(&frag_mutex);
+    return 0;
+}
+
+void net_frag_shutdown(void) {
+    frag_ctx_t *c;
+    frag_buf_t *b;
+    int i;
+
+    mutex_lock(&frag_mutex);
+
+    if(initted) {
+        while((c = TAILQ_FIRST(&frag_age)))
+            frag_drop(c);
+
+        for(i = 0; i < FRAG_CLASSES; ++i) {
+            while((b = SLIST_FIRST(&frag_bufs[i]))) {
+                SLIST_REMOVE_HEAD(&frag_bufs[i], entry);
+                free(b);
+            }
+
+            frag_buf_count[i] = 0;
+        }
+    }
+
+    initted = 0;
+    mutex_unlock(&frag_mutex);
+}
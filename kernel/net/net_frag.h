@@ -0,0 +1,56 @@
+/* KallistiOS ##version##
+
+   kernel/net/net_frag.h
+   Copyright (C) 2026 The KallistiOS Team
+
+*/
+
+#ifndef __LOCAL_NET_FRAG_H
+#define __LOCAL_NET_FRAG_H
+
+#include <kos/cdefs.h>
+__BEGIN_DECLS
+
+#include <stdint.h>
+#include <stddef.h>
+#include <netinet/in.h>
+#include <kos/net.h>
+
+/* Fragment reassembly, shared by IPv4 and IPv6. IPv4 addresses are kept as
+   v4-mapped IPv6 addresses, like in the neighbor table. */
+
+/* How long to wait for the rest of a datagram, in milliseconds. */
+#define FRAG_TIMEOUT_IPV4       30000
+#define FRAG_TIMEOUT_IPV6       60000   /* RFC 8200, section 4.5 */
+
+/* The biggest datagram that can be put back together. */
+#define FRAG_MAX_SIZE           65535
+
+/* One fragment, as pulled out of the IP header by the caller. */
+typedef struct net_frag {
+    int domain;                 /* AF_INET or AF_INET6 */
+    struct in6_addr src;
+    struct in6_addr dst;
+    uint32_t ident;
+    uint8_t proto;
+    int more;                   /* More fragments follow this one */
+    size_t offset;              /* In bytes */
+    uint32_t timeout;
+
+    /* The IP header, which is kept from the first fragment and delivered with
+       the finished datagram. */
+    const void *hdr;
+    size_t hdr_len;
+} net_frag_t;
+
+/* Add a fragment to its datagram, and deliver the datagram if that finishes
+   it. Safe to call inside an interrupt. */
+int net_frag_input(netif_t *src, const net_frag_t *frag, const uint8_t *data,
+                   size_t size);
+
+int net_frag_init(void);
+void net_frag_shutdown(void);
+
+__END_DECLS
+
+#endif /* !__LOCAL_NET_FRAG_H */
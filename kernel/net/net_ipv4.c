@@ -25,45 +25,261 @@
 
 static net_ipv4_stats_t ipv4_stats = { 0 };
 
+/* IP-style checksums. These add up the data 32 bits at a time, and only fold
+   the sum down to 16 bits at the very end, which gives the same answer as
+   adding it up 16 bits at a time would (see RFC 1071). The main loops use a
+   64-bit accumulator, which can't overflow for anything smaller than 16GiB.
+
+   On SH, there's also a version of the main loops done with addc, which keeps
+   the carries in the T bit, so there's no need for a wider accumulator. It
+   hasn't been checked against the C version on real hardware yet, so it's
+   only used if this is defined (to anything). */
+//#define IPV4_CSUM_ASM
+
+/* Fold a partial sum down to 16 bits. */
+static inline uint16_t csum_fold(uint64_t sum) {
+    sum = (sum >> 32) + (sum & 0xFFFFFFFF);
+    sum = (sum >> 16) + (sum & 0xFFFF);
+    sum = (sum >> 16) + (sum & 0xFFFF);
+    return (uint16_t)((sum >> 16) + sum);
+}
+
+/* The sum of a block that starts at an odd offset into the packet comes out
+   byte-swapped. */
+static inline uint16_t csum_shift(uint16_t sum, size_t offset) {
+    return (offset & 1) ? (uint16_t)((sum << 8) | (sum >> 8)) : sum;
+}
+
+/* Build the 16-bit word for two bytes, in memory order. */
+static inline uint16_t csum_pair(uint8_t first, uint8_t second) {
+    union {
+        uint8_t b[2];
+        uint16_t w;
+    } u = { { first, second } };
+
+    return u.w;
+}
+
+#if defined(__sh__) && defined(IPV4_CSUM_ASM)
+
+/* Add up count 32-bit words, which must be a multiple of 4. The carry out of
+   each addc is kept in T, which is saved across the dt and put back with the
+   cmp/eq in the delay slot. */
+static uint64_t csum_words(const uint32_t *data, size_t count) {
+    uint32_t sum = 0, tmp, carry;
+
+    if(!(count >>= 2))
+        return 0;
+
+    __asm__ __volatile__("clrt\n"
+                         "1:\n\t"
+                         "mov.l  @%1+, %3\n\t"
+                         "mov.l  @%1+, %4\n\t"
+                         "addc   %3, %0\n\t"
+                         "addc   %4, %0\n\t"
+                         "mov.l  @%1+, %3\n\t"
+                         "mov.l  @%1+, %4\n\t"
+                         "addc   %3, %0\n\t"
+                         "addc   %4, %0\n\t"
+                         "movt   %3\n\t"
+                         "dt     %2\n\t"
+                         "bf/s   1b\n\t"
+                         " cmp/eq #1, %3\n\t"
+                         "movt   %3\n"
+                         : "+r" (sum), "+r" (data), "+r" (count),
+                           "=&z" (carry), "=&r" (tmp)
+                         :
+                         : "t", "memory");
+
+    return (uint64_t)sum + carry;
+}
+
+/* Same as above, but copy the words to dst while adding them up. */
+static uint64_t csum_copy_words(uint32_t *dst, const uint32_t *src,
+                                size_t count) {
+    uint32_t sum = 0, tmp, carry;
+
+    if(!(count >>= 2))
+        return 0;
+
+    __asm__ __volatile__("clrt\n"
+                         "1:\n\t"
+                         "mov.l  @%2+, %4\n\t"
+                         "mov.l  @%2+, %5\n\t"
+                         "addc   %4, %0\n\t"
+                         "mov.l  %4, @%1\n\t"
+                         "addc   %5, %0\n\t"
+                         "mov.l  %5, @(4, %1)\n\t"
+                         "mov.l  @%2+, %4\n\t"
+                         "mov.l  @%2+, %5\n\t"
+                         "addc   %4, %0\n\t"
+                         "mov.l  %4, @(8, %1)\n\t"
+                         "addc   %5, %0\n\t"
+                         "mov.l  %5, @(12, %1)\n\t"
+                         "movt   %4\n\t"
+                         "add    #16, %1\n\t"
+                         "dt     %3\n\t"
+                         "bf/s   1b\n\t"
+                         " cmp/eq #1, %4\n\t"
+                         "movt   %4\n"
+                         : "+r" (sum), "+r" (dst), "+r" (src), "+r" (count),
+                           "=&z" (carry), "=&r" (tmp)
+                         :
+                         : "t", "memory");
+
+    return (uint64_t)sum + carry;
+}
+
+#define CSUM_WORDS_MASK     3
+
+#else
+
+static uint64_t csum_words(const uint32_t *data, size_t count) {
+    uint64_t sum = 0;
+
+    for(; count >= 4; count -= 4, data += 4) {
+        sum += data[0];
+        sum += data[1];
+        sum += data[2];
+        sum += data[3];
+    }
+
+    return sum;
+}
+
+static uint64_t csum_copy_words(uint32_t *dst, const uint32_t *src,
+                                size_t count) {
+    uint64_t sum = 0;
+    uint32_t w0, w1, w2, w3;
+
+    for(; count >= 4; count -= 4, src += 4, dst += 4) {
+        w0 = src[0];
+        w1 = src[1];
+        w2 = src[2];
+        w3 = src[3];
+        dst[0] = w0;
+        dst[1] = w1;
+        dst[2] = w2;
+        dst[3] = w3;
+        sum += w0;
+        sum += w1;
+        sum += w2;
+        sum += w3;
+    }
+
+    return sum;
+}
+
+#define CSUM_WORDS_MASK     3
+
+#endif
+
+/* Add up a block of data as if it started at an even offset into the packet,
+   without complementing the result. */
+static uint16_t csum_partial(const uint8_t *data, size_t bytes) {
+    uint64_t sum = 0;
+    size_t count, odd = (uintptr_t)data & 1;
+
+    if(!bytes)
+        return 0;
+
+    /* Get up to a 32-bit boundary. If we started out on an odd address, then
+       everything is added up one byte off, so swap it back at the end. */
+    if(odd) {
+        sum += csum_pair(0, *data++);
+        --bytes;
+    }
+
+    if(((uintptr_t)data & 2) && bytes >= 2) {
+        sum += *(const uint16_t *)data;
+        data += 2;
+        bytes -= 2;
+    }
+
+    count = bytes >> 2;
+    sum += csum_words((const uint32_t *)data, count & ~CSUM_WORDS_MASK);
+    data += (count & ~CSUM_WORDS_MASK) << 2;
+    bytes -= (count & ~CSUM_WORDS_MASK) << 2;
+
+    for(; bytes >= 2; bytes -= 2, data += 2)
+        sum += *(const uint16_t *)data;
+
+    if(bytes)
+        sum += csum_pair(*data, 0);
+
+    return csum_shift(csum_fold(sum), odd);
+}
+
 /* Perform an IP-style checksum on a block of data */
 uint16_t __pure net_ipv4_checksum(const uint8_t *data, size_t bytes, uint16_t start) {
-    uint32_t sum = start;
-    size_t i = bytes;
+    return csum_fold((uint64_t)start + csum_partial(data, bytes)) ^ 0xFFFF;
+}
 
-    /* Make sure we don't do any unaligned memory accesses */
-    if(((uint32_t)data) & 0x01) {
-        const uint8_t *ptr = data;
+/* Copy count 16-bit halfwords (a multiple of 4) while adding them up. This is
+   for when the source and destination are two bytes off from each other, which
+   is what usually happens with received packets, since the 14-byte Ethernet
+   header throws everything after it off by two. */
+static uint64_t csum_copy_halves(uint16_t *dst, const uint16_t *src,
+                                 size_t count) {
+    uint64_t sum = 0;
+    uint16_t h0, h1, h2, h3;
+
+    for(; count >= 4; count -= 4, src += 4, dst += 4) {
+        h0 = src[0];
+        h1 = src[1];
+        h2 = src[2];
+        h3 = src[3];
+        dst[0] = h0;
+        dst[1] = h1;
+        dst[2] = h2;
+        dst[3] = h3;
+        sum += h0 + h1;
+        sum += h2 + h3;
+    }
 
-        while(i > 1) {
-            sum += *ptr | ((*ptr + 1) << 8);
-            ptr += 2;
-            i -= 2;
+    return sum;
+}
 
-            while(sum >> 16)
-                sum = (sum >> 16) + (sum & 0xFFFF);
-        }
+/* Copy a block of data and do an IP-style checksum on it at the same time. The
+   copy can only be fused with the checksum if both blocks are an even number of
+   bytes apart; otherwise, this just does one after the other. */
+uint16_t net_ipv4_checksum_copy(uint8_t *dst, const uint8_t *src, size_t bytes,
+                                uint16_t start) {
+    uint64_t sum = start;
+    uintptr_t skew = ((uintptr_t)src ^ (uintptr_t)dst) & 3;
+    size_t head, count;
+
+    if(skew & 1) {
+        memcpy(dst, src, bytes);
+        return net_ipv4_checksum(src, bytes, start);
     }
-    else {
-        const uint16_t *ptr = (const uint16_t *)data;
 
-        while(i > 1) {
-            sum += *ptr++;
-            i -= 2;
+    /* Get the source up to the alignment that the main loop needs. */
+    if((head = -(uintptr_t)src & (skew ? 1 : 3)) > bytes)
+        head = bytes;
 
-            while(sum >> 16)
-                sum = (sum >> 16) + (sum & 0xFFFF);
-        }
-    }
+    memcpy(dst, src, head);
+    sum += csum_partial(src, head);
 
-    /* Handle the last byte, if we have an odd byte count */
-    if(i)
-        sum += data[bytes - 1];
+    if(skew) {
+        count = ((bytes - head) >> 1) & ~3;
+        sum += csum_shift(csum_fold(csum_copy_halves((uint16_t *)(dst + head),
+                                                     (const uint16_t *)(src + head),
+                                                     count)), head);
+        head += count << 1;
+    }
+    else {
+        count = ((bytes - head) >> 2) & ~CSUM_WORDS_MASK;
+        sum += csum_shift(csum_fold(csum_copy_words((uint32_t *)(dst + head),
+                                                    (const uint32_t *)(src + head),
+                                                    count)), head);
+        head += count << 2;
+    }
 
-    /* Take care of any carry bits */
-    while(sum >> 16)
-        sum = (sum >> 16) + (sum & 0xFFFF);
+    memcpy(dst + head, src + head, bytes - head);
+    sum += csum_shift(csum_partial(src + head, bytes - head), head);
 
-    return sum ^ 0xFFFF;
+    return csum_fold(sum) ^ 0xFFFF;
 }
 
 /* Determine if a given IP is in the current network */
@@ -92,11 +308,14 @@ static int __pure is_broadcast(const uint8_t dest[4], const uint8_t bc[4]) {
 }
 
 /* Send a packet on the specified network adapter */
-int net_ipv4_send_packet(netif_t *net, ip_hdr_t *hdr, const uint8_t *data,
-                         size_t size) {
+int net_ipv4_send_packet_pbuf(netif_t *net, ip_hdr_t *hdr, net_pbuf_t *pkt) {
     uint8_t dest_ip[4];
     uint8_t dest_mac[6];
-    uint8_t pkt[size + sizeof(ip_hdr_t) + sizeof(eth_hdr_t)];
+    uint8_t hbuf[sizeof(eth_hdr_t) + 60];
+    net_pbuf_t hpb;
+    size_t ihl = 4 * (hdr->version_ihl & 0x0f);
+    size_t hlen, size;
+    uint8_t *ptr;
     eth_hdr_t *ehdr;
     int err;
 
@@ -113,82 +332,100 @@ int net_ipv4_send_packet(netif_t *net, ip_hdr_t *hdr, const uint8_t *data,
 
     /* Is this a loopback address (127/8)? */
     if(dest_ip[0] == 0x7F) {
-        /* Put the IP header / data into our packet */
-        memcpy(pkt, hdr, 4 * (hdr->version_ihl & 0x0f));
-        memcpy(pkt + 4 * (hdr->version_ihl & 0x0f), data, size);
+        size = net_pbuf_length(pkt);
 
-        ++ipv4_stats.pkt_sent;
+        {
+            uint8_t buf[ihl + size];
 
-        /* Send it "away" */
-        net_ipv4_input(NULL, pkt, 4 * (hdr->version_ihl & 0x0f) + size, NULL);
+            /* Put the IP header / data into our packet */
+            memcpy(buf, hdr, ihl);
+            net_pbuf_copy_out(pkt, buf + ihl, size);
 
-        return 0;
-    }
-    else if(net->flags & NETIF_NOETH) {
-        /* Put the IP header / data into our packet */
-        memcpy(pkt, hdr, 4 * (hdr->version_ihl & 0x0f));
-        memcpy(pkt + 4 * (hdr->version_ihl & 0x0f), data, size);
+            ++ipv4_stats.pkt_sent;
 
-        ++ipv4_stats.pkt_sent;
+            /* Send it "away" */
+            net_ipv4_input(NULL, buf, ihl + size, NULL);
+        }
 
-        /* Send it away */
-        return net->if_tx(net, pkt, 4 * (hdr->version_ihl & 0x0f) + size,
-                          NETIF_BLOCK);
+        return 0;
     }
-
-    /* Are we sending a broadcast packet? */
-    if(hdr->dest == 0xFFFFFFFF || is_broadcast(dest_ip, net->broadcast)) {
-        /* Set the destination to the datalink layer broadcast address. */
-        memset(dest_mac, 0xFF, 6);
+    else if(net->flags & NETIF_NOETH) {
+        hlen = ihl;
     }
     else {
-        /* Is it in our network? */
-        if(!is_in_network(net->ip_addr, dest_ip, net->netmask)) {
-            memcpy(dest_ip, net->gateway, 4);
+        hlen = sizeof(eth_hdr_t) + ihl;
+
+        /* Are we sending a broadcast packet? */
+        if(hdr->dest == 0xFFFFFFFF || is_broadcast(dest_ip, net->broadcast)) {
+            /* Set the destination to the datalink layer broadcast address. */
+            memset(dest_mac, 0xFF, 6);
         }
+        else {
+            /* Is it in our network? */
+            if(!is_in_network(net->ip_addr, dest_ip, net->netmask)) {
+                memcpy(dest_ip, net->gateway, 4);
+            }
 
-        /* Get our destination's MAC address. If we do not have the MAC address
-           cached, return a distinguished error to the upper-level protocol so
-           that it can decide what to do. */
-        err = net_arp_lookup(net, dest_ip, dest_mac, hdr, data, size);
+            /* Get our destination's MAC address. If we do not have the MAC
+               address cached, return a distinguished error to the upper-level
+               protocol so that it can decide what to do. The packet is copied
+               into one piece and saved to send once the answer comes in. */
+            err = net_arp_lookup_pbuf(net, dest_ip, dest_mac, hdr, pkt);
 
-        if(err == -1) {
-            errno = ENETUNREACH;
-            ++ipv4_stats.pkt_send_failed;
-            return -1;
-        }
-        else if(err == -2) {
-            /* It'll send when the ARP reply comes in (assuming one does), so
-               return success. */
-            return 0;
+            if(err == -1) {
+                errno = ENETUNREACH;
+                ++ipv4_stats.pkt_send_failed;
+                return -1;
+            }
+            else if(err == -2) {
+                /* It'll send when the ARP reply comes in (assuming one does),
+                   so return success. */
+                return 0;
+            }
         }
     }
 
-    /* Fill in the ethernet header */
-    ehdr = (eth_hdr_t *)pkt;
-    memcpy(ehdr->dest, dest_mac, 6);
-    memcpy(ehdr->src, net->mac_addr, 6);
-    ehdr->type[0] = 0x08;
-    ehdr->type[1] = 0x00;
+    /* Put the headers in front of the data, in the space left for them if
+       there is any, or in a piece of their own if not. */
+    if(!(ptr = net_pbuf_push(pkt, hlen))) {
+        net_pbuf_init(&hpb, hbuf, 0, hlen);
+        hpb.next = pkt;
+        pkt = &hpb;
+        ptr = hbuf;
+    }
+
+    if(!(net->flags & NETIF_NOETH)) {
+        /* Fill in the ethernet header */
+        ehdr = (eth_hdr_t *)ptr;
+        memcpy(ehdr->dest, dest_mac, 6);
+        memcpy(ehdr->src, net->mac_addr, 6);
+        ehdr->type[0] = 0x08;
+        ehdr->type[1] = 0x00;
+        ptr += sizeof(eth_hdr_t);
+    }
 
-    /* Put the IP header / data into our ethernet packet */
-    memcpy(pkt + sizeof(eth_hdr_t), hdr, 4 * (hdr->version_ihl & 0x0f));
-    memcpy(pkt + sizeof(eth_hdr_t) + 4 * (hdr->version_ihl & 0x0f), data,
-           size);
+    memcpy(ptr, hdr, ihl);
 
     ++ipv4_stats.pkt_sent;
 
     /* Send it away */
-    net->if_tx(net, pkt, sizeof(ip_hdr_t) + size + sizeof(eth_hdr_t),
-               NETIF_BLOCK);
+    if(net->flags & NETIF_NOETH)
+        return net_pbuf_tx(net, pkt, NETIF_BLOCK);
 
+    net_pbuf_tx(net, pkt, NETIF_BLOCK);
     return 0;
 }
 
-int net_ipv4_send(netif_t *net, const uint8_t *data, size_t size, int id, int ttl,
-                  int proto, uint32_t src, uint32_t dst) {
-    ip_hdr_t hdr;
+int net_ipv4_send_packet(netif_t *net, ip_hdr_t *hdr, const uint8_t *data,
+                         size_t size) {
+    net_pbuf_t pkt;
+
+    net_pbuf_init(&pkt, (uint8_t *)data, 0, size);
+    return net_ipv4_send_packet_pbuf(net, hdr, &pkt);
+}
 
+static void ipv4_fill_hdr(ip_hdr_t *hdr, size_t size, int id, int ttl,
+                          int proto, uint32_t src, uint32_t dst) {
     /* If the ID is -1, generate a random ID value that can be used in case the
        packet gets fragmented. */
     if(id == -1) {
@@ -196,22 +433,56 @@ int net_ipv4_send(netif_t *net, const uint8_t *data, size_t size, int id, int tt
     }
 
     /* Fill in the IPv4 Header */
-    hdr.version_ihl = 0x45;
-    hdr.tos = 0;
-    hdr.length = htons(size + 20);
-    hdr.packet_id = id;
-    hdr.flags_frag_offs = 0;
-    hdr.ttl = ttl;
-    hdr.protocol = proto;
-    hdr.checksum = 0;
-    hdr.src = src;
-    hdr.dest = dst;
-
-    hdr.checksum = net_ipv4_checksum((uint8_t *)&hdr, sizeof(ip_hdr_t), 0);
+    hdr->version_ihl = 0x45;
+    hdr->tos = 0;
+    hdr->length = htons(size + 20);
+    hdr->packet_id = id;
+    hdr->flags_frag_offs = 0;
+    hdr->ttl = ttl;
+    hdr->protocol = proto;
+    hdr->checksum = 0;
+    hdr->src = src;
+    hdr->dest = dst;
+
+    hdr->checksum = net_ipv4_checksum((uint8_t *)hdr, sizeof(ip_hdr_t), 0);
+}
 
+int net_ipv4_send(netif_t *net, const uint8_t *data, size_t size, int id, int ttl,
+                  int proto, uint32_t src, uint32_t dst) {
+    ip_hdr_t hdr;
+
+    ipv4_fill_hdr(&hdr, size, id, ttl, proto, src, dst);
     return net_ipv4_frag_send(net, &hdr, data, size);
 }
 
+int net_ipv4_send_pbuf(netif_t *net, net_pbuf_t *pkt, int id, int ttl,
+                       int proto, uint32_t src, uint32_t dst) {
+    size_t size = net_pbuf_length(pkt);
+    ip_hdr_t hdr;
+
+    if(net == NULL) {
+        net = net_default_dev;
+
+        if(!net) {
+            errno = ENETDOWN;
+            return -1;
+        }
+    }
+
+    ipv4_fill_hdr(&hdr, size, id, ttl, proto, src, dst);
+
+    if(size + sizeof(ip_hdr_t) < net->mtu)
+        return net_ipv4_send_packet_pbuf(net, &hdr, pkt);
+
+    /* It needs to be fragmented, which needs it all in one piece. */
+    {
+        uint8_t buf[size];
+
+        net_pbuf_copy_out(pkt, buf, size);
+        return net_ipv4_frag_send(net, &hdr, buf, size);
+    }
+}
+
 int net_ipv4_input(netif_t *src, const uint8_t *pkt, size_t pktsize,
                    const eth_hdr_t *eth) {
     const ip_hdr_t *ip;
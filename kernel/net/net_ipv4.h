@@ -26,10 +26,15 @@ typedef struct {
 } __packed ipv4_pseudo_hdr_t;
 
 uint16_t __pure net_ipv4_checksum(const uint8_t *data, size_t bytes, uint16_t start);
+uint16_t net_ipv4_checksum_copy(uint8_t *dst, const uint8_t *src, size_t bytes,
+                                uint16_t start);
 int net_ipv4_send_packet(netif_t *net, ip_hdr_t *hdr, const uint8_t *data,
                          size_t size);
+int net_ipv4_send_packet_pbuf(netif_t *net, ip_hdr_t *hdr, net_pbuf_t *pkt);
 int net_ipv4_send(netif_t *net, const uint8_t *data, size_t size, int id, int ttl,
                   int proto, uint32_t src, uint32_t dst);
+int net_ipv4_send_pbuf(netif_t *net, net_pbuf_t *pkt, int id, int ttl,
+                       int proto, uint32_t src, uint32_t dst);
 int net_ipv4_input(netif_t *src, const uint8_t *pkt, size_t pktsize,
                    const eth_hdr_t *eth);
 int net_ipv4_input_proto(netif_t *net, const ip_hdr_t *ip, const uint8_t *data);
@@ -42,7 +47,14 @@ int net_ipv4_frag_send(netif_t *net, ip_hdr_t *hdr, const uint8_t *data,
                        size_t size);
 int net_ipv4_reassemble(netif_t *net, const ip_hdr_t *hdr, const uint8_t *data,
                         size_t size);
-int net_ipv4_frag_init(void);
-void net_ipv4_frag_shutdown(void);
+
+/* In net_arp.c */
+int net_arp_lookup_pbuf(netif_t *nif, const uint8_t ip_in[4],
+                        uint8_t mac_out[6], const ip_hdr_t *hdr,
+                        const net_pbuf_t *pkt);
+
+/* In net_pbuf.c */
+uint16_t __pure net_pbuf_checksum(const net_pbuf_t *pkt, uint16_t start);
+int net_pbuf_tx(netif_t *net, net_pbuf_t *pkt, int blocking);
 
 #endif /* __LOCAL_NET_IPV4_H */
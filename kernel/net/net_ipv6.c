@@ -7,6 +7,7 @@
 
 #include <stdint.h>
 #include <string.h>
+#include <stdlib.h>
 #include <netinet/in.h>
 #include <kos/net.h>
 #include <kos/fs_socket.h>
@@ -15,6 +16,7 @@
 #include "net_ipv6.h"
 #include "net_icmp6.h"
 #include "net_ipv4.h"
+#include "net_frag.h"
 
 #if __GNUC__ >= 9
 #pragma GCC diagnostic push
@@ -61,10 +63,12 @@ static int __pure is_in_network(netif_t *net, const struct in6_addr *ip) {
 }
 
 /* Send a packet on the specified network adapter */
-int net_ipv6_send_packet(netif_t *net, ipv6_hdr_t *hdr, const uint8_t *data,
-                         size_t data_size) {
-    uint8_t pkt[data_size + sizeof(ipv6_hdr_t) + sizeof(eth_hdr_t)];
+int net_ipv6_send_packet_pbuf(netif_t *net, ipv6_hdr_t *hdr, net_pbuf_t *pkt) {
+    uint8_t hbuf[sizeof(eth_hdr_t) + sizeof(ipv6_hdr_t)];
     uint8_t dst_mac[6];
+    net_pbuf_t hpb;
+    size_t hlen, data_size;
+    uint8_t *ptr;
     int err;
     struct in6_addr dst = hdr->dst_addr;
     eth_hdr_t *ehdr;
@@ -80,73 +84,154 @@ int net_ipv6_send_packet(netif_t *net, ipv6_hdr_t *hdr, const uint8_t *data,
 
     /* Are we sending a packet to loopback? */
     if(IN6_IS_ADDR_LOOPBACK(&hdr->dst_addr)) {
-        memcpy(pkt, hdr, sizeof(ipv6_hdr_t));
-        memcpy(pkt + sizeof(ipv6_hdr_t), data, data_size);
+        data_size = net_pbuf_length(pkt);
 
-        ++ipv6_stats.pkt_sent;
+        {
+            uint8_t buf[sizeof(ipv6_hdr_t) + data_size];
 
-        /* Send the packet "away" */
-        net_ipv6_input(NULL, pkt, sizeof(ipv6_hdr_t) + data_size, NULL);
-        return 0;
-    }
-    else if(net->flags & NETIF_NOETH) {
-        memcpy(pkt, hdr, sizeof(ipv6_hdr_t));
-        memcpy(pkt + sizeof(ipv6_hdr_t), data, data_size);
+            memcpy(buf, hdr, sizeof(ipv6_hdr_t));
+            net_pbuf_copy_out(pkt, buf + sizeof(ipv6_hdr_t), data_size);
 
-        ++ipv6_stats.pkt_sent;
+            ++ipv6_stats.pkt_sent;
 
-        /* Send the packet away */
-        return net->if_tx(net, pkt, sizeof(ipv6_hdr_t) + data_size,
-                          NETIF_BLOCK);
+            /* Send the packet "away" */
+            net_ipv6_input(NULL, buf, sizeof(ipv6_hdr_t) + data_size, NULL);
+        }
+
+        return 0;
     }
-    else if(IN6_IS_ADDR_MULTICAST(&hdr->dst_addr)) {
-        dst_mac[0] = dst_mac[1] = 0x33;
-        dst_mac[2] = hdr->dst_addr.__s6_addr.__s6_addr8[12];
-        dst_mac[3] = hdr->dst_addr.__s6_addr.__s6_addr8[13];
-        dst_mac[4] = hdr->dst_addr.__s6_addr.__s6_addr8[14];
-        dst_mac[5] = hdr->dst_addr.__s6_addr.__s6_addr8[15];
+    else if(net->flags & NETIF_NOETH) {
+        hlen = sizeof(ipv6_hdr_t);
     }
     else {
-        if(!is_in_network(net, &dst)) {
-            dst = net->ip6_gateway;
+        hlen = sizeof(eth_hdr_t) + sizeof(ipv6_hdr_t);
+
+        if(IN6_IS_ADDR_MULTICAST(&hdr->dst_addr)) {
+            dst_mac[0] = dst_mac[1] = 0x33;
+            dst_mac[2] = hdr->dst_addr.__s6_addr.__s6_addr8[12];
+            dst_mac[3] = hdr->dst_addr.__s6_addr.__s6_addr8[13];
+            dst_mac[4] = hdr->dst_addr.__s6_addr.__s6_addr8[14];
+            dst_mac[5] = hdr->dst_addr.__s6_addr.__s6_addr8[15];
         }
+        else {
+            if(!is_in_network(net, &dst)) {
+                dst = net->ip6_gateway;
+            }
 
-        err = net_ndp_lookup(net, &dst, dst_mac, hdr, data, data_size);
+            /* As with IPv4, the packet is saved to send once the address is
+               resolved. */
+            err = net_ndp_lookup_pbuf(net, &dst, dst_mac, hdr, pkt);
 
-        if(err == -1) {
-            errno = ENETUNREACH;
-            ++ipv6_stats.pkt_send_failed;
-            return err;
-        }
-        else if(err == -2) {
-            return 0;
+            if(err == -1) {
+                errno = ENETUNREACH;
+                ++ipv6_stats.pkt_send_failed;
+                return err;
+            }
+            else if(err == -2) {
+                return 0;
+            }
         }
     }
 
-    /* Fill in the ethernet header */
-    ehdr = (eth_hdr_t *)pkt;
-    memcpy(ehdr->dest, dst_mac, 6);
-    memcpy(ehdr->src, net->mac_addr, 6);
-    ehdr->type[0] = 0x86;
-    ehdr->type[1] = 0xDD;
+    /* Put the headers in front of the data, in the space left for them if
+       there is any, or in a piece of their own if not. */
+    if(!(ptr = net_pbuf_push(pkt, hlen))) {
+        net_pbuf_init(&hpb, hbuf, 0, hlen);
+        hpb.next = pkt;
+        pkt = &hpb;
+        ptr = hbuf;
+    }
+
+    if(!(net->flags & NETIF_NOETH)) {
+        /* Fill in the ethernet header */
+        ehdr = (eth_hdr_t *)ptr;
+        memcpy(ehdr->dest, dst_mac, 6);
+        memcpy(ehdr->src, net->mac_addr, 6);
+        ehdr->type[0] = 0x86;
+        ehdr->type[1] = 0xDD;
+        ptr += sizeof(eth_hdr_t);
+    }
 
-    /* Put the IP header / data into our ethernet packet */
-    memcpy(pkt + sizeof(eth_hdr_t), hdr, sizeof(ipv6_hdr_t));
-    memcpy(pkt + sizeof(eth_hdr_t) + sizeof(ipv6_hdr_t), data, data_size);
+    memcpy(ptr, hdr, sizeof(ipv6_hdr_t));
 
     ++ipv6_stats.pkt_sent;
 
     /* Send it away */
-    net->if_tx(net, pkt, sizeof(ipv6_hdr_t) + data_size + sizeof(eth_hdr_t),
-               NETIF_BLOCK);
+    if(net->flags & NETIF_NOETH)
+        return net_pbuf_tx(net, pkt, NETIF_BLOCK);
 
+    net_pbuf_tx(net, pkt, NETIF_BLOCK);
     return 0;
 }
 
-int net_ipv6_send(netif_t *net, const uint8_t *data, size_t data_size,
-                  int hop_limit, int proto, const struct in6_addr *src,
-                  const struct in6_addr *dst) {
+int net_ipv6_send_packet(netif_t *net, ipv6_hdr_t *hdr, const uint8_t *data,
+                         size_t data_size) {
+    net_pbuf_t pkt;
+
+    net_pbuf_init(&pkt, (uint8_t *)data, 0, data_size);
+    return net_ipv6_send_packet_pbuf(net, hdr, &pkt);
+}
+
+static inline size_t ipv6_mtu(netif_t *net) {
+    size_t mtu = net->mtu6 ? net->mtu6 : (size_t)net->mtu;
+
+    /* IPv6 links have to be able to carry at least this much. */
+    return mtu < 1280 ? 1280 : mtu;
+}
+
+/* Split a packet that's too big for the link up into fragments. Routers never
+   do this for IPv6, so it only ever happens here, at the sender. */
+static int ipv6_frag_send(netif_t *net, ipv6_hdr_t *hdr, net_pbuf_t *pkt,
+                          size_t size) {
+    ipv6_frag_hdr_t fh;
+    net_pbuf_t fpb, dpb;
+    size_t chunk, off, n;
+
+    if(size > FRAG_MAX_SIZE) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    /* All but the last fragment have to hold a multiple of 8 bytes. */
+    chunk = (ipv6_mtu(net) - sizeof(ipv6_hdr_t) - sizeof(ipv6_frag_hdr_t)) &
+            ~(size_t)7;
+
+    fh.next_header = hdr->next_header;
+    fh.reserved = 0;
+    fh.ident = (uint32_t)rand();
+    hdr->next_header = IPV6_HDR_EXT_FRAGMENT;
+
+    /* This needs it all in one piece, like with IPv4. */
+    {
+        uint8_t buf[size];
+
+        net_pbuf_copy_out(pkt, buf, size);
+
+        for(off = 0; off < size; off += n) {
+            n = size - off;
+
+            if(n > chunk)
+                n = chunk;
+
+            fh.frag_offs = htons(off | (off + n < size ? IPV6_FRAG_MORE : 0));
+            hdr->length = htons(sizeof(ipv6_frag_hdr_t) + n);
+
+            net_pbuf_init(&fpb, (uint8_t *)&fh, 0, sizeof(ipv6_frag_hdr_t));
+            net_pbuf_init(&dpb, buf + off, 0, n);
+            fpb.next = &dpb;
+
+            if(net_ipv6_send_packet_pbuf(net, hdr, &fpb))
+                return -1;
+        }
+    }
+
+    return 0;
+}
+
+int net_ipv6_send_pbuf(netif_t *net, net_pbuf_t *pkt, int hop_limit, int proto,
+                       const struct in6_addr *src, const struct in6_addr *dst) {
     ipv6_hdr_t hdr;
+    size_t data_size;
 
     if(!net) {
         net = net_default_dev;
@@ -171,15 +256,17 @@ int net_ipv6_send(netif_t *net, const uint8_t *data, size_t data_size,
        send function to do the rest. Note that only V4-mapped addresses are
        supported here (::ffff:x.y.z.w) */
     if(IN6_IS_ADDR_V4MAPPED(src) && IN6_IS_ADDR_V4MAPPED(dst)) {
-        return net_ipv4_send(net, data, data_size, -1, hop_limit, proto,
-                             src->__s6_addr.__s6_addr32[3],
-                             dst->__s6_addr.__s6_addr32[3]);
+        return net_ipv4_send_pbuf(net, pkt, -1, hop_limit, proto,
+                                  src->__s6_addr.__s6_addr32[3],
+                                  dst->__s6_addr.__s6_addr32[3]);
     }
     else if(IN6_IS_ADDR_V4MAPPED(src) || IN6_IS_ADDR_V4MAPPED(dst) ||
             IN6_IS_ADDR_V4COMPAT(src) || IN6_IS_ADDR_V4COMPAT(dst)) {
         return -1;
     }
 
+    data_size = net_pbuf_length(pkt);
+
     hdr.version_lclass = 0x60;
     hdr.hclass_lflow = 0;
     hdr.lclass = 0;
@@ -189,17 +276,158 @@ int net_ipv6_send(netif_t *net, const uint8_t *data, size_t data_size,
     hdr.src_addr = *src;
     hdr.dst_addr = *dst;
 
-    /* XXXX: Handle fragmentation... */
-    return net_ipv6_send_packet(net, &hdr, data, data_size);
+    if(data_size + sizeof(ipv6_hdr_t) > ipv6_mtu(net))
+        return ipv6_frag_send(net, &hdr, pkt, data_size);
+
+    return net_ipv6_send_packet_pbuf(net, &hdr, pkt);
+}
+
+int net_ipv6_send(netif_t *net, const uint8_t *data, size_t data_size,
+                  int hop_limit, int proto, const struct in6_addr *src,
+                  const struct in6_addr *dst) {
+    net_pbuf_t pkt;
+
+    net_pbuf_init(&pkt, (uint8_t *)data, 0, data_size);
+    return net_ipv6_send_pbuf(net, &pkt, hop_limit, proto, src, dst);
+}
+
+static int ipv6_input_payload(netif_t *src, const ipv6_hdr_t *ip,
+                              uint8_t next_hdr, const uint8_t *nh,
+                              const uint8_t *data, size_t len,
+                              const uint8_t *pkt, size_t pktsize);
+
+/* Hand a fragment off to be put back together with the rest of its packet. */
+static int ipv6_reassemble(netif_t *src, const ipv6_hdr_t *ip,
+                           const uint8_t *data, size_t len,
+                           const uint8_t *pkt, size_t pktsize) {
+    const ipv6_frag_hdr_t *fh = (const ipv6_frag_hdr_t *)data;
+    uint16_t offs;
+    net_frag_t frag;
+
+    if(len < sizeof(ipv6_frag_hdr_t)) {
+        ++ipv6_stats.pkt_recv_bad_size;
+        return -1;
+    }
+
+    offs = ntohs(fh->frag_offs);
+    data += sizeof(ipv6_frag_hdr_t);
+    len -= sizeof(ipv6_frag_hdr_t);
+
+    /* A fragment header on a packet that isn't fragmented at all (RFC 6946)
+       can just be skipped over. */
+    if(!(offs & (0xFFF8 | IPV6_FRAG_MORE))) {
+        return ipv6_input_payload(src, ip, fh->next_header, &fh->next_header,
+                                  data, len, pkt, pktsize);
+    }
+
+    /* Every fragment but the last has to be a multiple of 8 bytes long, and
+       none of them can go past the end of the biggest possible packet. RFC 8200
+       says which field to complain about for each. */
+    if((offs & IPV6_FRAG_MORE) && (!len || (len & 7))) {
+        ++ipv6_stats.pkt_recv_bad_size;
+        return net_icmp6_send_param_prob(src, ICMP6_PARAM_PROB_BAD_HEADER, 4,
+                                         pkt, pktsize);
+    }
+
+    if((offs & 0xFFF8) + len > FRAG_MAX_SIZE) {
+        ++ipv6_stats.pkt_recv_bad_size;
+        return net_icmp6_send_param_prob(src, ICMP6_PARAM_PROB_BAD_HEADER,
+                                         (const uint8_t *)&fh->frag_offs - pkt,
+                                         pkt, pktsize);
+    }
+
+    frag.domain = AF_INET6;
+    memcpy(&frag.src, &ip->src_addr, sizeof(struct in6_addr));
+    memcpy(&frag.dst, &ip->dst_addr, sizeof(struct in6_addr));
+    frag.ident = fh->ident;
+    frag.proto = fh->next_header;
+    frag.more = offs & IPV6_FRAG_MORE;
+    frag.offset = offs & 0xFFF8;
+    frag.timeout = FRAG_TIMEOUT_IPV6;
+    frag.hdr = ip;
+    frag.hdr_len = sizeof(ipv6_hdr_t);
+
+    return net_frag_input(src, &frag, data, len);
+}
+
+/* Pass the payload of a packet on to whatever protocol it's for, skipping over
+   any extension headers in front of it. The original packet is only used for
+   sending errors back, and isn't there for one that was put back together from
+   fragments. nh points at the field that held next_hdr. */
+static int ipv6_input_payload(netif_t *src, const ipv6_hdr_t *ip,
+                              uint8_t next_hdr, const uint8_t *nh,
+                              const uint8_t *data, size_t len,
+                              const uint8_t *pkt, size_t pktsize) {
+    const ipv6_ext_hdr_t *ext;
+    size_t hlen;
+    int rv;
+
+    for(;;) {
+        switch(next_hdr) {
+            case IPV6_HDR_EXT_HOP_BY_HOP:
+            case IPV6_HDR_EXT_DESTINATION:
+                /* None of the options in these are anything we act on, so just
+                   skip them. */
+                if(len < 8 ||
+                   len < (hlen = (((const ipv6_ext_hdr_t *)data)->ext_length +
+                                  1) << 3)) {
+                    ++ipv6_stats.pkt_recv_bad_size;
+                    return -1;
+                }
+
+                ext = (const ipv6_ext_hdr_t *)data;
+                next_hdr = ext->next_header;
+                nh = &ext->next_header;
+                data += hlen;
+                len -= hlen;
+                break;
+
+            case IPV6_HDR_EXT_FRAGMENT:
+                /* A packet that was already put back together can't have
+                   another fragment header in it. */
+                if(!pkt) {
+                    ++ipv6_stats.pkt_recv_bad_ext;
+                    return -1;
+                }
+
+                return ipv6_reassemble(src, ip, data, len, pkt, pktsize);
+
+            case IPV6_HDR_ICMP:
+                return net_icmp6_input(src, (ipv6_hdr_t *)ip, data, len);
+
+            default:
+                rv = fs_socket_input(src, AF_INET6, next_hdr,
+                                     (const uint8_t *)ip, data, len);
+
+                if(rv == -2) {
+                    /* We don't know what to do with this packet, so send an
+                       ICMPv6 message indicating that. */
+                    ++ipv6_stats.pkt_recv_bad_proto;
+
+                    if(!pkt)
+                        return -1;
+
+                    return net_icmp6_send_param_prob(src,
+                                                     ICMP6_PARAM_PROB_UNK_HEADER,
+                                                     nh - pkt, pkt, pktsize);
+                }
+
+                ++ipv6_stats.pkt_recv;
+                return rv;
+        }
+    }
+}
+
+int net_ipv6_input_proto(netif_t *src, const ipv6_hdr_t *ip,
+                         const uint8_t *data, size_t size) {
+    return ipv6_input_payload(src, ip, ip->next_header, NULL, data, size,
+                              NULL, 0);
 }
 
 int net_ipv6_input(netif_t *src, const uint8_t *pkt, size_t pktsize,
                    const eth_hdr_t *eth) {
-    ipv6_hdr_t *ip;
-    uint8_t next_hdr;
-    //int pos;
+    const ipv6_hdr_t *ip;
     size_t len;
-    int rv;
 
     if(pktsize < sizeof(ipv6_hdr_t)) {
         /* This is obviously a bad packet, drop it */
@@ -207,7 +435,7 @@ int net_ipv6_input(netif_t *src, const uint8_t *pkt, size_t pktsize,
         return -1;
     }
 
-    ip = (ipv6_hdr_t *)pkt;
+    ip = (const ipv6_hdr_t *)pkt;
     len = ntohs(ip->length);
 
     if(pktsize < len + sizeof(ipv6_hdr_t)) {
@@ -217,36 +445,11 @@ int net_ipv6_input(netif_t *src, const uint8_t *pkt, size_t pktsize,
         return -1;
     }
 
-    /* Parse the header to find the payload */
-    //pos = sizeof(ipv6_hdr_t); // Currently unused, but will be needed later.
-    next_hdr = ip->next_header;
-
     if(eth)
         net_ndp_insert(src, eth->src, &ip->src_addr, 1);
 
-    /* XXXX: Parse options and deal with fragmentation */
-    switch(next_hdr) {
-        case IPV6_HDR_ICMP:
-            return net_icmp6_input(src, ip, pkt + sizeof(ipv6_hdr_t), len);
-
-        default:
-            rv = fs_socket_input(src, AF_INET6, next_hdr, pkt,
-                                 pkt + sizeof(ipv6_hdr_t), len);
-
-            if(rv == -2) {
-                /* We don't know what to do with this packet, so send an ICMPv6
-                   message indicating that. */
-                ++ipv6_stats.pkt_recv_bad_proto;
-                return net_icmp6_send_param_prob(src,
-                                                 ICMP6_PARAM_PROB_UNK_HEADER, 6,
-                                                 pkt, pktsize);
-            }
-
-            ++ipv6_stats.pkt_recv;
-            return rv;
-    }
-
-    return 0;
+    return ipv6_input_payload(src, ip, ip->next_header, &ip->next_header,
+                              pkt + sizeof(ipv6_hdr_t), len, pkt, pktsize);
 }
 
 net_ipv6_stats_t net_ipv6_get_stats(void) {
@@ -18,6 +18,16 @@ typedef struct ipv6_ext_hdr_s {
     uint8_t       data[];
 } __packed ipv6_ext_hdr_t;
 
+typedef struct ipv6_frag_hdr_s {
+    uint8_t       next_header;
+    uint8_t       reserved;
+    uint16_t      frag_offs;
+    uint32_t      ident;
+} __packed ipv6_frag_hdr_t;
+
+/* In frag_offs, along with the offset in the upper 13 bits. */
+#define IPV6_FRAG_MORE              0x0001
+
 typedef struct ipv6_pseudo_hdr_s {
     struct in6_addr src_addr;
     struct in6_addr dst_addr;
@@ -37,11 +47,16 @@ typedef struct ipv6_pseudo_hdr_s {
 
 int net_ipv6_send_packet(netif_t *net, ipv6_hdr_t *hdr, const uint8_t *data,
                          size_t data_size);
+int net_ipv6_send_packet_pbuf(netif_t *net, ipv6_hdr_t *hdr, net_pbuf_t *pkt);
 int net_ipv6_send(netif_t *net, const uint8_t *data, size_t data_size,
                   int hop_limit, int proto, const struct in6_addr *src,
                   const struct in6_addr *dst);
+int net_ipv6_send_pbuf(netif_t *net, net_pbuf_t *pkt, int hop_limit, int proto,
+                       const struct in6_addr *src, const struct in6_addr *dst);
 int net_ipv6_input(netif_t *src, const uint8_t *pkt, size_t pktsize,
                    const eth_hdr_t *eth);
+int net_ipv6_input_proto(netif_t *src, const ipv6_hdr_t *ip,
+                         const uint8_t *data, size_t size);
 uint16_t net_ipv6_checksum_pseudo(const struct in6_addr *src,
                                 const struct in6_addr *dst,
                                 uint32_t upper_len, uint8_t next_hdr);
@@ -49,6 +64,11 @@ uint16_t net_ipv6_checksum_pseudo(const struct in6_addr *src,
 extern const struct in6_addr in6addr_linklocal_allnodes;
 extern const struct in6_addr in6addr_linklocal_allrouters;
 
+/* In net_ndp.c */
+int net_ndp_lookup_pbuf(netif_t *net, const struct in6_addr *ip,
+                        uint8_t mac_out[6], const ipv6_hdr_t *hdr,
+                        const net_pbuf_t *pkt);
+
 /* Init and Shutdown */
 int net_ipv6_init(void);
 void net_ipv6_shutdown(void);
@@ -0,0 +1,662 @@
+/* KallistiOS ##version##
+
+   kernel/net/net_loop.c
+   Copyright (C) 2026 The KallistiOS Team
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/queue.h>
+
+#include <kos/net.h>
+#include <kos/fs.h>
+#include <kos/mutex.h>
+#include <kos/genwait.h>
+#include <kos/dbglog.h>
+#include <arch/timer.h>
+
+#include "net_ipv4.h"
+#include "net_thd.h"
+
+/*
+
+  Software network device
+
+  Everything sent on this device comes back in on it, like on a cable that's
+  plugged into itself. It's an Ethernet device, so ARP/NDP and everything
+  above them get the same workout they would on a real network. On the way
+  through, frames can be held back, dropped or sent out of order, to see how
+  the stack copes with that.
+
+  Frames are always delivered from the network thread, never from inside
+  if_tx, so the stack never gets a packet while it's still in the middle of
+  sending one (and maybe holding a lock it'd need to take it in).
+
+  Frames that come in can also be recorded to a pcap file, and a pcap file
+  can be played back in as if its frames had just come in.
+
+*/
+
+#define LOOP_MTU        1500
+#define LOOP_FRAME_MAX  (LOOP_MTU + sizeof(eth_hdr_t))
+
+/* How many frames can be on their way at once. This is also how many are
+   delivered in one go before letting the rest of the network thread run. */
+#define LOOP_QUEUE_LEN  64
+
+typedef struct loop_frame {
+    TAILQ_ENTRY(loop_frame) entry;
+    uint64_t due;
+    int len;
+    uint8_t data[LOOP_FRAME_MAX];
+} loop_frame_t;
+
+TAILQ_HEAD(loop_queue, loop_frame);
+
+static netif_t loop_if;
+
+/* Frames on their way (sorted by when they're due) and free ones. */
+static loop_frame_t *frames;
+static struct loop_queue queue = TAILQ_HEAD_INITIALIZER(queue);
+static struct loop_queue free_frames = TAILQ_HEAD_INITIALIZER(free_frames);
+static net_timer_t deliver_timer;
+
+static net_loop_params_t params;
+static uint32_t rand_state;
+static net_loop_stats_t loop_stats;
+
+/* Protects all of the above. if_tx may be called inside an interrupt. */
+static mutex_t loop_mutex = RECURSIVE_MUTEX_INITIALIZER;
+
+/**************************************************************************/
+/* pcap files (see https://wiki.wireshark.org/Development/LibpcapFileFormat) */
+
+#define PCAP_MAGIC              0xA1B2C3D4
+#define PCAP_MAGIC_NSEC         0xA1B23C4D
+#define PCAP_LINKTYPE_ETHERNET  1
+
+typedef struct pcap_hdr {
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t network;
+} pcap_hdr_t;
+
+typedef struct pcap_rec {
+    uint32_t ts_sec;
+    uint32_t ts_frac;           /* Microseconds, or nanoseconds */
+    uint32_t incl_len;
+    uint32_t orig_len;
+} pcap_rec_t;
+
+static file_t rec_fd = FILEHND_INVALID;
+static uint64_t rec_base;       /* Wall clock time at timer_us_gettime64() 0 */
+
+static file_t play_fd = FILEHND_INVALID;
+static int play_flags;
+static int play_swap;
+static int play_nsec;
+static int play_have_rec;       /* play_rec holds the next frame's header */
+static int play_started;
+static uint64_t play_first;     /* Time of the first frame in the file (us) */
+static uint64_t play_start;     /* When it was played back (us) */
+static pcap_rec_t play_rec;
+static uint8_t play_buf[LOOP_FRAME_MAX];
+static net_timer_t play_timer;
+
+/* Protects the pcap state. This is only ever taken in a thread. */
+static mutex_t pcap_mutex = RECURSIVE_MUTEX_INITIALIZER;
+
+static void loop_pcap_write(const uint8_t *data, int len) {
+    pcap_rec_t rec;
+    uint64_t ts;
+
+    mutex_lock(&pcap_mutex);
+
+    if(rec_fd != FILEHND_INVALID) {
+        ts = rec_base + timer_us_gettime64();
+        rec.ts_sec = (uint32_t)(ts / 1000000);
+        rec.ts_frac = (uint32_t)(ts % 1000000);
+        rec.incl_len = rec.orig_len = len;
+
+        if(fs_write(rec_fd, &rec, sizeof(rec)) == (ssize_t)sizeof(rec) &&
+           fs_write(rec_fd, data, len) == len)
+            ++loop_stats.recorded;
+    }
+
+    mutex_unlock(&pcap_mutex);
+}
+
+int net_loop_pcap_record(const char *fn) {
+    file_t fd = FILEHND_INVALID;
+    pcap_hdr_t hdr;
+
+    if(fn) {
+        if((fd = fs_open(fn, O_WRONLY | O_CREAT | O_TRUNC)) == FILEHND_INVALID)
+            return -1;
+
+        hdr.magic = PCAP_MAGIC;
+        hdr.version_major = 2;
+        hdr.version_minor = 4;
+        hdr.thiszone = 0;
+        hdr.sigfigs = 0;
+        hdr.snaplen = LOOP_FRAME_MAX;
+        hdr.network = PCAP_LINKTYPE_ETHERNET;
+
+        if(fs_write(fd, &hdr, sizeof(hdr)) != (ssize_t)sizeof(hdr)) {
+            fs_close(fd);
+            errno = EIO;
+            return -1;
+        }
+    }
+
+    mutex_lock(&pcap_mutex);
+
+    if(rec_fd != FILEHND_INVALID)
+        fs_close(rec_fd);
+
+    rec_fd = fd;
+    rec_base = (uint64_t)time(NULL) * 1000000 - timer_us_gettime64();
+
+    mutex_unlock(&pcap_mutex);
+
+    return 0;
+}
+
+static uint32_t pcap_get32(uint32_t x) {
+    return play_swap ? __builtin_bswap32(x) : x;
+}
+
+/* Finish playing back a file. Called with pcap_mutex held. */
+static void loop_play_end(void) {
+    net_timer_cancel(&play_timer);
+
+    if(play_fd != FILEHND_INVALID) {
+        fs_close(play_fd);
+        play_fd = FILEHND_INVALID;
+    }
+
+    genwait_wake_all(&play_fd);
+}
+
+static void loop_play_cb(void *data) {
+    uint64_t ts, due, now;
+    size_t len;
+    int count = 0;
+
+    (void)data;
+
+    mutex_lock(&pcap_mutex);
+
+    while(play_fd != FILEHND_INVALID) {
+        if(!play_have_rec) {
+            if(fs_read(play_fd, &play_rec, sizeof(play_rec)) !=
+               (ssize_t)sizeof(play_rec)) {
+                loop_play_end();
+                break;
+            }
+
+            play_rec.ts_sec = pcap_get32(play_rec.ts_sec);
+            play_rec.ts_frac = pcap_get32(play_rec.ts_frac);
+            play_rec.incl_len = pcap_get32(play_rec.incl_len);
+            play_rec.orig_len = pcap_get32(play_rec.orig_len);
+            play_have_rec = 1;
+        }
+
+        now = timer_us_gettime64();
+
+        if(play_flags & NET_LOOP_REPLAY_TIMED) {
+            ts = (uint64_t)play_rec.ts_sec * 1000000 +
+                 (play_nsec ? play_rec.ts_frac / 1000 : play_rec.ts_frac);
+
+            if(!play_started) {
+                play_first = ts;
+                play_start = now;
+                play_started = 1;
+            }
+
+            due = play_start + (ts > play_first ? ts - play_first : 0);
+
+            if(due > now) {
+                net_timer_arm(&play_timer, (due + 999) / 1000);
+                break;
+            }
+        }
+
+        /* Let everything else on the network thread have a turn. */
+        if(count++ == LOOP_QUEUE_LEN) {
+            net_timer_arm(&play_timer, now / 1000);
+            break;
+        }
+
+        play_have_rec = 0;
+        len = play_rec.incl_len;
+
+        if(len < sizeof(eth_hdr_t) || len > LOOP_FRAME_MAX ||
+           len < play_rec.orig_len) {
+            if(fs_seek(play_fd, len, SEEK_CUR) < 0)
+                loop_play_end();
+
+            continue;
+        }
+
+        if(fs_read(play_fd, play_buf, len) != (ssize_t)len) {
+            loop_play_end();
+            break;
+        }
+
+        ++loop_stats.replayed;
+
+        /* play_buf is only ever used here, on the network thread, so it's
+           fine to let go of the lock while the stack has it. */
+        mutex_unlock(&pcap_mutex);
+
+        loop_pcap_write(play_buf, len);
+        net_input(&loop_if, play_buf, len);
+
+        mutex_lock(&pcap_mutex);
+    }
+
+    mutex_unlock(&pcap_mutex);
+}
+
+int net_loop_pcap_replay(const char *fn, int flags) {
+    file_t fd = FILEHND_INVALID;
+    pcap_hdr_t hdr;
+    int swap = 0, nsec = 0;
+
+    if(fn) {
+        if((fd = fs_open(fn, O_RDONLY)) == FILEHND_INVALID)
+            return -1;
+
+        if(fs_read(fd, &hdr, sizeof(hdr)) != (ssize_t)sizeof(hdr)) {
+            fs_close(fd);
+            errno = EINVAL;
+            return -1;
+        }
+
+        if(hdr.magic == __builtin_bswap32(PCAP_MAGIC) ||
+           hdr.magic == __builtin_bswap32(PCAP_MAGIC_NSEC)) {
+            swap = 1;
+            hdr.magic = __builtin_bswap32(hdr.magic);
+            hdr.network = __builtin_bswap32(hdr.network);
+        }
+
+        if(hdr.magic == PCAP_MAGIC_NSEC)
+            nsec = 1;
+
+        if((hdr.magic != PCAP_MAGIC && !nsec) ||
+           hdr.network != PCAP_LINKTYPE_ETHERNET) {
+            dbglog(DBG_WARNING, "net_loop: %s isn't an Ethernet pcap file\n",
+                   fn);
+            fs_close(fd);
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    mutex_lock(&pcap_mutex);
+
+    loop_play_end();
+
+    if(fd != FILEHND_INVALID) {
+        play_fd = fd;
+        play_flags = flags;
+        play_swap = swap;
+        play_nsec = nsec;
+        play_have_rec = 0;
+        play_started = 0;
+        net_timer_arm(&play_timer, timer_ms_gettime64());
+    }
+
+    mutex_unlock(&pcap_mutex);
+
+    return 0;
+}
+
+void net_loop_pcap_replay_wait(void) {
+    mutex_lock(&pcap_mutex);
+
+    /* The timeout covers the end of the file coming between letting go of the
+       lock and starting to wait. */
+    while(play_fd != FILEHND_INVALID) {
+        mutex_unlock(&pcap_mutex);
+        genwait_wait(&play_fd, "net_loop_pcap_replay_wait", 100, NULL);
+        mutex_lock(&pcap_mutex);
+    }
+
+    mutex_unlock(&pcap_mutex);
+}
+
+/**************************************************************************/
+/* The device itself */
+
+/* xorshift32: cheap, and the same every run for a given seed. */
+static uint32_t loop_rand(void) {
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 17;
+    rand_state ^= rand_state << 5;
+    return rand_state;
+}
+
+static int loop_chance(uint32_t per_mille) {
+    return per_mille && loop_rand() % 1000 < per_mille;
+}
+
+/* Hand any frames that are due back to the stack. */
+static void loop_deliver(void) {
+    loop_frame_t *f;
+    uint64_t now = timer_ms_gettime64();
+    int count = 0;
+
+    ++loop_if.stats.rx_wakeups;
+
+    for(;;) {
+        if(mutex_lock_irqsafe(&loop_mutex))
+            return;
+
+        f = TAILQ_FIRST(&queue);
+
+        if(!f || f->due > now || count++ == LOOP_QUEUE_LEN) {
+            /* Anything sent back right away in reply to what was just
+               delivered waits for the next pass, so that a conversation with
+               no delay set can't keep the network thread to itself. */
+            if(f)
+                net_timer_arm(&deliver_timer, f->due > now ? f->due : now);
+
+            mutex_unlock(&loop_mutex);
+            break;
+        }
+
+        TAILQ_REMOVE(&queue, f, entry);
+        ++loop_stats.rx;
+        ++loop_if.stats.rx_pkts;
+        loop_if.stats.rx_bytes += f->len;
+        mutex_unlock(&loop_mutex);
+
+        /* The frame is off both lists, so it's all ours until it's put back. */
+        loop_pcap_write(f->data, f->len);
+        net_input(&loop_if, f->data, f->len);
+
+        if(mutex_lock_irqsafe(&loop_mutex) == 0) {
+            TAILQ_INSERT_TAIL(&free_frames, f, entry);
+            mutex_unlock(&loop_mutex);
+        }
+    }
+}
+
+static void loop_deliver_cb(void *data) {
+    (void)data;
+    loop_deliver();
+}
+
+static int loop_if_detect(netif_t *self) {
+    self->flags |= NETIF_DETECTED;
+    return 0;
+}
+
+static int loop_if_init(netif_t *self) {
+    int i;
+
+    if(self->flags & NETIF_INITIALIZED)
+        return 0;
+
+    if(!frames) {
+        if(!(frames = (loop_frame_t *)malloc(sizeof(loop_frame_t) *
+                                             LOOP_QUEUE_LEN))) {
+            errno = ENOMEM;
+            return -1;
+        }
+
+        for(i = 0; i < LOOP_QUEUE_LEN; ++i)
+            TAILQ_INSERT_TAIL(&free_frames, &frames[i], entry);
+    }
+
+    self->flags |= NETIF_INITIALIZED;
+    return 0;
+}
+
+static int loop_if_shutdown(netif_t *self) {
+    if(!(self->flags & NETIF_INITIALIZED))
+        return 0;
+
+    net_timer_cancel(&deliver_timer);
+
+    mutex_lock(&loop_mutex);
+    TAILQ_INIT(&queue);
+    TAILQ_INIT(&free_frames);
+    free(frames);
+    frames = NULL;
+    mutex_unlock(&loop_mutex);
+
+    self->flags &= ~(NETIF_DETECTED | NETIF_INITIALIZED | NETIF_RUNNING);
+    return 0;
+}
+
+static int loop_if_start(netif_t *self) {
+    if(!(self->flags & NETIF_INITIALIZED))
+        return -1;
+
+    self->flags |= NETIF_RUNNING;
+    return 0;
+}
+
+static int loop_if_stop(netif_t *self) {
+    if(!(self->flags & NETIF_RUNNING))
+        return -1;
+
+    self->flags &= ~NETIF_RUNNING;
+    return 0;
+}
+
+static int loop_if_tx(netif_t *self, const uint8_t *data, int len,
+                      int blocking) {
+    loop_frame_t *f, *i;
+    uint64_t now;
+
+    if(!(self->flags & NETIF_RUNNING) || len <= 0 ||
+       (size_t)len > LOOP_FRAME_MAX)
+        return NETIF_TX_ERROR;
+
+    if(mutex_lock_irqsafe(&loop_mutex))
+        return NETIF_TX_AGAIN;
+
+    if(!(f = TAILQ_FIRST(&free_frames))) {
+        /* There's nothing to wait on that doesn't need the network thread,
+           which might well be who's sending this. So, just like a switch
+           with a full buffer, drop it on the floor if we have to. */
+        if(blocking) {
+            ++loop_stats.tx;
+            ++loop_stats.overflow;
+            ++self->stats.rx_dropped;
+        }
+        else {
+            ++self->stats.tx_busy;
+        }
+
+        mutex_unlock(&loop_mutex);
+        return blocking ? NETIF_TX_OK : NETIF_TX_AGAIN;
+    }
+
+    ++loop_stats.tx;
+    ++self->stats.tx_pkts;
+    self->stats.tx_bytes += len;
+
+    if(loop_chance(params.loss)) {
+        ++loop_stats.lost;
+        mutex_unlock(&loop_mutex);
+        return NETIF_TX_OK;
+    }
+
+    TAILQ_REMOVE(&free_frames, f, entry);
+    memcpy(f->data, data, len);
+    f->len = len;
+    now = timer_ms_gettime64();
+
+    if(loop_chance(params.reorder)) {
+        f->due = now;
+        ++loop_stats.reordered;
+    }
+    else {
+        f->due = now + params.delay;
+
+        if(params.jitter)
+            f->due += loop_rand() % (params.jitter + 1);
+
+        /* Don't let jitter pass a frame that went out before this one. */
+        if((i = TAILQ_LAST(&queue, loop_queue)) && i->due > f->due)
+            f->due = i->due;
+    }
+
+    /* Keep the queue in order of when things are due, and in the order they
+       were sent for frames that are due at the same time. */
+    TAILQ_FOREACH_REVERSE(i, &queue, loop_queue, entry) {
+        if(i->due <= f->due)
+            break;
+    }
+
+    if(i)
+        TAILQ_INSERT_AFTER(&queue, i, f, entry);
+    else
+        TAILQ_INSERT_HEAD(&queue, f, entry);
+
+    net_timer_arm_before(&deliver_timer, TAILQ_FIRST(&queue)->due);
+
+    mutex_unlock(&loop_mutex);
+    return NETIF_TX_OK;
+}
+
+static int loop_if_tx_commit(netif_t *self) {
+    (void)self;
+    return 0;
+}
+
+static int loop_if_rx_poll(netif_t *self) {
+    (void)self;
+    loop_deliver();
+    return 0;
+}
+
+static int loop_if_set_flags(netif_t *self, uint32_t flags_and,
+                             uint32_t flags_or) {
+    self->flags = (self->flags & flags_and) | flags_or;
+    return 0;
+}
+
+/* Everything gets through; net_input() does the filtering. */
+static int loop_if_set_mc(netif_t *self, const uint8_t *list, int count) {
+    (void)self;
+    (void)list;
+    (void)count;
+    return 0;
+}
+
+static void set_ipv6_lladdr(void) {
+    /* Set up the IPv6 link-local address. This is done in accordance with
+       Section 4/5 of RFC 2464 based on the MAC Address of the adapter. */
+    memset(&loop_if.ip6_lladdr, 0, sizeof(loop_if.ip6_lladdr));
+    loop_if.ip6_lladdr.__s6_addr.__s6_addr8[0]  = 0xFE;
+    loop_if.ip6_lladdr.__s6_addr.__s6_addr8[1]  = 0x80;
+    loop_if.ip6_lladdr.__s6_addr.__s6_addr8[8]  = loop_if.mac_addr[0] ^ 0x02;
+    loop_if.ip6_lladdr.__s6_addr.__s6_addr8[9]  = loop_if.mac_addr[1];
+    loop_if.ip6_lladdr.__s6_addr.__s6_addr8[10] = loop_if.mac_addr[2];
+    loop_if.ip6_lladdr.__s6_addr.__s6_addr8[11] = 0xFF;
+    loop_if.ip6_lladdr.__s6_addr.__s6_addr8[12] = 0xFE;
+    loop_if.ip6_lladdr.__s6_addr.__s6_addr8[13] = loop_if.mac_addr[3];
+    loop_if.ip6_lladdr.__s6_addr.__s6_addr8[14] = loop_if.mac_addr[4];
+    loop_if.ip6_lladdr.__s6_addr.__s6_addr8[15] = loop_if.mac_addr[5];
+}
+
+void net_loop_set_params(const net_loop_params_t *p) {
+    if(mutex_lock_irqsafe(&loop_mutex))
+        return;
+
+    params = *p;
+    rand_state = params.seed ? params.seed : 0x2545F491;
+
+    mutex_unlock(&loop_mutex);
+}
+
+net_loop_stats_t net_loop_get_stats(void) {
+    return loop_stats;
+}
+
+netif_t *net_loop_init(void) {
+    /* A locally administered address, so it can't clash with real hardware. */
+    static const uint8_t mac[6] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
+    net_loop_params_t p;
+
+    if(loop_if.flags & NETIF_REGISTERED)
+        return &loop_if;
+
+    memset(&loop_if, 0, sizeof(loop_if));
+    loop_if.name = "lo";
+    loop_if.descr = "Software loopback device";
+    loop_if.index = 0;
+    loop_if.dev_id = 0;
+    loop_if.flags = NETIF_NO_FLAGS;
+    memcpy(loop_if.mac_addr, mac, 6);
+
+    /* 10.0.0.1/24 -- anything but 127/8, which never makes it to a device. */
+    loop_if.ip_addr[0] = 10;
+    loop_if.ip_addr[3] = 1;
+    loop_if.netmask[0] = loop_if.netmask[1] = loop_if.netmask[2] = 255;
+    loop_if.broadcast[0] = 10;
+    loop_if.broadcast[3] = 255;
+    loop_if.mtu = LOOP_MTU;
+    set_ipv6_lladdr();
+
+    loop_if.if_detect = loop_if_detect;
+    loop_if.if_init = loop_if_init;
+    loop_if.if_shutdown = loop_if_shutdown;
+    loop_if.if_start = loop_if_start;
+    loop_if.if_stop = loop_if_stop;
+    loop_if.if_tx = loop_if_tx;
+    loop_if.if_tx_commit = loop_if_tx_commit;
+    loop_if.if_rx_poll = loop_if_rx_poll;
+    loop_if.if_set_flags = loop_if_set_flags;
+    loop_if.if_set_mc = loop_if_set_mc;
+
+    net_timer_init(&deliver_timer, &loop_deliver_cb, NULL);
+    net_timer_init(&play_timer, &loop_play_cb, NULL);
+
+    memset(&p, 0, sizeof(p));
+    net_loop_set_params(&p);
+    memset(&loop_stats, 0, sizeof(loop_stats));
+
+    /* Bring it all the way up now, since net_init() might have already been
+       and gone. If it hasn't, it'll find the device is already running. */
+    if(loop_if_detect(&loop_if) < 0 || loop_if_init(&loop_if) < 0 ||
+       loop_if_start(&loop_if) < 0)
+        return NULL;
+
+    if(net_reg_device(&loop_if) < 0) {
+        loop_if_shutdown(&loop_if);
+        errno = EBUSY;
+        return NULL;
+    }
+
+    return &loop_if;
+}
+
+void net_loop_shutdown(void) {
+    if(!(loop_if.flags & NETIF_REGISTERED))
+        return;
+
+    net_loop_pcap_record(NULL);
+    net_loop_pcap_replay(NULL, 0);
+
+    loop_if_stop(&loop_if);
+    loop_if_shutdown(&loop_if);
+    net_unreg_device(&loop_if);
+
+    if(net_default_dev == &loop_if)
+        net_set_default(NULL);
+}
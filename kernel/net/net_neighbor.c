@@ -0,0 +1,411 @@
+/* KallistiOS ##version##
+
+   kernel/net/net_neighbor.c
+   Copyright (C) 2026 The KallistiOS Team
+
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/queue.h>
+
+#include <kos/net.h>
+#include <kos/mutex.h>
+#include <arch/timer.h>
+
+#include "net_neighbor.h"
+#include "net_ipv4.h"
+#include "net_ipv6.h"
+#include "net_thd.h"
+
+/* This is the neighbor table shared by ARP and NDP. It used to be two separate
+   lists, each of which was walked on every lookup and every insert, and then
+   walked again to throw out old entries, so every packet going out paid for a
+   couple of trips through the whole list.
+
+   Entries are now hashed on the address, and each one has its own timer for
+   the next time its state needs to change, loosely following the neighbor
+   unreachability detection state machine from RFC 4861, section 7.3:
+
+   INCOMPLETE - Resolution is in progress. The query is resent every second,
+                and the entry is dropped after a few tries with no answer.
+                Packets sent to the address in the meantime are held on to
+                (up to a limit) and sent once the answer comes in.
+   REACHABLE  - We've heard from the neighbor recently. After a while, it goes
+                to STALE.
+   STALE      - The address is still used, but the next time it is, the
+                neighbor gets probed. Entries that go unused for long enough
+                are dropped.
+   PROBE      - Like INCOMPLETE, but the old address is still used while we
+                wait for the neighbor to answer.
+   PERMANENT  - Set by hand, never changes.
+
+   To keep things cheap on the receive side (every IPv4 packet that comes in
+   updates the table), confirming an entry that is already reachable doesn't
+   touch its timer, only its timestamp. The timer looks at that when it goes
+   off and puts itself back if the entry was confirmed in the meantime. */
+
+#define NEIGH_INCOMPLETE        0
+#define NEIGH_REACHABLE         1
+#define NEIGH_STALE             2
+#define NEIGH_PROBE             3
+#define NEIGH_PERMANENT         4
+
+#define NEIGH_HASH_BITS         6
+#define NEIGH_HASH_SIZE         (1 << NEIGH_HASH_BITS)
+
+#define NEIGH_RETRANS_TIME      1000        /* Between queries */
+#define NEIGH_MAX_PROBES        3           /* Queries before giving up */
+#define NEIGH_REACHABLE_TIME    30000       /* Until REACHABLE goes STALE */
+#define NEIGH_STALE_TIME        600000      /* Unused STALE entries go away */
+#define NEIGH_MAX_QUEUED        3           /* Packets held per entry */
+
+struct neigh_pkt {
+    STAILQ_ENTRY(neigh_pkt) entry;
+    size_t data_size;
+    uint8_t buf[];                          /* The header, then the data */
+};
+
+STAILQ_HEAD(neigh_pkt_queue, neigh_pkt);
+
+typedef struct neigh_entry {
+    LIST_ENTRY(neigh_entry) hash_entry;
+    net_timer_t timer;
+    struct in6_addr ip;
+    netif_t *nif;
+    uint64_t confirmed;
+    uint64_t used;
+    int state;
+    int probes;
+    int queued;
+    uint8_t mac[6];
+    struct neigh_pkt_queue pkts;
+} neigh_entry_t;
+
+LIST_HEAD(neigh_list, neigh_entry);
+
+static struct neigh_list neigh_hash[NEIGH_HASH_SIZE];
+static mutex_t neigh_mutex = RECURSIVE_MUTEX_INITIALIZER;
+
+static inline unsigned int neigh_bucket(const struct in6_addr *ip) {
+    uint32_t h = ip->__s6_addr.__s6_addr32[0] ^ ip->__s6_addr.__s6_addr32[1] ^
+                 ip->__s6_addr.__s6_addr32[2] ^ ip->__s6_addr.__s6_addr32[3];
+
+    return (h * 0x9E3779B1) >> (32 - NEIGH_HASH_BITS);
+}
+
+static neigh_entry_t *neigh_find(const struct in6_addr *ip) {
+    neigh_entry_t *e;
+
+    LIST_FOREACH(e, &neigh_hash[neigh_bucket(ip)], hash_entry) {
+        if(e->ip.__s6_addr.__s6_addr32[3] == ip->__s6_addr.__s6_addr32[3] &&
+           e->ip.__s6_addr.__s6_addr32[2] == ip->__s6_addr.__s6_addr32[2] &&
+           e->ip.__s6_addr.__s6_addr32[1] == ip->__s6_addr.__s6_addr32[1] &&
+           e->ip.__s6_addr.__s6_addr32[0] == ip->__s6_addr.__s6_addr32[0])
+            return e;
+    }
+
+    return NULL;
+}
+
+/* Send out a query for the entry's address. */
+static void neigh_solicit(neigh_entry_t *e) {
+    if(!e->nif)
+        return;
+
+    if(IN6_IS_ADDR_V4MAPPED(&e->ip))
+        net_arp_query(e->nif, e->ip.s6_addr + 12);
+    else
+        net_ndp_solicit(e->nif, &e->ip);
+}
+
+static void neigh_free_pkts(struct neigh_pkt_queue *q) {
+    struct neigh_pkt *p, *n;
+
+    p = STAILQ_FIRST(q);
+
+    while(p) {
+        n = STAILQ_NEXT(p, entry);
+        free(p);
+        p = n;
+    }
+
+    STAILQ_INIT(q);
+}
+
+static void neigh_free(neigh_entry_t *e) {
+    net_timer_cancel(&e->timer);
+    LIST_REMOVE(e, hash_entry);
+    neigh_free_pkts(&e->pkts);
+    free(e);
+}
+
+static void neigh_timer_cb(void *data) {
+    neigh_entry_t *e = (neigh_entry_t *)data;
+    uint64_t now = timer_ms_gettime64();
+
+    mutex_lock(&neigh_mutex);
+
+    switch(e->state) {
+        case NEIGH_INCOMPLETE:
+        case NEIGH_PROBE:
+
+            if(++e->probes >= NEIGH_MAX_PROBES) {
+                neigh_free(e);
+                break;
+            }
+
+            neigh_solicit(e);
+            net_timer_arm(&e->timer, now + NEIGH_RETRANS_TIME);
+            break;
+
+        case NEIGH_REACHABLE:
+
+            /* See if it's been confirmed since the timer was started. */
+            if(e->confirmed + NEIGH_REACHABLE_TIME > now) {
+                net_timer_arm(&e->timer, e->confirmed + NEIGH_REACHABLE_TIME);
+                break;
+            }
+
+            e->state = NEIGH_STALE;
+            __fallthrough;
+
+        case NEIGH_STALE:
+
+            if(e->used + NEIGH_STALE_TIME <= now &&
+               e->confirmed + NEIGH_STALE_TIME <= now) {
+                neigh_free(e);
+                break;
+            }
+
+            net_timer_arm(&e->timer, (e->used > e->confirmed ? e->used :
+                                      e->confirmed) + NEIGH_STALE_TIME);
+            break;
+    }
+
+    mutex_unlock(&neigh_mutex);
+}
+
+static neigh_entry_t *neigh_create(netif_t *nif, const struct in6_addr *ip) {
+    neigh_entry_t *e;
+
+    if(!(e = (neigh_entry_t *)malloc(sizeof(neigh_entry_t))))
+        return NULL;
+
+    memset(e, 0, sizeof(neigh_entry_t));
+    e->ip = *ip;
+    e->nif = nif;
+    e->used = e->confirmed = timer_ms_gettime64();
+    STAILQ_INIT(&e->pkts);
+    net_timer_init(&e->timer, &neigh_timer_cb, e);
+    LIST_INSERT_HEAD(&neigh_hash[neigh_bucket(ip)], e, hash_entry);
+
+    return e;
+}
+
+/* Hold on to a packet until the address is resolved. The packet might be in
+   several pieces, so it is put back together here. If there are already too
+   many waiting, the oldest one goes. */
+static int neigh_queue(neigh_entry_t *e, const void *hdr, size_t hdr_size,
+                       const net_pbuf_t *pkt) {
+    struct neigh_pkt *p;
+    size_t data_size = net_pbuf_length(pkt);
+
+    if(!(p = (struct neigh_pkt *)malloc(sizeof(struct neigh_pkt) + hdr_size +
+                                        data_size)))
+        return -1;
+
+    p->data_size = data_size;
+    memcpy(p->buf, hdr, hdr_size);
+    net_pbuf_copy_out(pkt, p->buf + hdr_size, data_size);
+
+    if(e->queued == NEIGH_MAX_QUEUED) {
+        struct neigh_pkt *old = STAILQ_FIRST(&e->pkts);
+
+        STAILQ_REMOVE_HEAD(&e->pkts, entry);
+        free(old);
+        --e->queued;
+    }
+
+    STAILQ_INSERT_TAIL(&e->pkts, p, entry);
+    ++e->queued;
+
+    return 0;
+}
+
+int net_neigh_lookup(netif_t *nif, const struct in6_addr *ip,
+                     uint8_t mac_out[6], const void *hdr, size_t hdr_size,
+                     const net_pbuf_t *pkt) {
+    neigh_entry_t *e;
+    int rv = 0;
+
+    if(pkt && !net_pbuf_length(pkt))
+        pkt = NULL;
+
+    if(mutex_lock_irqsafe(&neigh_mutex))
+        return -1;
+
+    if((e = neigh_find(ip))) {
+        if(e->state != NEIGH_INCOMPLETE)
+            e->used = timer_ms_gettime64();
+
+        switch(e->state) {
+            case NEIGH_INCOMPLETE:
+                rv = -1;
+
+                if(hdr && pkt && !neigh_queue(e, hdr, hdr_size, pkt))
+                    rv = -2;
+
+                goto out_nomac;
+
+            case NEIGH_STALE:
+                /* Make sure the neighbor is still there, but keep using the
+                   address we have in the meantime. */
+                e->state = NEIGH_PROBE;
+                e->probes = 0;
+                e->nif = nif;
+                neigh_solicit(e);
+                net_timer_arm(&e->timer, e->used + NEIGH_RETRANS_TIME);
+                break;
+        }
+
+        memcpy(mac_out, e->mac, 6);
+        mutex_unlock(&neigh_mutex);
+        return 0;
+    }
+
+    /* It's not there, so add an incomplete entry and ask around for it. */
+    if(!(e = neigh_create(nif, ip))) {
+        rv = -3;
+        goto out_nomac;
+    }
+
+    if(hdr && pkt)
+        neigh_queue(e, hdr, hdr_size, pkt);
+
+    neigh_solicit(e);
+    net_timer_arm(&e->timer, e->used + NEIGH_RETRANS_TIME);
+    rv = -2;
+
+out_nomac:
+    mutex_unlock(&neigh_mutex);
+    memset(mac_out, 0, 6);
+    return rv;
+}
+
+int net_neigh_update(netif_t *nif, const struct in6_addr *ip,
+                     const uint8_t mac[6], int how) {
+    neigh_entry_t *e;
+    struct neigh_pkt *p, *n;
+    uint64_t now = timer_ms_gettime64();
+    int changed, v4;
+
+    if(mutex_lock_irqsafe(&neigh_mutex))
+        return -1;
+
+    if(!(e = neigh_find(ip))) {
+        if(!(e = neigh_create(nif, ip))) {
+            mutex_unlock(&neigh_mutex);
+            return -1;
+        }
+
+        changed = 1;
+    }
+    else {
+        changed = e->state == NEIGH_INCOMPLETE || memcmp(e->mac, mac, 6);
+
+        /* The quick case: nothing new, from something we already know is
+           there. */
+        if(!changed && how == NEIGH_UPDATE_CONFIRMED &&
+           e->state == NEIGH_REACHABLE) {
+            e->confirmed = now;
+            mutex_unlock(&neigh_mutex);
+            return 0;
+        }
+    }
+
+    memcpy(e->mac, mac, 6);
+    e->nif = nif;
+    e->probes = 0;
+
+    if(how == NEIGH_UPDATE_PERMANENT || e->state == NEIGH_PERMANENT) {
+        e->state = NEIGH_PERMANENT;
+        net_timer_cancel(&e->timer);
+    }
+    else if(how == NEIGH_UPDATE_UNSOL && changed) {
+        /* We heard a new address for it, but not from the neighbor answering
+           us, so it needs to be checked before it can be trusted as
+           reachable. */
+        e->state = NEIGH_STALE;
+        e->used = now;
+        net_timer_arm(&e->timer, now + NEIGH_STALE_TIME);
+    }
+    else {
+        e->state = NEIGH_REACHABLE;
+        e->confirmed = now;
+        net_timer_arm(&e->timer, now + NEIGH_REACHABLE_TIME);
+    }
+
+    /* Send anything that was waiting on the address, once the lock is let go
+       of (since sending it will look the address up again). */
+    p = STAILQ_FIRST(&e->pkts);
+    STAILQ_INIT(&e->pkts);
+    e->queued = 0;
+    v4 = IN6_IS_ADDR_V4MAPPED(ip);
+
+    mutex_unlock(&neigh_mutex);
+
+    while(p) {
+        n = STAILQ_NEXT(p, entry);
+
+        if(v4)
+            net_ipv4_send_packet(nif, (ip_hdr_t *)p->buf,
+                                 p->buf + sizeof(ip_hdr_t), p->data_size);
+        else
+            net_ipv6_send_packet(nif, (ipv6_hdr_t *)p->buf,
+                                 p->buf + sizeof(ipv6_hdr_t), p->data_size);
+
+        free(p);
+        p = n;
+    }
+
+    return 0;
+}
+
+int net_neigh_revlookup(const uint8_t mac[6], int domain,
+                        struct in6_addr *ip_out) {
+    neigh_entry_t *e;
+    int i;
+
+    if(mutex_lock_irqsafe(&neigh_mutex))
+        return -1;
+
+    for(i = 0; i < NEIGH_HASH_SIZE; ++i) {
+        LIST_FOREACH(e, &neigh_hash[i], hash_entry) {
+            if(e->state != NEIGH_INCOMPLETE && !memcmp(mac, e->mac, 6) &&
+               !IN6_IS_ADDR_V4MAPPED(&e->ip) == (domain == AF_INET6)) {
+                *ip_out = e->ip;
+                mutex_unlock(&neigh_mutex);
+                return 0;
+            }
+        }
+    }
+
+    mutex_unlock(&neigh_mutex);
+    return -1;
+}
+
+void net_neigh_flush(void) {
+    neigh_entry_t *e;
+    int i;
+
+    mutex_lock(&neigh_mutex);
+
+    for(i = 0; i < NEIGH_HASH_SIZE; ++i) {
+        while((e = LIST_FIRST(&neigh_hash[i])))
+            neigh_free(e);
+    }
+
+    mutex_unlock(&neigh_mutex);
+}
@@ -0,0 +1,45 @@
+/* KallistiOS ##version##
+
+   kernel/net/net_neighbor.h
+   Copyright (C) 2026 The KallistiOS Team
+
+*/
+
+#ifndef __LOCAL_NET_NEIGHBOR_H
+#define __LOCAL_NET_NEIGHBOR_H
+
+#include <kos/cdefs.h>
+__BEGIN_DECLS
+
+#include <stdint.h>
+#include <stddef.h>
+#include <netinet/in.h>
+#include <kos/net.h>
+
+/* The neighbor table that backs both ARP and NDP. IPv4 addresses are kept in
+   it as v4-mapped IPv6 addresses. */
+
+/* How an entry got its link-layer address, for net_neigh_update(). */
+#define NEIGH_UPDATE_CONFIRMED  0   /* Confirmed reachable (a reply) */
+#define NEIGH_UPDATE_UNSOL      1   /* Heard about it some other way */
+#define NEIGH_UPDATE_PERMANENT  2   /* Set by hand, never expires */
+
+int net_neigh_lookup(netif_t *nif, const struct in6_addr *ip,
+                     uint8_t mac_out[6], const void *hdr, size_t hdr_size,
+                     const net_pbuf_t *pkt);
+int net_neigh_update(netif_t *nif, const struct in6_addr *ip,
+                     const uint8_t mac[6], int how);
+int net_neigh_revlookup(const uint8_t mac[6], int domain,
+                        struct in6_addr *ip_out);
+
+/* Throw out every entry. Only safe once the network thread has stopped, since
+   an entry's timer callback may already be running (and waiting on the lock)
+   when the entry is freed. */
+void net_neigh_flush(void);
+
+/* From net_ndp.c. */
+void net_ndp_solicit(netif_t *net, const struct in6_addr *ip);
+
+__END_DECLS
+
+#endif /* !__LOCAL_NET_NEIGHBOR_H */
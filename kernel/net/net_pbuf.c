@@ -0,0 +1,160 @@
+/* KallistiOS ##version##
+
+   kernel/net/net_pbuf.c
+   Copyright (C) 2026 The KallistiOS Team
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <kos/net.h>
+
+#include "net_ipv4.h"
+
+/* Packet buffers for the transmit path. Each protocol layer used to build its
+   packet in a new block of memory with its own header in front, which meant
+   that the data got copied once per layer (and then once more by the driver).
+   Now the data stays wherever it started out (a socket's send buffer, for
+   instance), and the headers get put in front of it as separate pieces of the
+   chain, or into the headroom of the first piece when there's space. The only
+   time the data gets copied is when it goes to the device, or if the device
+   can't take a chain, right before that. */
+
+net_pbuf_t *net_pbuf_alloc(size_t headroom, size_t len) {
+    net_pbuf_t *pb;
+
+    if(!(pb = (net_pbuf_t *)malloc(sizeof(net_pbuf_t) + headroom + len))) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    net_pbuf_init(pb, (uint8_t *)(pb + 1), headroom, len);
+    pb->ref = 1;
+
+    return pb;
+}
+
+void net_pbuf_init(net_pbuf_t *pb, void *buf, size_t headroom, size_t len) {
+    pb->next = NULL;
+    pb->head = (uint8_t *)buf;
+    pb->data = pb->head + headroom;
+    pb->len = len;
+    pb->ref = 0;
+}
+
+void net_pbuf_ref(net_pbuf_t *pb) {
+    if(pb->ref)
+        ++pb->ref;
+}
+
+void net_pbuf_free(net_pbuf_t *pb) {
+    net_pbuf_t *next;
+
+    while(pb) {
+        next = pb->next;
+
+        /* If someone else still has a reference to this one, then they have
+           one to the rest of the chain too, through it. */
+        if(pb->ref) {
+            if(--pb->ref)
+                return;
+
+            free(pb);
+        }
+
+        pb = next;
+    }
+}
+
+uint8_t *net_pbuf_push(net_pbuf_t *pb, size_t len) {
+    if((size_t)(pb->data - pb->head) < len)
+        return NULL;
+
+    pb->data -= len;
+    pb->len += len;
+
+    return pb->data;
+}
+
+size_t net_pbuf_length(const net_pbuf_t *pb) {
+    size_t len = 0;
+
+    for(; pb; pb = pb->next)
+        len += pb->len;
+
+    return len;
+}
+
+size_t net_pbuf_copy_out(const net_pbuf_t *pb, void *dst, size_t size) {
+    uint8_t *out = (uint8_t *)dst;
+    size_t len, total = 0;
+
+    for(; pb && total < size; pb = pb->next) {
+        len = pb->len;
+
+        if(len > size - total)
+            len = size - total;
+
+        memcpy(out + total, pb->data, len);
+        total += len;
+    }
+
+    return total;
+}
+
+net_pbuf_t *net_pbuf_copy(const net_pbuf_t *pb, size_t headroom) {
+    size_t len = net_pbuf_length(pb);
+    net_pbuf_t *rv;
+
+    if(!(rv = net_pbuf_alloc(headroom, len)))
+        return NULL;
+
+    net_pbuf_copy_out(pb, rv->data, len);
+
+    return rv;
+}
+
+/* Do an IP-style checksum on a whole chain. Any piece that starts at an odd
+   offset into the packet has its sum byte-swapped before it's added in (see
+   RFC 1071, section 2). */
+uint16_t __pure net_pbuf_checksum(const net_pbuf_t *pb, uint16_t start) {
+    uint32_t sum = start, part;
+    int odd = 0;
+
+    for(; pb; pb = pb->next) {
+        if(!pb->len)
+            continue;
+
+        part = (uint16_t)~net_ipv4_checksum(pb->data, pb->len, 0);
+
+        if(odd)
+            part = ((part & 0xFF) << 8) | (part >> 8);
+
+        sum += part;
+        odd ^= pb->len & 1;
+    }
+
+    while(sum >> 16)
+        sum = (sum >> 16) + (sum & 0xFFFF);
+
+    return sum ^ 0xFFFF;
+}
+
+int net_pbuf_tx(netif_t *net, net_pbuf_t *pkt, int blocking) {
+    size_t len;
+
+    if(net->if_tx_pbuf)
+        return net->if_tx_pbuf(net, pkt, blocking);
+
+    /* The driver can only take one block, so put it all together for it. This
+       is the only copy that the packet gets on its way down. */
+    len = net_pbuf_length(pkt);
+
+    {
+        uint8_t buf[len];
+
+        net_pbuf_copy_out(pkt, buf, len);
+        return net->if_tx(net, buf, (int)len, blocking);
+    }
+}
@@ -28,6 +28,7 @@
 #include "net_ipv4.h"
 #include "net_ipv6.h"
 #include "net_thd.h"
+#include "net_tcp_cc.h"
 
 /* Since some of this is a bit odd in its implementation, here's a few notes on
    what my thinking was while writing all of this...
@@ -73,22 +74,44 @@
    real socket created for them until they are accept()ed.
 
    On matching sockets:
-   All new sockets (including those created by accept()) are added to the head
-   of the list. Since we cannot bind a socket to an already used port for
-   listening, that means that any fully-created sockets should appear in the
-   list in front of those created for listening to a port (and thus that are
-   only partially-created). This simplifies the procedure for finding matching
-   sockets for incoming packets, since this makes sure that the fully-created
-   socket will be found first if it exists when simply iterating through the
-   list of sockets.
+   Besides the list of all sockets, each socket with a local port is in one of
+   two hash tables. Once it has a remote address (from connect() or accept()),
+   it is hashed on the remote address and both ports. Until then (which for a
+   listening socket is forever), it is hashed on just its local port. Incoming
+   packets check the first table before the second, so a fully-created socket
+   is always found ahead of the listening socket it came from, and only a
+   bucket's worth of sockets ever has to be looked at, no matter how many
+   connections are open. New sockets go at the head of their bucket, so the
+   newest one wins if there are ever two that match.
 
    On what's actually here:
-   I didn't bother implementing any TCP extensions beyond RFC 793. That means
-   that I just ignore things like the timestamp option and the selective
-   acknowledgement option. That also means that the window size maxes out at
-   65535. Some extensions may be implemented in the future, if I see fit to do
-   so. That all said, everything in here works just fine over IPv4 or IPv6, and
-   can be used just fine to communicate with "normal" TCP/IP implementations.
+   Other than RFC 793 itself, the window scale and timestamp options (RFC 7323)
+   and selective acknowledgements (RFC 2018) are supported, and are used if the
+   other side asks for them. Window scaling only matters if the receive buffer
+   is made bigger than 64KiB with SO_RCVBUF. Some extensions may be
+   implemented in the future, if I see fit to do so. That all said, everything
+   in here works just fine over IPv4 or IPv6, and can be used just fine to
+   communicate with "normal" TCP/IP implementations.
+
+   On congestion control:
+   The sender keeps a congestion window as per RFC 5681, and does fast
+   retransmit and NewReno fast recovery (RFC 6582) on three duplicate ACKs. How
+   the window grows and shrinks is up to a pluggable algorithm (see
+   net_tcp_cc.c), which can be picked per-socket with TCP_CONGESTION. The
+   receiver holds on to a few ranges of out-of-order data, so that a single
+   lost segment doesn't cost the whole window.
+
+   On timers:
+   Each connection has one timer, which is a deadline that means different
+   things depending on the state (retransmitting a SYN, data or FIN, or the
+   end of TIME-WAIT). The retransmission timeout is worked out from the round
+   trip time as per RFC 6298, from timestamps if we have them or by timing one
+   segment at a time if we don't, and doubles on each timeout. All of the
+   connections share one net_thd timer, which is kept armed for the earliest
+   deadline of any of them, so they go off on time and nothing runs at all
+   while every connection is idle. Anything else that the timer callback takes
+   care of (sending a FIN after close() once the data is all acked, or freeing
+   a connection once it is done with) kicks the timer to run right away.
 */
 
 typedef struct tcp_hdr {
@@ -111,7 +134,10 @@ struct lsock {
     struct sockaddr_in6 remote_addr;
     uint32_t isn;
     uint32_t wnd;
+    uint32_t ts_recent;
     uint16_t mss;
+    uint8_t options;
+    uint8_t wscale;
 };
 
 /* Send/receive variables... */
@@ -133,8 +159,24 @@ struct rcvrec {
     uint32_t irs;
 };
 
+/* Maximum number of separate ranges of out-of-order data that we keep track of
+   for each connection on the receiving side, and of ranges that the other side
+   has told us it has with SACK on the sending side. */
+#define TCP_OOO_MAX     16
+#define TCP_SACK_MAX    16
+
+/* A range of sequence numbers. These are used for data that arrived out of
+   order (and is sitting in the receive buffer past rcv.nxt) and for data that
+   the other side has selectively acknowledged. */
+struct tcp_range {
+    uint32_t start;
+    uint32_t end;
+};
+
 struct tcp_sock {
     LIST_ENTRY(tcp_sock) sock_list;
+    LIST_ENTRY(tcp_sock) hash_list;
+    int hashed;
     struct sockaddr_in6 local_addr;
     struct sockaddr_in6 remote_addr;
 
@@ -147,6 +189,7 @@ struct tcp_sock {
     int hop_limit;
     uint32_t rcvbuf_sz;
     uint32_t sndbuf_sz;
+    const tcp_cc_ops_t *cc_ops;
 
     union {
         struct {
@@ -165,12 +208,72 @@ struct tcp_sock {
             uint32_t rcvbuf_cur_sz;
             uint32_t rcvbuf_head;
             uint32_t rcvbuf_tail;
+            struct tcp_range ooo[TCP_OOO_MAX];
+            int ooo_count;
+            uint32_t ooo_last;
             uint8_t *sndbuf;
             uint32_t sndbuf_cur_sz;
             uint32_t sndbuf_head;
             uint32_t sndbuf_acked;
             uint32_t sndbuf_tail;
+
+            /* When the timer for this connection goes off (in milliseconds), or
+               0 if it isn't running. What the timer is for depends on the state
+               of the connection. */
             uint64_t timer;
+
+            /* Delayed ACKs and holding back small segments. delack_timer is
+               when an ACK that is being held back has to go out (0 if there
+               isn't one), and delack_segs is how many segments it covers.
+               cork_timer is when a partial segment being held by TCP_CORK or
+               MSG_MORE has to go out anyway. */
+            uint64_t delack_timer;
+            uint32_t delack_segs;
+            uint64_t cork_timer;
+
+            /* Round trip time estimation, as per RFC 6298. srtt is scaled by 8
+               and rttvar by 4 (both in milliseconds, 0 until we have the first
+               sample), and rto has any backoff applied already. If timestamps
+               aren't in use, one segment at a time is timed: rtt_seq is the
+               sequence number that'll acknowledge it and rtt_time is when it
+               was sent (0 if nothing is being timed). */
+            uint32_t srtt;
+            uint32_t rttvar;
+            uint32_t rto;
+            uint32_t rtt_seq;
+            uint64_t rtt_time;
+
+            /* TCP options that both sides agreed to on the SYNs (using the
+               TCPI_OPT_* values from <netinet/tcp.h>). ts_recent is the last
+               timestamp that the other side sent us, which gets echoed back
+               to them (RFC 7323). The window scale shifts are how far the
+               window field is shifted in each direction. */
+            uint32_t ts_recent;
+            uint8_t options;
+            uint8_t snd_wscale;
+            uint8_t rcv_wscale;
+
+            /* Congestion control and loss recovery. snd_max is the highest
+               sequence number ever sent, which is not always the same as
+               snd.nxt, since a retransmission timeout sends everything after
+               snd.una again. recover is the value of snd_max when we last went
+               into fast recovery (or had a timeout), as per RFC 6582. */
+            tcp_cc_t cc;
+            uint32_t snd_max;
+            uint32_t recover;
+            uint32_t dupacks;
+            uint32_t total_retrans;
+
+            /* SACK scoreboard (RFC 6675). This holds the ranges past snd.una
+               that the other side has told us that it has, in order. During
+               fast recovery, rexmit_nxt is where to start looking for the next
+               hole to fill in. */
+            struct tcp_range sacked[TCP_SACK_MAX];
+            int sack_count;
+            uint32_t rexmit_nxt;
+            uint8_t ca_state;
+            uint8_t retrans;
+
             condvar_t send_cv;
             condvar_t recv_cv;
         } data;
@@ -181,21 +284,128 @@ LIST_HEAD(tcp_sock_list, tcp_sock);
 
 static struct tcp_sock_list tcp_socks = LIST_HEAD_INITIALIZER(0);
 static rw_semaphore_t tcp_sem = RWSEM_INITIALIZER;
-static int thd_cb_id = 0;
+static net_timer_t tcp_timer;
+static net_tcp_stats_t tcp_stats = { 0 };
+
+/* Hash tables for matching incoming packets to sockets. Sockets that have a
+   remote address go in tcp_conn_hash, keyed on the remote address and both
+   ports. Sockets that only have a local port (mostly listening ones) go in
+   tcp_port_hash, keyed on that. Both are protected by tcp_sem. */
+#define TCP_HASH_BITS       7
+#define TCP_HASH_SIZE       (1 << TCP_HASH_BITS)
+
+static struct tcp_sock_list tcp_conn_hash[TCP_HASH_SIZE];
+static struct tcp_sock_list tcp_port_hash[TCP_HASH_SIZE];
+
+static inline unsigned int tcp_conn_bucket(const struct in6_addr *raddr,
+                                           uint16_t rport, uint16_t lport) {
+    uint32_t h = raddr->__s6_addr.__s6_addr32[0] ^
+                 raddr->__s6_addr.__s6_addr32[1] ^
+                 raddr->__s6_addr.__s6_addr32[2] ^
+                 raddr->__s6_addr.__s6_addr32[3];
+
+    h ^= ((uint32_t)rport << 16) | lport;
+    return (h * 0x9E3779B1) >> (32 - TCP_HASH_BITS);
+}
+
+static inline unsigned int tcp_port_bucket(uint16_t lport) {
+    return ntohs(lport) & (TCP_HASH_SIZE - 1);
+}
+
+static void tcp_unhash(struct tcp_sock *sock) {
+    if(sock->hashed) {
+        LIST_REMOVE(sock, hash_list);
+        sock->hashed = 0;
+    }
+}
+
+/* Put a socket in the right hash table for its current addresses. This needs to
+   be called whenever either of them changes, with the write lock held. New
+   sockets go at the head of the bucket, just like with the main list. */
+static void tcp_rehash(struct tcp_sock *sock) {
+    struct tcp_sock_list *bucket;
+
+    tcp_unhash(sock);
+
+    if(!sock->local_addr.sin6_port)
+        return;
+
+    if(IN6_IS_ADDR_UNSPECIFIED(&sock->remote_addr.sin6_addr))
+        bucket = &tcp_port_hash[tcp_port_bucket(sock->local_addr.sin6_port)];
+    else
+        bucket = &tcp_conn_hash[tcp_conn_bucket(&sock->remote_addr.sin6_addr,
+                                                sock->remote_addr.sin6_port,
+                                                sock->local_addr.sin6_port)];
+
+    LIST_INSERT_HEAD(bucket, sock, hash_list);
+    sock->hashed = 1;
+}
+
+/* See if any socket other than sock has the given local port (in network byte
+   order). Local addresses only ever change with the write lock held, so the
+   caller must be holding it. */
+static int tcp_port_in_use(const struct tcp_sock *sock, uint16_t port) {
+    struct tcp_sock *iter;
+
+    LIST_FOREACH(iter, &tcp_socks, sock_list) {
+        if(iter != sock && iter->local_addr.sin6_port == port)
+            return 1;
+    }
+
+    return 0;
+}
+
+/* Grab the first unused port >= 1024, in network byte order. */
+static uint16_t tcp_pick_port(const struct tcp_sock *sock) {
+    uint16_t port = 1024;
+
+    while(port && tcp_port_in_use(sock, htons(port)))
+        ++port;
+
+    return htons(port);
+}
 
 /* Default starting window size for connections. This should be big enough as a
    starting point, in general. If you need to adjust it, you can do so... */
 #define TCP_DEFAULT_WINDOW  8192
 
+/* Largest send or receive buffer that can be asked for with SO_SNDBUF and
+   SO_RCVBUF. Receive buffers over 64KiB only help if the other side does window
+   scaling. */
+#define TCP_MAX_BUFFER      (1024 * 1024)
+
 /* Default MSS */
 #define TCP_DEFAULT_MSS     1460
 
+/* Smallest MSS we'll accept from the other side. Anything less than this would
+   leave almost no room for data after the header. */
+#define TCP_MIN_MSS         64
+
 /* Default Maximum Segment Lifetime (in milliseconds). I arbitrarily chose this
    to be 15 seconds, since that's what Mac OS X does. */
 #define TCP_DEFAULT_MSL     15000
 
-/* Default retransmission timeout (in milliseconds). */
-#define TCP_DEFAULT_RTTO    2000
+/* Retransmission timeout bounds (in milliseconds). The initial value is from
+   RFC 6298. The minimum is lower than the 1 second that the RFC asks for, like
+   in most other implementations, so a loss on a fast link doesn't stall things
+   for ages. */
+#define TCP_INITIAL_RTO     1000
+#define TCP_MIN_RTO         200
+#define TCP_MAX_RTO         60000
+
+/* How many times we'll retransmit our FIN before giving up on the other side
+   of a connection that has already been closed. */
+#define TCP_MAX_FIN_RETRIES 8
+
+/* The longest that an ACK for in-order data is held back, hoping to send it
+   along with some data of our own (RFC 1122, section 4.2.3.2, says no more
+   than 500ms). Every second segment is acked right away regardless. */
+#define TCP_DELACK_TIME     40
+#define TCP_DELACK_SEGS     2
+
+/* The longest that a partial segment is held back with TCP_CORK or MSG_MORE
+   before it gets sent anyway (the same as on Linux). */
+#define TCP_CORK_TIME       200
 
 /* Default hop limit (or ttl for IPv4) for new sockets */
 #define TCP_DEFAULT_HOPS    64
@@ -230,10 +440,41 @@ static int thd_cb_id = 0;
 #define TCP_IFLAG_CANBEDEL      0x00000001
 #define TCP_IFLAG_QUEUEDCLOSE   0x00000002
 #define TCP_IFLAG_ACCEPTWAIT    0x00000004
+#define TCP_IFLAG_NODELAY       0x00000008
+#define TCP_IFLAG_CORK          0x00000010
+#define TCP_IFLAG_MORE          0x00000020
+#define TCP_IFLAG_FILLING       0x00000040
 
 #define TCP_OPT_EOL             0
 #define TCP_OPT_NOP             1
 #define TCP_OPT_MSS             2
+#define TCP_OPT_WSCALE          3
+#define TCP_OPT_SACK_PERMITTED  4
+#define TCP_OPT_SACK            5
+#define TCP_OPT_TIMESTAMP       8
+
+#define TCP_OPTLEN_WSCALE       3
+#define TCP_OPTLEN_SACK_PERM    2
+#define TCP_OPTLEN_TIMESTAMP    10
+
+/* Largest window scale shift allowed (RFC 7323, section 2.3). */
+#define TCP_MAX_WSCALE          14
+
+/* Most options we'll ever put on a SYN (MSS, timestamps, window scale and SACK
+   permitted, each padded out to 4 bytes) and the longest header we'll ever put
+   on anything else. */
+#define TCP_SYN_OPTLEN          (4 + TCP_OPTLEN_TIMESTAMP + 2 + \
+                                 TCP_OPTLEN_WSCALE + 1 + \
+                                 TCP_OPTLEN_SACK_PERM + 2)
+#define TCP_MAX_HDRLEN          60
+
+/* Length of the header on every segment, and so how much data fits into one
+   segment on a connection. SACK blocks only go on segments without data, so
+   they don't count here. */
+#define TCP_HDRLEN(s)   (sizeof(tcp_hdr_t) + \
+                         (((s)->data.options & TCPI_OPT_TIMESTAMPS) ? \
+                          TCP_OPTLEN_TIMESTAMP + 2 : 0))
+#define TCP_SMSS(s)     ((s)->data.snd.mss - TCP_HDRLEN(s))
 
 /* A few macros for comparing sequence numbers */
 #define SEQ_LT(x, y)    (((int32_t)((x) - (y))) < 0)
@@ -242,6 +483,7 @@ static int thd_cb_id = 0;
 #define SEQ_GE(x, y)    (((int32_t)((x) - (y))) >= 0)
 
 #define MAX(x, y)       ((x) > (y) ? (x) : (y))
+#define MIN(x, y)       ((x) < (y) ? (x) : (y))
 
 /* Forward declarations */
 static fs_socket_proto_t proto;
@@ -253,6 +495,20 @@ static int tcp_send_syn(struct tcp_sock *sock, int ack);
 static void tcp_send_ack(struct tcp_sock *sock);
 static void tcp_send_data(struct tcp_sock *sock, int resend);
 static void tcp_send_fin_ack(struct tcp_sock *sock);
+static void tcp_send_fin(struct tcp_sock *s);
+static void tcp_timer_set(struct tcp_sock *s, uint32_t ms);
+static void tcp_kick(void);
+
+/* Work out the window scale shift that we need to be able to advertise all of
+   a receive buffer of the given size. */
+static uint8_t tcp_wscale(uint32_t sz) {
+    uint8_t shift = 0;
+
+    while(shift < TCP_MAX_WSCALE && (sz >> shift) > 65535)
+        ++shift;
+
+    return shift;
+}
 
 /* Sockets interface... */
 static int net_tcp_socket(net_socket_t *hnd, int domain, int type, int proto) {
@@ -279,6 +535,7 @@ static int net_tcp_socket(net_socket_t *hnd, int domain, int type, int proto) {
     sock->hop_limit = TCP_DEFAULT_HOPS;
     sock->rcvbuf_sz = TCP_DEFAULT_WINDOW;
     sock->sndbuf_sz = TCP_DEFAULT_WINDOW;
+    sock->cc_ops = tcp_cc_default;
 
     if(rwsem_write_lock_irqsafe(&tcp_sem)) {
         free(sock);
@@ -406,8 +663,7 @@ retry:
         case TCP_STATE_SYN_RECEIVED:
             /* Don't have to worry about queued packets, since we don't allow
                any queueing until after the connection is established. */
-            tcp_send_fin_ack(sock);
-            ++sock->data.snd.nxt;
+            tcp_send_fin(sock);
             sock->state = TCP_STATE_FIN_WAIT_1;
             goto ret_no_remove;
 
@@ -418,8 +674,7 @@ retry:
                 goto ret_no_remove;
             }
 
-            tcp_send_fin_ack(sock);
-            ++sock->data.snd.nxt;
+            tcp_send_fin(sock);
             sock->state = TCP_STATE_CLOSING;
             goto ret_no_remove;
 
@@ -439,6 +694,7 @@ retry:
     }
 
 ret_remove:
+    tcp_unhash(sock);
     LIST_REMOVE(sock, sock_list);
     mutex_unlock(&sock->mutex);
     mutex_destroy(&sock->mutex);
@@ -459,6 +715,7 @@ ret_no_remove:
 
     /* Don't free anything here, it will be dealt with later on in the
        net_thd callback. */
+    tcp_kick();
     mutex_unlock(&sock->mutex);
     rwsem_write_unlock(&tcp_sem);
     return;
@@ -514,6 +771,7 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
             mutex_lock(&sock->mutex);
             free(sock->listen.queue);
             cond_destroy(&sock->listen.cv);
+            tcp_unhash(sock);
             LIST_REMOVE(sock, sock_list);
             mutex_unlock(&sock->mutex);
             mutex_destroy(&sock->mutex);
@@ -609,6 +867,8 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
     sock2->hop_limit = sock->hop_limit;
     sock2->rcvbuf_sz = sock->rcvbuf_sz;
     sock2->sndbuf_sz = sock->sndbuf_sz;
+    sock2->cc_ops = sock->cc_ops;
+    sock2->intflags = sock->intflags & (TCP_IFLAG_NODELAY | TCP_IFLAG_CORK);
     sock2->data.rcv.wnd = sock->rcvbuf_sz;
 
     /* Fill in the address, if they asked for it. */
@@ -708,17 +968,31 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
     sock2->data.snd.wnd = lsock.wnd;
     sock2->data.snd.wl1 = sock2->data.snd.iss;
     sock2->data.snd.mss = lsock.mss;
+    sock2->data.snd_max = sock2->data.snd.nxt;
+    sock2->data.recover = sock2->data.snd.iss;
     sock2->data.rcv.nxt = lsock.isn + 1;
     sock2->data.rcv.irs = lsock.isn;
+    sock2->data.options = lsock.options;
+    sock2->data.ts_recent = lsock.ts_recent;
+
+    if(lsock.options & TCPI_OPT_WSCALE) {
+        sock2->data.snd_wscale = lsock.wscale;
+        sock2->data.rcv_wscale = tcp_wscale(sock2->rcvbuf_sz);
+    }
+    sock2->data.rto = TCP_INITIAL_RTO;
+    tcp_cc_init(&sock2->data.cc, sock2->cc_ops, TCP_SMSS(sock2));
 
     /* Since nothing else has a pointer to this socket, this will not fail. */
     mutex_trylock(&sock2->mutex);
 
     /* Send the <SYN,ACK> packet now, add it to the list, and clean up. */
     tcp_send_syn(sock2, 1);
-    sock2->data.timer = timer_ms_gettime64();
+    tcp_timer_set(sock2, sock2->data.rto);
+    sock2->data.rtt_seq = sock2->data.snd.nxt;
+    sock2->data.rtt_time = timer_ms_gettime64();
     fd = sock2->sock;
     LIST_INSERT_HEAD(&tcp_socks, sock2, sock_list);
+    tcp_rehash(sock2);
     mutex_unlock(&sock2->mutex);
 
     sock->state &= ~TCP_STATE_ACCEPTING;
@@ -730,7 +1004,7 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
 
 static int net_tcp_bind(net_socket_t *hnd, const struct sockaddr *addr,
                         socklen_t addr_len) {
-    struct tcp_sock *sock, *iter;
+    struct tcp_sock *sock;
     struct sockaddr_in *realaddr4;
     struct sockaddr_in6 realaddr6;
 
@@ -817,59 +1091,22 @@ static int net_tcp_bind(net_socket_t *hnd, const struct sockaddr *addr,
     if(realaddr6.sin6_port != 0) {
         /* Make sure we don't already have a socket bound to the port
            specified */
-        LIST_FOREACH(iter, &tcp_socks, sock_list) {
-            if(iter == sock)
-                continue;
-
-            if(mutex_lock_irqsafe(&iter->mutex)) {
-                mutex_unlock(&sock->mutex);
-                rwsem_write_unlock(&tcp_sem);
-                return -1;
-            }
-
-            if(iter->local_addr.sin6_port == realaddr6.sin6_port) {
-                mutex_unlock(&iter->mutex);
-                mutex_unlock(&sock->mutex);
-                rwsem_write_unlock(&tcp_sem);
-                errno = EADDRINUSE;
-                return -1;
-            }
-
-            mutex_unlock(&iter->mutex);
+        if(tcp_port_in_use(sock, realaddr6.sin6_port)) {
+            mutex_unlock(&sock->mutex);
+            rwsem_write_unlock(&tcp_sem);
+            errno = EADDRINUSE;
+            return -1;
         }
 
         sock->local_addr = realaddr6;
     }
     else {
-        uint16_t port = 1024, tmp = 0;
-
-        /* Grab the first unused port >= 1024. This is, unfortunately, O(n^2) */
-        while(tmp != port) {
-            tmp = port;
-
-            LIST_FOREACH(iter, &tcp_socks, sock_list) {
-                if(iter == sock)
-                    continue;
-
-                if(mutex_lock_irqsafe(&iter->mutex)) {
-                    mutex_unlock(&sock->mutex);
-                    rwsem_write_unlock(&tcp_sem);
-                    return -1;
-                }
-
-                if(iter->local_addr.sin6_port == port) {
-                    ++port;
-                    break;
-                }
-
-                mutex_unlock(&iter->mutex);
-            }
-        }
-
         sock->local_addr = realaddr6;
-        sock->local_addr.sin6_port = htons(port);
+        sock->local_addr.sin6_port = tcp_pick_port(sock);
     }
 
+    tcp_rehash(sock);
+
     /* Release the locks, we're done */
     mutex_unlock(&sock->mutex);
     rwsem_write_unlock(&tcp_sem);
@@ -879,7 +1116,7 @@ static int net_tcp_bind(net_socket_t *hnd, const struct sockaddr *addr,
 
 static int net_tcp_connect(net_socket_t *hnd, const struct sockaddr *addr,
                            socklen_t addr_len) {
-    struct tcp_sock *sock, *iter;
+    struct tcp_sock *sock;
     struct sockaddr_in *realaddr4;
     struct sockaddr_in6 realaddr6;
 
@@ -972,32 +1209,7 @@ static int net_tcp_connect(net_socket_t *hnd, const struct sockaddr *addr,
 
     /* See if the socket is already bound to a local port */
     if(!sock->local_addr.sin6_port) {
-        uint16_t port = 1024, tmp = 0;
-
-        /* Grab the first unused port >= 1024. This is, unfortunately, O(n^2) */
-        while(tmp != port) {
-            tmp = port;
-
-            LIST_FOREACH(iter, &tcp_socks, sock_list) {
-                if(iter == sock)
-                    continue;
-
-                if(mutex_lock_irqsafe(&iter->mutex)) {
-                    mutex_unlock(&sock->mutex);
-                    rwsem_write_unlock(&tcp_sem);
-                    return -1;
-                }
-
-                if(iter->local_addr.sin6_port == port) {
-                    ++port;
-                    break;
-                }
-
-                mutex_unlock(&iter->mutex);
-            }
-        }
-
-        sock->local_addr.sin6_port = htons(port);
+        sock->local_addr.sin6_port = tcp_pick_port(sock);
 
         if(addr->sa_family == AF_INET) {
             sock->local_addr.sin6_addr.__s6_addr.__s6_addr16[5] = 0xFFFF;
@@ -1009,6 +1221,7 @@ static int net_tcp_connect(net_socket_t *hnd, const struct sockaddr *addr,
     /* Set the remote address on the socket and go to the SYN-SENT state (this
        includes setting up all the data we need for that). */
     sock->remote_addr = realaddr6;
+    tcp_rehash(sock);
 
     if(!(sock->data.rcvbuf = (uint8_t *)malloc(sock->rcvbuf_sz))) {
         errno = ENOBUFS;
@@ -1050,6 +1263,10 @@ static int net_tcp_connect(net_socket_t *hnd, const struct sockaddr *addr,
     sock->data.snd.iss = timer_us_gettime64() >> 2;
     sock->data.snd.una = sock->data.snd.iss;
     sock->data.snd.nxt = sock->data.snd.iss + 1;
+    sock->data.snd_max = sock->data.snd.nxt;
+    sock->data.recover = sock->data.snd.iss;
+    sock->data.rto = TCP_INITIAL_RTO;
+    sock->data.rcv_wscale = tcp_wscale(sock->rcvbuf_sz);
     sock->state = TCP_STATE_SYN_SENT;
 
     /* Send a <SYN> packet */
@@ -1059,6 +1276,10 @@ static int net_tcp_connect(net_socket_t *hnd, const struct sockaddr *addr,
         return -1;
     }
 
+    tcp_timer_set(sock, sock->data.rto);
+    sock->data.rtt_seq = sock->data.snd.nxt;
+    sock->data.rtt_time = timer_ms_gettime64();
+
     /* Release the write lock... */
     rwsem_write_unlock(&tcp_sem);
 
@@ -1276,8 +1497,9 @@ static ssize_t net_tcp_recvfrom(net_socket_t *hnd, void *buffer, size_t length,
             sock->data.rcvbuf_head = size - tmp;
     }
 
-    /* If we've got nothing left, move the pointers back to the beginning */
-    if(!sock->data.rcvbuf_cur_sz) {
+    /* If we've got nothing left, move the pointers back to the beginning. We
+       can't do that if there's out-of-order data past the tail. */
+    if(!sock->data.rcvbuf_cur_sz && !sock->data.ooo_count) {
         sock->data.rcvbuf_head = sock->data.rcvbuf_tail = 0;
     }
 
@@ -1322,47 +1544,25 @@ out:
     return size;
 }
 
-static ssize_t net_tcp_sendto(net_socket_t *hnd, const void *message,
-                              size_t length, int flags,
-                              const struct sockaddr *addr, socklen_t addr_len) {
-    struct tcp_sock *sock;
-    ssize_t size;
-    uint32_t bsz, tmp;
-    uint8_t *sb, *buf = (uint8_t *)message;
-
-    /* Check the parameters first */
-    if(message == NULL || (addr != NULL && addr_len == 0)) {
-        errno = EFAULT;
-        return -1;
-    }
-
-    /* Lock the socket's mutex, since we're going to be manipulating its state
-       in here... */
-    if(!(sock = net_tcp_read_lock_and_get_sock(hnd, &tcp_sem)))
-        return -1;
-
-    rwsem_read_unlock(&tcp_sem);
-
+/* Make sure that the socket is in a state where data can be sent on it. */
+static int tcp_send_check(struct tcp_sock *sock) {
     /* Check if the socket has been shut down for writing. */
     if(sock->flags & (SHUT_WR << 24)) {
         errno = EPIPE;
-        size = -1;
-        goto out;
+        return -1;
     }
 
     /* Check to make sure the socket is connected. */
     switch(sock->state) {
         case TCP_STATE_CLOSED | TCP_STATE_RESET:
             errno = ECONNRESET;
-            size = -1;
-            goto out;
+            return -1;
 
         case TCP_STATE_CLOSED:
         case TCP_STATE_LISTEN:
         case TCP_STATE_SYN_SENT:
             errno = ENOTCONN;
-            size = -1;
-            goto out;
+            return -1;
 
         case TCP_STATE_FIN_WAIT_1:
         case TCP_STATE_FIN_WAIT_2:
@@ -1370,43 +1570,33 @@ static ssize_t net_tcp_sendto(net_socket_t *hnd, const void *message,
         case TCP_STATE_LAST_ACK:
         case TCP_STATE_TIME_WAIT:
             errno = EPIPE;
-            size = -1;
-            goto out;
+            return -1;
     }
 
-    /* Check if there was an address specified, if so, return error. */
-    if(addr) {
-        errno = EISCONN;
-        size = -1;
-        goto out;
-    }
+    return 0;
+}
+
+/* Wait until there's space to buffer at least some data to send, and nobody
+   else is in the middle of filling the buffer in. */
+static int tcp_sndbuf_wait(struct tcp_sock *sock, int flags) {
+    for(;;) {
+        if(tcp_send_check(sock))
+            return -1;
+
+        if(sock->data.sndbuf_cur_sz != sock->sndbuf_sz &&
+           !(sock->intflags & TCP_IFLAG_FILLING))
+            break;
 
-    /* See if we have space to buffer at least some of the data... */
-    if(sock->data.sndbuf_cur_sz == sock->sndbuf_sz) {
         /* Can we block? */
         if((sock->flags & FS_SOCKET_NONBLOCK) || (flags & MSG_DONTWAIT) ||
            irq_inside_int()) {
             errno = EWOULDBLOCK;
-            size = -1;
-            goto out;
+            return -1;
         }
 
+        /* If the connection gets closed or reset while we're waiting, we'll
+           find out about it on the next time through. */
         cond_wait(&sock->data.send_cv, &sock->mutex);
-
-        /* If we still don't have any buffer space, its because the connection
-           has either been closed or reset by the other side... */
-        if(sock->data.sndbuf_cur_sz == sock->sndbuf_sz) {
-            if(sock->state & TCP_STATE_RESET) {
-                errno = ECONNRESET;
-                size = -1;
-                goto out;
-            }
-            else {
-                errno = ENOTCONN;
-                size = -1;
-                goto out;
-            }
-        }
     }
 
     /* Reset the pointers if there's nothing in the buffer */
@@ -1414,6 +1604,48 @@ static ssize_t net_tcp_sendto(net_socket_t *hnd, const void *message,
         sock->data.sndbuf_head = sock->data.sndbuf_acked =
                                      sock->data.sndbuf_tail = 0;
 
+    return 0;
+}
+
+static ssize_t net_tcp_sendto(net_socket_t *hnd, const void *message,
+                              size_t length, int flags,
+                              const struct sockaddr *addr, socklen_t addr_len) {
+    struct tcp_sock *sock;
+    ssize_t size;
+    uint32_t bsz, tmp;
+    uint8_t *sb, *buf = (uint8_t *)message;
+
+    /* Check the parameters first */
+    if(message == NULL || (addr != NULL && addr_len == 0)) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    /* Lock the socket's mutex, since we're going to be manipulating its state
+       in here... */
+    if(!(sock = net_tcp_read_lock_and_get_sock(hnd, &tcp_sem)))
+        return -1;
+
+    rwsem_read_unlock(&tcp_sem);
+
+    if(tcp_send_check(sock)) {
+        size = -1;
+        goto out;
+    }
+
+    /* Check if there was an address specified, if so, return error. */
+    if(addr) {
+        errno = EISCONN;
+        size = -1;
+        goto out;
+    }
+
+    /* See if we have space to buffer at least some of the data... */
+    if(tcp_sndbuf_wait(sock, flags)) {
+        size = -1;
+        goto out;
+    }
+
     /* Figure out how much we can copy in */
     bsz = sock->sndbuf_sz - sock->data.sndbuf_cur_sz;
 
@@ -1439,6 +1671,13 @@ static ssize_t net_tcp_sendto(net_socket_t *hnd, const void *message,
         sock->data.sndbuf_tail = size - tmp;
     }
 
+    /* With MSG_MORE, hold on to a partial segment at the end, since there's
+       more coming to fill it up. */
+    if(flags & MSG_MORE)
+        sock->intflags |= TCP_IFLAG_MORE;
+    else
+        sock->intflags &= ~TCP_IFLAG_MORE;
+
     /* Send some data! */
     tcp_send_data(sock, 0);
 
@@ -1447,6 +1686,125 @@ out:
     return size;
 }
 
+/* Fill the send buffer straight from a file. Files that can be memory mapped
+   get copied right out of the mapping. Anything else gets read right into the
+   free space in the buffer, with the socket unlocked while we do so (since the
+   read might have to wait on something slow, like the CD drive). Nobody else
+   will touch the free space in the meantime, as everyone that wants to add to
+   the buffer waits on TCP_IFLAG_FILLING first. */
+static ssize_t net_tcp_sendfile(net_socket_t *hnd, file_t fd, size_t count) {
+    struct tcp_sock *sock;
+    const uint8_t *map;
+    uint8_t *sb;
+    ssize_t rv, size = 0;
+    size_t total;
+    off_t pos = 0;
+    uint32_t bsz;
+    int err = errno;
+
+    /* Only bother with the mapping if it's already there to be had. */
+    if((map = (const uint8_t *)fs_mmap(fd))) {
+        pos = fs_tell(fd);
+        total = fs_total(fd);
+
+        if(pos < 0 || total == (size_t)-1)
+            return -1;
+
+        if((size_t)pos >= total)
+            return 0;
+
+        if(count > total - pos)
+            count = total - pos;
+    }
+
+    errno = err;
+
+    if(!count)
+        return 0;
+
+    if(!(sock = net_tcp_read_lock_and_get_sock(hnd, &tcp_sem)))
+        return -1;
+
+    rwsem_read_unlock(&tcp_sem);
+
+    while((size_t)size < count) {
+        if(tcp_sndbuf_wait(sock, 0)) {
+            if(!size)
+                size = -1;
+
+            break;
+        }
+
+        /* Fill in as much as we can without wrapping around. */
+        bsz = sock->sndbuf_sz - sock->data.sndbuf_cur_sz;
+
+        if(bsz > sock->sndbuf_sz - sock->data.sndbuf_tail)
+            bsz = sock->sndbuf_sz - sock->data.sndbuf_tail;
+
+        if(bsz > count - size)
+            bsz = count - size;
+
+        sb = sock->data.sndbuf + sock->data.sndbuf_tail;
+
+        if(map) {
+            memcpy(sb, map + pos + size, bsz);
+            rv = bsz;
+        }
+        else {
+            sock->intflags |= TCP_IFLAG_FILLING;
+            mutex_unlock(&sock->mutex);
+
+            rv = fs_read(fd, sb, bsz);
+            err = errno;
+
+            mutex_lock(&sock->mutex);
+            sock->intflags &= ~TCP_IFLAG_FILLING;
+            cond_signal(&sock->data.send_cv);
+
+            if(rv <= 0) {
+                if(rv < 0 && !size) {
+                    errno = err;
+                    size = -1;
+                }
+
+                break;
+            }
+
+            /* Don't send anything if the connection went away while we were
+               reading, and put back what we read so it isn't lost. */
+            if(tcp_send_check(sock)) {
+                fs_seek(fd, -rv, SEEK_CUR);
+
+                if(!size)
+                    size = -1;
+
+                break;
+            }
+        }
+
+        sock->data.sndbuf_cur_sz += rv;
+        sock->data.sndbuf_tail += rv;
+        size += rv;
+
+        if(sock->data.sndbuf_tail == sock->sndbuf_sz)
+            sock->data.sndbuf_tail = 0;
+
+        sock->intflags &= ~TCP_IFLAG_MORE;
+        tcp_send_data(sock, 0);
+
+        /* A non-blocking socket only gets what fits right now. */
+        if(sock->flags & FS_SOCKET_NONBLOCK)
+            break;
+    }
+
+    mutex_unlock(&sock->mutex);
+
+    if(map && size > 0)
+        fs_seek(fd, pos + size, SEEK_SET);
+
+    return size;
+}
+
 static int net_tcp_shutdownsock(net_socket_t *hnd, int how) {
     struct tcp_sock *sock;
 
@@ -1472,6 +1830,8 @@ static int net_tcp_getsockopt(net_socket_t *hnd, int level, int option_name,
                               void *option_value, socklen_t *option_len) {
     int tmp;
     struct tcp_sock *sock;
+    struct tcp_info info;
+    const char *name;
 
     if(!option_value || !option_len) {
         errno = EFAULT;
@@ -1539,8 +1899,52 @@ static int net_tcp_getsockopt(net_socket_t *hnd, int level, int option_name,
         case IPPROTO_TCP:
             switch(option_name) {
                 case TCP_NODELAY:
-                    tmp = 1;
+                    tmp = !!(sock->intflags & TCP_IFLAG_NODELAY);
+                    goto copy_int;
+
+                case TCP_CORK:
+                    tmp = !!(sock->intflags & TCP_IFLAG_CORK);
                     goto copy_int;
+
+                case TCP_INFO:
+                    memset(&info, 0, sizeof(info));
+
+                    /* Listening sockets don't have any of this... */
+                    if(sock->state != TCP_STATE_LISTEN) {
+                        info.tcpi_ca_state = sock->data.ca_state;
+                        info.tcpi_retransmits = sock->data.retrans;
+                        info.tcpi_snd_mss = sock->data.cc.mss;
+                        info.tcpi_snd_cwnd = sock->data.cc.cwnd;
+                        info.tcpi_snd_ssthresh = sock->data.cc.ssthresh;
+                        info.tcpi_snd_wnd = sock->data.snd.wnd;
+                        info.tcpi_rcv_wnd = sock->data.rcv.wnd;
+                        info.tcpi_unacked = sock->data.snd_max -
+                                            sock->data.snd.una;
+                        info.tcpi_total_retrans = sock->data.total_retrans;
+                        info.tcpi_rto = sock->data.rto * 1000;
+                        info.tcpi_rtt = (sock->data.srtt >> 3) * 1000;
+                        info.tcpi_rttvar = (sock->data.rttvar >> 2) * 1000;
+
+                        info.tcpi_options = sock->data.options;
+                        info.tcpi_snd_wscale = sock->data.snd_wscale;
+                        info.tcpi_rcv_wscale = sock->data.rcv_wscale;
+                    }
+
+                    if(*option_len > sizeof(info))
+                        *option_len = sizeof(info);
+
+                    memcpy(option_value, &info, *option_len);
+                    goto simply_return;
+
+                case TCP_CONGESTION:
+                    name = sock->cc_ops->name;
+                    tmp = strlen(name) + 1;
+
+                    if(*option_len > (socklen_t)tmp)
+                        *option_len = tmp;
+
+                    memcpy(option_value, name, *option_len);
+                    goto simply_return;
             }
 
             break;
@@ -1573,19 +1977,104 @@ simply_return:
     return 0;
 }
 
-static int net_tcp_setsockopt(net_socket_t *hnd, int level, int option_name,
-                              const void *option_value, socklen_t option_len) {
-    struct tcp_sock *sock;
-    int tmp;
-    uint8_t *new_ptr;
+/* Copy the contents of a ring buffer into a new, bigger one, starting from the
+   given offset so that it ends up at the beginning of the new buffer. */
+static uint8_t *tcp_ring_grow(uint8_t *buf, uint32_t sz, uint32_t start,
+                              uint32_t new_sz) {
+    uint8_t *rv;
 
-    if(!option_value || !option_len) {
-        errno = EFAULT;
-        return -1;
-    }
+    if(!(rv = (uint8_t *)malloc(new_sz)))
+        return NULL;
 
-    if(!(sock = net_tcp_read_lock_and_get_sock(hnd, &tcp_sem)))
-        return -1;
+    memcpy(rv, buf + start, sz - start);
+    memcpy(rv + sz - start, buf, start);
+    free(buf);
+
+    return rv;
+}
+
+/* Change the size of a socket's receive buffer. Until there's a connection,
+   there's no buffer yet, so this just changes the size that it'll be. After
+   that, the buffer can only grow, since we can't take back window that we
+   have already offered to the other side. */
+static int tcp_rcvbuf_resize(struct tcp_sock *sock, uint32_t sz) {
+    uint8_t *buf;
+
+    if((sock->state & 0x0F) == TCP_STATE_LISTEN || !sock->data.rcvbuf) {
+        sock->rcvbuf_sz = sz;
+        return 0;
+    }
+
+    if(sz <= sock->rcvbuf_sz)
+        return 0;
+
+    if(!(buf = tcp_ring_grow(sock->data.rcvbuf, sock->rcvbuf_sz,
+                             sock->data.rcvbuf_head, sz))) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    sock->data.rcvbuf = buf;
+    sock->data.rcvbuf_head = 0;
+    sock->data.rcvbuf_tail = sock->data.rcvbuf_cur_sz;
+    sock->data.rcv.wnd += sz - sock->rcvbuf_sz;
+    sock->rcvbuf_sz = sz;
+
+    return 0;
+}
+
+/* Change the size of a socket's send buffer. Like with the receive buffer, it
+   can only grow once the connection has been set up. */
+static int tcp_sndbuf_resize(struct tcp_sock *sock, uint32_t sz) {
+    uint8_t *buf;
+
+    if((sock->state & 0x0F) == TCP_STATE_LISTEN || !sock->data.sndbuf) {
+        sock->sndbuf_sz = sz;
+        return 0;
+    }
+
+    if(sz <= sock->sndbuf_sz)
+        return 0;
+
+    /* Can't move the buffer out from under sendfile(). */
+    if(sock->intflags & TCP_IFLAG_FILLING) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    if(!(buf = tcp_ring_grow(sock->data.sndbuf, sock->sndbuf_sz,
+                             sock->data.sndbuf_acked, sz))) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    sock->data.sndbuf = buf;
+    sock->data.sndbuf_head = MIN(sock->data.snd.nxt - sock->data.snd.una,
+                                 sock->data.sndbuf_cur_sz);
+    sock->data.sndbuf_acked = 0;
+    sock->data.sndbuf_tail = sock->data.sndbuf_cur_sz;
+    sock->sndbuf_sz = sz;
+    cond_signal(&sock->data.send_cv);
+
+    return 0;
+}
+
+static int net_tcp_setsockopt(net_socket_t *hnd, int level, int option_name,
+                              const void *option_value, socklen_t option_len) {
+    struct tcp_sock *sock;
+    int tmp;
+    uint32_t bufsz;
+    char name[TCP_CA_NAME_MAX];
+    const tcp_cc_ops_t *ops;
+    uint32_t cwnd, ssthresh;
+
+    if(!option_value || !option_len) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    if(!(sock = net_tcp_read_lock_and_get_sock(hnd, &tcp_sem)))
+        return -1;
 
     switch(level) {
         case SOL_SOCKET:
@@ -1599,39 +2088,34 @@ static int net_tcp_setsockopt(net_socket_t *hnd, int level, int option_name,
                     if(option_len != sizeof(uint32_t))
                         goto ret_inval;
 
-                    tmp = *(uint32_t *)option_value;
-                    /* Receive buffer size must be in the range 256 - 65535 */
-                    if(tmp < 256)
-                        tmp = 256;
-                    else if(tmp > 65535)
-                        tmp = 65535;
+                    bufsz = *(uint32_t *)option_value;
+                    /* Receive buffer size must be in the range 256 -
+                       TCP_MAX_BUFFER */
+                    if(bufsz < 256)
+                        bufsz = 256;
+                    else if(bufsz > TCP_MAX_BUFFER)
+                        bufsz = TCP_MAX_BUFFER;
 
-                    new_ptr = realloc(sock->data.rcvbuf, tmp);
-                    if(!new_ptr)
-                        goto ret_nomem;
+                    if(tcp_rcvbuf_resize(sock, bufsz))
+                        goto ret_err;
 
-                    sock->data.rcvbuf = new_ptr;
-                    sock->rcvbuf_sz = tmp;
                     goto ret_success;
 
                 case SO_SNDBUF:
                     if(option_len != sizeof(uint32_t))
                         goto ret_inval;
 
-                    tmp = *(uint32_t *)option_value;
-                    /* Send buffer size must be in the range 2048 - 65535 */
-                    if(tmp < 2048)
-                        tmp = 2048;
-                    else if(tmp > 65535)
-                        tmp = 65535;
+                    bufsz = *(uint32_t *)option_value;
+                    /* Send buffer size must be in the range 2048 -
+                       TCP_MAX_BUFFER */
+                    if(bufsz < 2048)
+                        bufsz = 2048;
+                    else if(bufsz > TCP_MAX_BUFFER)
+                        bufsz = TCP_MAX_BUFFER;
 
-                    new_ptr = realloc(sock->data.sndbuf, tmp);
-                    if(!new_ptr) {
-                        goto ret_nomem;
-                    }
+                    if(tcp_sndbuf_resize(sock, bufsz))
+                        goto ret_err;
 
-                    sock->data.sndbuf = new_ptr;
-                    sock->sndbuf_sz = tmp;
                     goto ret_success;
             }
 
@@ -1699,14 +2183,54 @@ static int net_tcp_setsockopt(net_socket_t *hnd, int level, int option_name,
         case IPPROTO_TCP:
             switch(option_name) {
                 case TCP_NODELAY:
+                case TCP_CORK:
                     if(option_len != sizeof(int))
                         goto ret_inval;
 
-                    tmp = *((int *)option_value);
+                    tmp = option_name == TCP_NODELAY ? TCP_IFLAG_NODELAY :
+                          TCP_IFLAG_CORK;
 
-                    if(tmp == 0)
+                    if(*((int *)option_value))
+                        sock->intflags |= tmp;
+                    else
+                        sock->intflags &= ~tmp;
+
+                    /* Either of these can let out something that was being
+                       held back. */
+                    if(sock->state == TCP_STATE_ESTABLISHED ||
+                            sock->state == TCP_STATE_CLOSE_WAIT) {
+                        sock->data.cork_timer = 0;
+                        tcp_send_data(sock, 0);
+                    }
+
+                    goto ret_success;
+
+                case TCP_CONGESTION:
+                    if(option_len >= TCP_CA_NAME_MAX)
                         goto ret_inval;
 
+                    memcpy(name, option_value, option_len);
+                    name[option_len] = '\0';
+
+                    if(!(ops = tcp_cc_find(name))) {
+                        mutex_unlock(&sock->mutex);
+                        rwsem_read_unlock(&tcp_sem);
+                        errno = ENOENT;
+                        return -1;
+                    }
+
+                    sock->cc_ops = ops;
+
+                    /* If the connection is already up, switch it over, but
+                       keep the window where it is. */
+                    if(sock->state != TCP_STATE_LISTEN && sock->data.cc.ops) {
+                        cwnd = sock->data.cc.cwnd;
+                        ssthresh = sock->data.cc.ssthresh;
+                        tcp_cc_init(&sock->data.cc, ops, sock->data.cc.mss);
+                        sock->data.cc.cwnd = cwnd;
+                        sock->data.cc.ssthresh = ssthresh;
+                    }
+
                     goto ret_success;
             }
 
@@ -1725,10 +2249,10 @@ ret_inval:
     errno = EINVAL;
     return -1;
 
-ret_nomem:
+/* errno has already been set by whatever failed. */
+ret_err:
     mutex_unlock(&sock->mutex);
     rwsem_read_unlock(&tcp_sem);
-    errno = ENOMEM;
     return -1;
 
 ret_success:
@@ -2059,175 +2583,469 @@ static void tcp_bpkt_rst(netif_t *net, const struct in6_addr *src,
                   dst, src);
 }
 
-static int tcp_send_syn(struct tcp_sock *sock, int ack) {
-    uint8_t rawpkt[sizeof(tcp_hdr_t) + 4];
-    tcp_hdr_t *hdr = (tcp_hdr_t *)rawpkt;
-    uint16_t cs;
+/* Start the timer on a connection, to go off the given number of milliseconds
+   from now. */
+static void tcp_timer_set(struct tcp_sock *s, uint32_t ms) {
+    s->data.timer = timer_ms_gettime64() + ms;
+    net_timer_arm_before(&tcp_timer, s->data.timer);
+}
 
-    /* Fill in the base packet */
-    hdr->src_port = sock->local_addr.sin6_port;
-    hdr->dst_port = sock->remote_addr.sin6_port;
-    hdr->seq = htonl(sock->data.snd.iss);
-    hdr->ack = htonl(sock->data.rcv.nxt);
+/* Have the timer callback look over all of the connections right away. */
+static void tcp_kick(void) {
+    net_timer_arm_before(&tcp_timer, timer_ms_gettime64());
+}
 
-    if(ack) {
-        hdr->off_flags = htons(TCP_FLAG_SYN | TCP_FLAG_ACK | TCP_OFFSET(6));
+/* Back off the retransmission timer after it goes off (RFC 6298, section 5.5).
+   The longer timeout sticks around until we get a new round trip time sample,
+   which can't come from anything that was sent before now. */
+static void tcp_backoff(struct tcp_sock *s) {
+    s->data.rto = MIN(s->data.rto * 2, TCP_MAX_RTO);
+    s->data.rtt_time = 0;
+
+    if(s->data.retrans < 255)
+        ++s->data.retrans;
+}
+
+/* Update the round trip time estimate and retransmission timeout with a new
+   sample (in milliseconds), as per RFC 6298, section 2. */
+static void tcp_rtt_sample(struct tcp_sock *s, uint32_t rtt) {
+    int32_t delta;
+    uint32_t rto;
+
+    /* The clock only counts in milliseconds, so a fast enough link could look
+       like it has no delay at all. Also don't let a bogus timestamp echo from
+       the other side throw the math off too badly. */
+    rtt = MIN(MAX(rtt, 1), TCP_MAX_RTO);
+
+    if(!s->data.srtt) {
+        s->data.srtt = rtt << 3;
+        s->data.rttvar = rtt << 1;
     }
     else {
-        hdr->off_flags = htons(TCP_FLAG_SYN | TCP_OFFSET(6));
+        delta = (int32_t)rtt - (int32_t)(s->data.srtt >> 3);
+        s->data.srtt += delta;
+
+        if(delta < 0)
+            delta = -delta;
+
+        s->data.rttvar += delta - (int32_t)(s->data.rttvar >> 2);
     }
 
-    hdr->wnd = htons(sock->data.rcv.wnd);
+    /* RTO = SRTT + max(G, 4 * RTTVAR), where the clock granularity G is 1ms.
+       rttvar is already scaled by 4. */
+    rto = (s->data.srtt >> 3) + MAX(s->data.rttvar, 1);
+    s->data.rto = MIN(MAX(rto, TCP_MIN_RTO), TCP_MAX_RTO);
+}
+
+/* Fill in the timestamp option (RFC 7323), with two NOPs in front of it to keep
+   things aligned. Returns the number of bytes of options used. */
+static int tcp_put_ts(struct tcp_sock *sock, uint8_t *opts) {
+    uint32_t tsval = htonl((uint32_t)timer_ms_gettime64());
+    uint32_t tsecr = htonl(sock->data.ts_recent);
+
+    opts[0] = TCP_OPT_NOP;
+    opts[1] = TCP_OPT_NOP;
+    opts[2] = TCP_OPT_TIMESTAMP;
+    opts[3] = TCP_OPTLEN_TIMESTAMP;
+    memcpy(opts + 4, &tsval, 4);
+    memcpy(opts + 8, &tsecr, 4);
+
+    return TCP_OPTLEN_TIMESTAMP + 2;
+}
+
+/* Fill in the header of an outgoing segment (other than a SYN), including any
+   options that go on every segment. Returns the length of the header. */
+static int tcp_fill_hdr(struct tcp_sock *sock, tcp_hdr_t *hdr, uint32_t seq,
+                        uint16_t flags) {
+    int len = sizeof(tcp_hdr_t);
+
+    hdr->src_port = sock->local_addr.sin6_port;
+    hdr->dst_port = sock->remote_addr.sin6_port;
+    hdr->seq = htonl(seq);
+    hdr->ack = htonl(sock->data.rcv.nxt);
+    hdr->wnd = htons(MIN(sock->data.rcv.wnd >> sock->data.rcv_wscale, 65535));
     hdr->checksum = 0;
     hdr->urg = 0;
 
-    /* Fill in our SYN options. The only one we worry about right now is MSS. */
-    hdr->options[0] = TCP_OPT_MSS;
-    hdr->options[1] = 4;
-    hdr->options[2] = (TCP_DEFAULT_MSS >> 8) & 0xFF;
-    hdr->options[3] = TCP_DEFAULT_MSS & 0xFF;
+    if(sock->data.options & TCPI_OPT_TIMESTAMPS)
+        len += tcp_put_ts(sock, hdr->options);
+
+    hdr->off_flags = htons(flags | TCP_OFFSET(len >> 2));
+
+    /* This acks everything we've gotten, so there's no need to send an ACK
+       that has been held back any more. */
+    sock->data.delack_timer = 0;
+    sock->data.delack_segs = 0;
+
+    return len;
+}
+
+/* Checksum and send a segment built with tcp_fill_hdr(). The header is at the
+   start of the first buffer in the chain, and any data follows it. */
+static int tcp_send_pbuf(struct tcp_sock *sock, net_pbuf_t *pkt) {
+    tcp_hdr_t *hdr = (tcp_hdr_t *)pkt->data;
+    uint16_t cs;
 
-    /* Calculate the real checksum */
     cs = net_ipv6_checksum_pseudo(&sock->local_addr.sin6_addr,
                                   &sock->remote_addr.sin6_addr,
-                                  sizeof(tcp_hdr_t) + 4, IPPROTO_TCP);
-    hdr->checksum = net_ipv4_checksum(rawpkt, sizeof(tcp_hdr_t) + 4, cs);
+                                  net_pbuf_length(pkt), IPPROTO_TCP);
+    hdr->checksum = net_pbuf_checksum(pkt, cs);
+    ++tcp_stats.pkt_sent;
 
-    return net_ipv6_send(sock->data.net, rawpkt, sizeof(tcp_hdr_t) + 4,
-                         sock->hop_limit, IPPROTO_TCP,
-                         &sock->local_addr.sin6_addr,
-                         &sock->remote_addr.sin6_addr);
+    return net_ipv6_send_pbuf(sock->data.net, pkt, sock->hop_limit,
+                              IPPROTO_TCP, &sock->local_addr.sin6_addr,
+                              &sock->remote_addr.sin6_addr);
 }
 
-static void tcp_send_fin_ack(struct tcp_sock *sock) {
-    uint8_t rawpkt[sizeof(tcp_hdr_t)];
+static int tcp_send_raw(struct tcp_sock *sock, uint8_t *rawpkt, int sz) {
+    net_pbuf_t pkt;
+
+    net_pbuf_init(&pkt, rawpkt, 0, sz);
+    return tcp_send_pbuf(sock, &pkt);
+}
+
+static int tcp_send_syn(struct tcp_sock *sock, int ack) {
+    uint8_t rawpkt[sizeof(tcp_hdr_t) + TCP_SYN_OPTLEN];
     tcp_hdr_t *hdr = (tcp_hdr_t *)rawpkt;
-    uint16_t cs;
+    uint8_t *opt = hdr->options;
+    int offer = !ack, len;
 
-    /* Fill in the base packet */
+    /* Fill in the base packet. The window is never scaled on a SYN. */
     hdr->src_port = sock->local_addr.sin6_port;
     hdr->dst_port = sock->remote_addr.sin6_port;
-    hdr->seq = htonl(sock->data.snd.nxt);
+    hdr->seq = htonl(sock->data.snd.iss);
     hdr->ack = htonl(sock->data.rcv.nxt);
-    hdr->off_flags = htons(TCP_FLAG_FIN | TCP_FLAG_ACK | TCP_OFFSET(5));
-    hdr->wnd = htons(sock->data.rcv.wnd);
+    hdr->wnd = htons(MIN(sock->data.rcv.wnd, 65535));
     hdr->checksum = 0;
     hdr->urg = 0;
 
-    /* Calculate the real checksum */
-    cs = net_ipv6_checksum_pseudo(&sock->local_addr.sin6_addr,
-                                  &sock->remote_addr.sin6_addr,
-                                  sizeof(tcp_hdr_t), IPPROTO_TCP);
-    hdr->checksum = net_ipv4_checksum(rawpkt, sizeof(tcp_hdr_t), cs);
+    /* Fill in our SYN options. We always tell the other side our MSS. We offer
+       everything else on an active open, but only send options back on a
+       <SYN,ACK> if the other side offered them to us. */
+    opt[0] = TCP_OPT_MSS;
+    opt[1] = 4;
+    opt[2] = (TCP_DEFAULT_MSS >> 8) & 0xFF;
+    opt[3] = TCP_DEFAULT_MSS & 0xFF;
+    opt += 4;
+
+    if(offer || (sock->data.options & TCPI_OPT_TIMESTAMPS))
+        opt += tcp_put_ts(sock, opt);
+
+    if(offer || (sock->data.options & TCPI_OPT_WSCALE)) {
+        opt[0] = TCP_OPT_NOP;
+        opt[1] = TCP_OPT_WSCALE;
+        opt[2] = TCP_OPTLEN_WSCALE;
+        opt[3] = sock->data.rcv_wscale;
+        opt += 4;
+    }
+
+    if(offer || (sock->data.options & TCPI_OPT_SACK)) {
+        opt[0] = TCP_OPT_NOP;
+        opt[1] = TCP_OPT_NOP;
+        opt[2] = TCP_OPT_SACK_PERMITTED;
+        opt[3] = TCP_OPTLEN_SACK_PERM;
+        opt += 4;
+    }
+
+    len = opt - rawpkt;
+
+    if(ack) {
+        hdr->off_flags = htons(TCP_FLAG_SYN | TCP_FLAG_ACK |
+                               TCP_OFFSET(len >> 2));
+    }
+    else {
+        hdr->off_flags = htons(TCP_FLAG_SYN | TCP_OFFSET(len >> 2));
+    }
+
+    return tcp_send_raw(sock, rawpkt, len);
+}
+
+static void tcp_send_fin_ack(struct tcp_sock *sock) {
+    uint8_t rawpkt[TCP_MAX_HDRLEN];
+    int len;
+
+    len = tcp_fill_hdr(sock, (tcp_hdr_t *)rawpkt, sock->data.snd.nxt,
+                       TCP_FLAG_FIN | TCP_FLAG_ACK);
+    tcp_send_raw(sock, rawpkt, len);
+}
+
+/* Fill in SACK blocks for the out-of-order data we're holding on to, in the
+   space left over after the rest of the header. The block with the most recent
+   data in it goes first, as RFC 2018 asks for. Returns the number of bytes of
+   options used. */
+static int tcp_put_sack(struct tcp_sock *sock, uint8_t *opt, int space) {
+    const struct tcp_range *o = sock->data.ooo;
+    const struct tcp_range *blocks[TCP_OOO_MAX];
+    int i, first = 0, cnt = 1, max = (space - 4) / 8;
+    uint32_t tmp;
+
+    for(i = 0; i < sock->data.ooo_count; ++i) {
+        if(SEQ_LE(o[i].start, sock->data.ooo_last) &&
+                SEQ_LT(sock->data.ooo_last, o[i].end))
+            first = i;
+    }
+
+    blocks[0] = o + first;
+
+    for(i = 0; i < sock->data.ooo_count && cnt < max; ++i) {
+        if(i != first)
+            blocks[cnt++] = o + i;
+    }
 
-    net_ipv6_send(sock->data.net, rawpkt, sizeof(tcp_hdr_t), sock->hop_limit,
-                  IPPROTO_TCP, &sock->local_addr.sin6_addr,
-                  &sock->remote_addr.sin6_addr);
+    for(i = 0; i < cnt; ++i) {
+        tmp = htonl(blocks[i]->start);
+        memcpy(opt + 4 + i * 8, &tmp, 4);
+        tmp = htonl(blocks[i]->end);
+        memcpy(opt + 8 + i * 8, &tmp, 4);
+    }
+
+    opt[0] = TCP_OPT_NOP;
+    opt[1] = TCP_OPT_NOP;
+    opt[2] = TCP_OPT_SACK;
+    opt[3] = 2 + cnt * 8;
+
+    return 4 + cnt * 8;
 }
 
 static void tcp_send_ack(struct tcp_sock *sock) {
-    tcp_hdr_t hdr;
-    uint16_t c;
+    uint8_t rawpkt[TCP_MAX_HDRLEN];
+    tcp_hdr_t *hdr = (tcp_hdr_t *)rawpkt;
+    int len;
+
+    len = tcp_fill_hdr(sock, hdr, sock->data.snd.nxt, TCP_FLAG_ACK);
+
+    /* Tell the other side what we have past the hole, if it can use that. */
+    if((sock->data.options & TCPI_OPT_SACK) && sock->data.ooo_count) {
+        len += tcp_put_sack(sock, rawpkt + len, TCP_MAX_HDRLEN - len);
+        hdr->off_flags = htons(TCP_FLAG_ACK | TCP_OFFSET(len >> 2));
+    }
+
+    tcp_send_raw(sock, rawpkt, len);
+    ++tcp_stats.acks_sent;
+}
+
+/* Acknowledge in-order data, holding the ACK back for a bit if we can (RFC
+   1122, section 4.2.3.2) so that it can go out along with a reply, or cover
+   the next segment too. */
+static void tcp_send_delack(struct tcp_sock *sock) {
+    if(++sock->data.delack_segs >= TCP_DELACK_SEGS) {
+        tcp_send_ack(sock);
+        return;
+    }
+
+    if(!sock->data.delack_timer) {
+        sock->data.delack_timer = timer_ms_gettime64() + TCP_DELACK_TIME;
+        net_timer_arm_before(&tcp_timer, sock->data.delack_timer);
+    }
+
+    ++tcp_stats.acks_delayed;
+}
+
+/* Send one segment of data from the send buffer, starting at the given sequence
+   number and offset into the buffer. This doesn't touch any of the send state;
+   that's up to the caller. */
+static void tcp_send_segment(struct tcp_sock *sock, uint32_t seq, uint32_t head,
+                             uint32_t len) {
+    uint8_t rawhdr[NET_PBUF_HEADROOM + TCP_MAX_HDRLEN];
+    net_pbuf_t hdr, data[2];
+    uint32_t tmp;
+    int hlen;
+
+    /* The header goes in its own buffer, with space in front of it for the IP
+       layer to add its own. The data is sent straight out of the send buffer
+       (in two pieces, if it wraps around the end). */
+    hlen = tcp_fill_hdr(sock, (tcp_hdr_t *)(rawhdr + NET_PBUF_HEADROOM), seq,
+                        TCP_FLAG_ACK);
+    net_pbuf_init(&hdr, rawhdr, NET_PBUF_HEADROOM, hlen);
+    hdr.next = &data[0];
+
+    if(head + len <= sock->sndbuf_sz) {
+        net_pbuf_init(&data[0], sock->data.sndbuf + head, 0, len);
+    }
+    else {
+        tmp = sock->sndbuf_sz - head;
+        net_pbuf_init(&data[0], sock->data.sndbuf + head, 0, tmp);
+        net_pbuf_init(&data[1], sock->data.sndbuf, 0, len - tmp);
+        data[0].next = &data[1];
+    }
+
+    tcp_send_pbuf(sock, &hdr);
+    ++tcp_stats.pkt_sent_data;
+
+    /* Don't time retransmitted segments, since there's no way to know which
+       copy the ACK is for (Karn's algorithm). */
+    if(SEQ_LT(seq, sock->data.snd_max)) {
+        ++sock->data.total_retrans;
+        sock->data.rtt_time = 0;
+    }
+}
+
+/* Decide whether to hold back a segment that's shorter than the MSS because it
+   has the last of what has been written. With TCP_CORK or MSG_MORE, it waits
+   for more to fill it up, for up to TCP_CORK_TIME. Otherwise, Nagle's algorithm
+   holds it as long as there's anything unacked in flight, unless TCP_NODELAY
+   is set (RFC 1122, section 4.2.3.4). */
+static int tcp_hold_small(struct tcp_sock *sock, uint32_t unacked) {
+    uint64_t now;
 
-    /* Fill in the base packet */
-    hdr.src_port = sock->local_addr.sin6_port;
-    hdr.dst_port = sock->remote_addr.sin6_port;
-    hdr.seq = htonl(sock->data.snd.nxt);
-    hdr.ack = htonl(sock->data.rcv.nxt);
-    hdr.off_flags = htons(TCP_FLAG_ACK | TCP_OFFSET(5));
-    hdr.wnd = htons(sock->data.rcv.wnd);
-    hdr.checksum = 0;
-    hdr.urg = 0;
+    if(sock->intflags & (TCP_IFLAG_CORK | TCP_IFLAG_MORE)) {
+        now = timer_ms_gettime64();
 
-    /* Calculate the real checksum */
-    c = net_ipv6_checksum_pseudo(&sock->local_addr.sin6_addr,
-                                 &sock->remote_addr.sin6_addr,
-                                 sizeof(tcp_hdr_t), IPPROTO_TCP);
-    hdr.checksum = net_ipv4_checksum((const uint8_t *)&hdr, sizeof(tcp_hdr_t), c);
+        if(!sock->data.cork_timer) {
+            sock->data.cork_timer = now + TCP_CORK_TIME;
+            net_timer_arm_before(&tcp_timer, sock->data.cork_timer);
+        }
+
+        if(sock->data.cork_timer <= now)
+            return 0;
+    }
+    else if(!unacked || (sock->intflags & TCP_IFLAG_NODELAY)) {
+        return 0;
+    }
+
+    ++tcp_stats.segs_held;
+    return 1;
+}
+
+/* Retransmit the first unacknowledged segment, for fast retransmit and for
+   partial acks in fast recovery. */
+static void tcp_resend_una(struct tcp_sock *sock) {
+    uint32_t len = TCP_SMSS(sock);
+
+    if(len > sock->data.sndbuf_cur_sz)
+        len = sock->data.sndbuf_cur_sz;
+
+    if(len)
+        tcp_send_segment(sock, sock->data.snd.una, sock->data.sndbuf_acked,
+                         len);
+}
+
+/* Retransmit the next hole in the SACK scoreboard that we haven't already
+   resent during this recovery. Only data below the highest SACKed sequence
+   number is considered lost (RFC 6675, section 5). Returns 0 if there isn't
+   anything to resend. */
+static int tcp_resend_hole(struct tcp_sock *sock) {
+    const struct tcp_range *r = sock->data.sacked;
+    uint32_t seq = sock->data.rexmit_nxt, off, len, head;
+    int i;
+
+    if(SEQ_LT(seq, sock->data.snd.una))
+        seq = sock->data.snd.una;
+
+    /* Skip over anything the other side already has. */
+    for(i = 0; i < sock->data.sack_count && SEQ_LE(r[i].start, seq); ++i) {
+        if(SEQ_GT(r[i].end, seq))
+            seq = r[i].end;
+    }
+
+    if(i == sock->data.sack_count)
+        return 0;
+
+    off = seq - sock->data.snd.una;
+
+    if(off >= sock->data.sndbuf_cur_sz)
+        return 0;
 
-    net_ipv6_send(sock->data.net, (const uint8_t *)&hdr, sizeof(tcp_hdr_t),
-                  sock->hop_limit, IPPROTO_TCP, &sock->local_addr.sin6_addr,
-                  &sock->remote_addr.sin6_addr);
+    len = MIN(r[i].start - seq, TCP_SMSS(sock));
+    len = MIN(len, sock->data.sndbuf_cur_sz - off);
+    head = sock->data.sndbuf_acked + off;
+
+    if(head >= sock->sndbuf_sz)
+        head -= sock->sndbuf_sz;
+
+    tcp_send_segment(sock, seq, head, len);
+    sock->data.rexmit_nxt = seq + len;
+    return 1;
 }
 
+/* Send as much new data as the send window and congestion window allow. If
+   resend is set, this goes back to snd.una and starts over from there (after a
+   retransmission timeout). */
 static void tcp_send_data(struct tcp_sock *sock, int resend) {
-    uint32_t wnd = sock->data.snd.wnd, snd;
-    int sz = sizeof(tcp_hdr_t);
-    uint8_t rawpkt[1500];
-    tcp_hdr_t *hdr = (tcp_hdr_t *)rawpkt;
-    uint16_t cs;
-    uint8_t *sb, *buf;
+    uint32_t wnd, snd, mss = TCP_SMSS(sock);
     uint32_t seq, unacked, head;
+    int idle = sock->data.snd.nxt == sock->data.snd.una, sent = 0;
+
+    wnd = MIN(sock->data.snd.wnd, sock->data.cc.cwnd);
 
     if(!resend) {
         seq = sock->data.snd.nxt;
         unacked = sock->data.snd.nxt - sock->data.snd.una;
-        wnd -= unacked;
         head = sock->data.sndbuf_head;
+
+        /* Don't send anything if the window is already full. */
+        if(unacked >= wnd)
+            return;
+
+        wnd -= unacked;
     }
     else {
         seq = sock->data.snd.una;
         unacked = 0;
         head = sock->data.sndbuf_acked;
-    }
 
-    if(!wnd)
-        wnd = 1;
-
-    /* Fill in the base packet */
-    hdr->src_port = sock->local_addr.sin6_port;
-    hdr->dst_port = sock->remote_addr.sin6_port;
-    hdr->ack = htonl(sock->data.rcv.nxt);
-    hdr->off_flags = htons(TCP_FLAG_ACK | TCP_OFFSET(5));
-    hdr->wnd = htons(sock->data.rcv.wnd);
-    hdr->urg = 0;
+        /* If the other side has closed its window, probe it with one byte. */
+        if(!wnd)
+            wnd = 1;
+    }
 
     /* Put on some data if we should do so */
-    while(sock->data.sndbuf_cur_sz - unacked && wnd) {
-        hdr->seq = htonl(seq);
-        hdr->checksum = 0;
-        buf = rawpkt + sizeof(tcp_hdr_t);
-        sb = sock->data.sndbuf + head;
-        snd = wnd;
+    while(sock->data.sndbuf_cur_sz > unacked && wnd) {
+        snd = MIN(wnd, mss);
 
-        if(snd > sock->data.snd.mss - sizeof(tcp_hdr_t))
-            snd = sock->data.snd.mss - sizeof(tcp_hdr_t);
-
-        if(snd > sock->data.sndbuf_cur_sz - unacked)
+        if(snd > sock->data.sndbuf_cur_sz - unacked) {
             snd = sock->data.sndbuf_cur_sz - unacked;
 
-        /* Copy in the data */
-        if(head + snd <= sock->sndbuf_sz) {
-            memcpy(buf, sb, snd);
-            head += snd;
-
-            if(head == sock->sndbuf_sz)
-                head = 0;
+            if(snd < mss && !resend && tcp_hold_small(sock, unacked))
+                break;
         }
-        else {
-            sz = sock->sndbuf_sz - head;
-            memcpy(buf, sb, sz);
-            memcpy(buf + sz, sock->data.sndbuf, snd - sz);
-            head = snd - sz;
+
+        /* Don't chop off a small segment just because the window is almost
+           full, unless there's nothing else in flight. Wait for the window to
+           open up instead (sender-side silly window avoidance). */
+        else if(snd < mss && unacked)
+            break;
+
+        tcp_send_segment(sock, seq, head, snd);
+        sent = 1;
+
+        /* Time this segment if it's new and we aren't already timing one. With
+           timestamps, every ACK gives us a sample, so there's no need. */
+        if(!(sock->data.options & TCPI_OPT_TIMESTAMPS) &&
+                !sock->data.rtt_time &&
+                !SEQ_LT(seq, sock->data.snd_max)) {
+            sock->data.rtt_seq = seq + snd;
+            sock->data.rtt_time = timer_ms_gettime64();
         }
 
-        sz = snd + sizeof(tcp_hdr_t);
+        head += snd;
+
+        if(head >= sock->sndbuf_sz)
+            head -= sock->sndbuf_sz;
+
         wnd -= snd;
         seq += snd;
         unacked += snd;
+    }
 
-        /* Calculate the checksum */
-        cs = net_ipv6_checksum_pseudo(&sock->local_addr.sin6_addr,
-                                      &sock->remote_addr.sin6_addr, sz,
-                                      IPPROTO_TCP);
-        hdr->checksum = net_ipv4_checksum(rawpkt, sz, cs);
+    /* Only restart the retransmission timer if this is the first thing in
+       flight or if we're starting over. Otherwise it is already running for
+       the oldest outstanding segment (RFC 6298, section 5.1). */
+    if(sent && (resend || idle))
+        tcp_timer_set(sock, sock->data.rto);
 
-        net_ipv6_send(sock->data.net, rawpkt, sz, sock->hop_limit, IPPROTO_TCP,
-                      &sock->local_addr.sin6_addr,
-                      &sock->remote_addr.sin6_addr);
-    }
+    /* If the other side's window is closed and there's nothing out there for
+       them to ack, make sure the timer is running so that we'll probe it. */
+    else if(!sent && idle && sock->data.sndbuf_cur_sz && !sock->data.timer)
+        tcp_timer_set(sock, sock->data.rto);
+
+    if(SEQ_GT(seq, sock->data.snd_max))
+        sock->data.snd_max = seq;
+
+    /* If everything that was written is out, nothing is being held back. */
+    if(sock->data.sndbuf_cur_sz == unacked)
+        sock->data.cork_timer = 0;
 
-    sock->data.timer = timer_ms_gettime64();
     sock->data.sndbuf_head = head;
     sock->data.snd.nxt = seq;
 }
@@ -2238,6 +3056,36 @@ static void tcp_send_data(struct tcp_sock *sock, int resend) {
      ((a1).__s6_addr.__s6_addr32[2] == (a2).__s6_addr.__s6_addr32[2]) && \
      ((a1).__s6_addr.__s6_addr32[3] == (a2).__s6_addr.__s6_addr32[3]))
 
+/* See if a socket can take a packet with the given addresses. */
+static int tcp_sock_match(const struct tcp_sock *i, const struct in6_addr *src,
+                          const struct in6_addr *dst, uint16_t sport,
+                          uint16_t dport, int domain) {
+    /* Ignore any closed sockets */
+    if(i->state == TCP_STATE_CLOSED)
+        return 0;
+
+    /* Ignore any sockets that are IPv6 only when we have an incoming IPv4
+       packet, or any that are IPv4 only when we have an incoming IPv6
+       packet. */
+    if((domain == AF_INET && (i->flags & FS_SOCKET_V6ONLY)) ||
+            (domain == AF_INET6 && i->domain == AF_INET))
+        return 0;
+
+    /* See if the remote end matches what's in the socket */
+    if(!IN6_IS_ADDR_UNSPECIFIED(&i->remote_addr.sin6_addr) &&
+            (!ADDR_EQUAL(i->remote_addr.sin6_addr, *src) ||
+             i->remote_addr.sin6_port != sport))
+        return 0;
+
+    /* See if it matches the local end */
+    if((!IN6_IS_ADDR_UNSPECIFIED(&i->local_addr.sin6_addr) &&
+            !ADDR_EQUAL(i->local_addr.sin6_addr, *dst)) ||
+            i->local_addr.sin6_port != dport)
+        return 0;
+
+    return 1;
+}
+
 /* Match a socket to an incoming packet. If an actual socket is returned, it is
    the caller's responsibility  to release the socket's mutex when they're done
    with it. */
@@ -2246,44 +3094,143 @@ static struct tcp_sock *find_sock(const struct in6_addr *src,
                                   uint16_t sport, uint16_t dport, int domain) {
     struct tcp_sock *i;
 
-    LIST_FOREACH(i, &tcp_socks, sock_list) {
-        /* Ignore any closed sockets */
-        if(i->state == TCP_STATE_CLOSED)
-            continue;
+    /* Connected sockets get the first shot at it, then anything that is only
+       bound to the port. See the comment at the top of the file for more
+       discussion of this, if you're interested. */
+    LIST_FOREACH(i, &tcp_conn_hash[tcp_conn_bucket(src, sport, dport)],
+                 hash_list) {
+        if(tcp_sock_match(i, src, dst, sport, dport, domain))
+            goto found;
+    }
 
-        /* Ignore any sockets that are IPv6 only when we have an incoming IPv4
-           packet, or any that are IPv4 only when we have an incoming IPv6
-           packet. */
-        if((domain == AF_INET && (i->flags & FS_SOCKET_V6ONLY)) ||
-                (domain == AF_INET6 && i->domain == AF_INET))
-            continue;
+    LIST_FOREACH(i, &tcp_port_hash[tcp_port_bucket(dport)], hash_list) {
+        if(tcp_sock_match(i, src, dst, sport, dport, domain))
+            goto found;
+    }
 
-        /* See if the remote end matches what's in the socket */
-        if(!IN6_IS_ADDR_UNSPECIFIED(&i->remote_addr.sin6_addr) &&
-                (!ADDR_EQUAL(i->remote_addr.sin6_addr, *src) ||
-                 i->remote_addr.sin6_port != sport))
-            continue;
+    return NULL;
 
-        /* See if it matches the local end */
-        if((!IN6_IS_ADDR_UNSPECIFIED(&i->local_addr.sin6_addr) &&
-                !ADDR_EQUAL(i->local_addr.sin6_addr, *dst)) ||
-                i->local_addr.sin6_port != dport)
-            continue;
+found:
+    if(mutex_lock_irqsafe(&i->mutex))
+        return (struct tcp_sock *) -1;
+
+    return i;
+}
+
+extern void __poll_event_trigger(int fd, short event);
+
+/* Most SACK blocks that will fit in a header. */
+#define TCP_SACK_BLOCKS     4
+
+/* How the timestamp option is laid out on just about every segment other than
+   a SYN (RFC 7323, appendix A), which is the only layout the fast path looks
+   for. Anything else goes the slow way. */
+#define TCP_TS_PREDICTED    ((TCP_OPT_NOP << 24) | (TCP_OPT_NOP << 16) | \
+                             (TCP_OPT_TIMESTAMP << 8) | TCP_OPTLEN_TIMESTAMP)
+
+/* Options that we care about from an incoming segment. options has the
+   TCPI_OPT_* flag set for each of the options that showed up. */
+struct tcp_opts {
+    uint16_t mss;
+    uint8_t options;
+    uint8_t wscale;
+    uint32_t tsval;
+    uint32_t tsecr;
+    int sack_count;
+    struct tcp_range sack[TCP_SACK_BLOCKS];
+};
+
+/* Parse the options on an incoming segment. The MSS, window scale and SACK
+   permitted options only count on a SYN, so the caller should fill in a default
+   MSS first. Unknown options are skipped over. Returns -1 if the options are
+   malformed. */
+static int tcp_parse_opts(const tcp_hdr_t *tcp, uint16_t flags,
+                          struct tcp_opts *opts) {
+    const uint8_t *opt = tcp->options;
+    int j = 0, k, end = TCP_GET_OFFSET(flags) - (int)sizeof(tcp_hdr_t);
+    struct tcp_range *sack;
+
+    opts->options = 0;
+    opts->wscale = 0;
+    opts->tsval = opts->tsecr = 0;
+    opts->sack_count = 0;
+
+    while(j < end) {
+        switch(opt[j]) {
+            case TCP_OPT_EOL:
+                return 0;
+
+            case TCP_OPT_NOP:
+                ++j;
+                continue;
+        }
 
-        if(mutex_lock_irqsafe(&i->mutex))
-            return (struct tcp_sock *) -1;
+        if(j + 2 > end || opt[j + 1] < 2 || j + opt[j + 1] > end)
+            return -1;
+
+        switch(opt[j]) {
+            case TCP_OPT_MSS:
+                if(opt[j + 1] != 4)
+                    return -1;
+
+                if(flags & TCP_FLAG_SYN)
+                    opts->mss = (opt[j + 2] << 8) | opt[j + 3];
+
+                break;
+
+            case TCP_OPT_TIMESTAMP:
+                if(opt[j + 1] != TCP_OPTLEN_TIMESTAMP)
+                    return -1;
+
+                memcpy(&opts->tsval, opt + j + 2, 4);
+                memcpy(&opts->tsecr, opt + j + 6, 4);
+                opts->tsval = ntohl(opts->tsval);
+                opts->tsecr = ntohl(opts->tsecr);
+                opts->options |= TCPI_OPT_TIMESTAMPS;
+                break;
+
+            case TCP_OPT_WSCALE:
+                if(opt[j + 1] != TCP_OPTLEN_WSCALE)
+                    return -1;
+
+                if(flags & TCP_FLAG_SYN) {
+                    opts->wscale = MIN(opt[j + 2], TCP_MAX_WSCALE);
+                    opts->options |= TCPI_OPT_WSCALE;
+                }
 
-        /* Because we always add new sockets to the head of the list, this
-           should be sufficient to match the socket. See the comment at the top
-           of the file for more discussion of this, if you're interested. */
-        return i;
+                break;
+
+            case TCP_OPT_SACK_PERMITTED:
+                if(opt[j + 1] != TCP_OPTLEN_SACK_PERM)
+                    return -1;
+
+                if(flags & TCP_FLAG_SYN)
+                    opts->options |= TCPI_OPT_SACK;
+
+                break;
+
+            case TCP_OPT_SACK:
+                if((opt[j + 1] - 2) % 8)
+                    return -1;
+
+                for(k = 2; k < opt[j + 1] &&
+                        opts->sack_count < TCP_SACK_BLOCKS; k += 8) {
+                    sack = opts->sack + opts->sack_count++;
+                    memcpy(&sack->start, opt + j + k, 4);
+                    memcpy(&sack->end, opt + j + k + 4, 4);
+                    sack->start = ntohl(sack->start);
+                    sack->end = ntohl(sack->end);
+                }
+
+                break;
+        }
+
+        j += opt[j + 1];
     }
 
-    return NULL;
+    return 0;
 }
 
-extern void __poll_event_trigger(int fd, short event);
-
 /* This function is basically a direct implementation of the first two and a
    half steps of the SEGMENT ARRIVES event processing defined in RFC 793 on
    pages 65 and 66. There are a few parts that are omitted and some are put off
@@ -2291,9 +3238,9 @@ extern void __poll_event_trigger(int fd, short event);
 static int listen_pkt(netif_t *src, const struct in6_addr *srca,
                       const struct in6_addr *dsta, const tcp_hdr_t *tcp,
                       struct tcp_sock *s, uint16_t flags, int size) {
-    int j = 0;
-    int end_of_opts;
-    uint16_t mss = 576;
+    int j;
+    struct tcp_opts opts;
+    uint16_t mss;
 
     (void)size;
 
@@ -2306,39 +3253,18 @@ static int listen_pkt(netif_t *src, const struct in6_addr *srca,
         return -1;
 
     /* Parse options now, in case we need to update the max segment size. */
-    end_of_opts = TCP_GET_OFFSET(flags) - 20;
-
-    while(j < end_of_opts) {
-        switch(tcp->options[j]) {
-            case TCP_OPT_EOL:
-                j = end_of_opts;
-                break;
-
-            case TCP_OPT_NOP:
-                ++j;
-                break;
-
-            case TCP_OPT_MSS:
-                if(j + 4 > end_of_opts || tcp->options[j + 1] != 4)
-                    return -1;
-
-                mss = (tcp->options[j + 2] << 8) | tcp->options[j + 3];
-                j += 4;
-                break;
-
-            default:
+    opts.mss = 576;
 
-                /* Skip unknown options */
-                if(j + 1 > end_of_opts || j + tcp->options[j + 1] > end_of_opts)
-                    return -1;
+    if(tcp_parse_opts(tcp, flags, &opts))
+        return -1;
 
-                j += tcp->options[j + 1];
-        }
-    }
+    mss = opts.mss;
 
     /* Silently cap the MSS... */
     if(mss > 1460)
         mss = 1460;
+    else if(mss < TCP_MIN_MSS)
+        mss = TCP_MIN_MSS;
 
     /* If the SYN bit is set, we should check the security/compartment. We just
        silently ignore them for now. We also ignore the precedence... Thus, the
@@ -2350,6 +3276,9 @@ static int listen_pkt(netif_t *src, const struct in6_addr *srca,
                 s->listen.queue[j].remote_addr.sin6_port == tcp->src_port) {
             s->listen.queue[j].isn = ntohl(tcp->seq);
             s->listen.queue[j].mss = mss;
+            s->listen.queue[j].options = opts.options;
+            s->listen.queue[j].wscale = opts.wscale;
+            s->listen.queue[j].ts_recent = opts.tsval;
             return 0;
         }
     }
@@ -2368,6 +3297,9 @@ static int listen_pkt(netif_t *src, const struct in6_addr *srca,
     s->listen.queue[s->listen.tail].isn = ntohl(tcp->seq);
     s->listen.queue[s->listen.tail].mss = mss;
     s->listen.queue[s->listen.tail].wnd = ntohs(tcp->wnd);
+    s->listen.queue[s->listen.tail].options = opts.options;
+    s->listen.queue[s->listen.tail].wscale = opts.wscale;
+    s->listen.queue[s->listen.tail].ts_recent = opts.tsval;
     ++s->listen.count;
     ++s->listen.tail;
 
@@ -2389,7 +3321,7 @@ static int synsent_pkt(netif_t *src, const struct in6_addr *srca,
                        struct tcp_sock *s, uint16_t flags, int size) {
     uint32_t ack, seq;
     int sz = size - TCP_GET_OFFSET(flags), gotack = 0;
-    int j = 0, end_of_opts, mss = 536;
+    struct tcp_opts opts;
 
     (void)src;
 
@@ -2425,47 +3357,43 @@ static int synsent_pkt(netif_t *src, const struct in6_addr *srca,
         s->data.rcv.nxt = seq + 1;
         s->data.rcv.irs = seq;
 
-        end_of_opts = TCP_GET_OFFSET(flags) - 20;
-
-        while(j < end_of_opts) {
-            switch(tcp->options[j]) {
-                case TCP_OPT_EOL:
-                    j = end_of_opts;
-                    break;
-
-                case TCP_OPT_NOP:
-                    ++j;
-                    break;
+        opts.mss = 536;
 
-                case TCP_OPT_MSS:
-
-                    if(j + 4 > end_of_opts || tcp->options[j + 1] != 4)
-                        return -1;
+        if(tcp_parse_opts(tcp, flags, &opts))
+            return -1;
 
-                    mss = (tcp->options[j + 2] << 8) | tcp->options[j + 3];
-                    j += 4;
-                    break;
+        /* Only use the options that the other side agreed to. */
+        s->data.options = opts.options;
+        s->data.ts_recent = opts.tsval;
 
-                default:
+        if(opts.options & TCPI_OPT_WSCALE)
+            s->data.snd_wscale = opts.wscale;
+        else
+            s->data.rcv_wscale = 0;
 
-                    /* Skip unknown options */
-                    if(j + 1 > end_of_opts ||
-                            j + tcp->options[j + 1] > end_of_opts)
-                        return -1;
-
-                    j += tcp->options[j + 1];
-            }
-        }
+        if(opts.mss < TCP_MIN_MSS)
+            opts.mss = TCP_MIN_MSS;
 
-        s->data.snd.mss = mss > 1460 ? 1460 : mss;
+        s->data.snd.mss = opts.mss > 1460 ? 1460 : opts.mss;
         s->data.snd.wnd = htons(tcp->wnd);
+        tcp_cc_init(&s->data.cc, s->cc_ops, TCP_SMSS(s));
 
         if(gotack) {
             s->data.snd.una = ack;
 
             /* If the ack covers our iss, then we've established the connection.
-               Update the state and ack it. */
+               Update the state and ack it. Our SYN can give us the first round
+               trip time sample, as long as it wasn't retransmitted. */
             if(SEQ_GT(ack, s->data.snd.iss)) {
+                if((opts.options & TCPI_OPT_TIMESTAMPS) && opts.tsecr)
+                    tcp_rtt_sample(s, (uint32_t)timer_ms_gettime64() -
+                                   opts.tsecr);
+                else if(s->data.rtt_time)
+                    tcp_rtt_sample(s, (uint32_t)(timer_ms_gettime64() -
+                                                 s->data.rtt_time));
+
+                s->data.rtt_time = 0;
+                s->data.timer = 0;
                 s->state = TCP_STATE_ESTABLISHED;
                 tcp_send_ack(s);
                 __poll_event_trigger(s->sock, POLLWRNORM | POLLWRBAND);
@@ -2475,6 +3403,7 @@ static int synsent_pkt(netif_t *src, const struct in6_addr *srca,
         else {
             s->state = TCP_STATE_SYN_RECEIVED;
             tcp_send_syn(s, 1);
+            tcp_timer_set(s, s->data.rto);
             __poll_event_trigger(s->sock, POLLWRNORM | POLLWRBAND);
             cond_signal(&s->data.send_cv);
         }
@@ -2483,16 +3412,397 @@ static int synsent_pkt(netif_t *src, const struct in6_addr *srca,
     return 0;
 }
 
+/* Copy incoming data into the receive buffer, starting the given number of
+   bytes past the tail. */
+static void tcp_rcvbuf_write(struct tcp_sock *s, uint32_t off,
+                             const uint8_t *buf, uint32_t len) {
+    uint32_t pos = s->data.rcvbuf_tail + off, tmp;
+
+    if(pos >= s->rcvbuf_sz)
+        pos -= s->rcvbuf_sz;
+
+    if(pos + len <= s->rcvbuf_sz) {
+        memcpy(s->data.rcvbuf + pos, buf, len);
+    }
+    else {
+        tmp = s->rcvbuf_sz - pos;
+        memcpy(s->data.rcvbuf + pos, buf, tmp);
+        memcpy(s->data.rcvbuf, buf + tmp, len - tmp);
+    }
+}
+
+/* Add a range to a sorted list of them, merging it with any ranges that it
+   overlaps or touches. Returns 0 if there's no room to keep it. */
+static int tcp_range_add(struct tcp_range *r, int *count, int max,
+                         uint32_t start, uint32_t end) {
+    int i, j, cnt = *count;
+
+    for(i = 0; i < cnt && SEQ_LT(r[i].end, start); ++i) ;
+
+    if(i < cnt && SEQ_LE(r[i].start, end)) {
+        if(SEQ_LT(start, r[i].start))
+            r[i].start = start;
+
+        if(SEQ_GT(end, r[i].end))
+            r[i].end = end;
+
+        /* This might have closed the gap to the next ones too. */
+        for(j = i + 1; j < cnt && SEQ_LE(r[j].start, r[i].end); ++j) {
+            if(SEQ_GT(r[j].end, r[i].end))
+                r[i].end = r[j].end;
+        }
+
+        memmove(r + i + 1, r + j, (cnt - j) * sizeof(struct tcp_range));
+        *count -= j - i - 1;
+        return 1;
+    }
+
+    if(cnt == max)
+        return 0;
+
+    memmove(r + i + 1, r + i, (cnt - i) * sizeof(struct tcp_range));
+    r[i].start = start;
+    r[i].end = end;
+    ++*count;
+    return 1;
+}
+
+/* Take anything that has been cumulatively acked out of the SACK scoreboard. */
+static void tcp_sack_trim(struct tcp_sock *s, uint32_t ack) {
+    struct tcp_range *r = s->data.sacked;
+    int i;
+
+    for(i = 0; i < s->data.sack_count && SEQ_LE(r[i].end, ack); ++i) ;
+
+    if(i) {
+        s->data.sack_count -= i;
+        memmove(r, r + i, s->data.sack_count * sizeof(struct tcp_range));
+    }
+
+    if(s->data.sack_count && SEQ_LT(r[0].start, ack))
+        r[0].start = ack;
+}
+
+/* Everything up to end is done with. Take out any ranges that are contiguous
+   with that (or behind it), and return where the contiguous data ends now. */
+static uint32_t tcp_range_advance(struct tcp_range *r, int *count,
+                                  uint32_t end) {
+    int i;
+
+    for(i = 0; i < *count && SEQ_LE(r[i].start, end); ++i) {
+        if(SEQ_GT(r[i].end, end))
+            end = r[i].end;
+    }
+
+    if(i) {
+        *count -= i;
+        memmove(r, r + i, *count * sizeof(struct tcp_range));
+    }
+
+    return end;
+}
+
+/* Take data that the other side has just acknowledged (up to ack, which must be
+   past snd.una) out of the send buffer, wake up anyone waiting to send more,
+   and update the round trip time estimate. Returns the number of bytes of data
+   that were acked. */
+static uint32_t tcp_ack_advance(struct tcp_sock *s, const struct tcp_opts *opts,
+                                uint32_t ack, int acksyn, uint64_t now) {
+    uint32_t acked = ack - s->data.snd.una - acksyn;
+
+    /* Don't count our FIN as data. */
+    if(acked > s->data.sndbuf_cur_sz)
+        acked = s->data.sndbuf_cur_sz;
+
+    s->data.sndbuf_acked += acked;
+    s->data.sndbuf_cur_sz -= acked;
+
+    /* If close() was waiting on this, the FIN can go out now. */
+    if(!s->data.sndbuf_cur_sz && (s->intflags & TCP_IFLAG_QUEUEDCLOSE))
+        tcp_kick();
+    s->data.snd.una = ack;
+    tcp_sack_trim(s, ack);
+    s->data.dupacks = 0;
+    s->data.retrans = 0;
+    __poll_event_trigger(s->sock, POLLWRNORM | POLLWRBAND);
+    cond_signal(&s->data.send_cv);
+
+    if(s->data.sndbuf_acked >= s->sndbuf_sz)
+        s->data.sndbuf_acked -= s->sndbuf_sz;
+
+    /* Update the round trip time estimate. With timestamps, anything that acks
+       new data tells us how long the round trip was (RFC 7323, section 4.1).
+       Otherwise, see if the segment we were timing made it there. */
+    if((s->data.options & opts->options & TCPI_OPT_TIMESTAMPS) &&
+            opts->tsecr) {
+        tcp_rtt_sample(s, (uint32_t)now - opts->tsecr);
+    }
+    else if(s->data.rtt_time && SEQ_GE(ack, s->data.rtt_seq)) {
+        tcp_rtt_sample(s, (uint32_t)(now - s->data.rtt_time));
+        s->data.rtt_time = 0;
+    }
+
+    /* If we went back to resend after a timeout, the other side might have had
+       more than we thought. Skip ahead to what it actually wants. */
+    if(SEQ_GT(ack, s->data.snd.nxt)) {
+        s->data.snd.nxt = ack;
+        s->data.sndbuf_head = s->data.sndbuf_acked;
+    }
+
+    return acked;
+}
+
+/* Deal with an acceptable ACK (one between snd.una and snd_max). This is where
+   all of the congestion control and loss recovery happens, as described in RFC
+   5681 and RFC 6582. */
+static void tcp_process_ack(struct tcp_sock *s, const tcp_hdr_t *tcp,
+                            const struct tcp_opts *opts, uint32_t seq,
+                            uint32_t ack, size_t sz, int acksyn) {
+    uint32_t acked, flight, mss = s->data.cc.mss;
+    uint32_t wnd = (uint32_t)ntohs(tcp->wnd) << s->data.snd_wscale;
+    uint32_t start, end;
+    uint64_t now = timer_ms_gettime64();
+    int dupack = 0, i;
+
+    flight = s->data.snd_max - s->data.snd.una;
+
+    if(ack == s->data.snd.una) {
+        /* This is a duplicate ACK if it doesn't carry any data or change the
+           window, and we have data outstanding (RFC 5681, section 2). */
+        dupack = s->data.sndbuf_cur_sz && flight && !sz &&
+                 wnd == s->data.snd.wnd;
+    }
+    else {
+        acked = tcp_ack_advance(s, opts, ack, acksyn, now);
+
+        if(s->data.ca_state == TCP_CA_RECOVERY) {
+            if(SEQ_GE(ack, s->data.recover)) {
+                /* Full acknowledgement. Deflate the window and go back to
+                   normal (RFC 6582, section 3.2, step 3). */
+                flight = s->data.snd_max - ack;
+                s->data.cc.cwnd = MIN(s->data.cc.ssthresh, MAX(flight, mss) +
+                                      mss);
+                s->data.ca_state = TCP_CA_OPEN;
+            }
+            else {
+                /* Partial acknowledgement. Resend the next hole, and take back
+                   the part of the window that was just acked. */
+                if(s->data.sack_count)
+                    tcp_resend_hole(s);
+                else
+                    tcp_resend_una(s);
+
+                if(s->data.cc.cwnd > acked + mss)
+                    s->data.cc.cwnd -= acked;
+                else
+                    s->data.cc.cwnd = mss;
+
+                if(acked >= mss)
+                    s->data.cc.cwnd += mss;
+            }
+        }
+        else {
+            if(s->data.ca_state == TCP_CA_LOSS &&
+                    SEQ_GE(ack, s->data.recover))
+                s->data.ca_state = TCP_CA_OPEN;
+
+            /* Only grow the window if we were actually using all of it, so
+               it doesn't run away while the other side's window or the
+               application is what's holding things back (RFC 7661). */
+            if(acked && flight + mss >= s->data.cc.cwnd)
+                s->data.cc.ops->ack(&s->data.cc, acked, now);
+        }
+
+        /* Restart the retransmission timer if there's still something
+           outstanding, otherwise stop it (RFC 6298, sections 5.2 and 5.3). */
+        if(s->data.snd.nxt != ack)
+            tcp_timer_set(s, s->data.rto);
+        else
+            s->data.timer = 0;
+    }
+
+    /* Update the scoreboard with anything the other side has selectively
+       acknowledged. Ignore anything that doesn't make sense. */
+    if(s->data.options & TCPI_OPT_SACK) {
+        for(i = 0; i < opts->sack_count; ++i) {
+            start = opts->sack[i].start;
+            end = opts->sack[i].end;
+
+            if(SEQ_GE(start, end) || SEQ_LE(end, s->data.snd.una) ||
+                    SEQ_GT(end, s->data.snd_max))
+                continue;
+
+            if(SEQ_LT(start, s->data.snd.una))
+                start = s->data.snd.una;
+
+            tcp_range_add(s->data.sacked, &s->data.sack_count, TCP_SACK_MAX,
+                          start, end);
+        }
+    }
+
+    if(SEQ_LT(s->data.snd.wl1, seq) ||
+            (s->data.snd.wl1 == seq && SEQ_LE(s->data.snd.wl2, ack))) {
+        s->data.snd.wnd = wnd;
+        s->data.snd.wl1 = seq;
+        s->data.snd.wl2 = ack;
+    }
+
+    if(dupack) {
+        ++s->data.dupacks;
+
+        if(s->data.ca_state == TCP_CA_RECOVERY) {
+            /* Each further duplicate means another segment has left the
+               network. Use that to fill in the next hole if we know of one,
+               otherwise inflate the window to match. */
+            if(!s->data.sack_count || !tcp_resend_hole(s))
+                s->data.cc.cwnd += mss;
+        }
+        else if(s->data.dupacks == 3 && SEQ_GE(ack, s->data.recover)) {
+            /* Fast retransmit. Only do this once per window of data, so
+               that we don't cut the window more than once for one loss
+               event. */
+            s->data.cc.ops->loss(&s->data.cc, flight, now);
+            s->data.recover = s->data.snd_max;
+            s->data.ca_state = TCP_CA_RECOVERY;
+            s->data.rexmit_nxt = s->data.snd.una;
+
+            if(!tcp_resend_hole(s))
+                tcp_resend_una(s);
+            s->data.cc.cwnd = s->data.cc.ssthresh + 3 * mss;
+            tcp_timer_set(s, s->data.rto);
+        }
+    }
+
+    /* Send whatever new data the window allows now. */
+    if((s->state == TCP_STATE_ESTABLISHED ||
+            s->state == TCP_STATE_CLOSE_WAIT) &&
+            s->data.sndbuf_cur_sz > s->data.snd.nxt - s->data.snd.una)
+        tcp_send_data(s, 0);
+}
+
+/* Header prediction, as in 4.4BSD. Nearly everything that arrives on a busy
+   connection is either a pure ACK for data we've sent, or the next bit of data
+   in order with nothing new acked, on a connection with nothing unusual going
+   on. Those can skip almost all of the checks in process_pkt(). Returns 1 if
+   the segment was dealt with here, or 0 if it needs to go the slow way. */
+static int tcp_fast_path(struct tcp_sock *s, const tcp_hdr_t *tcp,
+                         uint16_t flags, uint32_t seq, uint32_t ack,
+                         const uint8_t *buf, size_t sz) {
+    struct tcp_opts opts;
+    uint32_t wnd, acked, flight, tmp;
+    int optlen = TCP_GET_OFFSET(flags) - (int)sizeof(tcp_hdr_t);
+    uint64_t now;
+
+    if(s->state != TCP_STATE_ESTABLISHED ||
+            (flags & (TCP_FLAG_SYN | TCP_FLAG_FIN | TCP_FLAG_RST |
+                      TCP_FLAG_URG | TCP_FLAG_ACK)) != TCP_FLAG_ACK ||
+            seq != s->data.rcv.nxt ||
+            s->data.snd.nxt != s->data.snd_max ||
+            s->data.ca_state != TCP_CA_OPEN)
+        return 0;
+
+    /* The window can't have changed, so that nothing has to be updated. */
+    wnd = (uint32_t)ntohs(tcp->wnd) << s->data.snd_wscale;
+
+    if(!wnd || wnd != s->data.snd.wnd)
+        return 0;
+
+    /* If timestamps are in use, they have to be there (and not be older than
+       the last one we saw). Otherwise, there can't be any options at all. */
+    opts.options = 0;
+    opts.sack_count = 0;
+
+    if(s->data.options & TCPI_OPT_TIMESTAMPS) {
+        if(optlen != TCP_OPTLEN_TIMESTAMP + 2)
+            return 0;
+
+        memcpy(&tmp, tcp->options, 4);
+
+        if(ntohl(tmp) != TCP_TS_PREDICTED)
+            return 0;
+
+        memcpy(&opts.tsval, tcp->options + 4, 4);
+        memcpy(&opts.tsecr, tcp->options + 8, 4);
+        opts.tsval = ntohl(opts.tsval);
+        opts.tsecr = ntohl(opts.tsecr);
+
+        if(SEQ_LT(opts.tsval, s->data.ts_recent))
+            return 0;
+
+        opts.options = TCPI_OPT_TIMESTAMPS;
+    }
+    else if(optlen) {
+        return 0;
+    }
+
+    if(!sz) {
+        /* A pure ACK for new data, with nothing sacked. */
+        if(!SEQ_GT(ack, s->data.snd.una) || SEQ_GT(ack, s->data.snd_max) ||
+                s->data.sack_count)
+            return 0;
+
+        if(opts.options)
+            s->data.ts_recent = opts.tsval;
+
+        now = timer_ms_gettime64();
+        flight = s->data.snd_max - s->data.snd.una;
+        acked = tcp_ack_advance(s, &opts, ack, 0, now);
+
+        if(acked && flight + s->data.cc.mss >= s->data.cc.cwnd)
+            s->data.cc.ops->ack(&s->data.cc, acked, now);
+
+        if(s->data.snd.nxt != ack)
+            tcp_timer_set(s, s->data.rto);
+        else
+            s->data.timer = 0;
+
+        s->data.snd.wl1 = seq;
+        s->data.snd.wl2 = ack;
+
+        if(s->data.sndbuf_cur_sz > s->data.snd.nxt - s->data.snd.una)
+            tcp_send_data(s, 0);
+
+        ++tcp_stats.fast_acks;
+        return 1;
+    }
+
+    /* In-order data that acks nothing new, with nothing waiting out of order
+       behind it and room for all of it. */
+    if(ack != s->data.snd.una || s->data.ooo_count || sz > s->data.rcv.wnd)
+        return 0;
+
+    if(opts.options)
+        s->data.ts_recent = opts.tsval;
+
+    tcp_rcvbuf_write(s, 0, buf, sz);
+    s->data.rcv.nxt += sz;
+    s->data.rcv.wnd -= sz;
+    s->data.rcvbuf_cur_sz += sz;
+    s->data.rcvbuf_tail += sz;
+
+    if(s->data.rcvbuf_tail >= s->rcvbuf_sz)
+        s->data.rcvbuf_tail -= s->rcvbuf_sz;
+
+    s->data.snd.wl1 = seq;
+
+    __poll_event_trigger(s->sock, POLLRDNORM);
+    cond_signal(&s->data.recv_cv);
+    tcp_send_delack(s);
+
+    ++tcp_stats.fast_data;
+    return 1;
+}
+
 /* This implements the processing described for the synchronized states, as
    described in pages 69-76 of the RFC. */
 static int process_pkt(netif_t *src, const struct in6_addr *srca,
                        const struct in6_addr *dsta, const tcp_hdr_t *tcp,
                        struct tcp_sock *s, uint16_t flags, size_t size) {
-    uint32_t seq, ack, up;
+    uint32_t seq, ack, up, off, end, tmp;
     size_t sz;
-    int bad_pkt = 0, tmp, acksyn = 0;
+    int bad_pkt = 0, acksyn = 0, hole;
     const uint8_t *buf = (const uint8_t *)tcp;
-    uint8_t *rb;
+    struct tcp_opts opts;
 
     (void)src;
 
@@ -2500,10 +3810,15 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
     seq = ntohl(tcp->seq);
     ack = ntohl(tcp->ack);
 
-    /* Check the validity of the incoming segment's sequence number */
     sz = size - TCP_GET_OFFSET(flags);
     buf += TCP_GET_OFFSET(flags);
 
+    if(tcp_fast_path(s, tcp, flags, seq, ack, buf, sz))
+        return 0;
+
+    ++tcp_stats.slow_path;
+
+    /* Check the validity of the incoming segment's sequence number */
     if(s->data.rcv.wnd == 0) {
         if(sz || seq != s->data.rcv.nxt)
             bad_pkt = 1;
@@ -2533,6 +3848,16 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
         return 0;
     }
 
+    /* Grab the timestamp, if there is one. Keep the newest one that the other
+       side has sent for us to echo back to them (RFC 7323, section 4.3). */
+    if(tcp_parse_opts(tcp, flags, &opts))
+        opts.options = 0;
+
+    if((s->data.options & opts.options & TCPI_OPT_TIMESTAMPS) &&
+            SEQ_LE(seq, s->data.rcv.nxt) &&
+            SEQ_GE(opts.tsval, s->data.ts_recent))
+        s->data.ts_recent = opts.tsval;
+
     /* See if we have a reset, and process it */
     if(flags & TCP_FLAG_RST) {
         if(s->state == TCP_STATE_SYN_SENT) {
@@ -2582,25 +3907,13 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
         }
     }
 
-    /* Check the ack number for validity */
-    if(SEQ_LT(s->data.snd.una, ack) && SEQ_LE(ack, s->data.snd.nxt)) {
-        s->data.sndbuf_acked += (int32_t)(ack - s->data.snd.una - acksyn);
-        s->data.sndbuf_cur_sz -= (int32_t)(ack - s->data.snd.una - acksyn);
-        s->data.snd.una = ack;
-        __poll_event_trigger(s->sock, POLLWRNORM | POLLWRBAND);
-        cond_signal(&s->data.send_cv);
-
-        if(s->data.sndbuf_acked >= s->sndbuf_sz)
-            s->data.sndbuf_acked -= s->sndbuf_sz;
-
-        if(SEQ_LT(s->data.snd.wl1, seq) ||
-                (s->data.snd.wl1 == seq && SEQ_LE(s->data.snd.wl2, ack))) {
-            s->data.snd.wnd = ntohs(tcp->wnd);
-            s->data.snd.wl1 = seq;
-            s->data.snd.wl2 = ack;
-        }
+    /* Check the ack number for validity. Note that we check against the
+       highest sequence number we've sent, since snd.nxt gets pulled back after
+       a retransmission timeout. */
+    if(SEQ_LE(s->data.snd.una, ack) && SEQ_LE(ack, s->data.snd_max)) {
+        tcp_process_ack(s, tcp, &opts, seq, ack, sz, acksyn);
     }
-    else if(SEQ_GT(ack, s->data.snd.nxt)) {
+    else if(SEQ_GT(ack, s->data.snd_max)) {
         /* This ACKs something we haven't sent, so try to correct the other side
            and return */
         tcp_send_ack(s);
@@ -2623,7 +3936,7 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
             /* If the FIN has been acked, go to TIME-WAIT */
             if(ack == s->data.snd.nxt) {
                 s->state = TCP_STATE_TIME_WAIT;
-                s->data.timer = timer_ms_gettime64();
+                tcp_timer_set(s, 2 * TCP_DEFAULT_MSL);
                 break;
             }
             else {
@@ -2642,7 +3955,7 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
 
         case TCP_STATE_TIME_WAIT:
             /* ACK the FIN again, and restart the timer */
-            s->data.timer = timer_ms_gettime64();
+            tcp_timer_set(s, 2 * TCP_DEFAULT_MSL);
             tcp_send_ack(s);
             break;
     }
@@ -2661,35 +3974,55 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
             s->state == TCP_STATE_FIN_WAIT_2) {
         /* Next, check the data size versus our window. If its more than the
            window, truncate the data and copy out what we can. */
-        if(sz > s->data.rcv.wnd) {
-            sz = s->data.rcv.wnd;
+        off = seq - s->data.rcv.nxt;
+
+        if(sz > s->data.rcv.wnd - off) {
+            sz = s->data.rcv.wnd - off;
             bad_pkt = 1;
         }
 
-        /* Copy the data out */
-        if(sz) {
-            rb = s->data.rcvbuf + s->data.rcvbuf_tail;
-            s->data.rcv.nxt += sz;
-            s->data.rcv.wnd -= sz;
-            s->data.rcvbuf_cur_sz += sz;
-
-            if(s->data.rcvbuf_tail + sz <= s->rcvbuf_sz) {
-                memcpy(rb, buf, sz);
-                s->data.rcvbuf_tail += sz;
-            }
-            else {
-                tmp = s->rcvbuf_sz - s->data.rcvbuf_tail;
-                memcpy(rb, buf, tmp);
-                sz -= tmp;
-                buf += tmp;
-                memcpy(s->data.rcvbuf, buf, sz);
-                s->data.rcvbuf_tail = sz;
+        /* If this is out of order, stash it in the receive buffer where it
+           belongs and send a duplicate ACK so the other side knows what is
+           missing (RFC 5681, section 4.2). */
+        if(sz && off) {
+            if(tcp_range_add(s->data.ooo, &s->data.ooo_count, TCP_OOO_MAX,
+                             seq, seq + sz)) {
+                tcp_rcvbuf_write(s, off, buf, sz);
+                s->data.ooo_last = seq;
             }
 
-            /* Signal any waiting thread and send an ack for what we read */
+            tcp_send_ack(s);
+            return 0;
+        }
+
+        /* Copy the data out */
+        if(sz) {
+            hole = s->data.ooo_count;
+            tcp_rcvbuf_write(s, 0, buf, sz);
+
+            /* Pick up anything that came in early that this fills the gap
+               in front of. */
+            end = tcp_range_advance(s->data.ooo, &s->data.ooo_count,
+                                    seq + sz);
+            tmp = end - s->data.rcv.nxt;
+            s->data.rcv.nxt = end;
+            s->data.rcv.wnd -= tmp;
+            s->data.rcvbuf_cur_sz += tmp;
+            s->data.rcvbuf_tail += tmp;
+
+            if(s->data.rcvbuf_tail >= s->rcvbuf_sz)
+                s->data.rcvbuf_tail -= s->rcvbuf_sz;
+
+            /* Signal any waiting thread and send an ack for what we read. If
+               this filled in a hole, the other side needs to know right away
+               (RFC 5681, section 4.2). */
             __poll_event_trigger(s->sock, POLLRDNORM);
             cond_signal(&s->data.recv_cv);
-            tcp_send_ack(s);
+
+            if(hole)
+                tcp_send_ack(s);
+            else
+                tcp_send_delack(s);
         }
     }
     else if(sz) {
@@ -2699,8 +4032,8 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
     }
 
     /* Finally, check the FIN bit. We don't try to ack it if the packet had too
-       much data. */
-    if(!bad_pkt && (flags & TCP_FLAG_FIN)) {
+       much data, or if there's something missing in front of it. */
+    if(!bad_pkt && (flags & TCP_FLAG_FIN) && seq + sz == s->data.rcv.nxt) {
         /* ACK the FIN */
         ++s->data.rcv.nxt;
         tcp_send_ack(s);
@@ -2724,11 +4057,11 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
 
             case TCP_STATE_FIN_WAIT_2:
                 s->state = TCP_STATE_TIME_WAIT;
-                s->data.timer = timer_ms_gettime64();
+                tcp_timer_set(s, 2 * TCP_DEFAULT_MSL);
                 break;
 
             case TCP_STATE_TIME_WAIT:
-                s->data.timer = timer_ms_gettime64();
+                tcp_timer_set(s, 2 * TCP_DEFAULT_MSL);
                 break;
         }
     }
@@ -2781,9 +4114,11 @@ static int net_tcp_input(netif_t *src, int domain, const void *hdr,
     if(c) {
         /* The checksum should be 0 on success, so discard the packet if it does
            not match that expectation. */
+        ++tcp_stats.pkt_recv_bad_chksum;
         return 0;
     }
 
+    ++tcp_stats.pkt_recv;
     flags = ntohs(tcp->off_flags);
 
     if(rwsem_read_lock_irqsafe(&tcp_sem))
@@ -2825,8 +4160,17 @@ static int net_tcp_input(netif_t *src, int domain, const void *hdr,
                 break;
         }
 
+        /* If that finished off a connection that nobody has open anymore, get
+           it cleaned up. */
+        if((s->intflags & TCP_IFLAG_CANBEDEL) &&
+                (s->state & 0x0F) == TCP_STATE_CLOSED)
+            tcp_kick();
+
         mutex_unlock(&s->mutex);
     }
+    else {
+        ++tcp_stats.pkt_recv_no_sock;
+    }
 
     rwsem_read_unlock(&tcp_sem);
 
@@ -2838,9 +4182,55 @@ static int net_tcp_input(netif_t *src, int domain, const void *hdr,
     return 0;
 }
 
+/* The retransmission timer went off with data outstanding. Cut the congestion
+   window down to one segment and start over from snd.una (RFC 5681, section
+   3.1). A timeout while the other side's window is closed is just a window
+   probe, not a sign of congestion. */
+static void tcp_timeout(struct tcp_sock *s, uint64_t now) {
+    uint32_t flight = s->data.snd_max - s->data.snd.una;
+
+    if(s->data.snd.wnd && flight) {
+        s->data.cc.ops->timeout(&s->data.cc, flight, now);
+        s->data.ca_state = TCP_CA_LOSS;
+        s->data.recover = s->data.snd_max;
+        s->data.dupacks = 0;
+    }
+
+    /* Forget what the other side told us with SACK, since it is allowed to
+       throw away data it has SACKed (RFC 2018, section 8). */
+    s->data.sack_count = 0;
+    tcp_backoff(s);
+    tcp_send_data(s, 1);
+}
+
+/* Send our FIN, and start the timer to make sure it gets there. */
+static void tcp_send_fin(struct tcp_sock *s) {
+    tcp_send_fin_ack(s);
+    s->data.snd_max = ++s->data.snd.nxt;
+    tcp_timer_set(s, s->data.rto);
+}
+
+/* The retransmission timer went off without our FIN being acked. Since we only
+   ever send the FIN once everything else has been acked, it is the only thing
+   outstanding. If the other side doesn't answer after a while, give up on
+   them, since nobody has the socket open anymore anyway. */
+static void tcp_resend_fin(struct tcp_sock *s) {
+    tcp_backoff(s);
+
+    if(s->data.retrans > TCP_MAX_FIN_RETRIES) {
+        s->state = TCP_STATE_CLOSED;
+        return;
+    }
+
+    s->data.snd.nxt = s->data.snd.una;
+    tcp_send_fin(s);
+    ++s->data.total_retrans;
+}
+
 static void tcp_thd_cb(void *arg) {
     struct tcp_sock *i, *tmp;
-    uint64_t timer;
+    uint64_t timer, next = 0;
+    int expired;
 
     (void)arg;
 
@@ -2848,32 +4238,33 @@ static void tcp_thd_cb(void *arg) {
 
     LIST_FOREACH(i, &tcp_socks, sock_list) {
         mutex_lock_scoped(&i->mutex);
-        timer = timer_ms_gettime64();
 
-        switch(i->state) {
-            case TCP_STATE_LISTEN:
-                break;
+        if((i->state & 0x0F) == TCP_STATE_LISTEN)
+            continue;
 
-            case TCP_STATE_SYN_SENT:
+        timer = timer_ms_gettime64();
+        expired = i->data.timer && i->data.timer <= timer;
 
-                /* If our last <SYN> was sent more than one  retransmission
-                   timeout period ago and we are still in the SYN-SENT state,
-                   send another one. */
-                if(i->data.timer + TCP_DEFAULT_RTTO <= timer) {
-                    tcp_send_syn(i, 0);
-                    i->data.timer = timer;
-                }
+        /* Send an ACK that has been held back for long enough. */
+        if(i->data.delack_timer && i->data.delack_timer <= timer) {
+            if(i->state == TCP_STATE_ESTABLISHED ||
+                    i->state == TCP_STATE_FIN_WAIT_1 ||
+                    i->state == TCP_STATE_FIN_WAIT_2)
+                tcp_send_ack(i);
 
-                break;
+            i->data.delack_timer = 0;
+        }
 
+        switch(i->state) {
+            case TCP_STATE_SYN_SENT:
             case TCP_STATE_SYN_RECEIVED:
 
-                /* If our last <SYN,ACK> was sent more than one  retransmission
-                   timeout period ago and we are still in the SYN-RECEIVED
-                   state, send another one. */
-                if(i->data.timer + TCP_DEFAULT_RTTO <= timer) {
-                    tcp_send_syn(i, 1);
-                    i->data.timer = timer;
+                /* If the timer went off on our last <SYN> or <SYN,ACK> and we
+                   are still waiting on a response, send another one. */
+                if(expired) {
+                    tcp_backoff(i);
+                    tcp_send_syn(i, i->state == TCP_STATE_SYN_RECEIVED);
+                    tcp_timer_set(i, i->data.rto);
                 }
 
                 break;
@@ -2883,7 +4274,7 @@ static void tcp_thd_cb(void *arg) {
                 /* If the TIME-WAIT timer has expired, then clean up the rest of
                    the connection (the fd was already taken care of by a close()
                    call earlier that ended up putting us in this state). */
-                if(i->data.timer + 2 * TCP_DEFAULT_MSL <= timer)
+                if(expired)
                     i->state = TCP_STATE_CLOSED;
 
                 break;
@@ -2891,9 +4282,12 @@ static void tcp_thd_cb(void *arg) {
             case TCP_STATE_ESTABLISHED:
             case TCP_STATE_CLOSE_WAIT:
 
-                if(i->data.sndbuf_cur_sz &&
-                        i->data.timer + TCP_DEFAULT_RTTO <= timer) {
-                    tcp_send_data(i, 1);
+                if(i->data.sndbuf_cur_sz && expired) {
+                    tcp_timeout(i, timer);
+                }
+                else if(i->data.cork_timer && i->data.cork_timer <= timer) {
+                    /* Send whatever TCP_CORK or MSG_MORE was holding back. */
+                    tcp_send_data(i, 0);
                 }
                 else if(!i->data.sndbuf_cur_sz &&
                         (i->intflags & TCP_IFLAG_QUEUEDCLOSE)) {
@@ -2904,16 +4298,44 @@ static void tcp_thd_cb(void *arg) {
                         i->state = TCP_STATE_CLOSING;
                     }
 
-                    tcp_send_fin_ack(i);
-                    ++i->data.snd.nxt;
+                    tcp_send_fin(i);
                 }
 
                 break;
+
+            case TCP_STATE_FIN_WAIT_1:
+            case TCP_STATE_CLOSING:
+            case TCP_STATE_LAST_ACK:
+
+                if(expired && i->data.snd.una != i->data.snd_max)
+                    tcp_resend_fin(i);
+
+                break;
         }
+
+        /* If the timer went off with nothing to do, stop it, so that it gets
+           started up again the next time it's needed. */
+        if(i->data.timer && i->data.timer <= timer)
+            i->data.timer = 0;
+
+        if(i->data.cork_timer && i->data.cork_timer <= timer)
+            i->data.cork_timer = 0;
+
+        if(i->data.timer && (!next || i->data.timer < next))
+            next = i->data.timer;
+
+        if(i->data.delack_timer && (!next || i->data.delack_timer < next))
+            next = i->data.delack_timer;
+
+        if(i->data.cork_timer && (!next || i->data.cork_timer < next))
+            next = i->data.cork_timer;
     }
 
     rwsem_read_unlock(&tcp_sem);
 
+    if(next)
+        net_timer_arm_before(&tcp_timer, next);
+
     /* Go through and clean up any sockets that need to be destroyed. */
     rwsem_write_lock(&tcp_sem);
 
@@ -2924,6 +4346,7 @@ static void tcp_thd_cb(void *arg) {
 
         if((i->intflags & TCP_IFLAG_CANBEDEL) &&
                 (i->state & 0x0F) == TCP_STATE_CLOSED) {
+            tcp_unhash(i);
             LIST_REMOVE(i, sock_list);
             cond_destroy(&i->data.send_cv);
             cond_destroy(&i->data.recv_cv);
@@ -2960,22 +4383,28 @@ static fs_socket_proto_t proto = {
     net_tcp_getsockname,                /* getsockname */
     net_tcp_getpeername,                /* getpeername */
     net_tcp_fcntl,                      /* fcntl */
-    net_tcp_poll                        /* poll */
+    net_tcp_poll,                       /* poll */
+    NULL,                               /* recvmmsg */
+    NULL,                               /* sendmmsg */
+    net_tcp_sendfile                    /* sendfile */
 };
 
+net_tcp_stats_t net_tcp_get_stats(void) {
+    return tcp_stats;
+}
+
 int net_tcp_init(void) {
-    if((thd_cb_id = net_thd_add_callback(tcp_thd_cb, NULL, 50)) < 0)
-        return -1;
+    net_timer_init(&tcp_timer, tcp_thd_cb, NULL);
 
     return fs_socket_proto_add(&proto);
 }
 
 void net_tcp_shutdown(void) {
     struct tcp_sock *i, *tmp;
+    int j;
 
-    /* Kill the thread and make sure we can grab the lock */
-    if(thd_cb_id >= 0)
-        net_thd_del_callback(thd_cb_id);
+    /* Stop the timer and make sure we can grab the lock */
+    net_timer_cancel(&tcp_timer);
 
     /* Disable IRQs so we can kill the sockets in peace... */
     irq_disable_scoped();
@@ -2990,6 +4419,7 @@ void net_tcp_shutdown(void) {
             close(i->sock);
         }
         else {
+            tcp_unhash(i);
             LIST_REMOVE(i, sock_list);
             cond_destroy(&i->data.send_cv);
             cond_destroy(&i->data.recv_cv);
@@ -3004,6 +4434,11 @@ void net_tcp_shutdown(void) {
 
     LIST_INIT(&tcp_socks);
 
+    for(j = 0; j < TCP_HASH_SIZE; ++j) {
+        LIST_INIT(&tcp_conn_hash[j]);
+        LIST_INIT(&tcp_port_hash[j]);
+    }
+
     /* Remove us from fs_socket and clean up the semaphore */
     fs_socket_proto_remove(&proto);
 }
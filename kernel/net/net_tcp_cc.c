@@ -0,0 +1,271 @@
+/* KallistiOS ##version##
+
+   kernel/net/net_tcp_cc.c
+   Copyright (C) 2026 The KallistiOS Team
+
+*/
+
+#include <string.h>
+#include <stdint.h>
+
+#include "net_tcp_cc.h"
+
+/* TCP congestion control algorithms. There are two of these in here:
+
+   NewReno is the standard algorithm from RFC 5681 (with the recovery changes
+   in RFC 6582 being handled in net_tcp.c). The window doubles every round trip
+   in slow start, and grows by one segment every round trip after that. Every
+   loss halves it.
+
+   CUBIC is from RFC 9438. It only takes 30% off of the window on a loss, and
+   then grows it back along a cubic curve that is centered on the window size
+   where the last loss happened. This keeps long, fat or lossy links a lot
+   busier than NewReno does, while staying at least as aggressive as NewReno
+   would be (the "Reno-friendly" region) on short ones.
+
+   Everything in here is done in integer math, since the Dreamcast doesn't have
+   a double precision FPU to speak of. Times are in milliseconds. */
+
+/* Cap the congestion window well below where any of the math could overflow. */
+#define CWND_MAX        (1 << 30)
+
+/* CUBIC constants. C is 0.4 and beta is 0.7. */
+#define CUBIC_BETA_NUM  7
+#define CUBIC_BETA_DEN  10
+
+/* The Reno-friendly estimate grows by alpha = 3 * (1 - beta) / (1 + beta)
+   segments every round trip (about 0.529), until it passes w_max, where it
+   switches to 1. These are in thousandths. */
+#define CUBIC_ALPHA     529
+#define CUBIC_ALPHA_MAX 1000
+
+/* Don't let the time since the start of the epoch run off far enough that
+   cubing it could overflow. A minute is far more than needed to get back up
+   to w_max. */
+#define CUBIC_T_MAX     60000
+
+static uint32_t cc_min(uint32_t a, uint32_t b) {
+    return a < b ? a : b;
+}
+
+static uint32_t cc_max(uint32_t a, uint32_t b) {
+    return a > b ? a : b;
+}
+
+/* Grow the window during slow start (with the RFC 3465 limit of one segment
+   per ACK). Returns the number of acked bytes that weren't used up, in case we
+   crossed ssthresh along the way. */
+static uint32_t cc_slow_start(tcp_cc_t *cc, uint32_t acked) {
+    uint32_t inc = cc_min(acked, cc->mss);
+
+    if(cc->cwnd + inc > cc->ssthresh) {
+        inc = cc->ssthresh - cc->cwnd;
+        cc->cwnd = cc->ssthresh;
+        return acked - inc;
+    }
+
+    cc->cwnd += inc;
+    return 0;
+}
+
+/* Figure out how far down to go on a loss. */
+static uint32_t cc_halve(tcp_cc_t *cc, uint32_t flight) {
+    return cc_max(flight / 2, 2 * cc->mss);
+}
+
+/********************************** NewReno ***********************************/
+
+static void newreno_ack(tcp_cc_t *cc, uint32_t acked, uint64_t now) {
+    (void)now;
+
+    if(cc->cwnd < cc->ssthresh && !(acked = cc_slow_start(cc, acked)))
+        return;
+
+    /* Congestion avoidance: one more segment for every window's worth of data
+       acked (RFC 5681, section 3.1). */
+    cc->bytes_acked += acked;
+
+    if(cc->bytes_acked >= cc->cwnd) {
+        cc->bytes_acked -= cc->cwnd;
+        cc->cwnd = cc_min(cc->cwnd + cc->mss, CWND_MAX);
+    }
+}
+
+static void newreno_loss(tcp_cc_t *cc, uint32_t flight, uint64_t now) {
+    (void)now;
+
+    cc->ssthresh = cc_halve(cc, flight);
+    cc->bytes_acked = 0;
+}
+
+static void newreno_timeout(tcp_cc_t *cc, uint32_t flight, uint64_t now) {
+    newreno_loss(cc, flight, now);
+    cc->cwnd = cc->mss;
+}
+
+static const tcp_cc_ops_t tcp_cc_newreno = {
+    "newreno",
+    newreno_ack,
+    newreno_loss,
+    newreno_timeout
+};
+
+/*********************************** CUBIC ************************************/
+
+/* Integer cube root (from Hacker's Delight). */
+static uint32_t cubic_cbrt(uint64_t x) {
+    uint64_t y = 0, y2 = 0, b;
+    int s;
+
+    for(s = 63; s >= 0; s -= 3) {
+        y2 <<= 2;
+        y <<= 1;
+        b = 3 * (y2 + y) + 1;
+
+        if((x >> s) >= b) {
+            x -= b << s;
+            y2 += 2 * y + 1;
+            ++y;
+        }
+    }
+
+    return (uint32_t)y;
+}
+
+/* The cubic window function, W(t) = C * (t - K)^3 + w_max, in bytes. */
+static uint32_t cubic_target(const tcp_cc_t *cc, uint32_t t) {
+    int64_t d = (int64_t)t - cc->k;
+    int64_t off;
+
+    if(d > CUBIC_T_MAX)
+        d = CUBIC_T_MAX;
+    else if(d < -CUBIC_T_MAX)
+        d = -CUBIC_T_MAX;
+
+    /* C * (d / 1000)^3 segments, with C = 0.4 = 4 / 10. */
+    off = ((4 * d * d * d) / 1000000) * (int64_t)cc->mss / 10000;
+
+    if(off < -(int64_t)cc->w_max)
+        return 0;
+
+    if((int64_t)cc->w_max + off > CWND_MAX)
+        return CWND_MAX;
+
+    return (uint32_t)((int64_t)cc->w_max + off);
+}
+
+static void cubic_ack(tcp_cc_t *cc, uint32_t acked, uint64_t now) {
+    uint32_t target, alpha;
+    uint64_t inc;
+
+    if(cc->cwnd < cc->ssthresh && !(acked = cc_slow_start(cc, acked)))
+        return;
+
+    /* Start a new epoch on the first ACK in congestion avoidance. K is how long
+       it'll take to get back to w_max: cbrt((w_max - cwnd) / C), in seconds
+       and segments. */
+    if(!cc->epoch) {
+        cc->epoch = now ? now : 1;
+        cc->w_est = cc->cwnd;
+
+        if(cc->cwnd < cc->w_max) {
+            cc->k = cubic_cbrt((uint64_t)(cc->w_max - cc->cwnd) * 2500000000ULL /
+                               cc->mss);
+        }
+        else {
+            cc->k = 0;
+            cc->w_max = cc->cwnd;
+        }
+    }
+
+    target = cubic_target(cc, (uint32_t)cc_min(now - cc->epoch, CUBIC_T_MAX));
+
+    /* Never try to grow by more than half the window in one round trip. */
+    if(target > cc->cwnd + cc->cwnd / 2)
+        target = cc->cwnd + cc->cwnd / 2;
+
+    /* Work out what NewReno would have by now, and don't do any worse. */
+    alpha = cc->w_est >= cc->w_max ? CUBIC_ALPHA_MAX : CUBIC_ALPHA;
+    cc->w_est += (uint32_t)((uint64_t)acked * cc->mss * alpha /
+                            (1000ULL * cc->w_est));
+
+    if(target < cc->w_est)
+        target = cc->w_est;
+
+    if(target > cc->cwnd) {
+        inc = (uint64_t)(target - cc->cwnd) * acked / cc->cwnd;
+        cc->cwnd = cc_min(cc->cwnd + (uint32_t)inc, CWND_MAX);
+    }
+}
+
+static void cubic_loss(tcp_cc_t *cc, uint32_t flight, uint64_t now) {
+    /* The window might have been inflated during fast recovery, so don't go
+       by anything more than what was actually in flight. */
+    uint32_t cwnd = cc_min(cc->cwnd, flight);
+
+    (void)now;
+
+    /* Fast convergence: if we didn't make it back up to the last w_max, some
+       other flow probably wants the bandwidth, so back off a bit further. */
+    if(cwnd < cc->w_max)
+        cc->w_max = cwnd * (CUBIC_BETA_DEN + CUBIC_BETA_NUM) /
+                    (2 * CUBIC_BETA_DEN);
+    else
+        cc->w_max = cwnd;
+
+    cc->ssthresh = cc_max(cwnd / CUBIC_BETA_DEN * CUBIC_BETA_NUM,
+                          2 * cc->mss);
+    cc->epoch = 0;
+}
+
+static void cubic_timeout(tcp_cc_t *cc, uint32_t flight, uint64_t now) {
+    cubic_loss(cc, flight, now);
+    cc->cwnd = cc->mss;
+}
+
+static const tcp_cc_ops_t tcp_cc_cubic = {
+    "cubic",
+    cubic_ack,
+    cubic_loss,
+    cubic_timeout
+};
+
+/******************************************************************************/
+
+static const tcp_cc_ops_t *algorithms[] = {
+    &tcp_cc_newreno,
+    &tcp_cc_cubic,
+    NULL
+};
+
+const tcp_cc_ops_t *tcp_cc_default = &tcp_cc_newreno;
+
+const tcp_cc_ops_t *tcp_cc_find(const char *name) {
+    int i;
+
+    for(i = 0; algorithms[i]; ++i) {
+        if(!strcmp(algorithms[i]->name, name))
+            return algorithms[i];
+    }
+
+    return NULL;
+}
+
+void tcp_cc_init(tcp_cc_t *cc, const tcp_cc_ops_t *ops, uint32_t mss) {
+    memset(cc, 0, sizeof(tcp_cc_t));
+
+    cc->ops = ops ? ops : tcp_cc_default;
+    cc->mss = mss;
+
+    /* Initial window from RFC 5681, section 3.1. */
+    if(mss > 2190)
+        cc->cwnd = 2 * mss;
+    else if(mss > 1095)
+        cc->cwnd = 3 * mss;
+    else
+        cc->cwnd = 4 * mss;
+
+    /* Start out with an arbitrarily high ssthresh, so slow start goes until
+       there is a loss. */
+    cc->ssthresh = CWND_MAX;
+}
@@ -0,0 +1,63 @@
+/* KallistiOS ##version##
+
+   kernel/net/net_tcp_cc.h
+   Copyright (C) 2026 The KallistiOS Team
+
+*/
+
+#ifndef __LOCAL_NET_TCP_CC_H
+#define __LOCAL_NET_TCP_CC_H
+
+#include <kos/cdefs.h>
+#include <stdint.h>
+
+__BEGIN_DECLS
+
+/* Congestion control state for a single connection. The window sizes are all
+   in bytes. The algorithm only gets to look at the fields from cwnd down;
+   everything below that is its own private state. */
+typedef struct tcp_cc {
+    const struct tcp_cc_ops *ops;
+    uint32_t mss;               /* Sender maximum segment size */
+    uint32_t cwnd;              /* Congestion window */
+    uint32_t ssthresh;          /* Slow start threshold */
+
+    /* NewReno */
+    uint32_t bytes_acked;       /* Acked since cwnd last grew (avoidance) */
+
+    /* CUBIC */
+    uint32_t w_max;             /* Window before the last reduction */
+    uint32_t w_est;             /* Reno-friendly window estimate */
+    uint32_t k;                 /* Time to get back to w_max (ms) */
+    uint64_t epoch;             /* Start of this avoidance epoch (ms) */
+} tcp_cc_t;
+
+/* A congestion control algorithm. Loss recovery itself (fast retransmit/fast
+   recovery, as per RFC 5681 and RFC 6582) is done by the TCP code; these just
+   decide how the window grows and how far it comes down. */
+typedef struct tcp_cc_ops {
+    const char *name;
+
+    /* Data was newly acked outside of fast recovery. */
+    void (*ack)(tcp_cc_t *cc, uint32_t acked, uint64_t now);
+
+    /* Loss was detected by duplicate ACKs. Set ssthresh; the caller takes
+       care of cwnd. */
+    void (*loss)(tcp_cc_t *cc, uint32_t flight, uint64_t now);
+
+    /* The retransmission timer expired. Set ssthresh and cwnd. */
+    void (*timeout)(tcp_cc_t *cc, uint32_t flight, uint64_t now);
+} tcp_cc_ops_t;
+
+/* The algorithm that new sockets start out with. */
+extern const tcp_cc_ops_t *tcp_cc_default;
+
+/* Look up an algorithm by name, returning NULL if we don't have it. */
+const tcp_cc_ops_t *tcp_cc_find(const char *name);
+
+/* Set up the congestion state for a connection that is just starting. */
+void tcp_cc_init(tcp_cc_t *cc, const tcp_cc_ops_t *ops, uint32_t mss);
+
+__END_DECLS
+
+#endif /* !__LOCAL_NET_TCP_CC_H */
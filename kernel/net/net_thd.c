@@ -9,52 +9,151 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <limits.h>
 
 #include <kos/thread.h>
+#include <kos/genwait.h>
+#include <arch/irq.h>
 #include <arch/timer.h>
 #include "net_thd.h"
 
+/* The network thread keeps every pending timer on one list, sorted by deadline,
+   and sleeps until the first one is due (or until something is armed ahead of
+   it). Nothing wakes it up at all when there's nothing to do. Periodic
+   callbacks are built on top of the timers, and just re-arm themselves each
+   time they run. */
+
 struct thd_cb {
     TAILQ_ENTRY(thd_cb) thds;
 
+    net_timer_t timer;
     int cbid;
     void (*cb)(void *);
     void *data;
     uint64_t timeout;
-    uint64_t nextrun;
 };
 
 TAILQ_HEAD(thd_cb_queue, thd_cb);
+TAILQ_HEAD(net_timer_queue, net_timer);
 
 static struct thd_cb_queue cbs;
+static struct net_timer_queue timers = TAILQ_HEAD_INITIALIZER(timers);
+static struct thd_cb *cur_cb;
 static kthread_t *thd;
 static int done = 0;
 static int cbid_top;
 
+void net_timer_init(net_timer_t *t, void (*cb)(void *), void *data) {
+    t->cb = cb;
+    t->data = data;
+    t->when = 0;
+    t->armed = 0;
+}
+
+/* Put a timer in its place in the list. Interrupts must be disabled. */
+static void timer_insert(net_timer_t *t, uint64_t when) {
+    net_timer_t *i;
+
+    t->when = when;
+    t->armed = 1;
+
+    /* Most timers are armed for some time after everything that's already
+       there, so look from the back. */
+    TAILQ_FOREACH_REVERSE(i, &timers, net_timer_queue, entry) {
+        if(i->when <= when) {
+            TAILQ_INSERT_AFTER(&timers, i, t, entry);
+            return;
+        }
+    }
+
+    /* It's the new first one, so the thread might have to wake up earlier than
+       it planned to. */
+    TAILQ_INSERT_HEAD(&timers, t, entry);
+    genwait_wake_one(&timers);
+}
+
+void net_timer_arm(net_timer_t *t, uint64_t when) {
+    irq_disable_scoped();
+
+    if(t->armed)
+        TAILQ_REMOVE(&timers, t, entry);
+
+    timer_insert(t, when);
+}
+
+void net_timer_arm_before(net_timer_t *t, uint64_t when) {
+    irq_disable_scoped();
+
+    if(t->armed) {
+        if(t->when <= when)
+            return;
+
+        TAILQ_REMOVE(&timers, t, entry);
+    }
+
+    timer_insert(t, when);
+}
+
+void net_timer_cancel(net_timer_t *t) {
+    irq_disable_scoped();
+
+    if(t->armed) {
+        TAILQ_REMOVE(&timers, t, entry);
+        t->armed = 0;
+    }
+}
+
 static void *net_thd_thd(void *data) {
-    struct thd_cb *cb;
-    uint64_t now;
+    net_timer_t *t;
+    uint64_t now, wait;
+    irq_mask_t old;
 
     (void)data;
 
     while(!done) {
+        old = irq_disable();
         now = timer_ms_gettime64();
+        t = TAILQ_FIRST(&timers);
+
+        if(t && t->when <= now) {
+            TAILQ_REMOVE(&timers, t, entry);
+            t->armed = 0;
+            irq_restore(old);
+
+            t->cb(t->data);
+            continue;
+        }
 
-        /* Run any callbacks that need to be run now. */
-        TAILQ_FOREACH(cb, &cbs, thds) {
-            if(now >= cb->nextrun) {
-                cb->cb(cb->data);
-                cb->nextrun = now + cb->timeout;
-            }
+        /* Go to sleep til the next timer is due. Interrupts are still off, so
+           nothing can get armed between looking and going to sleep. */
+        if(t) {
+            wait = t->when - now;
+            genwait_wait(&timers, "net_thd", wait > INT_MAX ? INT_MAX :
+                         (int)wait, NULL);
+        }
+        else {
+            genwait_wait(&timers, "net_thd", 0, NULL);
         }
 
-        /* Go to sleep til we need to be run again. */
-        thd_sleep(50);
+        irq_restore(old);
     }
 
     return NULL;
 }
 
+static void thd_cb_run(void *data) {
+    struct thd_cb *cb = (struct thd_cb *)data;
+
+    cur_cb = cb;
+    cb->cb(cb->data);
+
+    /* The callback might have removed itself. */
+    if(cur_cb == cb) {
+        cur_cb = NULL;
+        net_timer_arm(&cb->timer, timer_ms_gettime64() + cb->timeout);
+    }
+}
+
 int net_thd_add_callback(void (*cb)(void *), void *data, uint64_t timeout) {
     struct thd_cb *newcb;
 
@@ -66,16 +165,17 @@ int net_thd_add_callback(void (*cb)(void *), void *data, uint64_t timeout) {
         return -1;
     }
 
-    newcb->cbid = cbid_top++;
     newcb->cb = cb;
     newcb->data = data;
     newcb->timeout = timeout;
-    newcb->nextrun = timer_ms_gettime64() + timeout;
+    net_timer_init(&newcb->timer, &thd_cb_run, newcb);
 
     /* Disable interrupts, insert, and re-enable interrupts */
     irq_disable_scoped();
 
+    newcb->cbid = cbid_top++;
     TAILQ_INSERT_TAIL(&cbs, newcb, thds);
+    net_timer_arm(&newcb->timer, timer_ms_gettime64() + timeout);
 
     return newcb->cbid;
 }
@@ -91,6 +191,11 @@ int net_thd_del_callback(int cbid) {
     TAILQ_FOREACH(cb, &cbs, thds) {
         if(cb->cbid == cbid) {
             TAILQ_REMOVE(&cbs, cb, thds);
+            net_timer_cancel(&cb->timer);
+
+            if(cur_cb == cb)
+                cur_cb = NULL;
+
             free(cb);
             return 0;
         }
@@ -109,6 +214,7 @@ void net_thd_kill(void) {
     done = 1;
 
     if(!irq_inside_int()) {
+        genwait_wake_all(&timers);
         thd_join(thd, NULL);
     }
     else {
@@ -141,6 +247,7 @@ void net_thd_shutdown(void) {
 
     while(c) {
         n = TAILQ_NEXT(c, thds);
+        net_timer_cancel(&c->timer);
         free(c);
         c = n;
     }
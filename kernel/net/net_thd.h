@@ -10,9 +10,35 @@
 
 #include <kos/cdefs.h>
 #include <stdint.h>
+#include <sys/queue.h>
 
 __BEGIN_DECLS
 
+/* A one-shot timer, run from the network thread. These are meant to be
+   embedded in whatever they're for, so arming and cancelling them never has
+   to allocate anything. Arming a timer that is already armed moves it to the
+   new deadline. All of these are safe to call with interrupts disabled, and
+   from inside of a timer's own callback. */
+typedef struct net_timer {
+    TAILQ_ENTRY(net_timer) entry;
+    void (*cb)(void *);
+    void *data;
+    uint64_t when;
+    int armed;
+} net_timer_t;
+
+void net_timer_init(net_timer_t *t, void (*cb)(void *), void *data);
+
+/* Arm the timer to go off at the given time (in ms, on timer_ms_gettime64()'s
+   clock). */
+void net_timer_arm(net_timer_t *t, uint64_t when);
+
+/* Like net_timer_arm(), but never pushes an armed timer back later. */
+void net_timer_arm_before(net_timer_t *t, uint64_t when);
+
+void net_timer_cancel(net_timer_t *t);
+
+/* Periodic callbacks, run every timeout milliseconds. */
 int net_thd_add_callback(void (*cb)(void *), void *data, uint64_t timeout);
 int net_thd_del_callback(int cbid);
 
@@ -33,6 +33,29 @@
 /* Default hop limit (or ttl for IPv4) for new sockets */
 #define UDP_DEFAULT_HOPS    64
 
+/* Receive buffer sizes. Each datagram waiting on a socket counts against its
+   buffer, along with the space taken up keeping track of it, and anything
+   that arrives when the buffer is full gets dropped. Can be changed with
+   SO_RCVBUF, within these limits. */
+#define UDP_DEFAULT_RCVBUF  (64 * 1024)
+#define UDP_MIN_RCVBUF      2048
+#define UDP_MAX_RCVBUF      (1024 * 1024)
+
+/* Received packets are kept in fixed-size slots, with room for anything that
+   fits in an Ethernet frame. The slots come from slabs of UDP_SLAB_SLOTS at a
+   time, which are only given back when the stack shuts down, so once enough
+   of them are around, receiving doesn't touch the heap at all. Bigger
+   datagrams (or any that come in once UDP_MAX_SLABS have been used up) are
+   allocated on their own. */
+#define UDP_SLOT_DATA       1472
+#define UDP_SLAB_SLOTS      16
+#define UDP_MAX_SLABS       8
+
+/* Outgoing data is passed down the stack straight out of the caller's iovecs,
+   with one packet buffer for each. Anything in more pieces than this gets
+   copied into a single buffer first, rather than using up a lot of stack. */
+#define UDP_SEND_PIECES     8
+
 typedef struct {
     uint16_t src_port __packed;
     uint16_t dst_port __packed;
@@ -43,17 +66,27 @@ typedef struct {
 struct udp_pkt {
     TAILQ_ENTRY(udp_pkt) pkt_queue;
     struct sockaddr_in6 from;
+    struct in6_addr to;
     uint8_t *data;
     uint16_t datasize;
+    uint16_t heap;
 };
 
 TAILQ_HEAD(udp_pkt_queue, udp_pkt);
 
+/* The size of a slot, rounded up to a cache line, and what a packet of a given
+   size costs against a socket's receive buffer. */
+#define UDP_SLOT_SIZE \
+    ((sizeof(struct udp_pkt) + UDP_SLOT_DATA + 31) & ~31)
+#define UDP_PKT_COST(sz)    (sizeof(struct udp_pkt) + (sz))
+
 #define UDPSOCK_NO_CHECKSUM 0x00000001
 #define UDPSOCK_LITE_RCVCOV 0x00000002
+#define UDPSOCK_PKTINFO     0x00000004
 
 struct udp_sock {
     LIST_ENTRY(udp_sock) sock_list;
+    LIST_ENTRY(udp_sock) hash_list;
     struct sockaddr_in6 local_addr;
     struct sockaddr_in6 remote_addr;
 
@@ -70,18 +103,141 @@ struct udp_sock {
     } udp_lite;
 
     struct udp_pkt_queue packets;
+    uint32_t rcvbuf_sz;
+    uint32_t rcvbuf_used;
 };
 
 LIST_HEAD(udp_sock_list, udp_sock);
 
 static struct udp_sock_list net_udp_sockets = LIST_HEAD_INITIALIZER(0);
 static mutex_t udp_mutex = MUTEX_INITIALIZER;
+
+/* Every socket that has a local port is also in this table, hashed on that
+   port, so that incoming packets only have to be checked against the sockets
+   that could possibly want them. Protected by udp_mutex, like the list. */
+#define UDP_HASH_SIZE       64
+#define UDP_HASH(port)      (ntohs(port) & (UDP_HASH_SIZE - 1))
+
+static struct udp_sock_list udp_port_hash[UDP_HASH_SIZE];
+
+static void udp_unhash(struct udp_sock *sock) {
+    if(sock->local_addr.sin6_port)
+        LIST_REMOVE(sock, hash_list);
+}
+
+static void udp_hash(struct udp_sock *sock) {
+    if(sock->local_addr.sin6_port)
+        LIST_INSERT_HEAD(&udp_port_hash[UDP_HASH(sock->local_addr.sin6_port)],
+                         sock, hash_list);
+}
+
+/* See if any socket other than sock has the given local port (in network byte
+   order). */
+static int udp_port_in_use(const struct udp_sock *sock, uint16_t port) {
+    struct udp_sock *iter;
+
+    LIST_FOREACH(iter, &udp_port_hash[UDP_HASH(port)], hash_list) {
+        if(iter != sock && iter->local_addr.sin6_port == port)
+            return 1;
+    }
+
+    return 0;
+}
+
+/* Grab the first unused port >= 1024, in network byte order. */
+static uint16_t udp_pick_port(const struct udp_sock *sock) {
+    uint16_t port = 1024;
+
+    while(port && udp_port_in_use(sock, htons(port)))
+        ++port;
+
+    return htons(port);
+}
 static net_udp_stats_t udp_stats = { 0 };
 
+/* Free packet slots, and the slabs they came from. Protected by udp_mutex. */
+static struct udp_pkt_queue udp_pool = TAILQ_HEAD_INITIALIZER(udp_pool);
+static uint8_t *udp_slabs[UDP_MAX_SLABS];
+static int udp_nslabs;
+
+static int udp_pool_grow(void) {
+    uint8_t *slab;
+    int i;
+
+    if(udp_nslabs == UDP_MAX_SLABS)
+        return -1;
+
+    if(!(slab = (uint8_t *)aligned_alloc(32, UDP_SLOT_SIZE * UDP_SLAB_SLOTS)))
+        return -1;
+
+    udp_slabs[udp_nslabs++] = slab;
+
+    for(i = 0; i < UDP_SLAB_SLOTS; ++i, slab += UDP_SLOT_SIZE)
+        TAILQ_INSERT_TAIL(&udp_pool, (struct udp_pkt *)slab, pkt_queue);
+
+    udp_stats.pool_slots += UDP_SLAB_SLOTS;
+    udp_stats.pool_free += UDP_SLAB_SLOTS;
+
+    return 0;
+}
+
+/* Get a packet to queue on a socket, charging it against the socket's receive
+   buffer. The buffer may go over its size by one packet, so that a datagram
+   bigger than the whole buffer can still get through to an empty socket. */
+static struct udp_pkt *udp_pkt_alloc(struct udp_sock *sock, size_t size) {
+    struct udp_pkt *pkt = NULL;
+
+    if(sock->rcvbuf_used &&
+       sock->rcvbuf_used + UDP_PKT_COST(size) > sock->rcvbuf_sz) {
+        ++udp_stats.pkt_recv_dropped;
+        return NULL;
+    }
+
+    if(size <= UDP_SLOT_DATA &&
+       (!TAILQ_EMPTY(&udp_pool) || !udp_pool_grow())) {
+        pkt = TAILQ_FIRST(&udp_pool);
+        TAILQ_REMOVE(&udp_pool, pkt, pkt_queue);
+        --udp_stats.pool_free;
+        pkt->heap = 0;
+    }
+    else if((pkt = (struct udp_pkt *)malloc(UDP_PKT_COST(size)))) {
+        ++udp_stats.pkt_recv_heap;
+        pkt->heap = 1;
+    }
+    else {
+        ++udp_stats.pkt_recv_no_mem;
+        return NULL;
+    }
+
+    memset(&pkt->from, 0, sizeof(pkt->from));
+    memset(&pkt->to, 0, sizeof(pkt->to));
+    pkt->data = (uint8_t *)(pkt + 1);
+    pkt->datasize = size;
+    sock->rcvbuf_used += UDP_PKT_COST(size);
+
+    return pkt;
+}
+
+/* Give back a packet that's been taken off of (or never made it onto) the
+   socket's queue. Slots go on the front of the free list, since they're the
+   most likely to still be in the cache. */
+static void udp_pkt_free(struct udp_sock *sock, struct udp_pkt *pkt) {
+    sock->rcvbuf_used -= UDP_PKT_COST(pkt->datasize);
+
+    if(pkt->heap) {
+        free(pkt);
+    }
+    else {
+        TAILQ_INSERT_HEAD(&udp_pool, pkt, pkt_queue);
+        ++udp_stats.pool_free;
+    }
+}
+
 static int net_udp_send_raw(netif_t *net, const struct sockaddr_in6 *src,
-                            const struct sockaddr_in6 *dst, const uint8_t *data,
-                            size_t size, uint32_t flags, int hops,
-                            uint32_t iflags, int proto, uint16_t cscov);
+                            const struct sockaddr_in6 *dst,
+                            const struct iovec *iov, int iovcnt,
+                            uint32_t flags, int hops, uint32_t iflags,
+                            int proto, uint16_t cscov);
 
 static int net_udp_accept(net_socket_t *hnd, struct sockaddr *addr,
                           socklen_t *addr_len) {
@@ -94,7 +250,7 @@ static int net_udp_accept(net_socket_t *hnd, struct sockaddr *addr,
 
 static int net_udp_bind(net_socket_t *hnd, const struct sockaddr *addr,
                         socklen_t addr_len) {
-    struct udp_sock *udpsock, *iter;
+    struct udp_sock *udpsock;
     struct sockaddr_in *realaddr4;
     struct sockaddr_in6 realaddr6;
 
@@ -167,38 +323,20 @@ static int net_udp_bind(net_socket_t *hnd, const struct sockaddr *addr,
     if(realaddr6.sin6_port != 0) {
         /* Make sure we don't already have a socket bound to the port
            specified */
-        LIST_FOREACH(iter, &net_udp_sockets, sock_list) {
-            if(iter == udpsock)
-                continue;
-
-            if(iter->local_addr.sin6_port == realaddr6.sin6_port) {
-                mutex_unlock(&udp_mutex);
-                errno = EADDRINUSE;
-                return -1;
-            }
+        if(udp_port_in_use(udpsock, realaddr6.sin6_port)) {
+            mutex_unlock(&udp_mutex);
+            errno = EADDRINUSE;
+            return -1;
         }
-
-        udpsock->local_addr = realaddr6;
     }
     else {
-        uint16_t port = 1024, tmp = 0;
-
-        /* Grab the first unused port >= 1024. This is, unfortunately, O(n^2) */
-        while(tmp != port) {
-            tmp = port;
-
-            LIST_FOREACH(iter, &net_udp_sockets, sock_list) {
-                if(iter->local_addr.sin6_port == port) {
-                    ++port;
-                    break;
-                }
-            }
-        }
-
-        udpsock->local_addr = realaddr6;
-        udpsock->local_addr.sin6_port = htons(port);
+        realaddr6.sin6_port = udp_pick_port(udpsock);
     }
 
+    udp_unhash(udpsock);
+    udpsock->local_addr = realaddr6;
+    udp_hash(udpsock);
+
     udpsock->sock = hnd->fd;
 
     mutex_unlock(&udp_mutex);
@@ -305,11 +443,125 @@ static int net_udp_listen(net_socket_t *hnd, int backlog) {
     return -1;
 }
 
-static ssize_t net_udp_recvfrom(net_socket_t *hnd, void *buffer, size_t length,
-                                int flags, struct sockaddr *addr,
-                                socklen_t *addr_len) {
+/* Fill in the address that a datagram came from, in the form that the socket
+   wants it in. */
+static void udp_copy_name(const struct udp_sock *udpsock,
+                          const struct sockaddr_in6 *from,
+                          struct sockaddr *addr, socklen_t *addr_len) {
+    if(udpsock->domain == AF_INET) {
+        struct sockaddr_in realaddr;
+
+        memset(&realaddr, 0, sizeof(struct sockaddr_in));
+        realaddr.sin_family = AF_INET;
+        realaddr.sin_addr.s_addr = from->sin6_addr.__s6_addr.__s6_addr32[3];
+        realaddr.sin_port = from->sin6_port;
+
+        if(*addr_len < sizeof(struct sockaddr_in)) {
+            memcpy(addr, &realaddr, *addr_len);
+        }
+        else {
+            memcpy(addr, &realaddr, sizeof(struct sockaddr_in));
+            *addr_len = sizeof(struct sockaddr_in);
+        }
+    }
+    else if(udpsock->domain == AF_INET6) {
+        struct sockaddr_in6 realaddr6;
+
+        memset(&realaddr6, 0, sizeof(struct sockaddr_in6));
+        realaddr6.sin6_family = AF_INET6;
+        realaddr6.sin6_addr = from->sin6_addr;
+        realaddr6.sin6_port = from->sin6_port;
+
+        if(*addr_len < sizeof(struct sockaddr_in6)) {
+            memcpy(addr, &realaddr6, *addr_len);
+        }
+        else {
+            memcpy(addr, &realaddr6, sizeof(struct sockaddr_in6));
+            *addr_len = sizeof(struct sockaddr_in6);
+        }
+    }
+}
+
+/* Put one ancillary data object in a message, as long as there's room. */
+static void udp_put_cmsg(struct msghdr *msg, socklen_t space, int level,
+                         int type, const void *data, size_t len) {
+    struct cmsghdr *cmsg = (struct cmsghdr *)msg->msg_control;
+
+    if(!cmsg || space < CMSG_LEN(len)) {
+        msg->msg_flags |= MSG_CTRUNC;
+        return;
+    }
+
+    cmsg->cmsg_len = CMSG_LEN(len);
+    cmsg->cmsg_level = level;
+    cmsg->cmsg_type = type;
+    memcpy(CMSG_DATA(cmsg), data, len);
+
+    msg->msg_controllen = space < CMSG_SPACE(len) ? space : CMSG_SPACE(len);
+}
+
+/* Copy one queued datagram out into a message. The mutex must be held. */
+static size_t udp_recv_one(const struct udp_sock *udpsock,
+                           const struct udp_pkt *pkt, struct msghdr *msg,
+                           int flags) {
+    socklen_t space = msg->msg_controllen;
+    size_t len, total = 0;
+    int i;
+
+    msg->msg_flags = 0;
+    msg->msg_controllen = 0;
+
+    for(i = 0; i < msg->msg_iovlen && total < pkt->datasize; ++i) {
+        len = msg->msg_iov[i].iov_len;
+
+        if(len > pkt->datasize - total)
+            len = pkt->datasize - total;
+
+        memcpy(msg->msg_iov[i].iov_base, pkt->data + total, len);
+        total += len;
+    }
+
+    if(total < pkt->datasize) {
+        msg->msg_flags |= MSG_TRUNC;
+
+        if(flags & MSG_TRUNC)
+            total = pkt->datasize;
+    }
+
+    if(msg->msg_name)
+        udp_copy_name(udpsock, &pkt->from, (struct sockaddr *)msg->msg_name,
+                      &msg->msg_namelen);
+
+    if(udpsock->int_flags & UDPSOCK_PKTINFO) {
+        if(udpsock->domain == AF_INET) {
+            struct in_pktinfo pi;
+
+            memset(&pi, 0, sizeof(pi));
+            pi.ipi_addr.s_addr = pkt->to.__s6_addr.__s6_addr32[3];
+            pi.ipi_spec_dst = pi.ipi_addr;
+            udp_put_cmsg(msg, space, IPPROTO_IP, IP_PKTINFO, &pi, sizeof(pi));
+        }
+        else {
+            struct in6_pktinfo pi6;
+
+            memset(&pi6, 0, sizeof(pi6));
+            pi6.ipi6_addr = pkt->to;
+            udp_put_cmsg(msg, space, IPPROTO_IPV6, IPV6_PKTINFO, &pi6,
+                         sizeof(pi6));
+        }
+    }
+
+    return total;
+}
+
+/* Pull a batch of datagrams off of the socket's queue at once. This backs all
+   of the receive calls, from recvfrom() up to recvmmsg(). */
+static int net_udp_recvmmsg(net_socket_t *hnd, struct mmsghdr *msgvec,
+                            unsigned int vlen, int flags) {
     struct udp_sock *udpsock;
-    struct udp_pkt *pkt;
+    struct udp_pkt *pkt = NULL;
+    struct msghdr *msg;
+    unsigned int i;
 
     if(mutex_lock_irqsafe(&udp_mutex))
         return -1;
@@ -327,195 +579,292 @@ static ssize_t net_udp_recvfrom(net_socket_t *hnd, void *buffer, size_t length,
         return 0;
     }
 
-    if(buffer == NULL || (addr != NULL && addr_len == NULL)) {
-        mutex_unlock(&udp_mutex);
-        errno = EFAULT;
-        return -1;
-    }
-
-    if(TAILQ_EMPTY(&udpsock->packets) &&
-       ((udpsock->flags & FS_SOCKET_NONBLOCK) || (flags & MSG_DONTWAIT) ||
-        irq_inside_int())) {
-        mutex_unlock(&udp_mutex);
-        errno = EWOULDBLOCK;
-        return -1;
-    }
-
-    while(TAILQ_EMPTY(&udpsock->packets)) {
-        mutex_unlock(&udp_mutex);
-        genwait_wait(udpsock, "net_udp_recvfrom", 0, NULL);
-        mutex_lock(&udp_mutex);
-    }
+    for(i = 0; i < vlen; ++i) {
+        msg = &msgvec[i].msg_hdr;
 
-    pkt = TAILQ_FIRST(&udpsock->packets);
+        if(msg->msg_iovlen < 0 || (msg->msg_iovlen && !msg->msg_iov)) {
+            errno = EFAULT;
+            goto err;
+        }
 
-    if(pkt->datasize > length) {
-        memcpy(buffer, pkt->data, length);
-    }
-    else {
-        memcpy(buffer, pkt->data, pkt->datasize);
-        length = pkt->datasize;
-    }
+        /* When peeking, nothing gets taken off of the queue, so walk down it
+           instead. */
+        if((flags & MSG_PEEK) && pkt)
+            pkt = TAILQ_NEXT(pkt, pkt_queue);
+        else
+            pkt = TAILQ_FIRST(&udpsock->packets);
 
-    if(addr != NULL) {
-        if(udpsock->domain == AF_INET) {
-            struct sockaddr_in realaddr;
+        if(!pkt) {
+            if(i && (flags & MSG_PEEK))
+                break;
 
-            memset(&realaddr, 0, sizeof(struct sockaddr_in));
-            realaddr.sin_family = AF_INET;
-            realaddr.sin_addr.s_addr =
-                pkt->from.sin6_addr.__s6_addr.__s6_addr32[3];
-            realaddr.sin_port = pkt->from.sin6_port;
+            if((udpsock->flags & FS_SOCKET_NONBLOCK) ||
+               (flags & MSG_DONTWAIT) || irq_inside_int()) {
+                if(i)
+                    break;
 
-            if(*addr_len < sizeof(struct sockaddr_in)) {
-                memcpy(addr, &realaddr, *addr_len);
+                errno = EWOULDBLOCK;
+                goto err;
             }
-            else {
-                memcpy(addr, &realaddr, sizeof(struct sockaddr_in));
-                *addr_len = sizeof(struct sockaddr_in);
+
+            while(TAILQ_EMPTY(&udpsock->packets)) {
+                mutex_unlock(&udp_mutex);
+                genwait_wait(udpsock, "net_udp_recvmmsg", 0, NULL);
+                mutex_lock(&udp_mutex);
             }
+
+            pkt = TAILQ_FIRST(&udpsock->packets);
         }
-        else if(udpsock->domain == AF_INET6) {
-            struct sockaddr_in6 realaddr6;
 
-            memset(&realaddr6, 0, sizeof(struct sockaddr_in6));
-            realaddr6.sin6_family = AF_INET6;
-            realaddr6.sin6_addr = pkt->from.sin6_addr;
-            realaddr6.sin6_port = pkt->from.sin6_port;
+        msgvec[i].msg_len = udp_recv_one(udpsock, pkt, msg, flags);
 
-            if(*addr_len < sizeof(struct sockaddr_in6)) {
-                memcpy(addr, &realaddr6, *addr_len);
-            }
-            else {
-                memcpy(addr, &realaddr6, sizeof(struct sockaddr_in6));
-                *addr_len = sizeof(struct sockaddr_in6);
-            }
+        /* Remove the packet if we're pulling data out of the queue. */
+        if(!(flags & MSG_PEEK)) {
+            TAILQ_REMOVE(&udpsock->packets, pkt, pkt_queue);
+            udp_pkt_free(udpsock, pkt);
         }
-    }
 
-    /* Remove the packet if we're pulling data out of the queue. */
-    if(!(flags & MSG_PEEK)) {
-        TAILQ_REMOVE(&udpsock->packets, pkt, pkt_queue);
-        free(pkt->data);
-        free(pkt);
+        if(flags & MSG_WAITFORONE)
+            flags |= MSG_DONTWAIT;
     }
 
     mutex_unlock(&udp_mutex);
+    return (int)i;
 
-    return length;
+err:
+    mutex_unlock(&udp_mutex);
+    return i ? (int)i : -1;
 }
 
-static ssize_t net_udp_sendto(net_socket_t *hnd, const void *message,
-                              size_t length, int flags,
-                              const struct sockaddr *addr, socklen_t addr_len) {
-    struct udp_sock *udpsock;
-    struct sockaddr_in *realaddr;
-    struct sockaddr_in6 realaddr6;
-    uint32_t sflags, iflags;
-    int hops, proto;
-    uint16_t cscov;
-    struct sockaddr_in6 local_addr;
-
-    (void)flags;
+static ssize_t net_udp_recvfrom(net_socket_t *hnd, void *buffer, size_t length,
+                                int flags, struct sockaddr *addr,
+                                socklen_t *addr_len) {
+    struct iovec iov = { buffer, length };
+    struct mmsghdr m;
+    int rv;
 
-    if(mutex_lock_irqsafe(&udp_mutex))
+    if(buffer == NULL || (addr != NULL && addr_len == NULL)) {
+        errno = EFAULT;
         return -1;
+    }
 
-    udpsock = (struct udp_sock *)hnd->data;
+    memset(&m, 0, sizeof(m));
+    m.msg_hdr.msg_name = addr;
+    m.msg_hdr.msg_namelen = addr ? *addr_len : 0;
+    m.msg_hdr.msg_iov = &iov;
+    m.msg_hdr.msg_iovlen = 1;
 
-    if(udpsock == NULL) {
-        errno = EBADF;
-        goto err;
-    }
+    if((rv = net_udp_recvmmsg(hnd, &m, 1, flags)) <= 0)
+        return rv;
 
-    if(udpsock->flags & (SHUT_WR << 24)) {
-        errno = EPIPE;
-        goto err;
-    }
+    if(addr)
+        *addr_len = m.msg_hdr.msg_namelen;
 
-    if(!IN6_IS_ADDR_UNSPECIFIED(&udpsock->remote_addr.sin6_addr) &&
-       udpsock->remote_addr.sin6_port != 0) {
+    return m.msg_len;
+}
+
+/* Everything needed to send on a socket, copied out while it's locked. */
+struct udp_send_info {
+    struct sockaddr_in6 local_addr;
+    struct sockaddr_in6 remote_addr;
+    int domain;
+    uint32_t flags;
+    uint32_t iflags;
+    int hops;
+    int proto;
+    uint16_t cscov;
+};
+
+/* Work out where a datagram is going. */
+static int udp_dest(const struct udp_send_info *si, const struct sockaddr *addr,
+                    socklen_t addr_len, struct sockaddr_in6 *dst) {
+    const struct sockaddr_in *realaddr;
+
+    if(!IN6_IS_ADDR_UNSPECIFIED(&si->remote_addr.sin6_addr) &&
+       si->remote_addr.sin6_port != 0) {
         if(addr) {
             errno = EISCONN;
-            goto err;
+            return -1;
         }
 
-        realaddr6 = udpsock->remote_addr;
+        *dst = si->remote_addr;
     }
     else if(addr == NULL) {
         errno = EDESTADDRREQ;
-        goto err;
+        return -1;
     }
-    else if(addr->sa_family != udpsock->domain) {
+    else if(addr->sa_family != si->domain) {
         errno = EAFNOSUPPORT;
-        goto err;
+        return -1;
     }
-    else if(udpsock->domain == AF_INET6) {
+    else if(si->domain == AF_INET6) {
         if(addr_len != sizeof(struct sockaddr_in6)) {
             errno = EINVAL;
-            goto err;
+            return -1;
         }
 
-        realaddr6 = *((struct sockaddr_in6 *)addr);
+        *dst = *((const struct sockaddr_in6 *)addr);
     }
-    else if(udpsock->domain == AF_INET) {
+    else if(si->domain == AF_INET) {
         if(addr_len != sizeof(struct sockaddr_in)) {
             errno = EINVAL;
-            goto err;
+            return -1;
         }
 
-        realaddr = (struct sockaddr_in *)addr;
-        memset(&realaddr6, 0, sizeof(struct sockaddr_in6));
-        realaddr6.sin6_family = AF_INET6;
-        realaddr6.sin6_addr.__s6_addr.__s6_addr16[5] = 0xFFFF;
-        realaddr6.sin6_addr.__s6_addr.__s6_addr32[3] =
-            realaddr->sin_addr.s_addr;
-        realaddr6.sin6_port = realaddr->sin_port;
+        realaddr = (const struct sockaddr_in *)addr;
+        memset(dst, 0, sizeof(struct sockaddr_in6));
+        dst->sin6_family = AF_INET6;
+        dst->sin6_addr.__s6_addr.__s6_addr16[5] = 0xFFFF;
+        dst->sin6_addr.__s6_addr.__s6_addr32[3] = realaddr->sin_addr.s_addr;
+        dst->sin6_port = realaddr->sin_port;
     }
     else {
         /* Shouldn't be able to get here... */
         errno = EBADF;
-        goto err;
+        return -1;
     }
 
-    if(message == NULL) {
-        errno = EFAULT;
-        goto err;
-    }
+    return 0;
+}
 
-    if(udpsock->local_addr.sin6_port == 0) {
-        uint16_t port = 1024, tmp = 0;
-        struct udp_sock *iter;
+/* Pick up a source address from any packet info in a message's ancillary
+   data. */
+static int udp_src_from_cmsg(const struct udp_send_info *si,
+                             const struct msghdr *msg, struct in6_addr *src) {
+    struct cmsghdr *cmsg;
+    struct in_pktinfo pi;
+    struct in6_pktinfo pi6;
+
+    for(cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if(si->domain == AF_INET && cmsg->cmsg_level == IPPROTO_IP &&
+           cmsg->cmsg_type == IP_PKTINFO) {
+            if(cmsg->cmsg_len < CMSG_LEN(sizeof(pi))) {
+                errno = EINVAL;
+                return -1;
+            }
 
-        /* Grab the first unused port >= 1024. This is, unfortunately, O(n^2) */
-        while(tmp != port) {
-            tmp = port;
+            memcpy(&pi, CMSG_DATA(cmsg), sizeof(pi));
 
-            LIST_FOREACH(iter, &net_udp_sockets, sock_list) {
-                if(iter->local_addr.sin6_port == port) {
-                    ++port;
-                    break;
-                }
+            if(pi.ipi_spec_dst.s_addr != INADDR_ANY) {
+                memset(src, 0, sizeof(struct in6_addr));
+                src->__s6_addr.__s6_addr16[5] = 0xFFFF;
+                src->__s6_addr.__s6_addr32[3] = pi.ipi_spec_dst.s_addr;
             }
         }
+        else if(si->domain == AF_INET6 && cmsg->cmsg_level == IPPROTO_IPV6 &&
+                cmsg->cmsg_type == IPV6_PKTINFO) {
+            if(cmsg->cmsg_len < CMSG_LEN(sizeof(pi6))) {
+                errno = EINVAL;
+                return -1;
+            }
+
+            memcpy(&pi6, CMSG_DATA(cmsg), sizeof(pi6));
 
-        udpsock->local_addr.sin6_port = htons(port);
+            if(!IN6_IS_ADDR_UNSPECIFIED(&pi6.ipi6_addr))
+                *src = pi6.ipi6_addr;
+        }
     }
 
-    local_addr = udpsock->local_addr;
-    sflags = udpsock->flags;
-    iflags = udpsock->int_flags;
-    hops = udpsock->hop_limit;
-    proto = udpsock->proto;
-    cscov = udpsock->udp_lite.send_cscov;
-    mutex_unlock(&udp_mutex);
+    return 0;
+}
 
-    return net_udp_send_raw(NULL, &local_addr, &realaddr6,
-                            (const uint8_t *)message, length, sflags, hops,
-                            iflags, proto, cscov);
-err:
+/* Send a batch of datagrams. The socket only has to be locked once for all of
+   them, to pick up everything needed to send on it. This backs all of the send
+   calls, from sendto() up to sendmmsg(). */
+static int net_udp_sendmmsg(net_socket_t *hnd, struct mmsghdr *msgvec,
+                            unsigned int vlen, int flags) {
+    struct udp_sock *udpsock;
+    struct udp_send_info si;
+    struct sockaddr_in6 src, dst;
+    struct msghdr *msg;
+    unsigned int i;
+    int rv;
+
+    (void)flags;
+
+    if(mutex_lock_irqsafe(&udp_mutex))
+        return -1;
+
+    udpsock = (struct udp_sock *)hnd->data;
+
+    if(udpsock == NULL) {
+        mutex_unlock(&udp_mutex);
+        errno = EBADF;
+        return -1;
+    }
+
+    if(udpsock->flags & (SHUT_WR << 24)) {
+        mutex_unlock(&udp_mutex);
+        errno = EPIPE;
+        return -1;
+    }
+
+    if(udpsock->local_addr.sin6_port == 0) {
+        udpsock->local_addr.sin6_port = udp_pick_port(udpsock);
+        udp_hash(udpsock);
+    }
+
+    si.local_addr = udpsock->local_addr;
+    si.remote_addr = udpsock->remote_addr;
+    si.domain = udpsock->domain;
+    si.flags = udpsock->flags;
+    si.iflags = udpsock->int_flags;
+    si.hops = udpsock->hop_limit;
+    si.proto = udpsock->proto;
+    si.cscov = udpsock->udp_lite.send_cscov;
     mutex_unlock(&udp_mutex);
-    return -1;
+
+    for(i = 0; i < vlen; ++i) {
+        msg = &msgvec[i].msg_hdr;
+
+        if(msg->msg_iovlen < 0 || (msg->msg_iovlen && !msg->msg_iov)) {
+            errno = EFAULT;
+            break;
+        }
+
+        if(udp_dest(&si, (const struct sockaddr *)msg->msg_name,
+                    msg->msg_namelen, &dst) < 0)
+            break;
+
+        src = si.local_addr;
+
+        if(udp_src_from_cmsg(&si, msg, &src.sin6_addr) < 0)
+            break;
+
+        rv = net_udp_send_raw(NULL, &src, &dst, msg->msg_iov, msg->msg_iovlen,
+                              si.flags, si.hops, si.iflags, si.proto,
+                              si.cscov);
+
+        if(rv < 0)
+            break;
+
+        msgvec[i].msg_len = rv;
+    }
+
+    return (i || !vlen) ? (int)i : -1;
+}
+
+static ssize_t net_udp_sendto(net_socket_t *hnd, const void *message,
+                              size_t length, int flags,
+                              const struct sockaddr *addr, socklen_t addr_len) {
+    struct iovec iov = { (void *)message, length };
+    struct mmsghdr m;
+
+    if(message == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    memset(&m, 0, sizeof(m));
+    m.msg_hdr.msg_name = (void *)addr;
+    m.msg_hdr.msg_namelen = addr_len;
+    m.msg_hdr.msg_iov = &iov;
+    m.msg_hdr.msg_iovlen = 1;
+
+    if(net_udp_sendmmsg(hnd, &m, 1, flags) < 0)
+        return -1;
+
+    return m.msg_len;
 }
 
 static int net_udp_shutdownsock(net_socket_t *hnd, int how) {
@@ -572,6 +921,7 @@ static int net_udp_socket(net_socket_t *hnd, int domain, int type, int proto) {
     udpsock->domain = domain;
     udpsock->proto = proto;
     udpsock->hop_limit = UDP_DEFAULT_HOPS;
+    udpsock->rcvbuf_sz = UDP_DEFAULT_RCVBUF;
 
     if(mutex_lock_irqsafe(&udp_mutex)) {
         free(udpsock);
@@ -606,11 +956,11 @@ static void net_udp_close(net_socket_t *hnd) {
         pkt = it;
         it = it->pkt_queue.tqe_next;
 
-        free(pkt->data);
         TAILQ_REMOVE(&udpsock->packets, pkt, pkt_queue);
-        free(pkt);
+        udp_pkt_free(udpsock, pkt);
     }
 
+    udp_unhash(udpsock);
     LIST_REMOVE(udpsock, sock_list);
 
     free(udpsock);
@@ -641,6 +991,10 @@ static int net_udp_getsockopt(net_socket_t *hnd, int level, int option_name,
                 case SO_TYPE:
                     tmp = SOCK_DGRAM;
                     goto copy_int;
+
+                case SO_RCVBUF:
+                    tmp = sock->rcvbuf_sz;
+                    goto copy_int;
             }
 
             break;
@@ -653,6 +1007,10 @@ static int net_udp_getsockopt(net_socket_t *hnd, int level, int option_name,
                 case IP_TTL:
                     tmp = sock->hop_limit;
                     goto copy_int;
+
+                case IP_PKTINFO:
+                    tmp = !!(sock->int_flags & UDPSOCK_PKTINFO);
+                    goto copy_int;
             }
 
             break;
@@ -669,6 +1027,10 @@ static int net_udp_getsockopt(net_socket_t *hnd, int level, int option_name,
                 case IPV6_V6ONLY:
                     tmp = !!(sock->flags & FS_SOCKET_V6ONLY);
                     goto copy_int;
+
+                case IPV6_RECVPKTINFO:
+                    tmp = !!(sock->int_flags & UDPSOCK_PKTINFO);
+                    goto copy_int;
             }
 
             break;
@@ -752,6 +1114,22 @@ static int net_udp_setsockopt(net_socket_t *hnd, int level, int option_name,
                 case SO_ERROR:
                 case SO_TYPE:
                     goto ret_inval;
+
+                case SO_RCVBUF:
+                    if(option_len != sizeof(int))
+                        goto ret_inval;
+
+                    tmp = *((int *)option_value);
+
+                    /* Anything already queued stays, even if the buffer is
+                       now smaller than that. */
+                    if(tmp < UDP_MIN_RCVBUF)
+                        tmp = UDP_MIN_RCVBUF;
+                    else if(tmp > UDP_MAX_RCVBUF)
+                        tmp = UDP_MAX_RCVBUF;
+
+                    sock->rcvbuf_sz = tmp;
+                    goto ret_success;
             }
 
             break;
@@ -775,6 +1153,9 @@ static int net_udp_setsockopt(net_socket_t *hnd, int level, int option_name,
                         sock->hop_limit = tmp;
 
                     goto ret_success;
+
+                case IP_PKTINFO:
+                    goto set_pktinfo;
             }
 
             break;
@@ -811,6 +1192,9 @@ static int net_udp_setsockopt(net_socket_t *hnd, int level, int option_name,
                         sock->flags &= ~FS_SOCKET_V6ONLY;
 
                     goto ret_success;
+
+                case IPV6_RECVPKTINFO:
+                    goto set_pktinfo;
             }
 
             break;
@@ -883,6 +1267,17 @@ static int net_udp_setsockopt(net_socket_t *hnd, int level, int option_name,
     errno = ENOPROTOOPT;
     return -1;
 
+set_pktinfo:
+    if(option_len != sizeof(int))
+        goto ret_inval;
+
+    if(*((int *)option_value))
+        sock->int_flags |= UDPSOCK_PKTINFO;
+    else
+        sock->int_flags &= ~UDPSOCK_PKTINFO;
+
+    goto ret_success;
+
 ret_inval:
     mutex_unlock(&udp_mutex);
     errno = EINVAL;
@@ -1101,11 +1496,35 @@ static short net_udp_poll(net_socket_t *hnd, short events) {
 
 extern void __poll_event_trigger(int fd, short event);
 
+/* Copy the payload of an incoming packet into its queue entry. For plain UDP,
+   the checksum isn't checked until here, so that it can be done while the data
+   is being copied, rather than going over it once for each. If verify is set,
+   cs is the checksum of the pseudo-header. */
+static int udp_copy_payload(struct udp_pkt *pkt, const uint8_t *data,
+                            int verify, uint16_t cs) {
+    if(!verify) {
+        memcpy(pkt->data, data + sizeof(udp_hdr_t), pkt->datasize);
+        return 0;
+    }
+
+    cs = (uint16_t)~net_ipv4_checksum(data, sizeof(udp_hdr_t), cs);
+
+    /* If the checksum is right, we'll get zero back from the checksum
+       function. */
+    if(net_ipv4_checksum_copy(pkt->data, data + sizeof(udp_hdr_t),
+                              pkt->datasize, cs)) {
+        ++udp_stats.pkt_recv_bad_chksum;
+        return -1;
+    }
+
+    return 0;
+}
+
 static int net_udp_input4(netif_t *src, const ip_hdr_t *ip, const uint8_t *data,
                           size_t size) {
     udp_hdr_t *hdr = (udp_hdr_t *)data;
-    uint16_t cs, cscov = 0;
-    int partial = 1;
+    uint16_t cs = 0, cscov = 0;
+    int partial = 1, verify = 0;
     struct udp_sock *sock;
     struct udp_pkt *pkt;
 
@@ -1121,17 +1540,12 @@ static int net_udp_input4(netif_t *src, const ip_hdr_t *ip, const uint8_t *data,
         /* Calculate the checksum if one was computed by the sender.
            Unfortunately, with IPv4, we don't know if a zero checksum means that
            the sender didn't calculate the checksum or if it actually came out
-           as 0xFFFF. We pretty much have to assume the former option though. */
+           as 0xFFFF. We pretty much have to assume the former option though.
+           The actual check is done when the data is copied out, or below if
+           there's no socket to copy it to. */
         if(hdr->checksum != 0) {
             cs = net_ipv4_checksum_pseudo(ip->src, ip->dest, IPPROTO_UDP, size);
-
-            /* If the checksum is right, we'll get zero back from the checksum
-               function */
-            if(net_ipv4_checksum(data, size, cs)) {
-                /* The checksum was wrong, bail out */
-                ++udp_stats.pkt_recv_bad_chksum;
-                return -1;
-            }
+            verify = 1;
         }
     }
     else {
@@ -1164,7 +1578,7 @@ static int net_udp_input4(netif_t *src, const ip_hdr_t *ip, const uint8_t *data,
         /* If the mutex is locked, there isn't much that can be done. */
         return -1;
 
-    LIST_FOREACH(sock, &net_udp_sockets, sock_list) {
+    LIST_FOREACH(sock, &udp_port_hash[UDP_HASH(hdr->dst_port)], hash_list) {
         /* Don't even bother looking at IPv6-only sockets */
         if(sock->domain == AF_INET6 && (sock->flags & FS_SOCKET_V6ONLY))
             continue;
@@ -1202,17 +1616,7 @@ static int net_udp_input4(netif_t *src, const ip_hdr_t *ip, const uint8_t *data,
             return 0;
         }
 
-        if(!(pkt = (struct udp_pkt *)malloc(sizeof(struct udp_pkt)))) {
-            mutex_unlock(&udp_mutex);
-            return -1;
-        }
-
-        memset(pkt, 0, sizeof(struct udp_pkt));
-
-        pkt->datasize = size - sizeof(udp_hdr_t);
-
-        if(!(pkt->data = (uint8_t *)malloc(pkt->datasize))) {
-            free(pkt);
+        if(!(pkt = udp_pkt_alloc(sock, size - sizeof(udp_hdr_t)))) {
             mutex_unlock(&udp_mutex);
             return -1;
         }
@@ -1221,8 +1625,14 @@ static int net_udp_input4(netif_t *src, const ip_hdr_t *ip, const uint8_t *data,
         pkt->from.sin6_addr.__s6_addr.__s6_addr16[5] = 0xFFFF;
         pkt->from.sin6_addr.__s6_addr.__s6_addr32[3] = ip->src;
         pkt->from.sin6_port = hdr->src_port;
+        pkt->to.__s6_addr.__s6_addr16[5] = 0xFFFF;
+        pkt->to.__s6_addr.__s6_addr32[3] = ip->dest;
 
-        memcpy(pkt->data, data + sizeof(udp_hdr_t), pkt->datasize);
+        if(udp_copy_payload(pkt, data, verify, cs)) {
+            udp_pkt_free(sock, pkt);
+            mutex_unlock(&udp_mutex);
+            return -1;
+        }
 
         TAILQ_INSERT_TAIL(&sock->packets, pkt, pkt_queue);
 
@@ -1234,7 +1644,12 @@ static int net_udp_input4(netif_t *src, const ip_hdr_t *ip, const uint8_t *data,
         return 0;
     }
 
-    ++udp_stats.pkt_recv_no_sock;
+    /* Don't count a damaged packet as one that nobody wanted. */
+    if(verify && net_ipv4_checksum(data, size, cs))
+        ++udp_stats.pkt_recv_bad_chksum;
+    else
+        ++udp_stats.pkt_recv_no_sock;
+
     mutex_unlock(&udp_mutex);
 
     return -1;
@@ -1243,8 +1658,8 @@ static int net_udp_input4(netif_t *src, const ip_hdr_t *ip, const uint8_t *data,
 static int net_udp_input6(netif_t *src, const ipv6_hdr_t *ip, const uint8_t *data,
                           size_t size) {
     udp_hdr_t *hdr = (udp_hdr_t *)data;
-    uint16_t cs, cscov = 0;
-    int partial = 1;
+    uint16_t cs = 0, cscov = 0;
+    int partial = 1, verify = 0;
     struct udp_sock *sock;
     struct udp_pkt *pkt;
 
@@ -1258,17 +1673,11 @@ static int net_udp_input6(netif_t *src, const ipv6_hdr_t *ip, const uint8_t *dat
 
     if(ip->next_header == IPPROTO_UDP) {
         /* Calculate the checksum of the packet. Note that this is optional for
-           IPv4 but required for IPv6. */
+           IPv4 but required for IPv6. As with IPv4, the actual check is done
+           when the data is copied out. */
         cs = net_ipv6_checksum_pseudo(&ip->src_addr, &ip->dst_addr, size,
                                       IPPROTO_UDP);
-
-        /* If the checksum is right, we'll get zero back from the checksum
-           function. */
-        if(net_ipv4_checksum(data, size, cs)) {
-            /* The checksum was wrong, bail out */
-            ++udp_stats.pkt_recv_bad_chksum;
-            return -1;
-        }
+        verify = 1;
     }
     else {
         cscov = ntohs(hdr->length);
@@ -1301,7 +1710,7 @@ static int net_udp_input6(netif_t *src, const ipv6_hdr_t *ip, const uint8_t *dat
         /* If the mutex is locked, there isn't much that can be done. */
         return -1;
 
-    LIST_FOREACH(sock, &net_udp_sockets, sock_list) {
+    LIST_FOREACH(sock, &udp_port_hash[UDP_HASH(hdr->dst_port)], hash_list) {
         /* Don't even bother looking at IPv4 sockets */
         if(sock->domain == AF_INET)
             continue;
@@ -1339,17 +1748,7 @@ static int net_udp_input6(netif_t *src, const ipv6_hdr_t *ip, const uint8_t *dat
             return 0;
         }
 
-        if(!(pkt = (struct udp_pkt *)malloc(sizeof(struct udp_pkt)))) {
-            mutex_unlock(&udp_mutex);
-            return -1;
-        }
-
-        memset(pkt, 0, sizeof(struct udp_pkt));
-
-        pkt->datasize = size - sizeof(udp_hdr_t);
-
-        if(!(pkt->data = (uint8_t *)malloc(pkt->datasize))) {
-            free(pkt);
+        if(!(pkt = udp_pkt_alloc(sock, size - sizeof(udp_hdr_t)))) {
             mutex_unlock(&udp_mutex);
             return -1;
         }
@@ -1357,8 +1756,13 @@ static int net_udp_input6(netif_t *src, const ipv6_hdr_t *ip, const uint8_t *dat
         pkt->from.sin6_family = AF_INET6;
         pkt->from.sin6_addr = ip->src_addr;
         pkt->from.sin6_port = hdr->src_port;
+        pkt->to = ip->dst_addr;
 
-        memcpy(pkt->data, data + sizeof(udp_hdr_t), pkt->datasize);
+        if(udp_copy_payload(pkt, data, verify, cs)) {
+            udp_pkt_free(sock, pkt);
+            mutex_unlock(&udp_mutex);
+            return -1;
+        }
 
         TAILQ_INSERT_TAIL(&sock->packets, pkt, pkt_queue);
 
@@ -1370,7 +1774,12 @@ static int net_udp_input6(netif_t *src, const ipv6_hdr_t *ip, const uint8_t *dat
         return 0;
     }
 
-    ++udp_stats.pkt_recv_no_sock;
+    /* Don't count a damaged packet as one that nobody wanted. */
+    if(verify && net_ipv4_checksum(data, size, cs))
+        ++udp_stats.pkt_recv_bad_chksum;
+    else
+        ++udp_stats.pkt_recv_no_sock;
+
     mutex_unlock(&udp_mutex);
 
     return -1;
@@ -1389,15 +1798,51 @@ static int net_udp_input(netif_t *src, int domain, const void *hdr,
     return -1;
 }
 
+/* Total length of the data in a set of iovecs. */
+static size_t udp_iov_size(const struct iovec *iov, int iovcnt) {
+    size_t size = 0;
+    int i;
+
+    for(i = 0; i < iovcnt; ++i)
+        size += iov[i].iov_len;
+
+    return size;
+}
+
+/* Checksum the first len bytes of a chain. The chain is cut short for this,
+   so it has to be one that the caller owns. */
+static uint16_t udp_pbuf_checksum(net_pbuf_t *pb, size_t len, uint16_t cs) {
+    net_pbuf_t *i, *next;
+    size_t plen;
+
+    for(i = pb; i->next && len > i->len; i = i->next)
+        len -= i->len;
+
+    next = i->next;
+    plen = i->len;
+    i->next = NULL;
+    i->len = len < plen ? len : plen;
+
+    cs = net_pbuf_checksum(pb, cs);
+
+    i->next = next;
+    i->len = plen;
+
+    return cs;
+}
+
 /* XXX */
 static int net_udp_send_raw(netif_t *net, const struct sockaddr_in6 *src,
-                            const struct sockaddr_in6 *dst, const uint8_t *data,
-                            size_t size, uint32_t flags, int hops,
-                            uint32_t iflags, int proto, uint16_t cscov) {
-    uint8_t buf[size + sizeof(udp_hdr_t)];
-    udp_hdr_t *hdr = (udp_hdr_t *)buf;
+                            const struct sockaddr_in6 *dst,
+                            const struct iovec *iov, int iovcnt,
+                            uint32_t flags, int hops, uint32_t iflags,
+                            int proto, uint16_t cscov) {
+    size_t size = udp_iov_size(iov, iovcnt), len, off;
+    uint8_t rawhdr[NET_PBUF_HEADROOM + sizeof(udp_hdr_t)];
+    udp_hdr_t *hdr = (udp_hdr_t *)(rawhdr + NET_PBUF_HEADROOM);
+    net_pbuf_t hpb, data[UDP_SEND_PIECES], *big = NULL;
     uint16_t cs;
-    int err;
+    int err, csum, i;
     struct in6_addr srcaddr = src->sin6_addr;
 
     (void)flags;
@@ -1438,8 +1883,7 @@ static int net_udp_send_raw(netif_t *net, const struct sockaddr_in6 *src,
         }
     }
 
-    memcpy(buf + sizeof(udp_hdr_t), data, size);
-    size += sizeof(udp_hdr_t);
+    len = size + sizeof(udp_hdr_t);
 
     hdr->src_port = src->sin6_port;
     hdr->dst_port = dst->sin6_port;
@@ -1447,30 +1891,64 @@ static int net_udp_send_raw(netif_t *net, const struct sockaddr_in6 *src,
 
     /* Is this UDP or UDP-Lite? */
     if(proto == IPPROTO_UDP) {
-        hdr->length = htons(size);
-
-        if(!(iflags & UDPSOCK_NO_CHECKSUM)) {
-            cs = net_ipv6_checksum_pseudo(&srcaddr, &dst->sin6_addr, size,
-                                          proto);
-            hdr->checksum = net_ipv4_checksum(buf, size, cs);
-        }
+        hdr->length = htons(len);
+        csum = !(iflags & UDPSOCK_NO_CHECKSUM);
     }
     else {
-        if(cscov <= size) {
+        if(cscov <= len) {
             hdr->length = htons(cscov);
         }
         else {
             hdr->length = 0;
-            cscov = size;
+            cscov = len;
         }
 
-        cs = net_ipv6_checksum_pseudo(&srcaddr, &dst->sin6_addr, size, proto);
-        hdr->checksum = net_ipv4_checksum(buf, size, cs);
+        csum = 1;
+    }
+
+    /* The header goes in its own buffer, with room in front of it for the
+       lower layers. The data follows it straight from the caller's memory. */
+    net_pbuf_init(&hpb, rawhdr, NET_PBUF_HEADROOM, sizeof(udp_hdr_t));
+
+    if(iovcnt <= UDP_SEND_PIECES) {
+        for(i = 0; i < iovcnt; ++i) {
+            net_pbuf_init(&data[i], iov[i].iov_base, 0, iov[i].iov_len);
+            data[i].next = i + 1 < iovcnt ? &data[i + 1] : NULL;
+        }
+
+        hpb.next = iovcnt ? &data[0] : NULL;
+    }
+    else {
+        if(!(big = net_pbuf_alloc(0, size))) {
+            errno = ENOMEM;
+            ++udp_stats.pkt_send_failed;
+            return -1;
+        }
+
+        for(i = 0, off = 0; i < iovcnt; ++i) {
+            memcpy(big->data + off, iov[i].iov_base, iov[i].iov_len);
+            off += iov[i].iov_len;
+        }
+
+        hpb.next = big;
+    }
+
+    if(csum) {
+        cs = net_ipv6_checksum_pseudo(&srcaddr, &dst->sin6_addr, len, proto);
+
+        /* UDP-Lite only covers the first cscov bytes (0 meaning all). */
+        if(proto == IPPROTO_UDP || !cscov)
+            hdr->checksum = net_pbuf_checksum(&hpb, cs);
+        else
+            hdr->checksum = udp_pbuf_checksum(&hpb, cscov, cs);
     }
 
     /* Pass everything off to the network layer to do the rest. */
-    err = net_ipv6_send(net, buf, size, hops, proto, &srcaddr,
-                        &dst->sin6_addr);
+    err = net_ipv6_send_pbuf(net, &hpb, hops, proto, &srcaddr,
+                             &dst->sin6_addr);
+
+    if(big)
+        net_pbuf_free(big);
 
     if(err < 0) {
         ++udp_stats.pkt_send_failed;
@@ -1478,7 +1956,7 @@ static int net_udp_send_raw(netif_t *net, const struct sockaddr_in6 *src,
     }
     else {
         ++udp_stats.pkt_sent;
-        return size - sizeof(udp_hdr_t);
+        return size;
     }
 }
 
@@ -1507,7 +1985,9 @@ static fs_socket_proto_t proto = {
     net_udp_getsockname,
     net_udp_getpeername,
     net_udp_fcntl,
-    net_udp_poll
+    net_udp_poll,
+    net_udp_recvmmsg,
+    net_udp_sendmmsg
 };
 
 static fs_socket_proto_t proto_lite = {
@@ -1530,16 +2010,41 @@ static fs_socket_proto_t proto_lite = {
     net_udp_getsockname,
     net_udp_getpeername,
     net_udp_fcntl,
-    net_udp_poll
+    net_udp_poll,
+    net_udp_recvmmsg,
+    net_udp_sendmmsg
 };
 
 int net_udp_init(void) {
+    /* Start off with one slab of slots, so that the first few packets don't
+       have to wait on the allocator. If it can't be had, it'll be tried again
+       when a packet comes in. */
+    mutex_lock(&udp_mutex);
+
+    if(!udp_nslabs)
+        udp_pool_grow();
+
+    mutex_unlock(&udp_mutex);
+
     return fs_socket_proto_add(&proto) | fs_socket_proto_add(&proto_lite);
 }
 
 void net_udp_shutdown(void) {
     fs_socket_proto_remove(&proto);
     fs_socket_proto_remove(&proto_lite);
+
+    /* The slots can only go if nothing could still have any of them. */
+    mutex_lock(&udp_mutex);
+
+    if(LIST_EMPTY(&net_udp_sockets)) {
+        while(udp_nslabs)
+            free(udp_slabs[--udp_nslabs]);
+
+        TAILQ_INIT(&udp_pool);
+        udp_stats.pool_slots = udp_stats.pool_free = 0;
+    }
+
+    mutex_unlock(&udp_mutex);
 }
 
 #if __GNUC__ >= 9